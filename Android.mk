@@ -41,6 +41,9 @@ SERVALD_SRC_FILES = \
 	serval-dna/rhizome_packetformats.c \
 	serval-dna/rhizome_direct.c \
 	serval-dna/rhizome_direct_http.c \
+	serval-dna/rhizome_direct_reconcile.c \
+	serval-dna/rhizome_archive.c \
+	serval-dna/rhizome_worker.c \
         serval-dna/responses.c     \
 	serval-dna/serval_packetvisualise.c \
         serval-dna/server.c        \
@@ -1151,6 +1151,32 @@ int app_rhizome_import_bundle(int argc, const char *const *argv, struct command_
   return status;
 }
 
+int app_rhizome_export_archive(int argc, const char *const *argv, struct command_line_option *o, void *context)
+{
+  if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
+  const char *archivepath;
+  if (cli_arg(argc, argv, o, "archivepath", &archivepath, NULL, NULL) == -1)
+    return -1;
+  if (create_serval_instance_dir() == -1)
+    return -1;
+  if (rhizome_opendb() == -1)
+    return -1;
+  return rhizome_archive_export(archivepath);
+}
+
+int app_rhizome_import_archive(int argc, const char *const *argv, struct command_line_option *o, void *context)
+{
+  if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
+  const char *archivepath;
+  if (cli_arg(argc, argv, o, "archivepath", &archivepath, NULL, NULL) == -1)
+    return -1;
+  if (create_serval_instance_dir() == -1)
+    return -1;
+  if (rhizome_opendb() == -1)
+    return -1;
+  return rhizome_archive_import(archivepath);
+}
+
 int app_rhizome_extract_manifest(int argc, const char *const *argv, struct command_line_option *o, void *context)
 {
   if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
@@ -1454,6 +1480,116 @@ int app_crypt_test(int argc, const char *const *argv, struct command_line_option
   return 0;
 }
 
+int app_rhizome_manifest_test(int argc, const char *const *argv, struct command_line_option *o, void *context)
+{
+  if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
+  const char *manifestpath, *iterations_text;
+  if (cli_arg(argc, argv, o, "manifestpath", &manifestpath, NULL, NULL) == -1
+   || cli_arg(argc, argv, o, "iterations", &iterations_text, NULL, "1000") == -1)
+    return -1;
+  int iterations = atoi(iterations_text);
+  if (iterations < 1)
+    iterations = 1;
+
+  /* Parse once from the file, then time everything from an in-memory copy */
+  rhizome_manifest *m = rhizome_new_manifest();
+  if (!m)
+    return WHY("Out of manifests");
+  if (rhizome_read_manifest_file(m, manifestpath, 0) == -1) {
+    rhizome_manifest_free(m);
+    return WHYF("Could not read manifest %s", manifestpath);
+  }
+  int len = m->manifest_all_bytes;
+  unsigned char buffer[MAX_MANIFEST_BYTES];
+  memcpy(buffer, m->manifestdata, len);
+  rhizome_manifest_free(m);
+
+  static const char *names[] = {
+    "id", "version", "filesize", "filehash", "service", "date", "name", "sender", "recipient", "BK", "crypt"
+  };
+  const int nnames = sizeof names / sizeof names[0];
+  long long found = 0;
+  int i, j;
+
+  /* Each phase is timed as a whole, because a single pass takes well under a millisecond */
+  time_ms_t start = gettime_ms();
+  for (i = 0; i < iterations; ++i) {
+    if ((m = rhizome_new_manifest()) == NULL)
+      return WHY("Out of manifests");
+    rhizome_read_manifest_file(m, (const char *) buffer, len);
+    rhizome_manifest_free(m);
+  }
+  time_ms_t parse_ms = gettime_ms() - start;
+
+  start = gettime_ms();
+  for (i = 0; i < iterations; ++i) {
+    if ((m = rhizome_new_manifest()) == NULL)
+      return WHY("Out of manifests");
+    rhizome_read_manifest_file(m, (const char *) buffer, len);
+    rhizome_manifest_verify(m);
+    rhizome_manifest_free(m);
+  }
+  time_ms_t verify_ms = gettime_ms() - start - parse_ms;
+
+  if ((m = rhizome_new_manifest()) == NULL)
+    return WHY("Out of manifests");
+  rhizome_read_manifest_file(m, (const char *) buffer, len);
+  start = gettime_ms();
+  for (i = 0; i < iterations; ++i)
+    for (j = 0; j < nnames; ++j)
+      if (rhizome_manifest_get(m, names[j], NULL, 0))
+	++found;
+  time_ms_t lookup_ms = gettime_ms() - start;
+  start = gettime_ms();
+  for (i = 0; i < iterations; ++i)
+    for (j = RHIZOME_FIELD_ID; j < RHIZOME_FIELD_COUNT; ++j)
+      if (rhizome_manifest_get_field(m, j))
+	++found;
+  time_ms_t field_ms = gettime_ms() - start;
+  rhizome_manifest_free(m);
+
+  printf("%d byte manifest, %d iterations, %lld fields found\n", len, iterations, found);
+  printf("parse - %lldms - mean time = %.4fms\n", (long long) parse_ms, parse_ms * 1.0 / iterations);
+  printf("verify - %lldms - mean time = %.4fms\n", (long long) verify_ms, verify_ms * 1.0 / iterations);
+  printf("get by name - %lldms - mean time = %.4fms\n", (long long) lookup_ms, lookup_ms * 1.0 / iterations);
+  printf("get by field - %lldms - mean time = %.4fms\n", (long long) field_ms, field_ms * 1.0 / iterations);
+  struct rhizome_signature_cache_stats stats;
+  rhizome_signature_cache_get_stats(&stats);
+  printf("signature cache - %d entries, %lld lookups, %lld hits, %lld database hits, %lld verified, %lld failed\n",
+      stats.size, stats.lookups, stats.hits, stats.db_hits, stats.verified, stats.failures);
+  return 0;
+}
+
+int app_rhizome_manifest_pool_test(int argc, const char *const *argv, struct command_line_option *o, void *context)
+{
+  if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
+  const char *count_text;
+  if (cli_arg(argc, argv, o, "count", &count_text, NULL, NULL) == -1)
+    return -1;
+  int count = atoi(count_text);
+  if (count < 1)
+    return WHYF("Invalid count %s", count_text);
+  rhizome_manifest **held = malloc(count * sizeof *held);
+  if (!held)
+    return WHY_perror("malloc");
+
+  /* Hold every record at once, the way a burst of adverts would, then release them all */
+  int i, allocated;
+  for (allocated = 0; allocated < count; ++allocated)
+    if ((held[allocated] = rhizome_new_manifest()) == NULL)
+      break;
+  struct rhizome_manifest_stats stats;
+  rhizome_manifest_get_stats(&stats);
+  for (i = 0; i < allocated; ++i)
+    rhizome_manifest_free(held[i]);
+  free(held);
+
+  printf("allocated %d of %d manifests\n", allocated, count);
+  printf("manifest records - %d high water, %d allocated in %d slabs, limit %d, %d failures\n",
+      stats.high_water, stats.allocated, stats.slabs, stats.limit, stats.failures);
+  return 0;
+}
+
 int app_node_info(int argc, const char *const *argv, struct command_line_option *o, void *context)
 {
   if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
@@ -1649,6 +1785,10 @@ struct command_line_option command_line_options[]={
    "Add a file to Rhizome and optionally write its manifest to the given path"},
   {app_rhizome_import_bundle,{"rhizome","import","bundle","<filepath>","<manifestpath>",NULL},CLIFLAG_STANDALONE,
    "Import a payload/manifest pair into Rhizome"},
+  {app_rhizome_export_archive,{"rhizome","export","archive","<archivepath>",NULL},CLIFLAG_STANDALONE,
+   "Write all bundles in Rhizome to a single archive file"},
+  {app_rhizome_import_archive,{"rhizome","import","archive","<archivepath>",NULL},CLIFLAG_STANDALONE,
+   "Import all new bundles from an archive file (- for standard input) into Rhizome"},
   {app_rhizome_list,{"rhizome","list","<pin,pin...>","[<service>]","[<sender_sid>]","[<recipient_sid>]","[<offset>]","[<limit>]",NULL},CLIFLAG_STANDALONE,
    "List all manifests and files in Rhizome"},
   {app_rhizome_extract_manifest,{"rhizome","extract","manifest","<manifestid>","[<manifestpath>]",NULL},CLIFLAG_STANDALONE,
@@ -1684,10 +1824,22 @@ struct command_line_option command_line_options[]={
     "Return a count of routable peers on the network"},
   {app_test_rfs,{"test","rfs",NULL},0,
    "Test RFS field calculation"},
+  {app_test_udp,{"test","udp","[<count>]",NULL},0,
+   "Run batched UDP send and receive speed test over loopback"},
+  {app_test_forward,{"test","forward","[<count>]","[<bytes>]",NULL},0,
+   "Run overlay packet receive and forward speed test"},
+  {app_test_stuff,{"test","stuff","[<waiting>]",NULL},0,
+   "Run transmit queue speed test with frames waiting for lost routes"},
+  {app_test_share,{"test","share",NULL},0,
+   "Report how saturated transmit queues share packets"},
   {app_monitor_cli,{"monitor",NULL},0,
    "Interactive servald monitor interface."},
   {app_crypt_test,{"crypt","test",NULL},0,
    "Run cryptography speed test"},
+  {app_rhizome_manifest_test,{"rhizome","test","manifest","<manifestpath>","[<iterations>]",NULL},CLIFLAG_STANDALONE,
+   "Run manifest parse, verify and field lookup speed test"},
+  {app_rhizome_manifest_pool_test,{"rhizome","test","manifests","<count>",NULL},CLIFLAG_STANDALONE,
+   "Allocate and release many manifest records at once"},
 #ifdef HAVE_VOIPTEST
   {app_pa_phone,{"phone",NULL},0,
    "Run phone test application"},
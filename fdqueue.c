@@ -30,6 +30,46 @@ struct sched_ent *next_alarm=NULL;
 struct sched_ent *next_deadline=NULL;
 struct profile_total poll_stats={NULL,0,"Idle (in poll)",0,0,0};
 
+/* How late scheduled alarms are called, in milliseconds past their alarm time.  Anything that
+   holds up the main loop shows up here as latency for every other alarm. */
+static const int latency_bounds[] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000};
+#define LATENCY_BUCKETS (sizeof latency_bounds / sizeof latency_bounds[0] + 1)
+static long long latency_count[LATENCY_BUCKETS];
+static time_ms_t latency_max = 0;
+
+static void record_latency(time_ms_t late)
+{
+  int i;
+  for (i = 0; i < LATENCY_BUCKETS - 1 && late >= latency_bounds[i]; ++i)
+    ;
+  ++latency_count[i];
+  if (late > latency_max)
+    latency_max = late;
+}
+
+int fd_showlatency()
+{
+  strbuf b = strbuf_alloca(256);
+  long long total = 0;
+  int i;
+  for (i = 0; i < LATENCY_BUCKETS; ++i) {
+    total += latency_count[i];
+    if (i < LATENCY_BUCKETS - 1)
+      strbuf_sprintf(b, " <%d:%lld", latency_bounds[i], latency_count[i]);
+    else
+      strbuf_sprintf(b, " >=%d:%lld", latency_bounds[i - 1], latency_count[i]);
+  }
+  INFOF("Alarm latency (ms): calls=%lld max=%lld%s", total, latency_max, strbuf_str(b));
+  return 0;
+}
+
+int fd_clearlatency()
+{
+  bzero(latency_count, sizeof latency_count);
+  latency_max = 0;
+  return 0;
+}
+
 void list_alarms() {
   DEBUG("Alarms;");
   time_ms_t now = gettime_ms();
@@ -230,6 +270,7 @@ int fd_poll()
   if (next_deadline && (next_deadline->deadline <=now || (r==0))){
     struct sched_ent *alarm = next_deadline;
     unschedule(alarm);
+    record_latency(now - alarm->alarm);
     call_alarm(alarm, 0);
     now=gettime_ms();
   }
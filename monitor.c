@@ -553,9 +553,9 @@ int monitor_announce_bundle(rhizome_manifest *m)
 {
   int i;
   char msg[1024];
-  const char *service = rhizome_manifest_get(m, "service", NULL, 0);
-  const char *sender = rhizome_manifest_get(m, "sender", NULL, 0);
-  const char *recipient = rhizome_manifest_get(m, "recipient", NULL, 0);
+  const char *service = rhizome_manifest_get_field(m, RHIZOME_FIELD_SERVICE);
+  const char *sender = rhizome_manifest_get_field(m, RHIZOME_FIELD_SENDER);
+  const char *recipient = rhizome_manifest_get_field(m, RHIZOME_FIELD_RECIPIENT);
   snprintf(msg,1024,"\nBUNDLE:%s:%s:%lld:%lld:%s:%s:%s\n",
 	   /* XXX bit of a hack here, since SIDs and cryptosign public keys have the same length */
 	   alloca_tohex_sid(m->cryptoSignPublic),
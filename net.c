@@ -129,6 +129,33 @@ ssize_t _write_str_nonblock(int fd, const char *str, struct __sourceloc where)
   return _write_all_nonblock(fd, str, strlen(str), where);
 }
 
+/* Set *ttl from the IP_TTL control message of a received datagram, if it has one.
+ */
+static void cmsg_ttl(struct msghdr *msg, int *ttl)
+{
+  struct cmsghdr *cmsg;
+  for (cmsg = CMSG_FIRSTHDR(msg); 
+       cmsg != NULL; 
+       cmsg = CMSG_NXTHDR(msg,cmsg)) {
+    
+    if ((cmsg->cmsg_level == IPPROTO_IP) && 
+	((cmsg->cmsg_type == IP_RECVTTL) ||(cmsg->cmsg_type == IP_TTL))
+	&&(cmsg->cmsg_len) ){
+      if (debug&DEBUG_PACKETRX)
+	DEBUGF("  TTL (%p) data location resolves to %p", ttl,CMSG_DATA(cmsg));
+      if (CMSG_DATA(cmsg)) {
+	*ttl = *(unsigned char *) CMSG_DATA(cmsg);
+	if (debug&DEBUG_PACKETRX)
+	  DEBUGF("  TTL of packet is %d", *ttl);
+      } 
+    } else {
+      if (debug&DEBUG_PACKETRX)
+	DEBUGF("I didn't expect to see level=%02x, type=%02x",
+	       cmsg->cmsg_level,cmsg->cmsg_type);
+    }	 
+  }
+}
+
 ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
 		    struct sockaddr *recvaddr, socklen_t *recvaddrlen)
 {
@@ -160,35 +187,74 @@ ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
     dump("received data", buffer, len);
   }
   
-  struct cmsghdr *cmsg;
   if (len>0)
-  {
-    for (cmsg = CMSG_FIRSTHDR(&msg); 
-	 cmsg != NULL; 
-	 cmsg = CMSG_NXTHDR(&msg,cmsg)) {
-      
-      if ((cmsg->cmsg_level == IPPROTO_IP) && 
-	  ((cmsg->cmsg_type == IP_RECVTTL) ||(cmsg->cmsg_type == IP_TTL))
-	  &&(cmsg->cmsg_len) ){
-	if (debug&DEBUG_PACKETRX)
-	  DEBUGF("  TTL (%p) data location resolves to %p", ttl,CMSG_DATA(cmsg));
-	if (CMSG_DATA(cmsg)) {
-	  *ttl = *(unsigned char *) CMSG_DATA(cmsg);
-	  if (debug&DEBUG_PACKETRX)
-	    DEBUGF("  TTL of packet is %d", *ttl);
-	} 
-      } else {
-	if (debug&DEBUG_PACKETRX)
-	  DEBUGF("I didn't expect to see level=%02x, type=%02x",
-		 cmsg->cmsg_level,cmsg->cmsg_type);
-      }	 
-    }
-  }
+    cmsg_ttl(&msg, ttl);
   *recvaddrlen=msg.msg_namelen;
   
   return len;
 }
 
+/* Receive up to count datagrams that are already waiting on a socket, without blocking, using a
+   single recvmmsg() call where the platform has it.  Each datagram's buffer and bufferlen must be
+   set by the caller; len, addr, addrlen and (if the packet carries one) ttl are filled in.
+   Returns the number of datagrams received, which is 0 if none were waiting, or -1 on error.
+ */
+int recvmmsgwithttl(int sock, struct recv_datagram *datagrams, int count)
+{
+  struct iovec iov[count];
+  struct cmsghdr cmsgs[count][16];
+  int i;
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr msgs[count];
+  bzero(msgs, sizeof msgs);
+  for (i = 0; i < count; ++i) {
+    iov[i].iov_base = datagrams[i].buffer;
+    iov[i].iov_len = datagrams[i].bufferlen;
+    msgs[i].msg_hdr.msg_name = &datagrams[i].addr;
+    msgs[i].msg_hdr.msg_namelen = sizeof datagrams[i].addr;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = &cmsgs[i][0];
+    msgs[i].msg_hdr.msg_controllen = sizeof cmsgs[i];
+  }
+  int n = recvmmsg(sock, msgs, count, MSG_DONTWAIT, NULL);
+  if (n == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    return WHY_perror("recvmmsg");
+  }
+  for (i = 0; i < n; ++i) {
+    datagrams[i].len = msgs[i].msg_len;
+    datagrams[i].addrlen = msgs[i].msg_hdr.msg_namelen;
+    cmsg_ttl(&msgs[i].msg_hdr, &datagrams[i].ttl);
+  }
+  return n;
+#else
+  for (i = 0; i < count; ++i) {
+    struct msghdr msg;
+    bzero(&msg, sizeof msg);
+    iov[i].iov_base = datagrams[i].buffer;
+    iov[i].iov_len = datagrams[i].bufferlen;
+    msg.msg_name = &datagrams[i].addr;
+    msg.msg_namelen = sizeof datagrams[i].addr;
+    msg.msg_iov = &iov[i];
+    msg.msg_iovlen = 1;
+    msg.msg_control = &cmsgs[i][0];
+    msg.msg_controllen = sizeof cmsgs[i];
+    ssize_t len = recvmsg(sock, &msg, MSG_DONTWAIT);
+    if (len == -1) {
+      if (i || errno == EAGAIN || errno == EWOULDBLOCK)
+	break;
+      return WHY_perror("recvmsg");
+    }
+    datagrams[i].len = len;
+    datagrams[i].addrlen = msg.msg_namelen;
+    cmsg_ttl(&msg, &datagrams[i].ttl);
+  }
+  return i;
+#endif
+}
+
 int urandombytes(unsigned char *x, unsigned long long xlen)
 {
   static int urandomfd = -1;
@@ -78,6 +78,61 @@ overlay_txqueue overlay_tx[OQ_MAX];
 
 keyring_file *keyring=NULL;
 
+/* Set up the transmit queues from their defaults and configured options */
+void overlay_queue_init()
+{
+  int i;
+  /* Set default congestion levels for queues */
+  for(i=0;i<OQ_MAX;i++) {
+    overlay_tx[i].maxLength=100;
+    overlay_tx[i].latencyTarget=1000; /* Keep packets in queue for 1 second by default */
+    overlay_tx[i].transmit_delay=10; /* Hold onto packets for 10ms before trying to send a full packet */
+    overlay_tx[i].grace_period=100; /* Delay sending a packet for up to 100ms if servald has other processing to do */
+  }
+  overlay_tx[OQ_ISOCHRONOUS_VOICE].name="voice";
+  overlay_tx[OQ_MESH_MANAGEMENT].name="mesh";
+  overlay_tx[OQ_ISOCHRONOUS_VIDEO].name="video";
+  overlay_tx[OQ_ORDINARY].name="ordinary";
+  overlay_tx[OQ_OPPORTUNISTIC].name="opportunistic";
+  
+  /* expire voice/video call packets much sooner, as they just aren't any use if late */
+  overlay_tx[OQ_ISOCHRONOUS_VOICE].latencyTarget=500;
+  overlay_tx[OQ_ISOCHRONOUS_VIDEO].latencyTarget=500;
+
+  /* try to send voice packets without any delay, and before other background processing */
+  overlay_tx[OQ_ISOCHRONOUS_VOICE].transmit_delay=0;
+  overlay_tx[OQ_ISOCHRONOUS_VOICE].grace_period=0;
+
+  /* opportunistic traffic can be significantly delayed */
+  overlay_tx[OQ_OPPORTUNISTIC].transmit_delay=200;
+  overlay_tx[OQ_OPPORTUNISTIC].grace_period=500;
+  
+  /* Voice goes first, but only up to mdp.queue.voice.max_bytes (600 by default) of each packet
+     until the other queues have had a turn. The rest of the packet is shared between the other
+     queues by weight. */
+  int quantum = confValueGetInt64Range("mdp.queue.quantum_bytes", 128LL, 1LL, 65536LL);
+  int weight[OQ_MAX];
+  weight[OQ_MESH_MANAGEMENT]=4;
+  weight[OQ_ISOCHRONOUS_VIDEO]=4;
+  weight[OQ_ORDINARY]=2;
+  weight[OQ_OPPORTUNISTIC]=1;
+  
+  for(i=0;i<OQ_MAX;i++) {
+    char option_name[64];
+    overlay_txqueue *queue=&overlay_tx[i];
+    snprintf(option_name, sizeof(option_name), "mdp.queue.%s.latency_ms", queue->name);
+    queue->latencyTarget = confValueGetInt64Range(option_name, queue->latencyTarget, 1LL, 3600000LL);
+    snprintf(option_name, sizeof(option_name), "mdp.queue.%s.max_length", queue->name);
+    queue->maxLength = confValueGetInt64Range(option_name, queue->maxLength, 1LL, 100000LL);
+    if (i==OQ_ISOCHRONOUS_VOICE){
+      queue->quantum = confValueGetInt64Range("mdp.queue.voice.max_bytes", 600LL, 0LL, 65536LL);
+    }else{
+      snprintf(option_name, sizeof(option_name), "mdp.queue.%s.weight", queue->name);
+      queue->quantum = quantum * confValueGetInt64Range(option_name, weight[i], 1LL, 1000LL);
+    }
+  }
+}
+
 int overlayServerMode()
 {
   /* In overlay mode we need to listen to all of our sockets, and also to
@@ -98,25 +153,7 @@ int overlayServerMode()
   /* put initial identity in if we don't have any visible */
   keyring_seed(keyring);
 
-  /* Set default congestion levels for queues */
-  int i;
-  for(i=0;i<OQ_MAX;i++) {
-    overlay_tx[i].maxLength=100;
-    overlay_tx[i].latencyTarget=1000; /* Keep packets in queue for 1 second by default */
-    overlay_tx[i].transmit_delay=10; /* Hold onto packets for 10ms before trying to send a full packet */
-    overlay_tx[i].grace_period=100; /* Delay sending a packet for up to 100ms if servald has other processing to do */
-  }
-  /* expire voice/video call packets much sooner, as they just aren't any use if late */
-  overlay_tx[OQ_ISOCHRONOUS_VOICE].latencyTarget=500;
-  overlay_tx[OQ_ISOCHRONOUS_VIDEO].latencyTarget=500;
-
-  /* try to send voice packets without any delay, and before other background processing */
-  overlay_tx[OQ_ISOCHRONOUS_VOICE].transmit_delay=0;
-  overlay_tx[OQ_ISOCHRONOUS_VOICE].grace_period=0;
-
-  /* opportunistic traffic can be significantly delayed */
-  overlay_tx[OQ_OPPORTUNISTIC].transmit_delay=200;
-  overlay_tx[OQ_OPPORTUNISTIC].grace_period=500;
+  overlay_queue_init();
   
   /* Get the set of socket file descriptors we need to monitor.
      Note that end-of-file will trigger select(), so we cannot run select() if we 
@@ -137,6 +174,11 @@ _sched_##X.alarm=gettime_ms()+Y;\
 _sched_##X.deadline=_sched_##X.alarm+D;\
 schedule(&_sched_##X); }
   
+  /* Fork the Rhizome worker, if configured, before there are any sockets or alarms for it to
+     inherit */
+  if (rhizome_enabled() && confValueGetBoolean("rhizome.worker", 0))
+    rhizome_worker_start();
+
   /* Periodically check for server shut down */
   SCHEDULE(server_shutdown_check, 0, 100);
   
@@ -148,7 +190,7 @@ schedule(&_sched_##X); }
 
   /* Get rhizome server started BEFORE populating fd list so that
      the server's listen socket is in the list for poll() */
-  if (rhizome_enabled()) 
+  if (rhizome_enabled() && !rhizome_worker_running())
     /* Rhizome http server needs to know which callback to attach
        to client sockets, so provide it here, along with the name to
        appear in time accounting statistics. */
@@ -167,6 +209,10 @@ schedule(&_sched_##X); }
      bundle announcements */
   SCHEDULE(rhizome_enqueue_suggestions, rhizome_fetch_interval_ms, rhizome_fetch_interval_ms*3);
 
+  /* Reclaim free database pages when idle, unless the Rhizome worker is doing it */
+  if (rhizome_enabled() && !rhizome_worker_running())
+    SCHEDULE(rhizome_vacuum, RHIZOME_VACUUM_INTERVAL_MS, RHIZOME_VACUUM_INTERVAL_MS);
+
   /* Periodically check for new interfaces */
   SCHEDULE(overlay_interface_discover, 1, 100);
 
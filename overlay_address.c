@@ -30,9 +30,31 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "overlay_buffer.h"
 #include "overlay_packet.h"
 
-#define MAX_BPIS 1024
-#define BPI_MASK 0x3ff
-static struct broadcast bpilist[MAX_BPIS];
+/* Recently seen BPIs are remembered in a pair of bloom filters.
+   New BPIs are added to the current filter, and both filters are checked.
+   Once per window, or sooner if the current filter has been given as many BPIs as it was sized for,
+   the older filter is cleared and becomes the current one.
+   So a BPI is remembered for at least one window unless we are overloaded, and for at most two.
+   Unlike a hash table, a busy mesh can't push a BPI out early by colliding with it,
+   but each filter can report a BPI we haven't seen at the configured false positive rate. */
+struct bpi_filter{
+  unsigned char *bits[2];
+  int current;
+  unsigned int size; /* bits in each filter */
+  int hashes;
+  int capacity;
+  int inserted;
+  uint64_t salt;
+  time_ms_t window;
+  time_ms_t rotated_at;
+  
+  /* statistics since they were last shown */
+  int new_bpis;
+  int duplicates;
+  int rotations;
+  int early_rotations;
+};
+static struct bpi_filter bpi_filter;
 
 // each node has 16 slots based on the next 4 bits of a subscriber id
 // each slot either points to another tree node or a struct subscriber.
@@ -301,33 +323,116 @@ int overlay_broadcast_generate_address(struct broadcast *addr)
   return 0;
 }
 
-// test if the broadcast address has been seen
-int overlay_broadcast_drop_check(struct broadcast *addr)
+static int overlay_broadcast_filter_init(time_ms_t now)
 {
-  /* Hash the BPI and see if we have seen it recently.
-     If so, drop the frame.
-     The occassional failure to supress a broadcast frame is not
-     something we are going to worry about just yet.  For byzantine
-     robustness it is however required. */
-  int bpi_index=0;
+  struct bpi_filter *f = &bpi_filter;
+  f->window = confValueGetInt64Range("mdp.broadcast.window_ms", 30000LL, 100LL, 3600000LL);
+  f->capacity = confValueGetInt64Range("mdp.broadcast.capacity", 4096LL, 16LL, 1048576LL);
+  int ppm = confValueGetInt64Range("mdp.broadcast.false_positive_ppm", 1000LL, 1LL, 500000LL);
+  
+  /* k = log2(1/p) hash functions, and k/ln(2) bits per BPI */
+  f->hashes = 0;
+  while((1000000>>f->hashes) > ppm)
+    f->hashes++;
+  if (f->hashes<1)
+    f->hashes=1;
+  f->size = ((unsigned int)f->capacity * f->hashes * 3 / 2 + 7) & ~7;
+  
   int i;
-  for(i=0;i<BROADCAST_LEN;i++)
-    {
-      bpi_index=((bpi_index<<3)&0xfff8)+((bpi_index>>13)&0x7);
-      bpi_index^=addr->id[i];
-    }
-  bpi_index&=BPI_MASK;
+  for (i=0;i<2;i++){
+    if (!f->bits[i])
+      f->bits[i] = calloc(f->size/8, 1);
+    if (!f->bits[i])
+      return WHY_perror("calloc");
+  }
+  f->salt = ((uint64_t)random()<<32) ^ random();
+  f->current = 0;
+  f->inserted = 0;
+  f->rotated_at = now;
+  if (debug&DEBUG_BROADCASTS)
+    DEBUGF("Remembering up to %d BPIs for %lldms, in 2 x %d bytes with %d hashes",
+	   f->capacity, (long long)f->window, f->size/8, f->hashes);
+  return 0;
+}
+
+static void overlay_broadcast_filter_rotate(time_ms_t now)
+{
+  struct bpi_filter *f = &bpi_filter;
+  f->current = !f->current;
+  bzero(f->bits[f->current], f->size/8);
+  f->inserted = 0;
+  f->rotated_at = now;
+  f->rotations++;
+}
+
+// test if the broadcast address has been seen, and remember it if it hasn't
+int overlay_broadcast_drop_check(struct broadcast *addr)
+{
+  struct bpi_filter *f = &bpi_filter;
+  time_ms_t now = gettime_ms();
   
-  if (memcmp(bpilist[bpi_index].id, addr->id, BROADCAST_LEN)){
-    if (debug&DEBUG_BROADCASTS)
-      DEBUGF("BPI %s is new", alloca_tohex(addr->id, BROADCAST_LEN));
-    bcopy(addr->id, bpilist[bpi_index].id, BROADCAST_LEN);
+  if (!f->bits[1] && overlay_broadcast_filter_init(now))
     return 0; /* don't drop */
-  }else{
+  
+  if (now - f->rotated_at >= f->window)
+    overlay_broadcast_filter_rotate(now);
+  
+  /* Derive every bit position from two 32 bit halves of a salted FNV-1a hash of the BPI,
+     so other nodes can't pick BPIs that collide with each other in our filter */
+  uint64_t hash = 0xcbf29ce484222325ULL ^ f->salt;
+  int i;
+  for(i=0;i<BROADCAST_LEN;i++){
+    hash ^= addr->id[i];
+    hash *= 0x100000001b3ULL;
+  }
+  uint32_t h1 = hash;
+  uint32_t h2 = (hash >> 32) | 1;
+  
+  int seen[2] = {1, 1};
+  for(i=0;i<f->hashes;i++){
+    unsigned int bit = (h1 + i*h2) % f->size;
+    unsigned char mask = 1 << (bit & 7);
+    if (!(f->bits[0][bit>>3] & mask))
+      seen[0] = 0;
+    if (!(f->bits[1][bit>>3] & mask))
+      seen[1] = 0;
+  }
+  
+  if (seen[0] || seen[1]){
+    f->duplicates++;
     if (debug&DEBUG_BROADCASTS)
       DEBUGF("BPI %s is a duplicate", alloca_tohex(addr->id, BROADCAST_LEN));
     return 1; /* drop frame because we have seen this BPI recently */
   }
+  
+  if (f->inserted >= f->capacity){
+    overlay_broadcast_filter_rotate(now);
+    f->early_rotations++;
+  }
+  
+  unsigned char *bits = f->bits[f->current];
+  for(i=0;i<f->hashes;i++){
+    unsigned int bit = (h1 + i*h2) % f->size;
+    bits[bit>>3] |= 1 << (bit & 7);
+  }
+  f->inserted++;
+  f->new_bpis++;
+  if (debug&DEBUG_BROADCASTS)
+    DEBUGF("BPI %s is new", alloca_tohex(addr->id, BROADCAST_LEN));
+  return 0; /* don't drop */
+}
+
+int overlay_broadcast_show_stats()
+{
+  struct bpi_filter *f = &bpi_filter;
+  if (f->new_bpis || f->duplicates)
+    INFOF("Broadcasts: %d new, %d duplicates dropped, %d filter rotations (%d early as the filter was full)",
+	  f->new_bpis, f->duplicates, f->rotations, f->early_rotations);
+  f->new_bpis=0;
+  f->duplicates=0;
+  f->rotations=0;
+  f->early_rotations=0;
+  return 0;
 }
 
 int overlay_broadcast_append(struct overlay_buffer *b, struct broadcast *broadcast)
@@ -392,7 +497,7 @@ int overlay_address_append_self(overlay_interface *interface, struct overlay_buf
 static int add_explain_response(struct subscriber *subscriber, void *context){
   struct decode_context *response = context;
   if (!response->please_explain){
-    response->please_explain = calloc(sizeof(struct overlay_frame),1);
+    response->please_explain = op_new();
     response->please_explain->payload=ob_new();
     ob_limitsize(response->please_explain->payload, 1024);
   }
@@ -429,7 +534,7 @@ int find_subscr_buffer(struct decode_context *context, struct overlay_buffer *b,
     
     // add the abbreviation you told me about
     if (!context->please_explain){
-      context->please_explain = calloc(sizeof(struct overlay_frame),1);
+      context->please_explain = op_new();
       context->please_explain->payload=ob_new();
       ob_limitsize(context->please_explain->payload, MDP_MTU);
     }
@@ -99,6 +99,8 @@ struct subscriber{
   time_ms_t sas_last_request;
   unsigned char sas_valid;
   
+  // frames waiting in each transmit queue for this destination
+  struct overlay_tx_bucket *tx_bucket[OQ_MAX];
 };
 
 struct broadcast{
@@ -123,6 +125,7 @@ int load_subscriber_address(struct subscriber *subscriber);
 int process_explain(struct overlay_frame *frame);
 int overlay_broadcast_drop_check(struct broadcast *addr);
 int overlay_broadcast_generate_address(struct broadcast *addr);
+int overlay_broadcast_show_stats();
 
 int overlay_broadcast_append(struct overlay_buffer *b, struct broadcast *broadcast);
 int overlay_address_append(struct overlay_buffer *b, struct subscriber *subscriber);
@@ -30,9 +30,169 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 
 
+long long ob_allocations=0;
+
+static struct overlay_pool *registered_pools=NULL;
+
+// take an object from the pool's free list, or from malloc() if the list is empty.
+// The object is NOT zeroed.
+void *ob_pool_get(struct overlay_pool *pool)
+{
+  void *ret;
+  if (pool->free_list){
+    ret = pool->free_list;
+    pool->free_list = *(void **)ret;
+    pool->stats.cached--;
+    pool->stats.reuses++;
+  }else{
+    ret = malloc(pool->size);
+    if (!ret) return WHYNULL("malloc() failed");
+    ob_allocations++;
+    pool->stats.system_allocs++;
+    if (!pool->_registered){
+      pool->_registered=1;
+      pool->_next=registered_pools;
+      registered_pools=pool;
+    }
+  }
+  if (++pool->stats.in_use > pool->stats.high_water)
+    pool->stats.high_water = pool->stats.in_use;
+  return ret;
+}
+
+// return an object to the pool, keeping at most max_cached of them for reuse
+void ob_pool_put(struct overlay_pool *pool, void *object)
+{
+  pool->stats.in_use--;
+  if (pool->stats.cached >= pool->max_cached){
+    pool->stats.system_frees++;
+    free(object);
+    return;
+  }
+  *(void **)object = pool->free_list;
+  pool->free_list = object;
+  pool->stats.cached++;
+}
+
+int ob_show_pool_stats()
+{
+  struct overlay_pool *pool;
+  for (pool=registered_pools; pool; pool=pool->_next){
+    INFOF("Pool %s: in_use=%d, high_water=%d, cached=%d, system_allocs=%lld, reuses=%lld, system_frees=%lld",
+	pool->name, pool->stats.in_use, pool->stats.high_water, pool->stats.cached,
+	pool->stats.system_allocs, pool->stats.reuses, pool->stats.system_frees);
+  }
+  return 0;
+}
+
+// total objects handed out by every pool and not yet returned
+int ob_pools_in_use()
+{
+  struct overlay_pool *pool;
+  int in_use=0;
+  for (pool=registered_pools; pool; pool=pool->_next)
+    in_use += pool->stats.in_use;
+  return in_use;
+}
+
+static struct overlay_pool header_pool={
+  .name="overlay_buffer",
+  .size=sizeof(struct overlay_buffer),
+  .max_cached=256,
+};
+
+/* Buffer contents come in power of two size classes from OB_MIN_BYTES to OB_MAX_POOLED_BYTES,
+   larger buffers go straight to malloc() */
+#define OB_MIN_SHIFT 6
+#define OB_MAX_POOLED_SHIFT 16
+#define OB_MIN_BYTES (1<<OB_MIN_SHIFT)
+#define OB_MAX_POOLED_BYTES (1<<OB_MAX_POOLED_SHIFT)
+#define OB_SIZE_CLASSES (OB_MAX_POOLED_SHIFT-OB_MIN_SHIFT+1)
+
+#ifdef MALLOC_PARANOIA
+#warning adding lots of padding to try to catch overruns
+#define OB_CATCH_TRAY 4096
+#else
+#define OB_CATCH_TRAY 0
+#endif
+
+#define BYTES_POOL(SHIFT, CACHED) { .name="bytes[" #SHIFT "]", .size=(1<<SHIFT)+OB_CATCH_TRAY, .max_cached=CACHED }
+static struct overlay_pool bytes_pools[OB_SIZE_CLASSES]={
+  BYTES_POOL(6, 256), BYTES_POOL(7, 256), BYTES_POOL(8, 256), BYTES_POOL(9, 128),
+  BYTES_POOL(10, 128), BYTES_POOL(11, 128), BYTES_POOL(12, 32), BYTES_POOL(13, 16),
+  BYTES_POOL(14, 8), BYTES_POOL(15, 4), BYTES_POOL(16, 4),
+};
+
+// round a requested size up to the size of the block that will hold it
+static int ob_bytes_size(int size)
+{
+  int rounded = OB_MIN_BYTES;
+  while (rounded < size && rounded < OB_MAX_POOLED_BYTES)
+    rounded <<= 1;
+  return size > rounded ? size : rounded;
+}
+
+static struct overlay_pool *ob_bytes_pool(int size)
+{
+  int i;
+  for (i=0; i<OB_SIZE_CLASSES; i++)
+    if (size == (1<<(OB_MIN_SHIFT+i)))
+      return &bytes_pools[i];
+  return NULL;
+}
+
+// size must have come from ob_bytes_size()
+static unsigned char *ob_bytes_get(int size)
+{
+  struct overlay_pool *pool = ob_bytes_pool(size);
+  unsigned char *ret;
+  if (pool)
+    ret = ob_pool_get(pool);
+  else{
+    ret = malloc(size+OB_CATCH_TRAY);
+    if (!ret) return WHYNULL("malloc() failed");
+    ob_allocations++;
+  }
+#ifdef MALLOC_PARANOIA
+  if (ret) {
+    int i;
+    for(i=0;i<OB_CATCH_TRAY;i++) ret[size+i]=0xbd;
+  }
+#endif
+  return ret;
+}
+
+static void ob_bytes_put(unsigned char *bytes, int size)
+{
+  struct overlay_pool *pool = ob_bytes_pool(size);
+  if (pool)
+    ob_pool_put(pool, bytes);
+  else
+    free(bytes);
+}
+
+void *ob_block_get(int *size)
+{
+  *size = ob_bytes_size(*size);
+  return ob_bytes_get(*size);
+}
+
+void ob_block_put(void *block, int size)
+{
+  ob_bytes_put(block, size);
+}
+
+static struct overlay_buffer *ob_header_new(void)
+{
+  struct overlay_buffer *ret=ob_pool_get(&header_pool);
+  if (!ret) return NULL;
+  bzero(ret, sizeof(struct overlay_buffer));
+  return ret;
+}
+
 struct overlay_buffer *ob_new(void)
 {
-  struct overlay_buffer *ret=calloc(sizeof(struct overlay_buffer),1);
+  struct overlay_buffer *ret=ob_header_new();
   if (!ret) return NULL;
   
   ob_unlimitsize(ret);
@@ -43,7 +203,7 @@ struct overlay_buffer *ob_new(void)
 // index an existing static buffer.
 // and allow other callers to use the ob_ convenience methods for reading and writing up to size bytes.
 struct overlay_buffer *ob_static(unsigned char *bytes, int size){
-  struct overlay_buffer *ret=calloc(sizeof(struct overlay_buffer),1);
+  struct overlay_buffer *ret=ob_header_new();
   if (!ret) return NULL;
   ret->bytes = bytes;
   ret->allocSize = size;
@@ -53,6 +213,15 @@ struct overlay_buffer *ob_static(unsigned char *bytes, int size){
   return ret;
 }
 
+// as ob_static, but fill in a header that the caller owns, so nothing is allocated.
+void ob_static_init(struct overlay_buffer *b, unsigned char *bytes, int size){
+  bzero(b, sizeof(struct overlay_buffer));
+  b->bytes = bytes;
+  b->allocSize = size;
+  b->embedded = 1;
+  ob_unlimitsize(b);
+}
+
 // create a new overlay buffer from an existing piece of another buffer.
 // Both buffers will point to the same memory region.
 // It is up to the caller to ensure this buffer is not used after the parent buffer is freed.
@@ -60,7 +229,7 @@ struct overlay_buffer *ob_slice(struct overlay_buffer *b, int offset, int length
   if (offset+length > b->allocSize)
     return WHYNULL("Buffer isn't long enough to slice");
       
-  struct overlay_buffer *ret=calloc(sizeof(struct overlay_buffer),1);
+  struct overlay_buffer *ret=ob_header_new();
   if (!ret)
       return NULL;
   ret->bytes = b->bytes+offset;
@@ -71,11 +240,19 @@ struct overlay_buffer *ob_slice(struct overlay_buffer *b, int offset, int length
   return ret;
 }
 
+// as ob_slice, but fill in a header that the caller owns, so nothing is allocated.
+int ob_slice_init(struct overlay_buffer *slice, struct overlay_buffer *b, int offset, int length){
+  if (offset+length > b->allocSize)
+    return WHY("Buffer isn't long enough to slice");
+  ob_static_init(slice, b->bytes+offset, length);
+  return 0;
+}
+
+// copy the contents of a buffer into a new allocated buffer, leaving the position after the copied bytes
 struct overlay_buffer *ob_dup(struct overlay_buffer *b){
-  struct overlay_buffer *ret=calloc(sizeof(struct overlay_buffer),1);
-  ret->sizeLimit = b->sizeLimit;
-  ret->position = b->position;
-  ret->checkpointLength = b->checkpointLength;
+  struct overlay_buffer *ret=ob_header_new();
+  if (!ret) return NULL;
+  ob_unlimitsize(ret);
   
   if (b->bytes && b->allocSize){
     // duplicate any bytes that might be relevant
@@ -85,19 +262,25 @@ struct overlay_buffer *ob_dup(struct overlay_buffer *b){
     if (byteCount > b->allocSize)
       byteCount = b->allocSize;
     
-    ob_append_bytes(ret, b->bytes, byteCount);
+    if (ob_append_bytes(ret, b->bytes, byteCount)){
+      ob_free(ret);
+      return NULL;
+    }
   }
+  ret->sizeLimit = b->sizeLimit;
+  ret->checkpointLength = b->checkpointLength;
   return ret;
 }
 
 int ob_free(struct overlay_buffer *b)
 {
   if (!b) return WHY("Asked to free NULL");
-  if (b->bytes && b->allocated) free(b->bytes);
+  if (b->bytes && b->allocated) ob_bytes_put(b->bytes, b->allocSize);
   b->bytes=NULL;
   b->allocSize=0;
   b->sizeLimit=0;
-  free(b);
+  if (!b->embedded)
+    ob_pool_put(&header_pool, b);
   return 0;
 }
 
@@ -151,46 +334,32 @@ int ob_makespace(struct overlay_buffer *b,int bytes)
     DEBUGF("ob_makespace(%p,%d)\n  b->bytes=%p,b->position=%d,b->allocSize=%d\n",
 	   b,bytes,b->bytes,b->position,b->allocSize);
 
+  /* Grow to at least double the current size, so a buffer that is appended to a byte at a
+     time is only copied a logarithmic number of times, but don't go past the size limit */
   int newSize=b->position+bytes;
-  if (newSize<64) newSize=64;
-  if (newSize&63) newSize+=64-(newSize&63);
-  if (newSize>1024) {
-    if (newSize&1023) newSize+=1024-(newSize&1023);
-  }
-  if (newSize>65536) {
-    if (newSize&65535) newSize+=65536-(newSize&65535);
-  }
-  if (0) DEBUGF("realloc(b->bytes=%p,newSize=%d)", b->bytes,newSize);
-  /* XXX OSX realloc() seems to be able to corrupt things if the heap is not happy when calling realloc(), making debugging memory corruption much harder.
-     So will do a three-stage malloc,bcopy,free to see if we can tease the bug out that way. */
-  /*
-    unsigned char *r=realloc(b->bytes,newSize);
-    if (!r) return WHY("realloc() failed");
-    b->bytes=r; 
-  */
+  int doubled=b->allocSize*2;
+  if (b->sizeLimit!=-1 && doubled>b->sizeLimit)
+    doubled=b->sizeLimit;
+  if (newSize<doubled)
+    newSize=doubled;
+  newSize=ob_bytes_size(newSize);
+  if (0) DEBUGF("resize(b->bytes=%p,newSize=%d)", b->bytes,newSize);
 #ifdef MALLOC_PARANOIA
-#warning adding lots of padding to try to catch overruns
   if (b->bytes) {
     int i;
     int corrupt=0;
-    for(i=0;i<4096;i++) if (b->bytes[b->allocSize+i]!=0xbd) corrupt++;
+    for(i=0;i<OB_CATCH_TRAY;i++) if (b->bytes[b->allocSize+i]!=0xbd) corrupt++;
     if (corrupt) {
       WHYF("!!!!!! %d corrupted bytes in overrun catch tray", corrupt);
-      dump("overrun catch tray",&b->bytes[b->allocSize],4096);
+      dump("overrun catch tray",&b->bytes[b->allocSize],OB_CATCH_TRAY);
       sleep(3600);
     }
   }
-  unsigned char *new=malloc(newSize+4096);
-  if (!new) return WHY("realloc() failed");
-  {
-    int i;
-    for(i=0;i<4096;i++) new[newSize+i]=0xbd;
-  }
-#else
-  unsigned char *new=malloc(newSize);
 #endif
+  unsigned char *new=ob_bytes_get(newSize);
+  if (!new) return WHY("Could not grow buffer");
   bcopy(b->bytes,new,b->position);
-  if (b->bytes) free(b->bytes);
+  if (b->bytes) ob_bytes_put(b->bytes, b->allocSize);
   b->bytes=new;
   b->allocated=1;
   b->allocSize=newSize;
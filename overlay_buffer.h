@@ -38,15 +38,53 @@ struct overlay_buffer {
   // is this an allocated buffer? can it be resized? Should it be freed?
   int allocated;
   
+  // is this header owned by the caller (on the stack, or inside another allocation)?
+  // if so, ob_free() only releases the bytes
+  int embedded;
+  
   // length position and size for later patching
   int var_length_offset;
   int var_length_bytes;
 };
 
+/* Free lists that keep recently released objects for reuse, so steady state traffic doesn't
+   call malloc() or free() for every frame */
+struct overlay_pool_stats {
+  int in_use;               // objects handed out and not yet returned; growth suggests a leak
+  int high_water;           // most objects in use at once
+  int cached;               // released objects waiting on the free list
+  long long system_allocs;  // objects that had to come from malloc()
+  long long reuses;         // objects served from the free list
+  long long system_frees;   // released objects given back to free() because the list was full
+};
+
+struct overlay_pool {
+  const char *name;
+  size_t size;
+  int max_cached;
+  void *free_list;
+  struct overlay_pool_stats stats;
+  // pools that have been used, for reporting
+  struct overlay_pool *_next;
+  int _registered;
+};
+
+void *ob_pool_get(struct overlay_pool *pool);
+void ob_pool_put(struct overlay_pool *pool, void *object);
+int ob_show_pool_stats();
+int ob_pools_in_use();
+
+/* Blocks from the size classed pools that hold buffer contents, for callers that keep several
+   objects in one allocation.  *size is rounded up to the size of the block returned. */
+void *ob_block_get(int *size);
+void ob_block_put(void *block, int size);
+
 struct overlay_buffer *ob_new(void);
 struct overlay_buffer *ob_static(unsigned char *bytes, int size);
 struct overlay_buffer *ob_slice(struct overlay_buffer *b, int offset, int length);
 struct overlay_buffer *ob_dup(struct overlay_buffer *b);
+void ob_static_init(struct overlay_buffer *b, unsigned char *bytes, int size);
+int ob_slice_init(struct overlay_buffer *slice, struct overlay_buffer *b, int offset, int length);
 int ob_free(struct overlay_buffer *b);
 int ob_checkpoint(struct overlay_buffer *b);
 int ob_rewind(struct overlay_buffer *b);
@@ -70,5 +108,8 @@ uint32_t ob_get_ui32(struct overlay_buffer *b);
 uint16_t ob_get_ui16(struct overlay_buffer *b);
 int ob_dump(struct overlay_buffer *b,char *desc);
 
+// count of calls to malloc() made for overlay buffers and frames
+extern long long ob_allocations;
+
 
 #endif
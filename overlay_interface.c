@@ -27,6 +27,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "strbuf.h"
 #include "overlay_buffer.h"
 #include "overlay_packet.h"
+#include "cli.h"
 
 #ifdef HAVE_IFADDRS_H
 #include <ifaddrs.h>
@@ -66,6 +67,22 @@ struct outgoing_packet{
 struct sched_ent next_packet;
 struct profile_total send_packet;
 
+/* Up to this many waiting datagrams are read from an interface socket per wakeup */
+#define OVERLAY_RECV_BATCH 16
+static unsigned char recv_buffers[OVERLAY_RECV_BATCH][16384];
+static struct recv_datagram recv_datagrams[OVERLAY_RECV_BATCH];
+
+/* Packets built while emptying the queues are held here, up to this many, and sent together
+   before returning to the poll loop */
+#define OVERLAY_SEND_BATCH 16
+struct batched_packet {
+  int interface;
+  struct sockaddr_in dest;
+  struct overlay_buffer *buffer;
+};
+static struct batched_packet send_batch[OVERLAY_SEND_BATCH];
+static int send_batch_count=0;
+
 static int overlay_tick_interface(int i, time_ms_t now);
 static void overlay_interface_poll(struct sched_ent *alarm);
 static void		logServalPacket(int level, struct __sourceloc where, const char *message, const unsigned char *packet, size_t len);
@@ -290,49 +307,57 @@ overlay_interface * overlay_interface_find_name(const char *name){
   return NULL;
 }
 
+static int
+overlay_recv_batch(int fd){
+  int i;
+  for (i=0;i<OVERLAY_RECV_BATCH;i++){
+    recv_datagrams[i].buffer=recv_buffers[i];
+    recv_datagrams[i].bufferlen=sizeof recv_buffers[i];
+    recv_datagrams[i].ttl=1;
+  }
+  return recvmmsgwithttl(fd, recv_datagrams, OVERLAY_RECV_BATCH);
+}
+
 // OSX doesn't recieve broadcast packets on sockets bound to an interface's address
 // So we have to bind a socket to INADDR_ANY to receive these packets.
 static void
 overlay_interface_read_any(struct sched_ent *alarm){
   if (alarm->poll.revents & POLLIN) {
-    int plen=0;
-    int recvttl=1;
-    unsigned char packet[16384];
-    overlay_interface *interface=NULL;
-    struct sockaddr src_addr;
-    socklen_t addrlen = sizeof(src_addr);
-    
-    /* Read only one UDP packet per call to share resources more fairly, and also
-     enable stats to accurately count packets received */
-    plen = recvwithttl(alarm->poll.fd, packet, sizeof(packet), &recvttl, &src_addr, &addrlen);
-    if (plen == -1) {
-      WHY_perror("recvwithttl(c)");
+    /* Read all the UDP packets that are waiting, up to a batch, in one system call where the
+       platform allows it */
+    int n = overlay_recv_batch(alarm->poll.fd);
+    if (n == -1) {
+      WHY("recvmmsgwithttl(c) failed");
       unwatch(alarm);
       close(alarm->poll.fd);
       return;
     }
     
-    struct in_addr src = ((struct sockaddr_in *)&src_addr)->sin_addr;
-    
-    /* Try to identify the real interface that the packet arrived on */
-    interface = overlay_interface_find(src);
-    
-    /* Drop the packet if we don't find a match */
-    if (!interface){
-      if (debug&DEBUG_OVERLAYINTERFACES)
-	DEBUGF("Could not find matching interface for packet received from %s", inet_ntoa(src));
-      return;
-    }
-    
-    /* We have a frame from this interface */
-    if (debug&DEBUG_PACKETRX)
-      DEBUG_packet_visualise("Read from real interface", packet,plen);
-    if (debug&DEBUG_OVERLAYINTERFACES) 
-      DEBUGF("Received %d bytes from %s on interface %s (ANY)",plen, 
-	     inet_ntoa(((struct sockaddr_in *)&src_addr)->sin_addr),
-	     interface->name);
-    if (packetOk(interface,packet,plen,NULL,recvttl,&src_addr,addrlen,1)) {
-      WHY("Malformed packet");
+    int i;
+    for (i=0;i<n;i++){
+      struct recv_datagram *d=&recv_datagrams[i];
+      struct in_addr src = ((struct sockaddr_in *)&d->addr)->sin_addr;
+      
+      /* Try to identify the real interface that the packet arrived on */
+      overlay_interface *interface = overlay_interface_find(src);
+      
+      /* Drop the packet if we don't find a match */
+      if (!interface){
+	if (debug&DEBUG_OVERLAYINTERFACES)
+	  DEBUGF("Could not find matching interface for packet received from %s", inet_ntoa(src));
+	continue;
+      }
+      
+      /* We have a frame from this interface */
+      if (debug&DEBUG_PACKETRX)
+	DEBUG_packet_visualise("Read from real interface", d->buffer,d->len);
+      if (debug&DEBUG_OVERLAYINTERFACES) 
+	DEBUGF("Received %d bytes from %s on interface %s (ANY)",(int)d->len, 
+	       inet_ntoa(src),
+	       interface->name);
+      if (packetOk(interface,d->buffer,d->len,NULL,d->ttl,&d->addr,d->addrlen,1)) {
+	WHY("Malformed packet");
+      }
     }
   }
   if (alarm->poll.revents & (POLLHUP | POLLERR)) {
@@ -452,6 +477,14 @@ overlay_interface_init(char *name, struct in_addr src_addr, struct in_addr netma
   interface->mtu=1200;
   interface->state=INTERFACE_STATE_DOWN;
   interface->bits_per_second=speed_in_bits;
+  /* Allow a burst of up to mdp.pacing.burst_ms of traffic at the interface's speed, but never
+     less than a whole packet */
+  interface->tx_budget_limit = (long long)speed_in_bits * 
+    confValueGetInt64Range("mdp.pacing.burst_ms", 100LL, 0LL, 60000LL);
+  if (interface->tx_budget_limit < interface->mtu * 8LL * 1000)
+    interface->tx_budget_limit = interface->mtu * 8LL * 1000;
+  interface->tx_budget = interface->tx_budget_limit;
+  interface->tx_budget_updated = gettime_ms();
   interface->port=port;
   interface->type=type;
   interface->last_tick_ms= -1; // not ticked yet
@@ -557,8 +590,9 @@ static void overlay_interface_poll(struct sched_ent *alarm)
       // tick the interface
       time_ms_t now = gettime_ms();
       int i = (interface - overlay_interfaces);
-      overlay_tick_interface(i, now);
-      alarm->alarm=now+interface->tick_ms;
+      // a paced tick returns how long until it can be sent
+      int delay = overlay_tick_interface(i, now);
+      alarm->alarm=now+(delay?delay:interface->tick_ms);
       alarm->deadline=alarm->alarm+interface->tick_ms/2;
       schedule(alarm);
     }
@@ -567,34 +601,30 @@ static void overlay_interface_poll(struct sched_ent *alarm)
   }
   
   if (alarm->poll.revents & POLLIN) {
-    int plen=0;
-    unsigned char packet[16384];
-
-    struct sockaddr src_addr;
-    socklen_t addrlen = sizeof(src_addr);
-
-    
-    /* Read only one UDP packet per call to share resources more fairly, and also
-       enable stats to accurately count packets received */
-    int recvttl=1;
-    plen = recvwithttl(alarm->poll.fd,packet, sizeof(packet), &recvttl, &src_addr, &addrlen);
-    if (plen == -1) {
-      WHY_perror("recvwithttl(c)");
+    /* Read all the UDP packets that are waiting, up to a batch, in one system call where the
+       platform allows it */
+    int n = overlay_recv_batch(alarm->poll.fd);
+    if (n == -1) {
+      WHY("recvmmsgwithttl(c) failed");
       overlay_interface_close(interface);
       return;
     }
     
-    /* We have a frame from this interface */
-    if (debug&DEBUG_PACKETRX)
-      DEBUG_packet_visualise("Read from real interface", packet,plen);
-    if (debug&DEBUG_OVERLAYINTERFACES) 
-      DEBUGF("Received %d bytes from %s on interface %s",plen, 
-	     inet_ntoa(((struct sockaddr_in *)&src_addr)->sin_addr),
-	     interface->name);
-    if (packetOk(interface,packet,plen,NULL,recvttl,&src_addr,addrlen,1)) {
-      WHY("Malformed packet");
-      // Do we really want to attempt to parse it again?
-      //DEBUG_packet_visualise("Malformed packet", packet,plen);
+    int i;
+    for (i=0;i<n;i++){
+      struct recv_datagram *d=&recv_datagrams[i];
+      /* We have a frame from this interface */
+      if (debug&DEBUG_PACKETRX)
+	DEBUG_packet_visualise("Read from real interface", d->buffer,d->len);
+      if (debug&DEBUG_OVERLAYINTERFACES) 
+	DEBUGF("Received %d bytes from %s on interface %s",(int)d->len, 
+	       inet_ntoa(((struct sockaddr_in *)&d->addr)->sin_addr),
+	       interface->name);
+      if (packetOk(interface,d->buffer,d->len,NULL,d->ttl,&d->addr,d->addrlen,1)) {
+	WHY("Malformed packet");
+	// Do we really want to attempt to parse it again?
+	//DEBUG_packet_visualise("Malformed packet", packet,plen);
+      }
     }
   }
   
@@ -689,6 +719,92 @@ void overlay_dummy_poll(struct sched_ent *alarm)
   return ;
 }
 
+// add the budget earned since it was last updated
+static void
+overlay_pacing_refill(overlay_interface *interface, time_ms_t now){
+  if (now > interface->tx_budget_updated){
+    interface->tx_budget += (now - interface->tx_budget_updated) * interface->bits_per_second;
+    if (interface->tx_budget > interface->tx_budget_limit)
+      interface->tx_budget = interface->tx_budget_limit;
+  }
+  interface->tx_budget_updated = now;
+}
+
+/* How long until this interface may send queued traffic without exceeding its speed?
+   Routing ticks may borrow up to one full burst, so they aren't starved by a busy queue. */
+static time_ms_t
+overlay_pacing_delay(overlay_interface *interface, time_ms_t now, int tick){
+  // an interface without a speed is only listening, there's nothing to pace
+  if (interface->bits_per_second<1)
+    return 0;
+  overlay_pacing_refill(interface, now);
+  long long threshold = tick ? -interface->tx_budget_limit : 0;
+  if (interface->tx_budget > threshold)
+    return 0;
+  return (threshold - interface->tx_budget) / interface->bits_per_second + 1;
+}
+
+// account for a packet sent on this interface
+static void
+overlay_pacing_charge(overlay_interface *interface, int len){
+  overlay_pacing_refill(interface, gettime_ms());
+  interface->tx_budget -= len * 8LL * 1000;
+  interface->tx_holding = 0;
+}
+
+// note that traffic is being held back, once until the next packet is sent
+static void
+overlay_pacing_hold(overlay_interface *interface, time_ms_t delay){
+  if (interface->tx_holding)
+    return;
+  interface->tx_holding = 1;
+  interface->tx_held++;
+  if (debug&DEBUG_OVERLAYINTERFACES)
+    DEBUGF("Pacing interface %s to %d bits per second, holding traffic for %lldms",
+	   interface->name, interface->bits_per_second, (long long)delay);
+}
+
+int overlay_interface_show_pacing()
+{
+  int i;
+  for (i=0;i<overlay_interface_count;i++){
+    overlay_interface *interface = &overlay_interfaces[i];
+    if (interface->state!=INTERFACE_STATE_UP)
+      continue;
+    if (interface->tx_frames || interface->tx_held)
+      INFOF("Interface %s: %d frames sent, %lldms average and %lldms max queueing delay, held back %d times to stay under %d bits per second",
+	    interface->name, interface->tx_frames,
+	    (long long)(interface->tx_frames?interface->tx_queue_delay / interface->tx_frames:0),
+	    (long long)interface->tx_queue_delay_max,
+	    interface->tx_held, interface->bits_per_second);
+    interface->tx_frames=0;
+    interface->tx_queue_delay=0;
+    interface->tx_queue_delay_max=0;
+    interface->tx_held=0;
+  }
+  return 0;
+}
+
+int overlay_queue_show_stats()
+{
+  int i;
+  for (i=0;i<OQ_MAX;i++){
+    overlay_txqueue *queue = &overlay_tx[i];
+    if (queue->sent || queue->dropped_expired || queue->dropped_congested)
+      INFOF("Queue %s: %d frames sent, %lldms average and %lldms max latency, %d expired, %d dropped while congested",
+	    queue->name, queue->sent,
+	    (long long)(queue->sent?queue->latency_total / queue->sent:0),
+	    (long long)queue->latency_max,
+	    queue->dropped_expired, queue->dropped_congested);
+    queue->sent=0;
+    queue->latency_total=0;
+    queue->latency_max=0;
+    queue->dropped_expired=0;
+    queue->dropped_congested=0;
+  }
+  return 0;
+}
+
 static int
 overlay_broadcast_ensemble(int interface_number,
 			   struct sockaddr_in *recipientaddr,
@@ -706,6 +822,8 @@ overlay_broadcast_ensemble(int interface_number,
     return WHYF("Cannot send to interface %s as it is down", interface->name);
   }
 
+  overlay_pacing_charge(interface, len);
+  
   if (interface->fileP)
     {
       char buf[2048];
@@ -783,6 +901,94 @@ int overlay_sendto(struct sockaddr_in *recipientaddr,unsigned char *bytes,int le
   return len;
 }
 
+/* Send all the packets held in the batch, grouped by interface, with one sendmmsg() call per
+   interface socket where the platform has it.
+ */
+static void
+overlay_send_batch_flush(){
+  int i, j;
+  for (i=0;i<send_batch_count;i++){
+    if (!send_batch[i].buffer)
+      continue;
+    overlay_interface *interface = &overlay_interfaces[send_batch[i].interface];
+    struct batched_packet *run[OVERLAY_SEND_BATCH];
+    int n=0;
+    for (j=i;j<send_batch_count;j++){
+      struct batched_packet *p=&send_batch[j];
+      if (!p->buffer || p->interface!=send_batch[i].interface)
+	continue;
+      if (debug&DEBUG_PACKETTX){
+	DEBUGF("Sending this packet via interface #%d",p->interface);
+	DEBUG_packet_visualise(NULL,p->buffer->bytes,p->buffer->position);
+      }
+      if (debug&DEBUG_OVERLAYINTERFACES) 
+	DEBUGF("Sending %d byte overlay frame on %s to %s",p->buffer->position,interface->name,inet_ntoa(p->dest.sin_addr));
+      run[n++]=p;
+    }
+    if (interface->state!=INTERFACE_STATE_UP){
+      WHYF("Cannot send to interface %s as it is down", interface->name);
+    }else{
+#ifdef HAVE_SENDMMSG
+      struct mmsghdr msgs[OVERLAY_SEND_BATCH];
+      struct iovec iov[OVERLAY_SEND_BATCH];
+      bzero(msgs, sizeof msgs);
+      for (j=0;j<n;j++){
+	iov[j].iov_base=run[j]->buffer->bytes;
+	iov[j].iov_len=run[j]->buffer->position;
+	msgs[j].msg_hdr.msg_name=&run[j]->dest;
+	msgs[j].msg_hdr.msg_namelen=sizeof(struct sockaddr_in);
+	msgs[j].msg_hdr.msg_iov=&iov[j];
+	msgs[j].msg_hdr.msg_iovlen=1;
+      }
+      int sent=0;
+      while(sent<n){
+	int r=sendmmsg(interface->alarm.poll.fd, &msgs[sent], n-sent, 0);
+	if (r==-1){
+	  WHY_perror("sendmmsg(c)");
+	  overlay_interface_close(interface);
+	  break;
+	}
+	sent+=r;
+      }
+#else
+      for (j=0;j<n;j++){
+	if(sendto(interface->alarm.poll.fd, run[j]->buffer->bytes, run[j]->buffer->position, 0,
+		  (struct sockaddr *)&run[j]->dest, sizeof(struct sockaddr_in)) != run[j]->buffer->position){
+	  WHY_perror("sendto(c)");
+	  overlay_interface_close(interface);
+	  break;
+	}
+      }
+#endif
+    }
+    for (j=0;j<n;j++){
+      ob_free(run[j]->buffer);
+      run[j]->buffer=NULL;
+    }
+  }
+  send_batch_count=0;
+}
+
+/* Take ownership of an assembled packet, and send it with the rest of the batch.  Packets for
+   dummy file interfaces are written straight away.
+ */
+static void
+overlay_queue_ensemble(int interface_number, struct sockaddr_in *dest, struct overlay_buffer *buffer){
+  if (overlay_interfaces[interface_number].fileP){
+    overlay_broadcast_ensemble(interface_number, dest, buffer->bytes, buffer->position);
+    ob_free(buffer);
+    return;
+  }
+  // charge for the packet now, so the rest of the batch is paced with it in mind
+  overlay_pacing_charge(&overlay_interfaces[interface_number], buffer->position);
+  if (send_batch_count>=OVERLAY_SEND_BATCH)
+    overlay_send_batch_flush();
+  struct batched_packet *p=&send_batch[send_batch_count++];
+  p->interface=interface_number;
+  p->dest=*dest;
+  p->buffer=buffer;
+}
+
 /* Register the interface, or update the existing interface registration */
 int
 overlay_interface_register(char *name,
@@ -893,7 +1099,7 @@ void overlay_interface_discover(struct sched_ent *alarm){
 
     if (i >= overlay_interface_count){
       /* New interface, so register it */      
-      overlay_interface_init(r->namespec,dummyaddr,dummyaddr,dummyaddr,1000000,PORT_DNA,OVERLAY_INTERFACE_WIFI);
+      overlay_interface_init(r->namespec,dummyaddr,dummyaddr,dummyaddr,r->speed_in_bits,PORT_DNA,OVERLAY_INTERFACE_WIFI);
     }
   }
 
@@ -949,6 +1155,7 @@ overlay_queue_remove(overlay_txqueue *queue, struct overlay_frame *frame){
   
   queue->length--;
   
+  overlay_queue_bucket_remove(queue, frame);
   op_free(frame);
   
   return next;
@@ -1024,9 +1231,10 @@ overlay_init_packet(struct outgoing_packet *packet, overlay_interface *interface
   }
 }
 
-// update the alarm time and return 1 if changed
+// update the alarm time and return 1 if changed.
+// ready is the earliest time the frame can be sent, if its interface is being paced
 static int
-overlay_calc_queue_time(overlay_txqueue *queue, struct overlay_frame *frame){
+overlay_calc_queue_time(overlay_txqueue *queue, struct overlay_frame *frame, time_ms_t ready){
   int ret=0;
   time_ms_t send_time;
 
@@ -1036,6 +1244,8 @@ overlay_calc_queue_time(overlay_txqueue *queue, struct overlay_frame *frame){
   
   // when is the next packet from this queue due?
   send_time=queue->first->enqueued_at + queue->transmit_delay;
+  if (send_time < ready)
+    send_time = ready;
   if (next_packet.alarm==0 || send_time < next_packet.alarm){
     next_packet.alarm=send_time;
     ret = 1;
@@ -1055,80 +1265,146 @@ overlay_calc_queue_time(overlay_txqueue *queue, struct overlay_frame *frame){
   return ret;
 }
 
+// can this packet carry a unicast payload for next_hop?
+static int
+overlay_packet_reaches(struct outgoing_packet *packet, struct subscriber *next_hop){
+  if(packet->interface != next_hop->interface)
+    return 0;
+  if (next_hop->reachable==REACHABLE_DIRECT && packet->unicast)
+    return 0;
+  if (next_hop->reachable==REACHABLE_UNICAST && 
+      ((!packet->unicast) ||
+      packet->dest.sin_addr.s_addr != next_hop->address.sin_addr.s_addr))
+    return 0;
+  return 1;
+}
+
+// a bucket that has had frames sent goes behind the others, unless that emptied and released it
 static void
-overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, time_ms_t now){
-  struct overlay_frame *frame = queue->first;
+overlay_bucket_served(overlay_txqueue *queue, struct subscriber *destination, struct overlay_tx_bucket *bucket){
+  struct overlay_tx_bucket *current = destination?destination->tx_bucket[queue - overlay_tx]:queue->broadcast_bucket;
+  if (current == bucket)
+    overlay_queue_bucket_rotate(queue, bucket);
+}
+
+// add as many frames as possible from one destination bucket to the packet
+// returns 1 if the queue has used its share of this packet, with frames left to send,
+// or 2 if a frame that could have been sent didn't fit in the room left in the packet
+static int
+overlay_stuff_bucket(struct outgoing_packet *packet, overlay_txqueue *queue, struct overlay_tx_bucket *bucket, time_ms_t now, int *budget){
+  /* Work out the route once for every frame in the bucket.
+   Note, once we queue a broadcast packet we are committed to sending it out every interface, 
+   even if we hear it from somewhere else in the mean time
+   */
+  struct subscriber *destination = bucket->destination;
+  struct subscriber *next_hop = destination;
+  int reachable = REACHABLE_BROADCAST;
   
-  // TODO stop when the packet is nearly full?
+  if (next_hop){
+    reachable = subscriber_is_reachable(next_hop);
+    switch(reachable){
+      case REACHABLE_NONE:
+	// nothing in this bucket can be sent, and it doesn't hold up the queue
+	return 0;
+	
+      case REACHABLE_INDIRECT:
+	next_hop=next_hop->next_hop;
+	break;
+	
+      case REACHABLE_DEFAULT_ROUTE:
+	next_hop=directory_service;
+	break;
+    }
+  }
+  int unicast = (reachable==REACHABLE_INDIRECT || reachable==REACHABLE_DEFAULT_ROUTE
+		 || reachable==REACHABLE_DIRECT || reachable==REACHABLE_UNICAST);
+  
+  // skip the whole bucket if the packet we're building goes somewhere else
+  if (unicast && packet->buffer && !overlay_packet_reaches(packet, next_hop)){
+    overlay_calc_queue_time(queue, bucket->first, 0);
+    return 0;
+  }
+  
+  // or if we would have to start a packet on an interface that has used its share of the link
+  if (unicast && !packet->buffer && next_hop->interface){
+    time_ms_t delay = overlay_pacing_delay(next_hop->interface, now, 0);
+    if (delay){
+      overlay_pacing_hold(next_hop->interface, delay);
+      overlay_calc_queue_time(queue, bucket->first, now + delay);
+      return 0;
+    }
+  }
+  
+  int waiting = 0;
+  int no_room = 0;
+  int served = 0;
+  // if frames are only waiting for pacing, when can the first of them go?
+  int held = 0;
+  time_ms_t ready = 0;
+  struct overlay_frame *frame = bucket->first;
   
   while(frame){
-    if (frame->enqueued_at + queue->latencyTarget < now){
-      DEBUGF("Dropping frame type %x for %s due to expiry timeout", 
-	     frame->type, frame->destination?alloca_tohex_sid(frame->destination->sid):"All");
-      frame = overlay_queue_remove(queue, frame);
-      continue;
+    if (unicast)
+      frame->sendBroadcast=0;
+    else if (bucket->destination && reachable==REACHABLE_BROADCAST && !frame->sendBroadcast){
+      if (frame->ttl>2)
+	frame->ttl=2;
+      frame->sendBroadcast=1;
+      if (is_all_matching(frame->broadcast_id.id, BROADCAST_LEN, 0)){
+	overlay_broadcast_generate_address(&frame->broadcast_id);
+	// mark it as already seen so we don't immediately retransmit it
+	overlay_broadcast_drop_check(&frame->broadcast_id);
+      }
+      int i;
+      for(i=0;i<OVERLAY_MAX_INTERFACES;i++)
+	frame->broadcast_sent_via[i]=0;
     }
-    /* Note, once we queue a broadcast packet we are committed to sending it out every interface, 
-     even if we hear it from somewhere else in the mean time
-     */
     
-    struct subscriber *next_hop = frame->destination;
-    
-    if (next_hop){
-      switch(subscriber_is_reachable(next_hop)){
-	case REACHABLE_NONE:
-	  goto skip;
-	  
-	case REACHABLE_INDIRECT:
-	  next_hop=next_hop->next_hop;
-	  frame->sendBroadcast=0;
-	  break;
-	  
-	case REACHABLE_DEFAULT_ROUTE:
-	  next_hop=directory_service;
-	  frame->sendBroadcast=0;
-	  break;
-	  
-	case REACHABLE_DIRECT:
-	case REACHABLE_UNICAST:
-	  frame->sendBroadcast=0;
-	  break;
-	  
-	case REACHABLE_BROADCAST:
-	  if (!frame->sendBroadcast){
-	    if (frame->ttl>2)
-	      frame->ttl=2;
-	    frame->sendBroadcast=1;
-	    if (is_all_matching(frame->broadcast_id.id, BROADCAST_LEN, 0)){
-	      overlay_broadcast_generate_address(&frame->broadcast_id);
-	      // mark it as already seen so we don't immediately retransmit it
-	      overlay_broadcast_drop_check(&frame->broadcast_id);
-	    }
-	    int i;
-	    for(i=0;i<OVERLAY_MAX_INTERFACES;i++)
-	      frame->broadcast_sent_via[i]=0;
-	  }
-	  break;
-      }
+    // leave the rest for the next round once this queue has used its share of the packet
+    if (budget && frame->payload->position > *budget){
+      overlay_calc_queue_time(queue, frame, 0);
+      if (served)
+	overlay_bucket_served(queue, destination, bucket);
+      return 1;
     }
     
     if (!packet->buffer){
       // use the interface of the first payload we find
       if (frame->sendBroadcast){
-	// find an interface that we haven't broadcast on yet
+	// find an interface that we haven't broadcast on yet, and isn't being paced
 	int i;
+	overlay_interface *paced = NULL;
+	time_ms_t delay = 0;
 	for(i=0;i<OVERLAY_MAX_INTERFACES;i++)
 	{
 	  if (overlay_interfaces[i].state==INTERFACE_STATE_UP
 	      && !frame->broadcast_sent_via[i]){
-	    overlay_init_packet(packet, &overlay_interfaces[i], 0);
-	    break;
+	    time_ms_t d = overlay_pacing_delay(&overlay_interfaces[i], now, 0);
+	    if (!d){
+	      overlay_init_packet(packet, &overlay_interfaces[i], 0);
+	      break;
+	    }
+	    if (!paced || d < delay){
+	      paced = &overlay_interfaces[i];
+	      delay = d;
+	    }
 	  }
 	}
 	
+	if (!packet->buffer && paced){
+	  overlay_pacing_hold(paced, delay);
+	  if (!held || now + delay < ready)
+	    ready = now + delay;
+	  held = 1;
+	  frame = frame->bucket_next;
+	  continue;
+	}
+	
 	if (!packet->buffer){
 	  // oh dear, why is this broadcast still in the queue?
-	  frame = overlay_queue_remove(queue, frame);
+	  struct overlay_frame *next = frame->bucket_next;
+	  overlay_queue_remove(queue, frame);
+	  frame = next;
 	  continue;
 	}
       }else{
@@ -1145,16 +1421,8 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
 	if (frame->broadcast_sent_via[packet->i]){
 	  goto skip;
 	}
-      }else{
-	if(packet->interface != next_hop->interface)
-	  goto skip;
-	if (next_hop->reachable==REACHABLE_DIRECT && packet->unicast)
-	  goto skip;
-	if (next_hop->reachable==REACHABLE_UNICAST && 
-	    ((!packet->unicast) ||
-	    packet->dest.sin_addr.s_addr != next_hop->address.sin_addr.s_addr))
-	  goto skip;
-      }
+      }else if (!overlay_packet_reaches(packet, next_hop))
+	goto skip;
     }
     
     if (debug&DEBUG_OVERLAYFRAMES){
@@ -1163,9 +1431,21 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
 	     frame->sendBroadcast?alloca_tohex(frame->broadcast_id.id, BROADCAST_LEN):alloca_tohex_sid(next_hop->sid));
     }
     
-    if (overlay_frame_append_payload(packet->interface, frame, next_hop, packet->buffer))
-      // payload was not queued
+    int position = packet->buffer->position;
+    if (overlay_frame_append_payload(packet->interface, frame, next_hop, packet->buffer)){
+      // payload didn't fit in the packet
+      no_room = 1;
       goto skip;
+    }
+    if (budget)
+      *budget -= packet->buffer->position - position;
+    served = 1;
+    
+    time_ms_t delay = now - frame->enqueued_at;
+    packet->interface->tx_frames++;
+    packet->interface->tx_queue_delay += delay;
+    if (delay > packet->interface->tx_queue_delay_max)
+      packet->interface->tx_queue_delay_max = delay;
     
     // mark the payload as sent
     int keep_payload = 0;
@@ -1190,17 +1470,64 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
     }
     
     if (!keep_payload){
-      frame = overlay_queue_remove(queue, frame);
+      queue->sent++;
+      queue->latency_total += delay;
+      if (delay > queue->latency_max)
+	queue->latency_max = delay;
+      struct overlay_frame *next = frame->bucket_next;
+      overlay_queue_remove(queue, frame);
+      frame = next;
       continue;
     }
     
   skip:
-    // if we can't send the payload now, check when we should try
-    overlay_calc_queue_time(queue, frame);
-    frame = frame->next;
+    waiting = 1;
+    frame = frame->bucket_next;
   }
+  
+  // if we couldn't send everything now, check when we should try
+  if (waiting)
+    overlay_calc_queue_time(queue, bucket->first, 0);
+  else if (held)
+    overlay_calc_queue_time(queue, bucket->first, ready);
+  if (served)
+    overlay_bucket_served(queue, destination, bucket);
+  return no_room?2:0;
 }
 
+// returns 1 if the queue has used its share of this packet, with frames left to send,
+// or 2 if it had frames to send that didn't fit in the room left in the packet
+static int
+overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, time_ms_t now, int *budget){
+  // frames are queued in order with the same latency target, so expired frames are at the front
+  while(queue->first && queue->first->enqueued_at + queue->latencyTarget < now){
+    struct overlay_frame *frame = queue->first;
+    DEBUGF("Dropping frame type %x for %s due to expiry timeout", 
+	   frame->type, frame->destination?alloca_tohex_sid(frame->destination->sid):"All");
+    queue->dropped_expired++;
+    overlay_queue_remove(queue, frame);
+  }
+  
+  int ret = 0;
+  // visit each bucket once, even though those that are served go to the back
+  struct overlay_tx_bucket *bucket = queue->first_bucket;
+  struct overlay_tx_bucket *last = queue->last_bucket;
+  while(bucket){
+    // only the bucket being stuffed can be released or moved while we do so
+    struct overlay_tx_bucket *next = bucket==last?NULL:bucket->next;
+    int r = overlay_stuff_bucket(packet, queue, bucket, now, budget);
+    if (r==1)
+      return 1;
+    if (r)
+      ret = r;
+    bucket = next;
+  }
+  return ret;
+}
+
+// the queue that gets the first turn at the next packet
+static int drr_next=0;
+
 // fill a packet from our outgoing queues and send it
 static int
 overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now) {
@@ -1211,11 +1538,46 @@ overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now) {
   next_packet.alarm=0;
   next_packet.deadline=0;
   
-  for (i=0;i<OQ_MAX;i++){
-    overlay_txqueue *queue=&overlay_tx[i];
-    
-    overlay_stuff_packet(packet, queue, now);
+  // voice goes first, up to its share of the packet
+  int voice_budget = overlay_tx[OQ_ISOCHRONOUS_VOICE].quantum;
+  overlay_stuff_packet(packet, &overlay_tx[OQ_ISOCHRONOUS_VOICE], now, &voice_budget);
+  
+  /* Deficit round robin between the other queues. Each round a queue may add its quantum of bytes.
+     Only queues that were held back by their deficit get another round. */
+  int blocked[OQ_MAX];
+  int more=1;
+  for (i=0;i<OQ_MAX;i++)
+    blocked[i]=(i!=OQ_ISOCHRONOUS_VOICE);
+  while(more){
+    more=0;
+    for (i=0;i<OQ_MAX;i++){
+      int q = (drr_next + i) % OQ_MAX;
+      overlay_txqueue *queue=&overlay_tx[q];
+      if (!blocked[q])
+	continue;
+      blocked[q]=0;
+      int held=0;
+      if (queue->first){
+	queue->deficit += queue->quantum;
+	held=overlay_stuff_packet(packet, queue, now, &queue->deficit);
+	blocked[q]=(held==1);
+	more|=blocked[q];
+      }
+      /* Keep what is left of the deficit only while the queue has frames it could send but were
+	 held back by the deficit or by the room left in the packet. Frames skipped for having no
+	 route, another next hop or a paced interface must not let the queue save up for later.
+	 A queue whose frames keep finding no room may save up no more than one more packet. */
+      if (!held)
+	queue->deficit=0;
+      else if (packet->interface && queue->deficit > queue->quantum + packet->interface->mtu)
+	queue->deficit = queue->quantum + packet->interface->mtu;
+    }
   }
+  // start the next packet with the next queue, so no queue always gets the first bytes
+  drr_next = (drr_next + 1) % OQ_MAX;
+  
+  // voice can have any room that is left
+  overlay_stuff_packet(packet, &overlay_tx[OQ_ISOCHRONOUS_VOICE], now, NULL);
   
   if (next_packet.alarm)
     schedule(&next_packet);
@@ -1231,26 +1593,34 @@ overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now) {
       if (debug&DEBUG_PACKETCONSTRUCTION)
 	dump("assembled packet",&packet->buffer->bytes[0],packet->buffer->position);
       
-      overlay_broadcast_ensemble(packet->i, &packet->dest, packet->buffer->bytes, packet->buffer->position);
-    }
-    ob_free(packet->buffer);
+      overlay_queue_ensemble(packet->i, &packet->dest, packet->buffer);
+    }else
+      ob_free(packet->buffer);
+    packet->buffer=NULL;
     overlay_address_clear();
     RETURN(1);
   }
   RETURN(0);
 }
 
-// when the queue timer elapses, send a packet
+// when the queue timer elapses, send every packet that is due, up to a batch
 void overlay_send_packet(struct sched_ent *alarm){
-  struct outgoing_packet packet;
-  bzero(&packet, sizeof(struct outgoing_packet));
-  
-  overlay_fill_send_packet(&packet, gettime_ms());
+  time_ms_t now = gettime_ms();
+  int i;
+  for (i=0;i<OVERLAY_SEND_BATCH;i++){
+    struct outgoing_packet packet;
+    bzero(&packet, sizeof(struct outgoing_packet));
+    if (!overlay_fill_send_packet(&packet, now))
+      break;
+    if (!next_packet.alarm || next_packet.alarm>now)
+      break;
+  }
+  overlay_send_batch_flush();
 }
 
 // update time for next alarm and reschedule
 void overlay_update_queue_schedule(overlay_txqueue *queue, struct overlay_frame *frame){
-  if (overlay_calc_queue_time(queue, frame)){
+  if (overlay_calc_queue_time(queue, frame, 0)){
     unschedule(&next_packet);
     schedule(&next_packet);
   }
@@ -1266,6 +1636,13 @@ overlay_tick_interface(int i, time_ms_t now) {
       || overlay_interfaces[i].state!=INTERFACE_STATE_UP) {
     RETURN(0);
   }
+  
+  /* Don't tick while the link is carrying all it can, try again once there's room */
+  time_ms_t delay = overlay_pacing_delay(&overlay_interfaces[i], now, 1);
+  if (delay){
+    overlay_pacing_hold(&overlay_interfaces[i], delay);
+    RETURN(delay);
+  }
 
   if (debug&DEBUG_OVERLAYINTERFACES) DEBUGF("Ticking interface #%d",i);
   
@@ -1278,6 +1655,7 @@ overlay_tick_interface(int i, time_ms_t now) {
   
   /* Stuff more payloads from queues and send it */
   overlay_fill_send_packet(&packet, now);
+  overlay_send_batch_flush();
   RETURN(0);
 }
 
@@ -1325,3 +1703,459 @@ logServalPacket(int level, struct __sourceloc where, const char *message, const
   if (mb.buffer)
     free(mb.buffer);
 }
+
+/* Bring up interface 0 on a loopback UDP socket that sends to itself, with no pacing, for the
+   speed tests below.  The daemon must not be running in this process. */
+static overlay_interface *
+overlay_test_interface(){
+  overlay_interface *interface = &overlay_interfaces[0];
+  bzero(interface, sizeof(overlay_interface));
+  strcpy(interface->name, "test0");
+  interface->address.sin_family = AF_INET;
+  interface->address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  interface->netmask.s_addr = htonl(0xFF000000);
+  interface->alarm.poll.fd = overlay_bind_socket((const struct sockaddr *)&interface->address, sizeof(interface->address), NULL);
+  if (interface->alarm.poll.fd<0)
+    return NULL;
+  socklen_t len = sizeof(interface->address);
+  getsockname(interface->alarm.poll.fd, (struct sockaddr *)&interface->address, &len);
+  interface->broadcast_address = interface->address;
+  int on=1, rcvbuf=1024*1024;
+  if (setsockopt(interface->alarm.poll.fd, IPPROTO_IP, IP_RECVTTL, &on, sizeof(on)) < 0)
+    WHY_perror("setsockopt(IP_RECVTTL)");
+  setsockopt(interface->alarm.poll.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  fcntl(interface->alarm.poll.fd, F_SETFL, fcntl(interface->alarm.poll.fd, F_GETFL, NULL) | O_NONBLOCK);
+  interface->mtu = 1200;
+  interface->send_broadcasts = 1;
+  interface->bits_per_second = 1000000000;
+  interface->tx_budget_limit = interface->tx_budget = 1LL<<60;
+  interface->state = INTERFACE_STATE_UP;
+  overlay_interface_count = 1;
+  return interface;
+}
+
+static void
+overlay_test_interface_close(overlay_interface *interface){
+  close(interface->alarm.poll.fd);
+  interface->state = INTERFACE_STATE_DOWN;
+  overlay_interface_count = 0;
+}
+
+// a made up subscriber for the speed tests, reached directly over the test interface
+static struct subscriber *
+overlay_test_subscriber(int n, int reachable, overlay_interface *interface){
+  unsigned char sid[SID_SIZE];
+  memset(sid, 0x77, sizeof sid);
+  sid[0] = 0x10 + (n >> 8);
+  sid[1] = n;
+  struct subscriber *s = find_subscriber(sid, SID_SIZE, 1);
+  if (!s)
+    return NULL;
+  s->reachable = reachable;
+  s->interface = interface;
+  s->address = interface->broadcast_address;
+  return s;
+}
+
+// this process doesn't run the overlay, so it needs an identity of its own to build packets
+static struct subscriber *
+overlay_test_self(overlay_interface *interface){
+  if (!my_subscriber)
+    my_subscriber = overlay_test_subscriber(0, REACHABLE_SELF, interface);
+  return my_subscriber;
+}
+
+/* Datagrams are sent in bursts that fit in the socket's receive buffer, and read back after each */
+#define TEST_UDP_BURST 64
+#define TEST_UDP_BYTES 400
+
+// read every waiting datagram, one recvwithttl() at a time
+static int
+test_udp_drain_single(int fd, int *reads, int *ttls){
+  unsigned char buffer[16384];
+  int received=0;
+  while(1){
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int ttl=-1;
+    ssize_t len = recvwithttl(fd, buffer, sizeof(buffer), &ttl, (struct sockaddr *)&addr, &addrlen);
+    (*reads)++;
+    if (len<=0)
+      return received;
+    if (len==TEST_UDP_BYTES)
+      received++;
+    if (ttl>0)
+      (*ttls)++;
+  }
+}
+
+// read every waiting datagram, as many per recvmmsgwithttl() call as the batch holds
+static int
+test_udp_drain_batched(int fd, int *reads, int *ttls){
+  int received=0, i;
+  while(1){
+    for (i=0;i<OVERLAY_RECV_BATCH;i++){
+      recv_datagrams[i].buffer=recv_buffers[i];
+      recv_datagrams[i].bufferlen=sizeof recv_buffers[i];
+      recv_datagrams[i].ttl=-1;
+    }
+    int n = recvmmsgwithttl(fd, recv_datagrams, OVERLAY_RECV_BATCH);
+    (*reads)++;
+    if (n<=0)
+      return received;
+    for (i=0;i<n;i++){
+      if (recv_datagrams[i].len==TEST_UDP_BYTES)
+	received++;
+      if (recv_datagrams[i].ttl>0)
+	(*ttls)++;
+    }
+  }
+}
+
+// read and count every waiting packet that the queue tests built, whatever its length
+static int
+test_drain_packets(int fd){
+  int received=0, n, i;
+  do{
+    for (i=0;i<OVERLAY_RECV_BATCH;i++){
+      recv_datagrams[i].buffer=recv_buffers[i];
+      recv_datagrams[i].bufferlen=sizeof recv_buffers[i];
+      recv_datagrams[i].ttl=-1;
+    }
+    n = recvmmsgwithttl(fd, recv_datagrams, OVERLAY_RECV_BATCH);
+    if (n>0)
+      received+=n;
+  }while(n>0);
+  return received;
+}
+
+/* Send count datagrams over loopback, first with a sendto() and a recvwithttl() each, then
+   through the send batch and recvmmsgwithttl(), as a busy interface does. */
+int app_test_udp(int argc, const char *const *argv, struct command_line_option *o, void *context)
+{
+  if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
+  const char *count_text;
+  if (cli_arg(argc, argv, o, "count", &count_text, NULL, "10000") == -1)
+    return -1;
+  int count = atoi(count_text);
+  if (count < 1)
+    return WHYF("Invalid count %s", count_text);
+  overlay_interface *interface = overlay_test_interface();
+  if (!interface)
+    return WHY("Could not bind a loopback socket");
+  int fd = interface->alarm.poll.fd;
+  unsigned char data[TEST_UDP_BYTES];
+  memset(data, 0x5a, sizeof data);
+  int sent, received=0, reads=0, ttls=0, i;
+
+  time_ms_t start = gettime_ms();
+  for (sent=0; sent<count; ){
+    for (i=0; i<TEST_UDP_BURST && sent<count; i++, sent++)
+      if (sendto(fd, data, sizeof data, 0, (struct sockaddr *)&interface->broadcast_address, sizeof(interface->broadcast_address)) != sizeof data)
+	WHY_perror("sendto");
+    received += test_udp_drain_single(fd, &reads, &ttls);
+  }
+  time_ms_t single_ms = gettime_ms() - start;
+  printf("single - %lldms - %d of %d received in %d reads, %d with a ttl, %.0f datagrams/s\n",
+	 (long long) single_ms, received, count, reads, ttls, received * 1000.0 / (single_ms?single_ms:1));
+
+  received=reads=ttls=0;
+  start = gettime_ms();
+  for (sent=0; sent<count; ){
+    for (i=0; i<TEST_UDP_BURST && sent<count; i++, sent++){
+      struct overlay_buffer *b = ob_new();
+      if (!b || ob_append_bytes(b, data, sizeof data))
+	return WHY("Could not build datagram");
+      overlay_queue_ensemble(0, &interface->broadcast_address, b);
+    }
+    overlay_send_batch_flush();
+    received += test_udp_drain_batched(fd, &reads, &ttls);
+  }
+  time_ms_t batched_ms = gettime_ms() - start;
+  printf("batched - %lldms - %d of %d received in %d reads, %d with a ttl, %.0f datagrams/s\n",
+	 (long long) batched_ms, received, count, reads, ttls, received * 1000.0 / (batched_ms?batched_ms:1));
+
+  overlay_test_interface_close(interface);
+  return 0;
+}
+
+/* Act as a relay: parse count received packets, each carrying frames for another node, then
+   forward the copies that were queued.  The receive buffer is cleared after each packet, as the
+   next read would overwrite it, before the queued copies are checked. */
+#define TEST_FORWARD_FRAMES 3
+int app_test_forward(int argc, const char *const *argv, struct command_line_option *o, void *context)
+{
+  if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
+  const char *count_text, *bytes_text;
+  if (cli_arg(argc, argv, o, "count", &count_text, NULL, "10000") == -1
+   || cli_arg(argc, argv, o, "bytes", &bytes_text, NULL, "300") == -1)
+    return -1;
+  int count = atoi(count_text);
+  int bytes = atoi(bytes_text);
+  if (count < 1)
+    return WHYF("Invalid count %s", count_text);
+  if (bytes < 1 || bytes > 350)
+    return WHYF("Invalid payload size %s", bytes_text);
+  overlay_interface *interface = overlay_test_interface();
+  if (!interface)
+    return WHY("Could not bind a loopback socket");
+  overlay_queue_init();
+  overlay_txqueue *queue = &overlay_tx[OQ_ORDINARY];
+  queue->maxLength = TEST_FORWARD_FRAMES;
+  struct subscriber *self = overlay_test_self(interface);
+  struct subscriber *origin = overlay_test_subscriber(1, REACHABLE_NONE, interface);
+  struct subscriber *far = overlay_test_subscriber(2, REACHABLE_DIRECT, interface);
+  if (!self || !origin || !far)
+    return WHY("Could not create subscribers");
+
+  int in_use = ob_pools_in_use();
+  
+  // build the packet that we will keep receiving, with frames for far sent to us
+  struct overlay_buffer *packet = ob_new();
+  ob_append_bytes(packet, magic_header, 4);
+  overlay_address_clear();
+  int i, j;
+  for (i=0; i<TEST_FORWARD_FRAMES; i++){
+    struct overlay_frame *f = op_new();
+    f->type = OF_TYPE_DATA;
+    f->ttl = 5;
+    f->destination = far;
+    f->source = origin;
+    f->payload = ob_new();
+    for (j=0; j<bytes; j++)
+      ob_append_byte(f->payload, i+j);
+    if (overlay_frame_append_payload(interface, f, self, packet))
+      return WHY("Could not build packet");
+    op_free(f);
+  }
+  unsigned char received[packet->position];
+  int len = packet->position;
+
+  int forwarded=0, corrupt=0, sent=0;
+  long long allocations=0;
+  time_ms_t start = gettime_ms();
+  for (i=0; i<count; i++){
+    bcopy(packet->bytes, received, len);
+    long long before = ob_allocations;
+    packetOkOverlay(interface, received, len, NULL, 1, (struct sockaddr *)&interface->address, sizeof(interface->address), 1);
+    allocations += ob_allocations - before;
+    memset(received, 0, len);
+    
+    struct overlay_frame *f;
+    int n;
+    for (f=queue->first, n=0; f; f=f->next, n++){
+      forwarded++;
+      int bad = f->ttl!=4 || f->payload->position!=bytes;
+      for (j=0; j<f->payload->position && !bad; j++)
+	bad = f->payload->bytes[j]!=(unsigned char)(n+j);
+      corrupt += bad;
+    }
+    while(queue->first)
+      overlay_send_packet(&next_packet);
+    sent += test_drain_packets(interface->alarm.poll.fd);
+  }
+  time_ms_t elapsed = gettime_ms() - start;
+  unschedule(&next_packet);
+  ob_free(packet);
+  
+  printf("forwarded %d of %d frames of %d bytes in %d packets - %lldms - %.0f frames/s\n",
+	 forwarded, count * TEST_FORWARD_FRAMES, bytes, sent, (long long) elapsed, forwarded * 1000.0 / (elapsed?elapsed:1));
+  printf("%d corrupt copies\n", corrupt);
+  printf("%.3f allocations per received packet\n", (double) allocations / count);
+  printf("%d pooled objects leaked\n", ob_pools_in_use() - in_use);
+  overlay_test_interface_close(interface);
+  return 0;
+}
+
+// queue a frame of bytes bytes for dest, as if it had come from origin
+static int
+test_queue_frame(int q, int bytes, struct subscriber *dest, struct subscriber *origin){
+  struct overlay_frame *f = op_new();
+  if (!f)
+    return -1;
+  f->type = q==OQ_ISOCHRONOUS_VOICE?OF_TYPE_DATA_VOICE:OF_TYPE_DATA;
+  f->ttl = 5;
+  f->destination = dest;
+  f->source = origin;
+  f->payload = ob_new();
+  unsigned char data[bytes];
+  memset(data, 0x33, bytes);
+  if (!f->payload || ob_append_bytes(f->payload, data, bytes) || overlay_payload_enqueue(q, f)){
+    op_free(f);
+    return -1;
+  }
+  return 0;
+}
+
+/* Build packets while frames for destinations whose route has been lost wait in the ordinary
+   queue, sending one frame for a reachable destination in each.  Then let the waiting frames
+   expire.  Finally, keep one destination's backlog big enough to fill every packet, and see how
+   long a frame queued behind it for another destination waits. */
+#define TEST_STUFF_LOST 100
+#define TEST_STUFF_PACKETS 2000
+#define TEST_STUFF_BACKLOG 8
+#define TEST_STUFF_TURNS 20
+int app_test_stuff(int argc, const char *const *argv, struct command_line_option *o, void *context)
+{
+  if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
+  const char *waiting_text;
+  if (cli_arg(argc, argv, o, "waiting", &waiting_text, NULL, "10000") == -1)
+    return -1;
+  int waiting = atoi(waiting_text);
+  if (waiting < 0)
+    return WHYF("Invalid number of waiting frames %s", waiting_text);
+  overlay_interface *interface = overlay_test_interface();
+  if (!interface)
+    return WHY("Could not bind a loopback socket");
+  overlay_queue_init();
+  overlay_txqueue *queue = &overlay_tx[OQ_ORDINARY];
+  queue->maxLength = waiting + TEST_STUFF_PACKETS;
+  queue->latencyTarget = 3600000;
+  struct subscriber *self = overlay_test_self(interface);
+  struct subscriber *origin = overlay_test_subscriber(1, REACHABLE_NONE, interface);
+  struct subscriber *live = overlay_test_subscriber(2, REACHABLE_DIRECT, interface);
+  struct subscriber *lost[TEST_STUFF_LOST];
+  int i;
+  for (i=0; i<TEST_STUFF_LOST; i++)
+    lost[i] = overlay_test_subscriber(0x100 + i, REACHABLE_DIRECT, interface);
+  if (!self || !origin || !live)
+    return WHY("Could not create subscribers");
+  
+  for (i=0; i<waiting; i++)
+    if (test_queue_frame(OQ_ORDINARY, 100, lost[i % TEST_STUFF_LOST], origin))
+      return WHY("Could not queue frame");
+  for (i=0; i<TEST_STUFF_LOST; i++)
+    lost[i]->reachable = REACHABLE_NONE;
+  
+  int sent=0;
+  time_ms_t start = gettime_ms();
+  for (i=0; i<TEST_STUFF_PACKETS; i++){
+    if (test_queue_frame(OQ_ORDINARY, 100, live, origin))
+      return WHY("Could not queue frame");
+    overlay_send_packet(&next_packet);
+    sent += test_drain_packets(interface->alarm.poll.fd);
+  }
+  time_ms_t elapsed = gettime_ms() - start;
+  printf("%d frames waiting - %d packets - %lldms - %.1fus per packet\n",
+	 waiting, sent, (long long) elapsed, elapsed * 1000.0 / TEST_STUFF_PACKETS);
+  printf("%d of %d frames sent, %d left waiting\n",
+	 queue->sent, TEST_STUFF_PACKETS, queue->length);
+  
+  // everything still waiting is now too old to send
+  queue->latencyTarget = -1;
+  int expired = queue->dropped_expired;
+  overlay_send_packet(&next_packet);
+  printf("%d expired, %d left waiting\n", queue->dropped_expired - expired, queue->length);
+  
+  queue->latencyTarget = 3600000;
+  struct subscriber *busy = overlay_test_subscriber(3, REACHABLE_DIRECT, interface);
+  struct subscriber *quiet = overlay_test_subscriber(4, REACHABLE_DIRECT, interface);
+  if (!busy || !quiet)
+    return WHY("Could not create subscribers");
+  for (i=0; i<TEST_STUFF_BACKLOG; i++)
+    if (test_queue_frame(OQ_ORDINARY, 300, busy, origin))
+      return WHY("Could not queue frame");
+  if (test_queue_frame(OQ_ORDINARY, 300, quiet, origin))
+    return WHY("Could not queue frame");
+  int turn;
+  for (turn=1; turn<=TEST_STUFF_TURNS && quiet->tx_bucket[OQ_ORDINARY]; turn++){
+    // more than a packet's worth arrives for the busy destination each time
+    for (i=0; i<TEST_STUFF_BACKLOG/2; i++)
+      if (test_queue_frame(OQ_ORDINARY, 300, busy, origin))
+	return WHY("Could not queue frame");
+    overlay_send_packet(&next_packet);
+    test_drain_packets(interface->alarm.poll.fd);
+  }
+  if (quiet->tx_bucket[OQ_ORDINARY])
+    printf("frame behind a backlog not sent in %d packets\n", TEST_STUFF_TURNS);
+  else
+    printf("frame behind a backlog sent in packet %d\n", turn - 1);
+  
+  unschedule(&next_packet);
+  overlay_test_interface_close(interface);
+  return 0;
+}
+
+/* Saturate the mesh, ordinary and opportunistic queues, and report how the bytes of the
+   packets built are shared between them.  For the first packets the ordinary queue's frames
+   have no route, so only the shares once the route comes back are counted.  Then queue a frame
+   that can never fit, and check that no queue's deficit grows past its bound. */
+#define TEST_SHARE_FRAMES 2000
+#define TEST_SHARE_HELD_PACKETS 200
+#define TEST_SHARE_PACKETS 15
+
+// the number of queues that have saved up more than a packet beyond their quantum
+static int
+test_share_over_bound(overlay_interface *interface){
+  int q, over=0;
+  for (q=0; q<OQ_MAX; q++)
+    if (overlay_tx[q].deficit > overlay_tx[q].quantum + interface->mtu)
+      over++;
+  return over;
+}
+
+int app_test_share(int argc, const char *const *argv, struct command_line_option *o, void *context)
+{
+  if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
+  overlay_interface *interface = overlay_test_interface();
+  if (!interface)
+    return WHY("Could not bind a loopback socket");
+  overlay_queue_init();
+  struct subscriber *self = overlay_test_self(interface);
+  struct subscriber *origin = overlay_test_subscriber(1, REACHABLE_NONE, interface);
+  struct subscriber *dest = overlay_test_subscriber(2, REACHABLE_DIRECT, interface);
+  struct subscriber *lost = overlay_test_subscriber(3, REACHABLE_DIRECT, interface);
+  if (!self || !origin || !dest || !lost)
+    return WHY("Could not create subscribers");
+  int bytes[OQ_MAX]={0};
+  bytes[OQ_MESH_MANAGEMENT]=100;
+  bytes[OQ_ORDINARY]=300;
+  bytes[OQ_OPPORTUNISTIC]=300;
+  int q, i;
+  for (q=0; q<OQ_MAX; q++){
+    overlay_tx[q].maxLength = TEST_SHARE_FRAMES;
+    overlay_tx[q].latencyTarget = 3600000;
+    for (i=0; bytes[q] && i<TEST_SHARE_FRAMES; i++)
+      if (test_queue_frame(q, bytes[q], q==OQ_ORDINARY?lost:dest, origin))
+	return WHY("Could not queue frame");
+  }
+  lost->reachable = REACHABLE_NONE;
+  
+  int sent=0, phase, start[OQ_MAX], over=0;
+  for (phase=0; phase<2; phase++){
+    if (phase)
+      lost->reachable = REACHABLE_DIRECT;
+    for (q=0; q<OQ_MAX; q++)
+      start[q] = overlay_tx[q].sent;
+    for (sent=0; sent<(phase?TEST_SHARE_PACKETS:TEST_SHARE_HELD_PACKETS); ){
+      overlay_send_packet(&next_packet);
+      sent += test_drain_packets(interface->alarm.poll.fd);
+      over += test_share_over_bound(interface);
+    }
+  }
+  
+  long total=0;
+  for (q=0; q<OQ_MAX; q++)
+    total += (long)(overlay_tx[q].sent - start[q]) * bytes[q];
+  for (q=0; q<OQ_MAX; q++){
+    if (!bytes[q])
+      continue;
+    long b = (long)(overlay_tx[q].sent - start[q]) * bytes[q];
+    printf("%s - %d frames - %ld bytes - %ld%%\n", overlay_tx[q].name,
+	   overlay_tx[q].sent - start[q], b, total ? b * 100 / total : 0);
+  }
+  
+  // a queue whose only frame is too big for any packet keeps finding no room
+  if (test_queue_frame(OQ_ISOCHRONOUS_VIDEO, interface->mtu, dest, origin))
+    return WHY("Could not queue frame");
+  for (sent=0; sent<TEST_SHARE_HELD_PACKETS; ){
+    overlay_send_packet(&next_packet);
+    sent += test_drain_packets(interface->alarm.poll.fd);
+    over += test_share_over_bound(interface);
+  }
+  printf("%d deficits over their bound\n", over);
+  
+  unschedule(&next_packet);
+  overlay_test_interface_close(interface);
+  return 0;
+}
@@ -647,7 +647,7 @@ int overlay_mdp_dispatch(overlay_mdp_frame *mdp,int userGeneratedFrameP,
   IN();
 
   /* Prepare the overlay frame for dispatch */
-  struct overlay_frame *frame = calloc(1,sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   if (!frame)
     FATAL("Couldn't allocate frame buffer");
   
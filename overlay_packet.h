@@ -52,11 +52,20 @@ struct overlay_frame {
   /* Actual payload */
   struct overlay_buffer *payload;
   
+  /* The destination bucket of the queue holding this frame */
+  struct overlay_tx_bucket *bucket;
+  struct overlay_frame *bucket_prev;
+  struct overlay_frame *bucket_next;
+  
   time_ms_t enqueued_at;
   
+  /* Size of the pooled block holding this frame, its payload header and payload bytes together,
+     or 0 if the frame came from op_new() */
+  int block_size;
 };
 
 
+struct overlay_frame *op_new();
 int op_free(struct overlay_frame *p);
 struct overlay_frame *op_dup(struct overlay_frame *f);
 
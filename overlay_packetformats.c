@@ -50,7 +50,8 @@ int process_incoming_frame(time_ms_t now, struct overlay_interface *interface, s
     case OF_TYPE_RHIZOME_ADVERT:
       if (debug&DEBUG_OVERLAYFRAMES)
 	DEBUG("Processing OF_TYPE_RHIZOME_ADVERT");
-      overlay_rhizome_saw_advertisements(id,f,now);
+      if (!rhizome_worker_forward_advert(id,f))
+	overlay_rhizome_saw_advertisements(id,f,now);
       break;
     case OF_TYPE_DATA:
     case OF_TYPE_DATA_VOICE:
@@ -70,6 +71,25 @@ int process_incoming_frame(time_ms_t now, struct overlay_interface *interface, s
   return 0;
 }
 
+static long long received_packets=0;
+static long long received_packet_allocations=0;
+
+int overlay_show_allocations()
+{
+  if (received_packets)
+    INFOF("Overlay buffer allocations: %lld for %lld received packets, %.2f per packet",
+	received_packet_allocations, received_packets,
+	(double)received_packet_allocations/received_packets);
+  return 0;
+}
+
+int overlay_reset_allocations()
+{
+  received_packets=0;
+  received_packet_allocations=0;
+  return 0;
+}
+
 // duplicate the frame and queue it
 int overlay_forward_payload(struct overlay_frame *f){
   f->ttl--;
@@ -169,8 +189,14 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
     .please_explain=NULL,
   };
   
+  /* The packet and payload buffer headers live on the stack, so parsing and handling a packet
+     should not touch the heap. Only payloads that we forward are copied, see op_dup() */
+  struct overlay_buffer packet_buffer, payload_buffer;
+  long long allocations = ob_allocations;
+  
   time_ms_t now = gettime_ms();
-  struct overlay_buffer *b = ob_static(packet, len);
+  struct overlay_buffer *b = &packet_buffer;
+  ob_static_init(b, packet, len);
   ob_limitsize(b, len);
   // skip magic bytes and version as they have already been parsed
   b->position=4;
@@ -311,11 +337,11 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
       goto next;
     }
     
-    f.payload = ob_slice(b, b->position, next_payload - b->position);
-    if (!f.payload){
+    if (ob_slice_init(&payload_buffer, b, b->position, next_payload - b->position)){
       WHY("Payload length is longer than remaining packet size");
       break;
     }
+    f.payload = &payload_buffer;
     // mark the entire payload as having valid data
     ob_limitsize(f.payload, next_payload - b->position);
     
@@ -340,6 +366,9 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
   
   ob_free(b);
   
+  received_packets++;
+  received_packet_allocations += ob_allocations - allocations;
+  
   send_please_explain(&context, my_subscriber, sender);
   return 0;
 }
@@ -177,6 +177,101 @@ int dump_payload(struct overlay_frame *p, char *message)
   return 0;
 }
 
+static struct overlay_pool bucket_pool={
+  .name="overlay_tx_bucket",
+  .size=sizeof(struct overlay_tx_bucket),
+  .max_cached=64,
+};
+
+// add a queued frame to the end of the bucket for its destination, creating the bucket if needed
+int overlay_queue_bucket_append(overlay_txqueue *queue, struct overlay_frame *p)
+{
+  int q = queue - overlay_tx;
+  struct overlay_tx_bucket **slot = p->destination?&p->destination->tx_bucket[q]:&queue->broadcast_bucket;
+  struct overlay_tx_bucket *bucket = *slot;
+  
+  if (!bucket){
+    bucket = ob_pool_get(&bucket_pool);
+    if (!bucket)
+      return WHY("Could not allocate queue bucket");
+    bzero(bucket, sizeof(struct overlay_tx_bucket));
+    bucket->destination = p->destination;
+    bucket->prev = queue->last_bucket;
+    if (queue->last_bucket)
+      queue->last_bucket->next = bucket;
+    else
+      queue->first_bucket = bucket;
+    queue->last_bucket = bucket;
+    *slot = bucket;
+  }
+  
+  p->bucket = bucket;
+  p->bucket_prev = bucket->last;
+  p->bucket_next = NULL;
+  if (bucket->last)
+    bucket->last->bucket_next = p;
+  else
+    bucket->first = p;
+  bucket->last = p;
+  bucket->length++;
+  return 0;
+}
+
+// take a frame out of its bucket, releasing the bucket once it is empty
+void overlay_queue_bucket_remove(overlay_txqueue *queue, struct overlay_frame *p)
+{
+  struct overlay_tx_bucket *bucket = p->bucket;
+  if (!bucket)
+    return;
+  
+  if (p->bucket_prev)
+    p->bucket_prev->bucket_next = p->bucket_next;
+  else
+    bucket->first = p->bucket_next;
+  if (p->bucket_next)
+    p->bucket_next->bucket_prev = p->bucket_prev;
+  else
+    bucket->last = p->bucket_prev;
+  p->bucket = NULL;
+  p->bucket_prev = p->bucket_next = NULL;
+  
+  if (--bucket->length > 0)
+    return;
+  
+  if (bucket->prev)
+    bucket->prev->next = bucket->next;
+  else
+    queue->first_bucket = bucket->next;
+  if (bucket->next)
+    bucket->next->prev = bucket->prev;
+  else
+    queue->last_bucket = bucket->prev;
+  
+  if (bucket->destination)
+    bucket->destination->tx_bucket[queue - overlay_tx] = NULL;
+  else
+    queue->broadcast_bucket = NULL;
+  ob_pool_put(&bucket_pool, bucket);
+}
+
+// move a bucket that has just had its turn behind every other bucket in the queue
+void overlay_queue_bucket_rotate(overlay_txqueue *queue, struct overlay_tx_bucket *bucket)
+{
+  if (!bucket->next)
+    return;
+  
+  if (bucket->prev)
+    bucket->prev->next = bucket->next;
+  else
+    queue->first_bucket = bucket->next;
+  bucket->next->prev = bucket->prev;
+  
+  bucket->prev = queue->last_bucket;
+  bucket->next = NULL;
+  queue->last_bucket->next = bucket;
+  queue->last_bucket = bucket;
+}
+
 int overlay_payload_enqueue(int q, struct overlay_frame *p)
 {
   /* Add payload p to queue q.
@@ -210,8 +305,10 @@ int overlay_payload_enqueue(int q, struct overlay_frame *p)
     p->payload->sizeLimit=p->payload->position;
   }
   
-  if (overlay_tx[q].length>=overlay_tx[q].maxLength) 
+  if (overlay_tx[q].length>=overlay_tx[q].maxLength){
+    overlay_tx[q].dropped_congested++;
     return WHYF("Queue #%d congested (size = %d)",q,overlay_tx[q].maxLength);
+  }
 
   if (p->send_copies<=0)
     p->send_copies=1;
@@ -242,6 +339,9 @@ int overlay_payload_enqueue(int q, struct overlay_frame *p)
     p->sendBroadcast=1;
   }
   
+  if (overlay_queue_bucket_append(&overlay_tx[q], p))
+    return -1;
+  
   struct overlay_frame *l=overlay_tx[q].last;
   if (l) l->next=p;
   p->prev=l;
@@ -259,6 +359,20 @@ int overlay_payload_enqueue(int q, struct overlay_frame *p)
   return 0;
 }
 
+static struct overlay_pool frame_pool={
+  .name="overlay_frame",
+  .size=sizeof(struct overlay_frame),
+  .max_cached=256,
+};
+
+struct overlay_frame *op_new()
+{
+  struct overlay_frame *ret=ob_pool_get(&frame_pool);
+  if (!ret) return NULL;
+  bzero(ret, sizeof(struct overlay_frame));
+  return ret;
+}
+
 int op_free(struct overlay_frame *p)
 {
   if (!p) return WHY("Asked to free NULL");
@@ -268,7 +382,10 @@ int op_free(struct overlay_frame *p)
   p->next=NULL;
   if (p->payload) ob_free(p->payload);
   p->payload=NULL;
-  free(p);
+  if (p->block_size)
+    ob_block_put(p, p->block_size);
+  else
+    ob_pool_put(&frame_pool, p);
   return 0;
 }
 
@@ -276,14 +393,35 @@ struct overlay_frame *op_dup(struct overlay_frame *in)
 {
   if (!in) return NULL;
 
-  /* clone the frame */
-  struct overlay_frame *out=malloc(sizeof(struct overlay_frame));
-  if (!out) return WHYNULL("malloc() failed");
+  /* The copy of the frame, its payload header and the payload bytes that might be relevant
+     share one block from the buffer pools, which op_free() returns */
+  struct overlay_buffer *p=in->payload;
+  int byteCount=0;
+  if (p && p->bytes && p->allocSize){
+    byteCount = p->sizeLimit;
+    if (byteCount < p->position)
+      byteCount = p->position;
+    if (byteCount > p->allocSize)
+      byteCount = p->allocSize;
+  }
+  int size=sizeof(struct overlay_frame) + (p?sizeof(struct overlay_buffer)+byteCount:0);
+  struct overlay_frame *out=ob_block_get(&size);
+  if (!out) return WHYNULL("Could not allocate frame");
 
   /* copy main data structure */
   bcopy(in,out,sizeof(struct overlay_frame));
+  out->block_size=size;
 
-  if (in->payload)
-    out->payload=ob_dup(in->payload);
+  if (p){
+    struct overlay_buffer *q=(struct overlay_buffer *)(out+1);
+    unsigned char *bytes=(unsigned char *)(q+1);
+    bcopy(p->bytes,bytes,byteCount);
+    ob_static_init(q,bytes,byteCount);
+    q->sizeLimit=p->sizeLimit;
+    q->checkpointLength=p->checkpointLength;
+    // the copied bytes are the contents of the new frame
+    q->position=byteCount;
+    out->payload=q;
+  }
   return out;
 }
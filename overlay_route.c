@@ -231,8 +231,8 @@ int overlay_route_ack_selfannounce(struct overlay_frame *f,
 
   /* XXX Allocate overlay_frame structure and populate it */
   struct overlay_frame *out=NULL;
-  out=calloc(sizeof(struct overlay_frame),1);
-  if (!out) return WHY("calloc() failed to allocate an overlay frame");
+  out=op_new();
+  if (!out) return WHY("failed to allocate an overlay frame");
 
   out->type=OF_TYPE_SELFANNOUNCE_ACK;
   out->modifiers=0;
@@ -18,6 +18,9 @@
  */
 
 #include "serval.h"
+#include "overlay_buffer.h"
+#include "overlay_address.h"
+#include "rhizome.h"
 
 struct profile_total *stats_head=NULL;
 struct call_stats *current_call=NULL;
@@ -166,6 +169,16 @@ void fd_periodicstats(struct sched_ent *alarm)
 {
   fd_showstats();
   fd_clearstats();  
+  fd_showlatency();
+  fd_clearlatency();
+  overlay_show_allocations();
+  overlay_reset_allocations();
+  ob_show_pool_stats();
+  overlay_interface_show_pacing();
+  overlay_queue_show_stats();
+  overlay_broadcast_show_stats();
+  rhizome_manifest_show_stats();
+  rhizome_http_server_show_stats();
   alarm->alarm = gettime_ms()+3000;
   alarm->deadline = alarm->alarm+1000;
   schedule(alarm);
@@ -23,6 +23,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 static int rhizome_enabled_flag = -1; // unknown
 int rhizome_fetch_interval_ms = -1;
+static int rhizome_geo_flag = 0;
+static double rhizome_geo_latitude = 0;
+static double rhizome_geo_longitude = 0;
+static int rhizome_geo_radius_km = 50;
 
 /* Configure rhizome.
    @author Andrew Bettison <andrew@servalproject.com>
@@ -31,9 +35,40 @@ int rhizome_configure()
 {
   rhizome_enabled_flag = confValueGetBoolean("rhizome.enable", 1);
   rhizome_fetch_interval_ms = (int) confValueGetInt64Range("rhizome.fetch_interval_ms", 3000, 1, 3600000);
+  /* This node's position, if it has been told one, is used to fetch and advertise bundles about
+     nearby places ahead of the rest */
+  const char *latitude = confValueGet("rhizome.geo.latitude", NULL);
+  const char *longitude = confValueGet("rhizome.geo.longitude", NULL);
+  rhizome_geo_flag = 0;
+  if (latitude && longitude) {
+    rhizome_geo_latitude = atof(latitude);
+    rhizome_geo_longitude = atof(longitude);
+    if (rhizome_geo_latitude < -90 || rhizome_geo_latitude > 90 || rhizome_geo_longitude < -180 || rhizome_geo_longitude > 180)
+      WARNF("Ignoring invalid rhizome.geo position %s,%s", latitude, longitude);
+    else
+      rhizome_geo_flag = 1;
+  }
+  rhizome_geo_radius_km = (int) confValueGetInt64Range("rhizome.geo.radius_km", 50, 1, 20000);
+  rhizome_subscriptions_configure();
   return 0;
 }
 
+/* Return 1 and this node's configured position in degrees and the radius of its neighbourhood, or
+   0 if it has no position.
+ */
+int rhizome_geo_position(double *latitude, double *longitude, int *radius_km)
+{
+  if (rhizome_enabled_flag < 0)
+    rhizome_configure();
+  if (!rhizome_geo_flag)
+    return 0;
+  *latitude = rhizome_geo_latitude;
+  *longitude = rhizome_geo_longitude;
+  if (radius_km)
+    *radius_km = rhizome_geo_radius_km;
+  return 1;
+}
+
 int rhizome_enabled()
 {
   if (rhizome_enabled_flag < 0)
@@ -107,16 +142,16 @@ int rhizome_bundle_import(rhizome_manifest *m, int ttl)
 int rhizome_manifest_check_sanity(rhizome_manifest *m_in)
 {
   /* Ensure manifest meets basic sanity checks. */
-  const char *service = rhizome_manifest_get(m_in, "service", NULL, 0);
-  const char *sender = rhizome_manifest_get(m_in, "sender", NULL, 0);
-  const char *recipient = rhizome_manifest_get(m_in, "recipient", NULL, 0);
+  const char *service = rhizome_manifest_get_field(m_in, RHIZOME_FIELD_SERVICE);
+  const char *sender = rhizome_manifest_get_field(m_in, RHIZOME_FIELD_SENDER);
+  const char *recipient = rhizome_manifest_get_field(m_in, RHIZOME_FIELD_RECIPIENT);
   
   if (service == NULL || !service[0])
       return WHY("Manifest missing 'service' field");
-  if (rhizome_manifest_get_ll(m_in, "date") == -1)
+  if (rhizome_manifest_get_field_ll(m_in, RHIZOME_FIELD_DATE) == -1)
       return WHY("Manifest missing 'date' field");
   if (strcasecmp(service, RHIZOME_SERVICE_FILE) == 0) {
-    const char *name = rhizome_manifest_get(m_in, "name", NULL, 0);
+    const char *name = rhizome_manifest_get_field(m_in, RHIZOME_FIELD_NAME);
     if (name == NULL)
       return WHY("Manifest missing 'name' field");
   } else if (strcasecmp(service, RHIZOME_SERVICE_MESHMS) == 0) {
@@ -222,7 +257,7 @@ int rhizome_manifest_bind_file(rhizome_manifest *m_in,const char *filename,int e
 int rhizome_manifest_check_file(rhizome_manifest *m_in)
 {
   long long gotfile = 0;
-  if (sqlite_exec_int64(&gotfile, "SELECT COUNT(*) FROM FILES WHERE ID='%s' and datavalid=1;", m_in->fileHexHash) != 1) {
+  if (sqlite_exec_int64_key(&gotfile, m_in->fileHexHash, "SELECT COUNT(*) FROM FILES WHERE ID=? and datavalid=1;") != 1) {
     WHYF("Failed to count files");
     return 0;
   }
@@ -232,11 +267,11 @@ int rhizome_manifest_check_file(rhizome_manifest *m_in)
   }
 
   /* Find out whether the payload is expected to be encrypted or not */
-  m_in->payloadEncryption=rhizome_manifest_get_ll(m_in, "crypt");
+  m_in->payloadEncryption=rhizome_manifest_get_field_ll(m_in, RHIZOME_FIELD_CRYPT);
   
   /* Check payload file is accessible and discover its length, then check that it
      matches the file size stored in the manifest */
-  long long mfilesize = rhizome_manifest_get_ll(m_in, "filesize");
+  long long mfilesize = rhizome_manifest_get_field_ll(m_in, RHIZOME_FIELD_FILESIZE);
   m_in->fileLength = 0;
   if (m_in->dataFileName && m_in->dataFileName[0]) {
     struct stat stat;
@@ -256,7 +291,7 @@ int rhizome_manifest_check_file(rhizome_manifest *m_in)
 
   /* If payload is empty, ensure manifest has not file hash, otherwis compute the hash of the
      payload and check that it matches manifest. */
-  const char *mhexhash = rhizome_manifest_get(m_in, "filehash", NULL, 0);
+  const char *mhexhash = rhizome_manifest_get_field(m_in, RHIZOME_FIELD_FILEHASH);
   if (m_in->fileLength != 0) {
     char hexhashbuf[RHIZOME_FILEHASH_STRLEN + 1];
     if (rhizome_hash_file(m_in,m_in->dataFileName, hexhashbuf))
@@ -320,7 +355,7 @@ int rhizome_add_manifest(rhizome_manifest *m_in,int ttl)
     return WHY("File does not belong to this manifest");
 
   /* Get manifest version number. */
-  m_in->version = rhizome_manifest_get_ll(m_in, "version");
+  m_in->version = rhizome_manifest_get_field_ll(m_in, RHIZOME_FIELD_VERSION);
   if (m_in->version==-1)
     return WHY("Manifest must have a version number");
 
@@ -336,7 +371,7 @@ int rhizome_add_manifest(rhizome_manifest *m_in,int ttl)
     str_toupper_inplace(id);
     /* Discard the new manifest unless it is newer than the most recent known version with the same ID */
     long long storedversion = -1;
-    switch (sqlite_exec_int64(&storedversion, "SELECT version from manifests where id='%s';", id)) {
+    switch (sqlite_exec_int64_key(&storedversion, id, "SELECT version from manifests where id=?;")) {
       case -1:
 	return WHY("Select failed");
       case 0:
@@ -362,13 +397,16 @@ int rhizome_add_manifest(rhizome_manifest *m_in,int ttl)
     return WHY("rhizome_store_bundle() failed.");
 
   // This message used in tests; do not modify or remove.
-  const char *service = rhizome_manifest_get(m_in, "service", NULL, 0);
+  const char *service = rhizome_manifest_get_field(m_in, RHIZOME_FIELD_SERVICE);
   INFOF("RHIZOME ADD MANIFEST service=%s bid=%s version=%lld",
       service ? service : "NULL",
       alloca_tohex_sid(m_in->cryptoSignPublic),
       m_in->version
       );
-  monitor_announce_bundle(m_in);
+  if (rhizome_worker_process)
+    rhizome_worker_announce_bundle(m_in);
+  else
+    monitor_announce_bundle(m_in);
   return 0;
 }
 
@@ -56,6 +56,23 @@ extern time_ms_t rhizome_voice_timeout;
 
 #define RHIZOME_IDLE_TIMEOUT 10000
 
+/* Default limits on concurrent HTTP server requests, overall and from any one client address.
+   Overridden by the "rhizome.http.max_connections" and "rhizome.http.max_connections_per_peer"
+   config options. */
+#define RHIZOME_SERVER_MAX_LIVE_REQUESTS 32
+#define RHIZOME_SERVER_MAX_REQUESTS_PER_PEER 8
+
+struct rhizome_http_server_stats {
+  int live;              // requests currently open
+  long long accepted;    // connections accepted
+  long long refused;     // connections refused because the server was full
+  long long refused_per_peer; // connections refused because the client had too many open
+  long long throttled;   // times a client was paused for exceeding its bandwidth share
+};
+
+void rhizome_http_server_get_stats(struct rhizome_http_server_stats *stats);
+void rhizome_http_server_show_stats();
+
 typedef struct rhizome_signature {
   unsigned char signature[crypto_sign_edwards25519sha512batch_BYTES
 			  +crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES+1];
@@ -71,13 +88,53 @@ typedef struct rhizome_signature {
 #define RHIZOME_BAR_GEOBOX_OFFSET 23
 #define RHIZOME_BAR_TTL_OFFSET 31
 
+/* Payload size range of the first Rhizome Direct cursor size bin; each later bin is twice as wide */
+#define RHIZOME_SIZE_BIN_BYTES 1024
+#define RHIZOME_SIZE_BIN_LIMIT (1LL<<48)
+
+/* Geobox coordinates are quantised into 16 bits, the same way in the BAR and the spatial index */
+#define RHIZOME_GEO_LAT_UNITS (65535/180)
+#define RHIZOME_GEO_LONG_UNITS (65535/360)
+/* Only bundles about an area no wider than this many degrees are kept in the spatial index, which
+   bounds the range scan needed to find the boxes that overlap a given area. */
+#define RHIZOME_GEO_INDEX_SPAN_DEGREES 5
+/* Bundles are ranked by roughly log2(km) from this node's position, up to this rank */
+#define RHIZOME_GEO_RANK_MAX 15
+/* Number of nearby BARs advertised ahead of the round robin in each advert */
+#define RHIZOME_GEO_ADVERT_BARS 4
+
+/* How long an advertised bundle that this node is not subscribed to is ignored for */
+#define RHIZOME_UNSUBSCRIBED_IGNORE_MS 300000
+
 #define MAX_MANIFEST_VARS 256
 #define MAX_MANIFEST_BYTES 8192
+
+/* Well-known manifest fields are interned when they are parsed or set, so that the hot paths can
+   find their values without scanning the variable list.  RHIZOME_FIELD_OTHER is any field not in
+   this list, which is kept (and re-packed) exactly as it was read.
+ */
+#define RHIZOME_FIELD_OTHER	  0
+#define RHIZOME_FIELD_ID	  1
+#define RHIZOME_FIELD_VERSION	  2
+#define RHIZOME_FIELD_FILESIZE	  3
+#define RHIZOME_FIELD_FILEHASH	  4
+#define RHIZOME_FIELD_SERVICE	  5
+#define RHIZOME_FIELD_BK	  6
+#define RHIZOME_FIELD_DATE	  7
+#define RHIZOME_FIELD_NAME	  8
+#define RHIZOME_FIELD_SENDER	  9
+#define RHIZOME_FIELD_RECIPIENT	  10
+#define RHIZOME_FIELD_CRYPT	  11
+#define RHIZOME_FIELD_COUNT	  12
+
 typedef struct rhizome_manifest {
   int manifest_record_number;
   int manifest_bytes;
   int manifest_all_bytes;
-  unsigned char manifestdata[MAX_MANIFEST_BYTES];
+  /* The text and signature blocks, in a malloc()ed buffer sized to fit them plus a terminating
+     null, so that a record does not carry MAX_MANIFEST_BYTES for every manifest */
+  unsigned char *manifestdata;
+  int manifestdata_size;
   unsigned char manifesthash[crypto_hash_sha512_BYTES];
 
   /* CryptoSign key pair for this manifest.
@@ -90,6 +147,12 @@ typedef struct rhizome_manifest {
   int var_count;
   char *vars[MAX_MANIFEST_VARS];
   char *values[MAX_MANIFEST_VARS];
+  /* RHIZOME_FIELD_* code of each variable */
+  unsigned char var_field[MAX_MANIFEST_VARS];
+  /* Index+1 of each well-known field in vars[], or 0 if absent */
+  short field_slot[RHIZOME_FIELD_COUNT];
+  /* Decimal value of each well-known field, or -1 if absent or not a number */
+  long long field_ll[RHIZOME_FIELD_COUNT];
 
   int sig_count;
   /* Parties who have signed this manifest (raw byte format) */
@@ -146,6 +209,7 @@ extern int rhizome_fetch_interval_ms;
 extern unsigned short rhizome_http_server_port;
 
 int rhizome_configure();
+int rhizome_geo_position(double *latitude, double *longitude, int *radius_km);
 
 int rhizome_set_datastore_path(const char *path);
 
@@ -193,6 +257,27 @@ sqlite_retry_state sqlite_retry_state_init(int serverLimit, int serverSleep, int
 
 #define SQLITE_RETRY_STATE_DEFAULT sqlite_retry_state_init(-1,-1,-1,-1)
 
+/* Set whenever a query gives up because the database is locked by another process */
+extern int rhizome_db_busy;
+
+#define RHIZOME_DB_BUSY (-2)
+#define RHIZOME_DB_REQUEST_MAX 32
+#define RHIZOME_DB_RETRY_MIN_MS 10
+#define RHIZOME_DB_RETRY_MAX_MS 500
+#define RHIZOME_DB_RETRY_LIMIT_MS 10000
+int rhizome_db_request(const char *description, int (*function)(void *context),
+		       void (*completion)(void *context, int result), void *context);
+#define RHIZOME_USAGE_RECONCILE_MS 60000
+#define RHIZOME_VACUUM_PAGES 64
+#define RHIZOME_VACUUM_INTERVAL_MS 5000
+#define RHIZOME_VACUUM_BUSY_INTERVAL_MS 100
+long long rhizome_database_used_bytes();
+void rhizome_database_usage_adjust(long long bytes);
+void rhizome_database_usage_invalidate();
+int rhizome_size_bin(long long size);
+int rhizome_db_request_pending(int (*function)(void *context), int (*match)(void *context, const void *arg), const void *arg);
+int rhizome_db_request_cancel(int (*function)(void *context), void *context);
+
 int rhizome_write_manifest_file(rhizome_manifest *m, const char *filename);
 int rhizome_manifest_selfsign(rhizome_manifest *m);
 int rhizome_drop_stored_file(const char *id,int maximum_priority);
@@ -201,6 +286,9 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 int rhizome_hash_file(rhizome_manifest *m, const char *filename,char *hash_out);
 char *rhizome_manifest_get(const rhizome_manifest *m, const char *var, char *out, int maxlen);
 long long  rhizome_manifest_get_ll(rhizome_manifest *m, const char *var);
+int rhizome_manifest_field_code(const char *var);
+char *rhizome_manifest_get_field(const rhizome_manifest *m, int field);
+long long rhizome_manifest_get_field_ll(const rhizome_manifest *m, int field);
 int rhizome_manifest_set_ll(rhizome_manifest *m,char *var,long long value);
 int rhizome_manifest_set(rhizome_manifest *m, const char *var, const char *value);
 int rhizome_manifest_del(rhizome_manifest *m, const char *var);
@@ -214,6 +302,26 @@ int rhizome_store_bundle(rhizome_manifest *m);
 int rhizome_manifest_add_group(rhizome_manifest *m,char *groupid);
 int rhizome_clean_payload(const char *fileidhex);
 int rhizome_store_file(rhizome_manifest *m,const unsigned char *key);
+
+/* A payload being stored incrementally, see rhizome_open_write() */
+#define RHIZOME_WRITE_BUFFER_SIZE (16*RHIZOME_CRYPT_PAGE_SIZE)
+/* How far the buffer may grow while the database is too busy to take its contents */
+#define RHIZOME_WRITE_BUFFER_MAX (256*RHIZOME_CRYPT_PAGE_SIZE)
+struct rhizome_write {
+  char id[RHIZOME_FILEHASH_STRLEN + 1];
+  int64_t rowid;
+  long long file_length;
+  long long file_offset;
+  unsigned char *buffer;
+  int buffer_size;
+  int data_size;
+  SHA512_CTX sha512_context;
+  int hash_checked;
+};
+int rhizome_open_write(struct rhizome_write *write, const char *expected_hash, long long file_length, int priority);
+int rhizome_write_buffer(struct rhizome_write *write, const unsigned char *data, int len);
+int rhizome_finish_write(struct rhizome_write *write);
+void rhizome_fail_write(struct rhizome_write *write);
 int rhizome_bundle_import_files(const char *manifest_path, const char *payload_path, int ttl);
 int rhizome_bundle_import(rhizome_manifest *m, int ttl);
 
@@ -252,6 +360,10 @@ int _sqlite_exec_void_retry(struct __sourceloc, sqlite_retry_state *retry, const
 int _sqlite_exec_int64(struct __sourceloc, long long *result, const char *sqlformat,...);
 int _sqlite_exec_int64_retry(struct __sourceloc, sqlite_retry_state *retry, long long *result, const char *sqlformat,...);
 int _sqlite_exec_strbuf(struct __sourceloc, strbuf sb, const char *sqlformat,...);
+int _sqlite_exec_void_key(struct __sourceloc, const char *hexkey, const char *sqlformat, ...);
+int _sqlite_exec_void_key_retry(struct __sourceloc, sqlite_retry_state *retry, const char *hexkey, const char *sqlformat, ...);
+int _sqlite_exec_int64_key(struct __sourceloc, long long *result, const char *hexkey, const char *sqlformat, ...);
+int _sqlite_exec_int64_key_retry(struct __sourceloc, sqlite_retry_state *retry, long long *result, const char *hexkey, const char *sqlformat, ...);
 
 #define sqlite_prepare(rs,fmt,...)              _sqlite_prepare(__HERE__, (rs), (fmt), ##__VA_ARGS__)
 #define sqlite_prepare_loglevel(ll,rs,sb)       _sqlite_prepare_loglevel(__HERE__, (ll), (rs), (sb))
@@ -265,6 +377,17 @@ int _sqlite_exec_strbuf(struct __sourceloc, strbuf sb, const char *sqlformat,...
 #define sqlite_exec_int64(res,fmt,...)          _sqlite_exec_int64(__HERE__, (res), (fmt), ##__VA_ARGS__)
 #define sqlite_exec_int64_retry(rs,res,fmt,...) _sqlite_exec_int64_retry(__HERE__, (rs), (res), (fmt), ##__VA_ARGS__)
 #define sqlite_exec_strbuf(sb,fmt,...)          _sqlite_exec_strbuf(__HERE__, (sb), (fmt), ##__VA_ARGS__)
+#define sqlite_exec_void_key(key,fmt,...)       _sqlite_exec_void_key(__HERE__, (key), (fmt), ##__VA_ARGS__)
+#define sqlite_exec_void_key_retry(rs,key,fmt,...) _sqlite_exec_void_key_retry(__HERE__, (rs), (key), (fmt), ##__VA_ARGS__)
+#define sqlite_exec_int64_key(res,key,fmt,...)  _sqlite_exec_int64_key(__HERE__, (res), (key), (fmt), ##__VA_ARGS__)
+#define sqlite_exec_int64_key_retry(rs,res,key,fmt,...) _sqlite_exec_int64_key_retry(__HERE__, (rs), (res), (key), (fmt), ##__VA_ARGS__)
+
+/* Manifest IDs, file hashes and group IDs are stored in the database as raw-byte BLOB keys, not
+   as hex text.  These convert between the two at the statement boundary.
+ */
+#define RHIZOME_KEY_MAX_BYTES RHIZOME_FILEHASH_BYTES
+int rhizome_bind_key(sqlite3_stmt *statement, int index, const char *hexkey);
+char *rhizome_column_key(sqlite3_stmt *statement, int column, char *hexkey, size_t hexkeysize);
 
 double rhizome_manifest_get_double(rhizome_manifest *m,char *var,double default_value);
 int rhizome_manifest_extract_signature(rhizome_manifest *m,int *ofs);
@@ -274,7 +397,12 @@ int rhizome_find_duplicate(const rhizome_manifest *m, rhizome_manifest **found,
 int rhizome_manifest_to_bar(rhizome_manifest *m,unsigned char *bar);
 long long rhizome_bar_version(unsigned char *bar);
 unsigned long long rhizome_bar_bidprefix_ll(unsigned char *bar);
+void rhizome_bar_geobox(const unsigned char *bar, unsigned short box[4]);
+int rhizome_bar_geo_rank(const unsigned char *bar);
+int rhizome_manifest_geo_rank(rhizome_manifest *m);
 int rhizome_queue_manifest_import(rhizome_manifest *m, struct sockaddr_in *peerip, int *manifest_kept);
+int rhizome_subscriptions_configure();
+int rhizome_manifest_subscribed(rhizome_manifest *m);
 int rhizome_list_manifests(const char *service, const char *sender_sid, const char *recipient_sid, int limit, int offset);
 int rhizome_retrieve_manifest(const char *manifestid, rhizome_manifest **mp);
 int rhizome_retrieve_file(const char *fileid, const char *filepath,
@@ -287,6 +415,7 @@ int rhizome_fetching_get_fds(struct pollfd *fds,int *fdcount,int fdmax);
 int rhizome_manifest_version_cache_lookup(rhizome_manifest *m);
 int rhizome_manifest_version_cache_store(rhizome_manifest *m);
 int monitor_announce_bundle(rhizome_manifest *m);
+int rhizome_worker_announce_bundle(rhizome_manifest *m);
 int rhizome_bk_xor(const unsigned char *authorSid, // binary
 		   unsigned char bid[crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES],
 		   unsigned char bkin[crypto_sign_edwards25519sha512batch_SECRETKEYBYTES],
@@ -302,9 +431,51 @@ int rhizome_ignore_manifest_check(rhizome_manifest *m,
 
 /* one manifest is required per candidate, plus a few spare.
    so MAX_RHIZOME_MANIFESTS must be > MAX_CANDIDATES. 
+   MAX_RHIZOME_MANIFESTS is the size of the initial manifest pool, which grows in slabs of
+   RHIZOME_MANIFEST_SLAB_RECORDS up to the "rhizome.manifest.max_records" config option.
 */
 #define MAX_RHIZOME_MANIFESTS 24
 #define MAX_CANDIDATES 16
+#define RHIZOME_MANIFEST_SLAB_RECORDS 16
+#define RHIZOME_MANIFEST_DEFAULT_MAX_RECORDS 256
+#define RHIZOME_MANIFEST_MAX_RECORDS_LIMIT 65536
+/* how many records to list when the pool is exhausted */
+#define RHIZOME_MANIFEST_TRACE_RECORDS 8
+
+struct rhizome_manifest_stats {
+  int in_use;     // records currently allocated to callers
+  int high_water; // most records ever in use at once
+  int allocated;  // records in the pool, free or not
+  int limit;      // most records the pool may grow to
+  int slabs;      // number of times the pool has grown
+  int failures;   // allocations refused because the pool was at its limit
+};
+
+void rhizome_manifest_get_stats(struct rhizome_manifest_stats *stats);
+void rhizome_manifest_show_stats();
+
+/* A manifest signature block is the signature proper followed by the signatory's public key.
+   The signature cache holds "rhizome.verify.cache_size" entries, and the VERIFICATIONS table keeps
+   up to RHIZOME_SIGNATURE_PERSIST_FACTOR times that many verified signatures between restarts.
+ */
+#define RHIZOME_SIGNATURE_BLOCK_BYTES (crypto_sign_edwards25519sha512batch_BYTES + crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES)
+#define RHIZOME_SIGNATURE_CACHE_DEFAULT_SIZE 1024
+#define RHIZOME_SIGNATURE_CACHE_MAX_SIZE 65536
+#define RHIZOME_SIGNATURE_PERSIST_FACTOR 16
+#define RHIZOME_SIGNATURE_PERSIST_BATCH 32
+#define RHIZOME_SIGNATURE_PERSIST_DELAY_MS 2000
+
+struct rhizome_signature_cache_stats {
+  int size;            // entries in the cache
+  long long lookups;   // signature blocks checked
+  long long hits;      // answered from the cache
+  long long db_hits;   // answered from the VERIFICATIONS table
+  long long verified;  // full signature verifications done
+  long long failures;  // verifications that failed
+  long long evictions; // cache entries displaced by a different signature
+};
+
+void rhizome_signature_cache_get_stats(struct rhizome_signature_cache_stats *stats);
 
 int rhizome_suggest_queue_manifest_import(rhizome_manifest *m,
 					  struct sockaddr_in *peerip);
@@ -340,7 +511,12 @@ typedef struct rhizome_http_request {
   // for anything too big, we can just use a blob
 #define RHIZOME_HTTP_REQUEST_BLOB 64
 #define RHIZOME_HTTP_REQUEST_FAVICON 128
+  // rows of an SQL query, fetched a buffer at a time
+#define RHIZOME_HTTP_REQUEST_SQL_ROWS 256
   
+  /* Payloads are streamed through a buffer of this size, allocated once per connection. */
+#define RHIZOME_BLOB_BUFFER_SIZE 65536
+
   /* Local buffer of data to be sent.
    If a RHIZOME_HTTP_REQUEST_FROMBUFFER, then the buffer is sent, and when empty
    the request is closed.
@@ -358,8 +534,27 @@ typedef struct rhizome_http_request {
   /* Boundary string for POST multipart form requests */
   char boundary_string[1024];
   int boundary_string_length;
+  /* Where the body of the current part of a POST multipart form is going (RD_FIELD_*) */
+  int field_sink;
   /* File currently being written to while decoding POST multipart form */
   FILE *field_file;
+  /* Set when the CRLF ending the last line of the current part has been held back, as it
+     belongs to the boundary line if one follows */
+  int field_crlf_pending;
+  /* The manifest part of a /rhizome/import, kept in memory */
+  unsigned char *manifest_part;
+  int manifest_part_length;
+  /* The manifest of a /rhizome/import, once received and verified, and what became of its
+     payload (RD_IMPORT_PAYLOAD_*) */
+  rhizome_manifest *import_manifest;
+  int import_payload;
+  struct rhizome_write import_write;
+  /* Set while the import is waiting for the database, with the connection parked, and if the form
+     ended meanwhile */
+  int import_deferred;
+  int import_form_ended;
+  /* The body of a /rhizome/importarchive, imported as it arrives */
+  struct rhizome_archive_reader *archive;
   /* Name of data file supplied */
   char data_file_name[1024];
   /* Which fields have been seen in POST multipart form */
@@ -380,6 +575,19 @@ typedef struct rhizome_http_request {
 #define RD_MIME_STATE_PARTHEADERS 0xffff0000
 #define RD_MIME_STATE_BODY 0xffff0001
 
+#define RD_FIELD_FILE 0
+#define RD_FIELD_MANIFEST 1
+#define RD_FIELD_PAYLOAD 2
+#define RD_FIELD_DISCARD 3
+#define RD_FIELD_ARCHIVE 4
+
+#define RD_IMPORT_PAYLOAD_NONE 0
+#define RD_IMPORT_PAYLOAD_STORED 1
+#define RD_IMPORT_PAYLOAD_HELD 2
+#define RD_IMPORT_PAYLOAD_FILE 3
+#define RD_IMPORT_PAYLOAD_FAILED 4
+#define RD_IMPORT_PAYLOAD_WRITTEN 5 // all received, but the database was too busy to finish it
+
   /* The source specification data which are used in different ways by different 
    request types */
   char source[1024];
@@ -387,10 +595,17 @@ typedef struct rhizome_http_request {
   long long source_count;
   int source_record_size;
   unsigned int source_flags;
+  /* rowid of the last SQL row sent, so the next piece of the list can seek past it */
+  long long source_last_rowid;
+  char *source_table;
+  char *source_column;
   
   sqlite3_blob *blob;
   /* source_index used for offset in blob */
   long long blob_end; 
+
+  /* Set while sending is paused because the client has used its bandwidth share */
+  int throttled;
   
 } rhizome_http_request;
 
@@ -450,6 +665,19 @@ int rhizome_direct_get_bars(const unsigned char bid_low[RHIZOME_MANIFEST_ID_BYTE
 			    int bars_requested);
 int rhizome_direct_process_post_multipart_bytes
 (rhizome_http_request *r,const char *bytes,int count);
+void rhizome_direct_free_request_state(rhizome_http_request *r);
+
+/* Set reconciliation ranges are identified by a number of leading hex digits
+   (nibbles) of the BID.  Each range is summarised by the number of bundles in it and
+   the XOR of a hash of each of their BARs, so that two stores can tell whether they
+   hold the same bundles in a range without exchanging the BARs themselves. */
+#define RHIZOME_DIRECT_RANGE_MAX_NIBBLES (RHIZOME_BAR_PREFIX_BYTES*2)
+#define RHIZOME_DIRECT_RANGE_DIGEST_BYTES 16
+#define RHIZOME_DIRECT_RANGE_RECORD_BYTES (1+RHIZOME_BAR_PREFIX_BYTES+4+RHIZOME_DIRECT_RANGE_DIGEST_BYTES)
+/* Ranges with at most this many bundles are answered with their BARs instead of being split */
+#define RHIZOME_DIRECT_RECONCILE_LEAF_BARS 32
+/* Most ranges sent in a single reconciliation enquiry */
+#define RHIZOME_DIRECT_RECONCILE_MAX_RANGES 64
 
 typedef struct rhizome_direct_sync_request {
   struct sched_ent alarm;
@@ -481,14 +709,38 @@ typedef struct rhizome_direct_sync_request {
   int fills_sent;
   int fill_responses_processed;
   int bundles_pushed;
-  int bundles_pulled;
+  /* Pulls handed to the fetch queue, which does not say whether they succeed */
+  int pulls_requested;
   int bundle_transfers_in_progress;
 
+  /* Cursor fills dispatched whose responses have not yet been processed, and the
+     most that may be outstanding at once */
+  int fills_in_flight;
+  int max_fills_in_flight;
+
+  /* Cursor fills that could not be sent.  No more are dispatched once one fails, and the
+     sync concludes as failed when those in flight have been answered. */
+  int fills_failed;
+
+  /* Bytes of enquiries sent, and of their responses received */
+  long long enquiry_bytes_sent;
+  long long enquiry_bytes_received;
+
+  /* Set reconciliation mode.  Instead of walking the cursor, ranges of the BID space
+     are compared with the far end by digest, and only the ranges that differ are
+     split and explored further.  These are the ranges still to be sent, as wire
+     records (see rhizome_direct_reconcile.c). */
+  int reconcile;
+  unsigned char (*ranges)[RHIZOME_DIRECT_RANGE_RECORD_BYTES];
+  int range_count;
+  int range_size;
+
 } rhizome_direct_sync_request;
 
 #define RHIZOME_DIRECT_MAX_SYNC_HANDLES 16
 extern rhizome_direct_sync_request *rd_sync_handles[RHIZOME_DIRECT_MAX_SYNC_HANDLES];
 extern int rd_sync_handle_count;
+extern int rd_sync_failures;
 
 rhizome_direct_sync_request
 *rhizome_direct_new_sync_request(
@@ -500,10 +752,36 @@ int rhizome_direct_continue_sync_request(rhizome_direct_sync_request *r);
 int rhizome_direct_conclude_sync_request(rhizome_direct_sync_request *r);
 rhizome_direct_bundle_cursor *rhizome_direct_get_fill_response
 (unsigned char *buffer,int size,int max_response_bytes);
+int rhizome_direct_reconcile_start(rhizome_direct_sync_request *r);
+int rhizome_direct_reconcile_fill(rhizome_direct_sync_request *r);
+int rhizome_direct_reconcile_response(rhizome_direct_sync_request *r,
+				      const unsigned char *response,int length,
+				      unsigned char **actions,int *actions_length);
+unsigned char *rhizome_direct_get_reconcile_response(const unsigned char *request,int length,
+						     int *response_length);
+
+/* A batched push stops taking more bundles once it carries this many payload bytes */
+#define RHIZOME_DIRECT_PUSH_BATCH_BYTES (1024*1024)
 
 typedef struct rhizome_direct_transport_state_http {
+  /* Polls for progress of queued and in-flight bundle transfers */
+  struct sched_ent alarm;
+  rhizome_direct_sync_request *sync;
   int port;
   char host[1024];  
+  struct sockaddr_in addr;
+
+  /* Pushes and pulls requested by the far end, waiting to be started.  Each entry
+     is a type byte (1=push, 2=pull, 3=push that an earlier batch did not deliver)
+     followed by a BAR prefix. */
+  unsigned char (*pending)[1+RHIZOME_BAR_PREFIX_BYTES];
+  int pending_count;
+  int pending_size;
+  int pushes_in_flight;
+  int max_pushes;
+  /* Most bundles to send in one POST; 1 means one /rhizome/import request per bundle */
+  int push_batch;
+  int pulls_in_flight;
 } rhizome_direct_transport_state_http;
 
 void rhizome_direct_http_dispatch(rhizome_direct_sync_request *);
@@ -512,6 +790,41 @@ extern unsigned char favicon_bytes[];
 extern int favicon_len;
 
 int rhizome_import_from_files(const char *manifestpath,const char *filepath);
+
+/* Rhizome bundle archives, see rhizome_archive.c */
+#define RHIZOME_ARCHIVE_MAGIC "SVRZARC1"
+#define RHIZOME_ARCHIVE_MAGIC_BYTES 8
+#define RHIZOME_ARCHIVE_ENTRY_HEADER_BYTES (1 + RHIZOME_MANIFEST_ID_BYTES + 8 + 4 + 8 + crypto_hash_sha512_BYTES)
+#define RHIZOME_ARCHIVE_INDEX_RECORD_BYTES (RHIZOME_MANIFEST_ID_BYTES + 8 + 8)
+#define RHIZOME_ARCHIVE_STATUS_RECORD_BYTES (1 + RHIZOME_BAR_PREFIX_BYTES)
+#define RHIZOME_ARCHIVE_STATUS_IMPORTED 0
+#define RHIZOME_ARCHIVE_STATUS_HELD 1
+#define RHIZOME_ARCHIVE_STATUS_REJECTED 2
+
+struct rhizome_archive_index {
+  unsigned char (*records)[RHIZOME_ARCHIVE_INDEX_RECORD_BYTES];
+  int count;
+  int size;
+};
+
+void rhizome_archive_entry_header(unsigned char *header, const unsigned char *bid, long long version,
+				  const unsigned char *manifest, int manifest_bytes, long long payload_bytes);
+int rhizome_archive_index_append(struct rhizome_archive_index *index, const unsigned char *bid, long long version, off_t offset);
+int rhizome_archive_index_bytes(const struct rhizome_archive_index *index);
+void rhizome_archive_put_index(const struct rhizome_archive_index *index, unsigned char *buf, off_t offset);
+int rhizome_archive_export(const char *path);
+struct rhizome_archive_reader;
+struct rhizome_archive_reader *rhizome_archive_reader_new(const char *name);
+int rhizome_archive_reader_feed(struct rhizome_archive_reader *a, const unsigned char *bytes, size_t len);
+long long rhizome_archive_reader_skippable(const struct rhizome_archive_reader *a);
+int rhizome_archive_reader_busy(const struct rhizome_archive_reader *a);
+int rhizome_archive_reader_resume(struct rhizome_archive_reader *a);
+void rhizome_archive_reader_abort(struct rhizome_archive_reader *a);
+int rhizome_archive_reader_end(struct rhizome_archive_reader *a, unsigned char **statuses, int *status_count);
+int rhizome_archive_import_stream(FILE *f, const char *name, unsigned char **statuses, int *status_count);
+int rhizome_archive_import(const char *path);
+int rhizome_fetch_queue_size();
+int rhizome_fetch_queue_space();
 int rhizome_fetch_request_manifest_by_prefix(struct sockaddr_in *peerip,
 					     unsigned char *prefix,
 					     int prefix_length,
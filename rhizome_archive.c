@@ -0,0 +1,858 @@
+/*
+Serval Mesh Software
+Copyright (C) 2012 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Rhizome bundle archives.
+
+  An archive carries a whole Rhizome store between sites that have no network path between
+  them (a USB stick, an SD card, a tape), as a single file written strictly sequentially
+  and append-only, so that it can be produced onto and consumed from a pipe.
+
+  The archive begins with the RHIZOME_ARCHIVE_MAGIC bytes and is followed by one entry per
+  bundle:
+
+     1 byte - RHIZOME_ARCHIVE_ENTRY_BUNDLE
+     RHIZOME_MANIFEST_ID_BYTES bytes - the BID
+     8 bytes - the manifest version (big-endian)
+     4 bytes - manifest length in bytes (big-endian)
+     8 bytes - payload length in bytes (big-endian)
+     crypto_hash_sha512_BYTES bytes - SHA512 hash of the manifest bytes
+     the manifest bytes, signatures included
+     the payload bytes
+
+  The payload is covered by the filehash field of the (signed) manifest, so needs no hash
+  of its own.  After the last entry comes the index:
+
+     1 byte - RHIZOME_ARCHIVE_ENTRY_INDEX
+     4 bytes - number of entries (big-endian)
+     for each entry, the BID, 8 bytes version and 8 bytes offset of the entry's type byte
+     8 bytes - the offset of the index's type byte
+     RHIZOME_ARCHIVE_MAGIC again
+
+  so that a reader that can seek may find the index from the end of the file, and a reader
+  that cannot may tell a complete archive from a truncated one.
+
+  Import reads the archive front to back.  An entry whose BID we already hold at the same or
+  a newer version is passed over without its manifest or payload being read (by seeking, if
+  the archive is seekable).  Otherwise the payload is written into the FILES table as it is
+  read, but is not marked valid until its hash has been checked, and the manifest is only
+  stored once that has happened, so an interrupted or corrupt import never leaves a bundle
+  half imported.
+*/
+
+#include "serval.h"
+#include "rhizome.h"
+#include "str.h"
+#include <assert.h>
+
+#define RHIZOME_ARCHIVE_ENTRY_BUNDLE 'B'
+#define RHIZOME_ARCHIVE_ENTRY_INDEX 'I'
+
+static void put_be(unsigned char *p, unsigned long long v, int bytes)
+{
+  int i;
+  for (i = bytes - 1; i >= 0; --i) {
+    p[i] = v & 0xff;
+    v >>= 8;
+  }
+}
+
+static unsigned long long get_be(const unsigned char *p, int bytes)
+{
+  unsigned long long v = 0;
+  int i;
+  for (i = 0; i < bytes; ++i)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+/* Compose the header of a bundle entry, which is followed in the archive by the manifest and
+   payload bytes.
+ */
+void rhizome_archive_entry_header(unsigned char *header, const unsigned char *bid, long long version,
+				  const unsigned char *manifest, int manifest_bytes, long long payload_bytes)
+{
+  unsigned char *p = header;
+  *p++ = RHIZOME_ARCHIVE_ENTRY_BUNDLE;
+  bcopy(bid, p, RHIZOME_MANIFEST_ID_BYTES); p += RHIZOME_MANIFEST_ID_BYTES;
+  put_be(p, version, 8); p += 8;
+  put_be(p, manifest_bytes, 4); p += 4;
+  put_be(p, payload_bytes, 8); p += 8;
+  crypto_hash_sha512(p, manifest, manifest_bytes);
+}
+
+int rhizome_archive_index_append(struct rhizome_archive_index *index, const unsigned char *bid, long long version, off_t offset)
+{
+  if (index->count >= index->size) {
+    int size = index->size ? index->size * 2 : 256;
+    void *records = realloc(index->records, size * sizeof index->records[0]);
+    if (!records)
+      return WHY("Out of memory");
+    index->records = records;
+    index->size = size;
+  }
+  unsigned char *r = index->records[index->count++];
+  bcopy(bid, r, RHIZOME_MANIFEST_ID_BYTES);
+  put_be(&r[RHIZOME_MANIFEST_ID_BYTES], version, 8);
+  put_be(&r[RHIZOME_MANIFEST_ID_BYTES + 8], offset, 8);
+  return 0;
+}
+
+/* The number of bytes that rhizome_archive_put_index() will write.
+ */
+int rhizome_archive_index_bytes(const struct rhizome_archive_index *index)
+{
+  return 1 + 4 + index->count * RHIZOME_ARCHIVE_INDEX_RECORD_BYTES + 8 + RHIZOME_ARCHIVE_MAGIC_BYTES;
+}
+
+/* Compose the index and trailer that end an archive, given the offset at which the index
+   begins (ie, the length of the magic and all entries).
+ */
+void rhizome_archive_put_index(const struct rhizome_archive_index *index, unsigned char *buf, off_t offset)
+{
+  unsigned char *p = buf;
+  *p++ = RHIZOME_ARCHIVE_ENTRY_INDEX;
+  put_be(p, index->count, 4); p += 4;
+  bcopy(index->records, p, index->count * RHIZOME_ARCHIVE_INDEX_RECORD_BYTES);
+  p += index->count * RHIZOME_ARCHIVE_INDEX_RECORD_BYTES;
+  put_be(p, offset, 8); p += 8;
+  bcopy(RHIZOME_ARCHIVE_MAGIC, p, RHIZOME_ARCHIVE_MAGIC_BYTES);
+}
+
+static int write_bytes(FILE *f, const char *path, const void *buf, size_t len)
+{
+  if (len && fwrite(buf, len, 1, f) != 1)
+    return WHYF_perror("fwrite(%s)", alloca_str_toprint(path));
+  return 0;
+}
+
+static int export_payload(FILE *f, const char *path, int64_t rowid, long long length)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_blob *blob = NULL;
+  int ret;
+  do ret = sqlite3_blob_open(rhizome_db, "main", "FILES", "data", rowid, 0 /* read only */, &blob);
+  while (sqlite_code_busy(ret) && sqlite_retry(&retry, "sqlite3_blob_open"));
+  if (!sqlite_code_ok(ret))
+    return WHYF("sqlite3_blob_open() failed, %s", sqlite3_errmsg(rhizome_db));
+  sqlite_retry_done(&retry, "sqlite3_blob_open");
+  unsigned char buffer[RHIZOME_CRYPT_PAGE_SIZE];
+  long long offset;
+  for (offset = 0; offset < length; offset += sizeof buffer) {
+    int n = length - offset > sizeof buffer ? sizeof buffer : length - offset;
+    if (sqlite3_blob_read(blob, buffer, n, offset) != SQLITE_OK) {
+      WHYF("sqlite3_blob_read() failed, %s", sqlite3_errmsg(rhizome_db));
+      sqlite3_blob_close(blob);
+      return -1;
+    }
+    if (write_bytes(f, path, buffer, n) == -1) {
+      sqlite3_blob_close(blob);
+      return -1;
+    }
+  }
+  sqlite3_blob_close(blob);
+  return 0;
+}
+
+/* Write every bundle in the store, with its payload, to an archive at the given path.
+ */
+int rhizome_archive_export(const char *path)
+{
+  FILE *f = fopen(path, "w");
+  if (f == NULL)
+    return WHYF_perror("fopen(%s, \"w\")", alloca_str_toprint(path));
+  struct rhizome_archive_index index = { NULL, 0, 0 };
+  long long bytes = 0;
+  int ret = -1;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = NULL;
+  sqlite3_stmt *files = NULL;
+  if (write_bytes(f, path, RHIZOME_ARCHIVE_MAGIC, RHIZOME_ARCHIVE_MAGIC_BYTES) == -1)
+    goto end;
+  statement = sqlite_prepare(&retry, "SELECT id, manifest, version, filesize, filehash FROM MANIFESTS ORDER BY rowid;");
+  files = sqlite_prepare(&retry, "SELECT rowid, length FROM FILES WHERE id = ? AND datavalid != 0;");
+  if (!statement || !files)
+    goto end;
+  while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    char id[RHIZOME_MANIFEST_ID_STRLEN + 1];
+    const unsigned char *manifest = sqlite3_column_blob(statement, 1);
+    int manifest_bytes = sqlite3_column_bytes(statement, 1);
+    long long version = sqlite3_column_int64(statement, 2);
+    long long filesize = sqlite3_column_int64(statement, 3);
+    unsigned char bid[RHIZOME_MANIFEST_ID_BYTES];
+    if (!rhizome_column_key(statement, 0, id, sizeof id) || fromhexstr(bid, id, RHIZOME_MANIFEST_ID_BYTES) == -1
+     || !manifest || manifest_bytes > MAX_MANIFEST_BYTES) {
+      WARN("MANIFESTS row is invalid -- skipped");
+      continue;
+    }
+    int64_t rowid = 0;
+    if (filesize > 0) {
+      sqlite3_reset(files);
+      sqlite3_bind_blob(files, 1, sqlite3_column_blob(statement, 4), sqlite3_column_bytes(statement, 4), SQLITE_TRANSIENT);
+      if (sqlite_step_retry(&retry, files) != SQLITE_ROW || sqlite3_column_int64(files, 1) != filesize) {
+	WARNF("Payload of bundle id=%s is not in the store -- skipped", id);
+	continue;
+      }
+      rowid = sqlite3_column_int64(files, 0);
+    }
+    off_t offset = ftello(f);
+    if (offset == -1) {
+      WHYF_perror("ftello(%s)", alloca_str_toprint(path));
+      goto end;
+    }
+    if (rhizome_archive_index_append(&index, bid, version, offset) == -1)
+      goto end;
+    unsigned char header[RHIZOME_ARCHIVE_ENTRY_HEADER_BYTES];
+    rhizome_archive_entry_header(header, bid, version, manifest, manifest_bytes, filesize);
+    if (write_bytes(f, path, header, sizeof header) == -1
+     || write_bytes(f, path, manifest, manifest_bytes) == -1
+     || (filesize > 0 && export_payload(f, path, rowid, filesize) == -1))
+      goto end;
+    bytes += sizeof header + manifest_bytes + filesize;
+    if (debug & DEBUG_RHIZOME)
+      DEBUGF("Archived bundle id=%s version=%lld filesize=%lld at offset %lld", id, version, filesize, (long long) offset);
+  }
+  {
+    off_t offset = ftello(f);
+    if (offset == -1) {
+      WHYF_perror("ftello(%s)", alloca_str_toprint(path));
+      goto end;
+    }
+    int len = rhizome_archive_index_bytes(&index);
+    unsigned char *buf = malloc(len);
+    if (!buf) {
+      WHY("Out of memory");
+      goto end;
+    }
+    rhizome_archive_put_index(&index, buf, offset);
+    int written = write_bytes(f, path, buf, len);
+    free(buf);
+    if (written == -1)
+      goto end;
+  }
+  ret = 0;
+end:
+  if (statement)
+    sqlite3_finalize(statement);
+  if (files)
+    sqlite3_finalize(files);
+  if (fclose(f) == EOF && ret == 0)
+    ret = WHYF_perror("fclose(%s)", alloca_str_toprint(path));
+  if (ret == 0) {
+    INFOF("Exported %d bundles (%lld bytes) to %s", index.count, bytes, path);
+    cli_puts("bundles"); cli_delim(":");
+    cli_printf("%d", index.count); cli_delim("\n");
+    cli_puts("bytes"); cli_delim(":");
+    cli_printf("%lld", bytes); cli_delim("\n");
+  }
+  if (index.records)
+    free(index.records);
+  return ret;
+}
+
+/* The archive reader is fed the archive as it arrives, in pieces of any size, so that it can
+   import from a socket as well as from a file.  The driver may pass over the bytes that
+   rhizome_archive_reader_skippable() reports without reading them.  If a step finds the database
+   busy, the reader stops where it is and keeps whatever is fed to it meanwhile, until the driver
+   calls rhizome_archive_reader_resume() to redo the step and catch up.
+ */
+
+#define RA_MAGIC 0
+#define RA_TYPE 1
+#define RA_HEADER 2
+#define RA_MANIFEST 3
+#define RA_PAYLOAD 4
+#define RA_SKIP 5
+#define RA_INDEX_COUNT 6
+#define RA_INDEX 7
+#define RA_TRAILER 8
+#define RA_DONE 9
+#define RA_FAILED 10
+
+/* The step that found the database busy */
+#define RA_BUSY_ITEM 1
+#define RA_BUSY_PAYLOAD 2
+#define RA_BUSY_ENTRY 3
+
+struct rhizome_archive_reader {
+  char name[256];
+  int state;
+  /* Bytes gathered for the current fixed size item */
+  unsigned char buf[RHIZOME_ARCHIVE_ENTRY_HEADER_BYTES + MAX_MANIFEST_BYTES];
+  int have;
+  int need;
+  /* Offset of the next byte to arrive */
+  off_t position;
+  /* The entry being read */
+  off_t entry_offset;
+  char id[RHIZOME_MANIFEST_ID_STRLEN + 1];
+  long long version;
+  int manifest_bytes;
+  long long payload_bytes;
+  unsigned char manifest_hash[crypto_hash_sha512_BYTES];
+  /* Payload bytes still to be stored or passed over, and the status of an entry being passed over */
+  long long remaining;
+  int skip_status;
+  /* A verified manifest waiting for its payload */
+  rhizome_manifest *m;
+  struct rhizome_write write;
+  int writing;
+  /* Index records for the entries read, and the number checked against the archive's index */
+  struct rhizome_archive_index index;
+  int index_count;
+  int index_checked;
+  unsigned char *statuses;
+  int status_count;
+  int status_size;
+  int counts[3];
+  /* The step waiting for the database, and the bytes that arrived while it waited */
+  int busy;
+  int busy_status;
+  unsigned char *backlog;
+  size_t backlog_len;
+  size_t backlog_size;
+};
+
+struct rhizome_archive_reader *rhizome_archive_reader_new(const char *name)
+{
+  struct rhizome_archive_reader *a = calloc(1, sizeof *a);
+  if (!a) {
+    WHY_perror("calloc");
+    return NULL;
+  }
+  strncpy(a->name, name, sizeof a->name - 1);
+  a->state = RA_MAGIC;
+  a->need = RHIZOME_ARCHIVE_MAGIC_BYTES;
+  return a;
+}
+
+static void reader_expect(struct rhizome_archive_reader *a, int state, int need)
+{
+  a->state = state;
+  a->have = 0;
+  a->need = need;
+}
+
+static int reader_fail(struct rhizome_archive_reader *a)
+{
+  a->state = RA_FAILED;
+  a->busy = 0;
+  return -1;
+}
+
+/* Stop at the given step until the database is free.
+ */
+static int reader_wait(struct rhizome_archive_reader *a, int step)
+{
+  if (debug & DEBUG_RHIZOME)
+    DEBUGF("Database busy, archive %s waiting at offset %lld", alloca_str_toprint(a->name), (long long) a->position);
+  a->busy = step;
+  return RHIZOME_DB_BUSY;
+}
+
+/* Keep bytes that arrive while a step waits for the database.
+ */
+static int reader_backlog(struct rhizome_archive_reader *a, const unsigned char *bytes, size_t len)
+{
+  if (len == 0)
+    return RHIZOME_DB_BUSY;
+  assert(bytes);
+  if (a->backlog_len + len > a->backlog_size) {
+    size_t size = a->backlog_size ? a->backlog_size : RHIZOME_CRYPT_PAGE_SIZE;
+    while (size < a->backlog_len + len)
+      size *= 2;
+    unsigned char *p = realloc(a->backlog, size);
+    if (!p) {
+      WHY_perror("realloc");
+      return reader_fail(a);
+    }
+    a->backlog = p;
+    a->backlog_size = size;
+  }
+  bcopy(bytes, &a->backlog[a->backlog_len], len);
+  a->backlog_len += len;
+  return RHIZOME_DB_BUSY;
+}
+
+static int reader_status(struct rhizome_archive_reader *a, int status)
+{
+  if (a->status_count >= a->status_size) {
+    int size = a->status_size ? a->status_size * 2 : 64;
+    unsigned char *p = realloc(a->statuses, size * RHIZOME_ARCHIVE_STATUS_RECORD_BYTES);
+    if (!p)
+      return WHY("Out of memory");
+    a->statuses = p;
+    a->status_size = size;
+  }
+  unsigned char *record = &a->statuses[a->status_count++ * RHIZOME_ARCHIVE_STATUS_RECORD_BYTES];
+  record[0] = status;
+  bcopy(a->index.records[a->index.count - 1], &record[1], RHIZOME_BAR_PREFIX_BYTES);
+  a->counts[status]++;
+  return 0;
+}
+
+/* The current entry is finished with: store its manifest if it got this far, record its fate,
+   and move on to the next entry.
+ */
+static int reader_entry_done(struct rhizome_archive_reader *a, int status)
+{
+  if (a->m) {
+    rhizome_db_busy = 0;
+    if (status == RHIZOME_ARCHIVE_STATUS_IMPORTED && rhizome_add_manifest(a->m, 1) == -1) {
+      if (rhizome_db_busy) {
+	a->busy_status = status;
+	return reader_wait(a, RA_BUSY_ENTRY);
+      }
+      WHYF("Could not store archived bundle id=%s", a->id);
+      status = RHIZOME_ARCHIVE_STATUS_REJECTED;
+    }
+    rhizome_manifest_free(a->m);
+    a->m = NULL;
+  }
+  reader_expect(a, RA_TYPE, 1);
+  return reader_status(a, status);
+}
+
+/* Pass over the rest of the current entry, then finish it with the given status.
+ */
+static int reader_skip(struct rhizome_archive_reader *a, long long bytes, int status)
+{
+  a->remaining = bytes;
+  if (a->remaining == 0)
+    return reader_entry_done(a, status);
+  reader_expect(a, RA_SKIP, 0);
+  /* Remember how to finish the entry once the bytes have gone by */
+  a->skip_status = status;
+  return 0;
+}
+
+static int reader_header(struct rhizome_archive_reader *a)
+{
+  const unsigned char *p = a->buf;
+  const unsigned char *bid = p; p += RHIZOME_MANIFEST_ID_BYTES;
+  a->version = get_be(p, 8); p += 8;
+  a->manifest_bytes = get_be(p, 4); p += 4;
+  a->payload_bytes = get_be(p, 8); p += 8;
+  bcopy(p, a->manifest_hash, sizeof a->manifest_hash);
+  if (a->manifest_bytes > MAX_MANIFEST_BYTES || a->payload_bytes < 0) {
+    WHYF("Archive %s is corrupt at offset %lld", alloca_str_toprint(a->name), (long long) a->entry_offset);
+    return reader_fail(a);
+  }
+  tohex(a->id, bid, RHIZOME_MANIFEST_ID_BYTES);
+  long long storedversion = -1;
+  rhizome_db_busy = 0;
+  if (sqlite_exec_int64_key(&storedversion, a->id, "SELECT version FROM MANIFESTS WHERE id=?;") == -1)
+    return rhizome_db_busy ? reader_wait(a, RA_BUSY_ITEM) : reader_fail(a);
+  if (rhizome_archive_index_append(&a->index, bid, a->version, a->entry_offset) == -1)
+    return reader_fail(a);
+  if (storedversion >= a->version) {
+    if (debug & DEBUG_RHIZOME)
+      DEBUGF("Already hold bundle id=%s version=%lld (archived version=%lld), skipping", a->id, storedversion, a->version);
+    return reader_skip(a, a->manifest_bytes + a->payload_bytes, RHIZOME_ARCHIVE_STATUS_HELD);
+  }
+  reader_expect(a, RA_MANIFEST, a->manifest_bytes);
+  return 0;
+}
+
+static int reader_manifest(struct rhizome_archive_reader *a)
+{
+  unsigned char hash[crypto_hash_sha512_BYTES];
+  crypto_hash_sha512(hash, a->buf, a->manifest_bytes);
+  unsigned char bid[RHIZOME_MANIFEST_ID_BYTES];
+  fromhexstr(bid, a->id, RHIZOME_MANIFEST_ID_BYTES);
+  rhizome_manifest *m = NULL;
+  int ok = 0;
+  if (memcmp(hash, a->manifest_hash, sizeof hash) != 0)
+    WHYF("Archived manifest id=%s does not match its hash", a->id);
+  else if ((m = rhizome_new_manifest()) == NULL)
+    WHY("Out of manifests");
+  else if (rhizome_read_manifest_file(m, (const char *) a->buf, a->manifest_bytes) == -1)
+    WHYF("Archived manifest id=%s is invalid", a->id);
+  else if (rhizome_manifest_verify(m))
+    WHYF("Verification of archived manifest id=%s failed", a->id);
+  else if (memcmp(m->cryptoSignPublic, bid, RHIZOME_MANIFEST_ID_BYTES) != 0
+	|| rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_VERSION) != a->version
+	|| rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_FILESIZE) != a->payload_bytes)
+    WHYF("Archived manifest id=%s does not match its entry", a->id);
+  else
+    ok = 1;
+  const char *filehash = ok && a->payload_bytes > 0 ? rhizome_manifest_get_field(m, RHIZOME_FIELD_FILEHASH) : NULL;
+  if (ok && a->payload_bytes > 0 && (!filehash || strlen(filehash) != RHIZOME_FILEHASH_STRLEN)) {
+    WHYF("Archived manifest id=%s has invalid filehash", a->id);
+    ok = 0;
+  }
+  if (!ok) {
+    if (m)
+      rhizome_manifest_free(m);
+    return reader_skip(a, a->payload_bytes, RHIZOME_ARCHIVE_STATUS_REJECTED);
+  }
+  /* Make sure we store signatures */
+  m->manifest_bytes = m->manifest_all_bytes;
+  m->fileLength = a->payload_bytes;
+  a->m = m;
+  if (a->payload_bytes == 0)
+    return reader_entry_done(a, RHIZOME_ARCHIVE_STATUS_IMPORTED);
+  memcpy(m->fileHexHash, filehash, RHIZOME_FILEHASH_STRLEN + 1);
+  str_toupper_inplace(m->fileHexHash);
+  m->fileHashedP = 1;
+  long long gotfile = 0;
+  rhizome_db_busy = 0;
+  if (sqlite_exec_int64_key(&gotfile, m->fileHexHash, "SELECT COUNT(*) FROM FILES WHERE id=? AND datavalid<>0;") == -1)
+    goto failed;
+  if (gotfile)
+    return reader_skip(a, a->payload_bytes, RHIZOME_ARCHIVE_STATUS_IMPORTED);
+  if (rhizome_open_write(&a->write, m->fileHexHash, a->payload_bytes, RHIZOME_PRIORITY_DEFAULT) == -1)
+    goto failed;
+  a->writing = 1;
+  a->remaining = a->payload_bytes;
+  reader_expect(a, RA_PAYLOAD, 0);
+  return 0;
+failed:
+  if (!rhizome_db_busy)
+    return reader_skip(a, a->payload_bytes, RHIZOME_ARCHIVE_STATUS_REJECTED);
+  /* The manifest is read again from a->buf when the database is free */
+  rhizome_manifest_free(m);
+  a->m = NULL;
+  return reader_wait(a, RA_BUSY_ITEM);
+}
+
+/* All of the payload has gone into the database, so check it and store the manifest.
+ */
+static int reader_payload_done(struct rhizome_archive_reader *a)
+{
+  int ok = 0;
+  if (a->writing) {
+    rhizome_db_busy = 0;
+    if (rhizome_finish_write(&a->write) == 0)
+      ok = 1;
+    else if (rhizome_db_busy)
+      return reader_wait(a, RA_BUSY_PAYLOAD);
+    a->writing = 0;
+  }
+  return reader_entry_done(a, ok ? RHIZOME_ARCHIVE_STATUS_IMPORTED : RHIZOME_ARCHIVE_STATUS_REJECTED);
+}
+
+static int reader_index_record(struct rhizome_archive_reader *a)
+{
+  /* The index must agree with the entries we have read, which is what tells a complete archive
+     from one that was truncated between entries. */
+  if (memcmp(a->buf, a->index.records[a->index_checked], RHIZOME_ARCHIVE_INDEX_RECORD_BYTES) != 0) {
+    WHYF("Index of archive %s does not match its contents", alloca_str_toprint(a->name));
+    return reader_fail(a);
+  }
+  if (++a->index_checked < a->index_count)
+    reader_expect(a, RA_INDEX, RHIZOME_ARCHIVE_INDEX_RECORD_BYTES);
+  else
+    reader_expect(a, RA_TRAILER, 8 + RHIZOME_ARCHIVE_MAGIC_BYTES);
+  return 0;
+}
+
+/* A fixed size item has been gathered into a->buf.
+ */
+static int reader_item(struct rhizome_archive_reader *a)
+{
+  switch (a->state) {
+  case RA_MAGIC:
+    if (memcmp(a->buf, RHIZOME_ARCHIVE_MAGIC, RHIZOME_ARCHIVE_MAGIC_BYTES) != 0) {
+      WHYF("%s is not a Rhizome archive", alloca_str_toprint(a->name));
+      return reader_fail(a);
+    }
+    reader_expect(a, RA_TYPE, 1);
+    return 0;
+  case RA_TYPE:
+    a->entry_offset = a->position - 1;
+    if (a->buf[0] == RHIZOME_ARCHIVE_ENTRY_BUNDLE) {
+      reader_expect(a, RA_HEADER, RHIZOME_ARCHIVE_ENTRY_HEADER_BYTES - 1);
+      return 0;
+    }
+    if (a->buf[0] == RHIZOME_ARCHIVE_ENTRY_INDEX) {
+      reader_expect(a, RA_INDEX_COUNT, 4);
+      return 0;
+    }
+    WHYF("Archive %s is corrupt at offset %lld", alloca_str_toprint(a->name), (long long) a->entry_offset);
+    return reader_fail(a);
+  case RA_HEADER:
+    return reader_header(a);
+  case RA_MANIFEST:
+    return reader_manifest(a);
+  case RA_INDEX_COUNT:
+    a->index_count = get_be(a->buf, 4);
+    if (a->index_count != a->index.count) {
+      WHYF("Index of archive %s does not match its contents", alloca_str_toprint(a->name));
+      return reader_fail(a);
+    }
+    if (a->index_count)
+      reader_expect(a, RA_INDEX, RHIZOME_ARCHIVE_INDEX_RECORD_BYTES);
+    else
+      reader_expect(a, RA_TRAILER, 8 + RHIZOME_ARCHIVE_MAGIC_BYTES);
+    return 0;
+  case RA_INDEX:
+    return reader_index_record(a);
+  case RA_TRAILER:
+    if (get_be(a->buf, 8) != (unsigned long long) a->entry_offset
+     || memcmp(&a->buf[8], RHIZOME_ARCHIVE_MAGIC, RHIZOME_ARCHIVE_MAGIC_BYTES) != 0) {
+      WHYF("Archive %s has an invalid trailer", alloca_str_toprint(a->name));
+      return reader_fail(a);
+    }
+    reader_expect(a, RA_DONE, 0);
+    return 0;
+  }
+  return reader_fail(a);
+}
+
+static int reader_items(struct rhizome_archive_reader *a)
+{
+  int ret = reader_item(a);
+  /* A zero length manifest cannot be valid, but must still be consumed */
+  while (ret == 0 && a->state == RA_MANIFEST && a->need == 0)
+    ret = reader_item(a);
+  return ret;
+}
+
+/* Feed the next len bytes of the archive to the reader.  If bytes is NULL, the driver has passed
+   over them without reading them, which it may only do for bytes reported by
+   rhizome_archive_reader_skippable().  Returns -1 once the archive has proved to be invalid, and
+   RHIZOME_DB_BUSY while a step is waiting for the database.
+ */
+int rhizome_archive_reader_feed(struct rhizome_archive_reader *a, const unsigned char *bytes, size_t len)
+{
+  if (a->busy)
+    return reader_backlog(a, bytes, len);
+  while (len > 0) {
+    size_t n;
+    int ret;
+    switch (a->state) {
+    case RA_FAILED:
+      return -1;
+    case RA_DONE:
+      WHYF("Unexpected bytes after end of archive %s", alloca_str_toprint(a->name));
+      return reader_fail(a);
+    case RA_SKIP:
+    case RA_PAYLOAD:
+      n = len < a->remaining ? len : a->remaining;
+      if (a->state == RA_PAYLOAD) {
+	assert(bytes);
+	if (a->writing && rhizome_write_buffer(&a->write, bytes, n) == -1) {
+	  rhizome_fail_write(&a->write);
+	  a->writing = 0;
+	}
+      } else
+	assert(bytes || n == len);
+      a->remaining -= n;
+      a->position += n;
+      len -= n;
+      if (bytes)
+	bytes += n;
+      if (a->remaining == 0) {
+	ret = a->state == RA_SKIP ? reader_entry_done(a, a->skip_status) : reader_payload_done(a);
+	if (ret == RHIZOME_DB_BUSY)
+	  return reader_backlog(a, bytes, len);
+	if (ret == -1)
+	  return reader_fail(a);
+      }
+      break;
+    default:
+      assert(bytes);
+      n = a->need - a->have;
+      if (n > len)
+	n = len;
+      bcopy(bytes, &a->buf[a->have], n);
+      a->have += n;
+      a->position += n;
+      bytes += n;
+      len -= n;
+      if (a->have == a->need) {
+	ret = reader_items(a);
+	if (ret == RHIZOME_DB_BUSY)
+	  return reader_backlog(a, bytes, len);
+	if (ret == -1)
+	  return reader_fail(a);
+      }
+      break;
+    }
+  }
+  return a->state == RA_FAILED ? -1 : 0;
+}
+
+/* The number of bytes that the driver may pass over without reading them.
+ */
+long long rhizome_archive_reader_skippable(const struct rhizome_archive_reader *a)
+{
+  return a->state == RA_SKIP && !a->busy ? a->remaining : 0;
+}
+
+/* True while a step is waiting for the database.
+ */
+int rhizome_archive_reader_busy(const struct rhizome_archive_reader *a)
+{
+  return a->busy != 0;
+}
+
+/* Redo the step that found the database busy, then feed the reader the bytes that arrived since.
+   Returns as rhizome_archive_reader_feed().
+ */
+int rhizome_archive_reader_resume(struct rhizome_archive_reader *a)
+{
+  if (a->state == RA_FAILED)
+    return -1;
+  int busy = a->busy;
+  a->busy = 0;
+  int ret = 0;
+  switch (busy) {
+  case RA_BUSY_ITEM:
+    ret = reader_items(a);
+    break;
+  case RA_BUSY_PAYLOAD:
+    ret = reader_payload_done(a);
+    break;
+  case RA_BUSY_ENTRY:
+    ret = reader_entry_done(a, a->busy_status);
+    break;
+  }
+  if (ret == RHIZOME_DB_BUSY)
+    return ret;
+  if (ret == -1)
+    return reader_fail(a);
+  unsigned char *backlog = a->backlog;
+  size_t len = a->backlog_len;
+  a->backlog = NULL;
+  a->backlog_len = a->backlog_size = 0;
+  if (len)
+    ret = rhizome_archive_reader_feed(a, backlog, len);
+  if (backlog)
+    free(backlog);
+  return ret;
+}
+
+/* The database stayed busy for too long, so give up on the rest of the archive.  The entries
+   already read keep their status.
+ */
+void rhizome_archive_reader_abort(struct rhizome_archive_reader *a)
+{
+  if (a->state == RA_FAILED)
+    return;
+  WARNF("Database busy, abandoning archive %s at offset %lld", alloca_str_toprint(a->name), (long long) a->entry_offset);
+  reader_fail(a);
+}
+
+/* The archive has ended, completely or not.  Hands over the status records of the entries
+   read (see rhizome_archive_import_stream()), frees the reader, and returns 0 if the archive
+   was complete and valid.
+ */
+int rhizome_archive_reader_end(struct rhizome_archive_reader *a, unsigned char **statuses, int *status_count)
+{
+  int ret = 0;
+  if (a->state != RA_DONE) {
+    if (a->state != RA_FAILED)
+      WHYF("Archive %s is truncated", alloca_str_toprint(a->name));
+    ret = -1;
+  }
+  if (a->writing)
+    rhizome_fail_write(&a->write);
+  if (a->m)
+    rhizome_manifest_free(a->m);
+  INFOF("Archive %s: %d bundles imported, %d already held, %d rejected", a->name,
+      a->counts[RHIZOME_ARCHIVE_STATUS_IMPORTED], a->counts[RHIZOME_ARCHIVE_STATUS_HELD], a->counts[RHIZOME_ARCHIVE_STATUS_REJECTED]);
+  if (statuses) {
+    *statuses = a->statuses;
+    *status_count = a->status_count;
+  } else if (a->statuses)
+    free(a->statuses);
+  if (a->index.records)
+    free(a->index.records);
+  if (a->backlog)
+    free(a->backlog);
+  free(a);
+  return ret;
+}
+
+/* Import all the bundles in an archive being read from the given stream that are newer than
+   those we hold.  If statuses is given, it is set to a malloc()ed list of
+   RHIZOME_ARCHIVE_STATUS_RECORD_BYTES records, one per entry read, each of which is the
+   entry's RHIZOME_ARCHIVE_STATUS_* byte followed by the BID prefix, and *status_count to the
+   number of records.  These are returned even if the archive turns out to be truncated or
+   corrupt, as the entries before that point have been imported.
+ */
+int rhizome_archive_import_stream(FILE *f, const char *name, unsigned char **statuses, int *status_count)
+{
+  int seekable = fseeko(f, 0, SEEK_CUR) != -1;
+  struct rhizome_archive_reader *a = rhizome_archive_reader_new(name);
+  if (!a)
+    return -1;
+  /* Read a page at a time, so that at most that much of an entry we do not need is read
+     before we know to seek past it */
+  unsigned char buffer[RHIZOME_CRYPT_PAGE_SIZE];
+  while (1) {
+    long long skip = rhizome_archive_reader_skippable(a);
+    if (seekable && skip > 0) {
+      if (fseeko(f, skip, SEEK_CUR) == -1) {
+	WHYF_perror("fseeko(%s)", alloca_str_toprint(name));
+	break;
+      }
+      /* Passing over an entry finishes it, which may need the database */
+      if (rhizome_archive_reader_feed(a, NULL, skip) == RHIZOME_DB_BUSY) {
+	rhizome_archive_reader_abort(a);
+	break;
+      }
+      continue;
+    }
+    size_t n = fread(buffer, 1, sizeof buffer, f);
+    if (n == 0) {
+      if (ferror(f))
+	WHYF_perror("fread(%s)", alloca_str_toprint(name));
+      break;
+    }
+    int ret = rhizome_archive_reader_feed(a, buffer, n);
+    if (ret == RHIZOME_DB_BUSY)
+      rhizome_archive_reader_abort(a);
+    if (ret != 0)
+      break;
+  }
+  return rhizome_archive_reader_end(a, statuses, status_count);
+}
+
+/* Import all the bundles in the archive at the given path that are newer than those we hold.
+   A path of "-" reads the archive from standard input.
+ */
+int rhizome_archive_import(const char *path)
+{
+  FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (f == NULL)
+    return WHYF_perror("fopen(%s, \"r\")", alloca_str_toprint(path));
+  unsigned char *statuses = NULL;
+  int count = 0;
+  int ret = rhizome_archive_import_stream(f, path, &statuses, &count);
+  if (f != stdin)
+    fclose(f);
+  if (ret == 0) {
+    int tally[3] = { 0, 0, 0 };
+    int i;
+    for (i = 0; i < count; ++i)
+      tally[statuses[i * RHIZOME_ARCHIVE_STATUS_RECORD_BYTES]]++;
+    cli_puts("imported"); cli_delim(":");
+    cli_printf("%d", tally[RHIZOME_ARCHIVE_STATUS_IMPORTED]); cli_delim("\n");
+    cli_puts("skipped"); cli_delim(":");
+    cli_printf("%d", tally[RHIZOME_ARCHIVE_STATUS_HELD]); cli_delim("\n");
+    cli_puts("rejected"); cli_delim(":");
+    cli_printf("%d", tally[RHIZOME_ARCHIVE_STATUS_REJECTED]); cli_delim("\n");
+  }
+  if (statuses)
+    free(statuses);
+  return ret;
+}
@@ -18,6 +18,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <stdlib.h>
+#include <ctype.h>
 #include "serval.h"
 #include "rhizome.h"
 #include "str.h"
@@ -50,7 +51,7 @@ int rhizome_manifest_verify(rhizome_manifest *m)
   /* Make sure that id variable is correct */
   {
     unsigned char manifest_id[RHIZOME_MANIFEST_ID_BYTES];
-    char *id = rhizome_manifest_get(m,"id",NULL,0);
+    char *id = rhizome_manifest_get_field(m, RHIZOME_FIELD_ID);
     if (!id) {
       WARN("Manifest lacks 'id' field");
       m->errors++;
@@ -83,6 +84,96 @@ int rhizome_manifest_verify(rhizome_manifest *m)
   else return 0;
 }
 
+static const char *rhizome_field_names[RHIZOME_FIELD_COUNT] = {
+  NULL, "id", "version", "filesize", "filehash", "service", "BK", "date", "name", "sender", "recipient", "crypt"
+};
+
+/* Map a manifest variable name to its RHIZOME_FIELD_* code.  The first letter (and for the two
+   pairs that share one, a single later letter) picks the only candidate, so at most one string
+   comparison is done per lookup.
+ */
+static int rhizome_field_code(const char *var, int (*cmp)(const char *, const char *))
+{
+  int field = RHIZOME_FIELD_OTHER;
+  switch (tolower((unsigned char) var[0])) {
+    case 'i': field = RHIZOME_FIELD_ID; break;
+    case 'v': field = RHIZOME_FIELD_VERSION; break;
+    case 'f':
+      if (var[1] && var[2] && var[3])
+	field = tolower((unsigned char) var[4]) == 's' ? RHIZOME_FIELD_FILESIZE : RHIZOME_FIELD_FILEHASH;
+      break;
+    case 's':
+      if (var[1])
+	field = tolower((unsigned char) var[2]) == 'r' ? RHIZOME_FIELD_SERVICE : RHIZOME_FIELD_SENDER;
+      break;
+    case 'b': field = RHIZOME_FIELD_BK; break;
+    case 'd': field = RHIZOME_FIELD_DATE; break;
+    case 'n': field = RHIZOME_FIELD_NAME; break;
+    case 'r': field = RHIZOME_FIELD_RECIPIENT; break;
+    case 'c': field = RHIZOME_FIELD_CRYPT; break;
+  }
+  if (field != RHIZOME_FIELD_OTHER && cmp(var, rhizome_field_names[field]) != 0)
+    field = RHIZOME_FIELD_OTHER;
+  return field;
+}
+
+int rhizome_manifest_field_code(const char *var)
+{
+  return rhizome_field_code(var, strcmp);
+}
+
+static long long rhizome_field_value_ll(const char *vp)
+{
+  char *ep = (char *) vp;
+  long long val = strtoll(vp, &ep, 10);
+  return (ep != vp && *ep == '\0') ? val : -1;
+}
+
+/* Record the field code of variable i, and if it is a well-known field, remember where it lives
+   and decode its numeric value.
+ */
+static void rhizome_manifest_intern(rhizome_manifest *m, int i)
+{
+  int field = rhizome_manifest_field_code(m->vars[i]);
+  m->var_field[i] = field;
+  if (field != RHIZOME_FIELD_OTHER) {
+    m->field_slot[field] = i + 1;
+    m->field_ll[field] = rhizome_field_value_ll(m->values[i]);
+  }
+}
+
+/* Return the index of the named variable, or -1 if it is not present.
+ */
+static int rhizome_manifest_var_index(const rhizome_manifest *m, const char *var)
+{
+  int field = rhizome_manifest_field_code(var);
+  if (field != RHIZOME_FIELD_OTHER)
+    return m->field_slot[field] - 1;
+  int i;
+  for (i = 0; i < m->var_count; ++i)
+    if (m->var_field[i] == RHIZOME_FIELD_OTHER && strcmp(m->vars[i], var) == 0)
+      return i;
+  return -1;
+}
+
+/* Make room in a manifest's buffer for the given number of bytes, keeping what is there.  The
+   rest of the buffer is zeroed, so that the text is always null terminated.
+ */
+static int rhizome_manifest_reserve(rhizome_manifest *m, int bytes)
+{
+  if (bytes > MAX_MANIFEST_BYTES)
+    return WHYF("Manifest of %d bytes is too long", bytes);
+  if (bytes < m->manifestdata_size)
+    return 0;
+  unsigned char *p = realloc(m->manifestdata, bytes + 1);
+  if (!p)
+    return WHYF_perror("realloc(%d)", bytes + 1);
+  bzero(&p[m->manifestdata_size], bytes + 1 - m->manifestdata_size);
+  m->manifestdata = p;
+  m->manifestdata_size = bytes + 1;
+  return 0;
+}
+
 int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bufferP)
 {
   IN();
@@ -90,21 +181,30 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
   if (!m) RETURN(WHY("Null manifest"));
 
   if (bufferP) {
+    if (rhizome_manifest_reserve(m, bufferP) == -1)
+      RETURN(-1);
     m->manifest_bytes=bufferP;
     memcpy(m->manifestdata, filename, m->manifest_bytes);
   } else {
     FILE *f = fopen(filename, "r");
     if (f == NULL)
       RETURN(WHYF("Could not open manifest file %s for reading.", filename)); 
-    m->manifest_bytes = fread(m->manifestdata, 1, MAX_MANIFEST_BYTES, f);
+    unsigned char buffer[MAX_MANIFEST_BYTES];
+    size_t bytes = fread(buffer, 1, sizeof buffer, f);
     int ret = 0;
-    if (m->manifest_bytes == -1)
+    if (ferror(f))
       ret = WHY_perror("fread");
     if (fclose(f) == EOF)
       ret = WHY_perror("fclose");
+    if (ret == 0)
+      ret = rhizome_manifest_reserve(m, bytes);
     if (ret == -1)
       RETURN(-1);
+    m->manifest_bytes = bytes;
+    memcpy(m->manifestdata, buffer, bytes);
   }
+  /* Anything left over from a longer manifest read into this record before must go */
+  bzero(&m->manifestdata[m->manifest_bytes], m->manifestdata_size - m->manifest_bytes);
 
   m->manifest_all_bytes=m->manifest_bytes;
 
@@ -156,7 +256,9 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
       } else {
 	m->vars[m->var_count] = strdup(var);
 	m->values[m->var_count] = strdup(value);
-	if (strcasecmp(var, "id") == 0) {
+	char *ep;
+	switch (rhizome_field_code(var, strcasecmp)) {
+	case RHIZOME_FIELD_ID:
 	  have_id = 1;
 	  if (fromhexstr(m->cryptoSignPublic, value, RHIZOME_MANIFEST_ID_BYTES) == -1) {
 	    WARNF("Invalid manifest id: %s", value);
@@ -165,7 +267,8 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	    /* Force to upper case to avoid case sensitive comparison problems later. */
 	    str_toupper_inplace(m->values[m->var_count]);
 	  }
-	} else if (strcasecmp(var, "filehash") == 0) {
+	  break;
+	case RHIZOME_FIELD_FILEHASH:
 	  have_filehash = 1;
 	  if (!rhizome_str_is_file_hash(value)) {
 	    WARNF("Invalid filehash: %s", value);
@@ -176,7 +279,8 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	    strcpy(m->fileHexHash, m->values[m->var_count]);
 	    m->fileHashedP = 1;
 	  }
-	} else if (strcasecmp(var, "BK") == 0) {
+	  break;
+	case RHIZOME_FIELD_BK:
 	  if (!rhizome_str_is_bundle_key(value)) {
 	    WARNF("Invalid BK: %s", value);
 	    m->errors++;
@@ -184,9 +288,10 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	    /* Force to upper case to avoid case sensitive comparison problems later. */
 	    str_toupper_inplace(m->values[m->var_count]);
 	  }
-	} else if (strcasecmp(var, "filesize") == 0) {
+	  break;
+	case RHIZOME_FIELD_FILESIZE:
 	  have_filesize = 1;
-	  char *ep = value;
+	  ep = value;
 	  long long filesize = strtoll(value, &ep, 10);
 	  if (ep == value || *ep || filesize < 0) {
 	    WARNF("Invalid filesize: %s", value);
@@ -194,7 +299,8 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	  } else {
 	    m->fileLength = filesize;
 	  }
-	} else if (strcasecmp(var, "service") == 0) {
+	  break;
+	case RHIZOME_FIELD_SERVICE:
 	  have_service = 1;
 	  if ( strcasecmp(value, RHIZOME_SERVICE_FILE) == 0
 	    || strcasecmp(value, RHIZOME_SERVICE_MESHMS) == 0) {
@@ -202,9 +308,10 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	    INFOF("Unsupported service: %s", value);
 	    // This is not an error... older rhizome nodes must carry newer manifests.
 	  }
-	} else if (strcasecmp(var, "version") == 0) {
+	  break;
+	case RHIZOME_FIELD_VERSION:
 	  have_version = 1;
-	  char *ep = value;
+	  ep = value;
 	  long long version = strtoll(value, &ep, 10);
 	  if (ep == value || *ep || version < 0) {
 	    WARNF("Invalid version: %s", value);
@@ -212,16 +319,19 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	  } else {
 	    m->version = version;
 	  }
-	} else if (strcasecmp(var, "date") == 0) {
+	  break;
+	case RHIZOME_FIELD_DATE:
 	  have_date = 1;
-	  char *ep = value;
+	  ep = value;
 	  long long date = strtoll(value, &ep, 10);
 	  if (ep == value || *ep || date < 0) {
 	    WARNF("Invalid date: %s", value);
 	    m->errors++;
 	  }
 	  // TODO: store date in manifest struct
-	} else if (strcasecmp(var, "sender") == 0 || strcasecmp(var, "recipient") == 0) {
+	  break;
+	case RHIZOME_FIELD_SENDER:
+	case RHIZOME_FIELD_RECIPIENT:
 	  if (!str_is_subscriber_id(value)) {
 	    WARNF("Invalid %s: %s", var, value);
 	    m->errors++;
@@ -229,23 +339,28 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	    /* Force to upper case to avoid case sensitive comparison problems later. */
 	    str_toupper_inplace(m->values[m->var_count]);
 	  }
-	} else if (strcasecmp(var, "name") == 0) {
+	  break;
+	case RHIZOME_FIELD_NAME:
 	  if (value[0] == '\0') {
 	    WARNF("Empty name", value);
 	    m->errors++;
 	  }
 	  // TODO: complain if service is not MeshMS
-	} else if (strcasecmp(var, "crypt") == 0) {
+	  break;
+	case RHIZOME_FIELD_CRYPT:
 	  if (!(strcmp(value, "0") == 0 || strcmp(value, "1") == 0)) {
 	    WARNF("Invalid crypt: %s", value);
 	    m->errors++;
 	  } else {
 	    m->payloadEncryption = atoi(value);
 	  }
-	} else {
+	  break;
+	default:
 	  INFOF("Unsupported field: %s=%s", var, value);
 	  // This is not an error... older rhizome nodes must carry newer manifests.
+	  break;
 	}
+	rhizome_manifest_intern(m, m->var_count);
 	m->var_count++;
       }
     }
@@ -335,84 +450,95 @@ char *rhizome_manifest_get(const rhizome_manifest *m, const char *var, char *out
 
   if (!m) return NULL;
 
-  for(i=0;i<m->var_count;i++)
-    if (!strcmp(m->vars[i],var)) {
-      if (out) {
-	for(j=0;(j<maxlen);j++) {
-	  out[j]=m->values[i][j];
-	  if (!out[j]) break;
-	}
-      }
-      return m->values[i];
+  i = rhizome_manifest_var_index(m, var);
+  if (i == -1)
+    return NULL;
+  if (out) {
+    for(j=0;(j<maxlen);j++) {
+      out[j]=m->values[i][j];
+      if (!out[j]) break;
     }
-  return NULL;
+  }
+  return m->values[i];
 }
 
 long long rhizome_manifest_get_ll(rhizome_manifest *m, const char *var)
 {
   if (!m)
     return -1;
-  int i;
-  for (i = 0; i < m->var_count; ++i)
-    if (!strcmp(m->vars[i], var)) {
-      char *vp = m->values[i];
-      char *ep = vp;
-      long long val = strtoll(vp, &ep, 10);
-      return (ep != vp && *ep == '\0') ? val : -1;
-    }
-  return -1;
+  int field = rhizome_manifest_field_code(var);
+  if (field != RHIZOME_FIELD_OTHER)
+    return rhizome_manifest_get_field_ll(m, field);
+  int i = rhizome_manifest_var_index(m, var);
+  return i == -1 ? -1 : rhizome_field_value_ll(m->values[i]);
 }
 
-double rhizome_manifest_get_double(rhizome_manifest *m,char *var,double default_value)
+/* Return the value of a well-known field, or NULL if the manifest does not have it.
+ */
+char *rhizome_manifest_get_field(const rhizome_manifest *m, int field)
 {
-  int i;
+  if (!m || m->field_slot[field] == 0)
+    return NULL;
+  return m->values[m->field_slot[field] - 1];
+}
 
+/* Return the decimal value of a well-known field, or -1 if it is absent or not a number.
+ */
+long long rhizome_manifest_get_field_ll(const rhizome_manifest *m, int field)
+{
+  if (!m || m->field_slot[field] == 0)
+    return -1;
+  return m->field_ll[field];
+}
+
+double rhizome_manifest_get_double(rhizome_manifest *m,char *var,double default_value)
+{
   if (!m) return default_value;
 
-  for(i=0;i<m->var_count;i++)
-    if (!strcmp(m->vars[i],var))
-      return strtod(m->values[i],NULL);
-  return default_value;
+  int i = rhizome_manifest_var_index(m, var);
+  return i == -1 ? default_value : strtod(m->values[i],NULL);
 }
 
 /* @author Andrew Bettison <andrew@servalproject.com>
  */
 int rhizome_manifest_del(rhizome_manifest *m, const char *var)
 {
-  int ret = 0;
-  int i;
-  for (i = 0; i < m->var_count; ++i)
-    if (strcmp(m->vars[i], var) == 0) {
-      free(m->vars[i]); 
-      free(m->values[i]); 
-      --m->var_count;
-      m->finalised = 0;
-      ret = 1;
-      break;
-    }
+  int i = rhizome_manifest_var_index(m, var);
+  if (i == -1)
+    return 0;
+  free(m->vars[i]);
+  free(m->values[i]);
+  --m->var_count;
+  m->finalised = 0;
   for (; i < m->var_count; ++i) {
     m->vars[i] = m->vars[i + 1];
     m->values[i] = m->values[i + 1];
+    m->var_field[i] = m->var_field[i + 1];
   }
-  return ret;
+  bzero(m->field_slot, sizeof m->field_slot);
+  for (i = 0; i < m->var_count; ++i)
+    if (m->var_field[i] != RHIZOME_FIELD_OTHER)
+      m->field_slot[m->var_field[i]] = i + 1;
+  return 1;
 }
 
 int rhizome_manifest_set(rhizome_manifest *m, const char *var, const char *value)
 {
   if (!m)
     return WHY("m == NULL");
-  int i;
-  for(i=0;i<m->var_count;i++)
-    if (!strcmp(m->vars[i],var)) {
-      free(m->values[i]); 
-      m->values[i]=strdup(value);
-      m->finalised=0;
-      return 0;
-    }
+  int i = rhizome_manifest_var_index(m, var);
+  if (i != -1) {
+    free(m->values[i]); 
+    m->values[i]=strdup(value);
+    rhizome_manifest_intern(m, i);
+    m->finalised=0;
+    return 0;
+  }
   if (m->var_count >= MAX_MANIFEST_VARS)
     return WHY("no more manifest vars");
   m->vars[m->var_count]=strdup(var);
   m->values[m->var_count]=strdup(value);
+  rhizome_manifest_intern(m, m->var_count);
   m->var_count++;
   m->finalised=0;
   return 0;
@@ -427,64 +553,127 @@ int rhizome_manifest_set_ll(rhizome_manifest *m,char *var,long long value)
   return rhizome_manifest_set(m,var,svalue);
 }
 
-rhizome_manifest manifests[MAX_RHIZOME_MANIFESTS];
-char manifest_free[MAX_RHIZOME_MANIFESTS];
-int manifest_first_free=-1;
-struct __sourceloc manifest_alloc_where[MAX_RHIZOME_MANIFESTS];
-struct __sourceloc manifest_free_where[MAX_RHIZOME_MANIFESTS];
+/* Manifest records are allocated in slabs of RHIZOME_MANIFEST_SLAB_RECORDS, on demand, up to the
+   limit given by the "rhizome.manifest.max_records" config option.  Slabs are never released, so
+   a record's address is stable for its whole life, and the pool settles at the size needed to
+   absorb the largest burst seen so far.  Each record keeps the source location of its last
+   allocation and release, so that leaks and double frees can still be traced to their origin.
+ */
+struct manifest_slot {
+  rhizome_manifest *m;
+  char free;
+  struct __sourceloc alloc_where;
+  struct __sourceloc free_where;
+};
+
+static struct manifest_slot *manifest_slots = NULL;
+static int manifest_slot_count = 0;
+static int manifest_slot_limit = 0;
+static int manifest_first_free = 0;
+
+static struct rhizome_manifest_stats manifest_stats;
 
 static void _log_manifest_trace(struct __sourceloc where, const char *operation)
 {
-  int count_free = 0;
-  int i;
-  for (i = 0; i != MAX_RHIZOME_MANIFESTS; ++i)
-    if (manifest_free[i])
-      ++count_free;
-  logMessage(LOG_LEVEL_DEBUG, where, "%s(): count_free = %d", operation, count_free);
+  logMessage(LOG_LEVEL_DEBUG, where, "%s(): in_use = %d, allocated = %d, high_water = %d, limit = %d",
+      operation,
+      manifest_stats.in_use,
+      manifest_slot_count,
+      manifest_stats.high_water,
+      manifest_slot_limit
+    );
 }
 
-rhizome_manifest *_rhizome_new_manifest(struct __sourceloc where)
+void rhizome_manifest_get_stats(struct rhizome_manifest_stats *stats)
 {
-  if (manifest_first_free<0) {
-    /* Setup structures */
-    int i;
-    for(i=0;i<MAX_RHIZOME_MANIFESTS;i++) {
-      manifest_alloc_where[i]=__NOWHERE__;
-      manifest_free_where[i]=__NOWHERE__;
-      manifest_free[i]=1;
-    }
-    manifest_first_free=0;
+  *stats = manifest_stats;
+  stats->allocated = manifest_slot_count;
+  stats->limit = manifest_slot_limit;
+}
+
+void rhizome_manifest_show_stats()
+{
+  if (manifest_slot_count == 0)
+    return;
+  INFOF("Manifest records: %d in use, %d high water, %d allocated in %d slabs, limit %d, %d failures",
+      manifest_stats.in_use, manifest_stats.high_water, manifest_slot_count, manifest_stats.slabs,
+      manifest_slot_limit, manifest_stats.failures);
+}
+
+/* Add another slab of free records to the pool.  Returns -1 if the configured limit has been
+   reached or memory is exhausted.
+ */
+static int manifest_pool_grow()
+{
+  if (manifest_slot_limit == 0)
+    manifest_slot_limit = (int) confValueGetInt64Range("rhizome.manifest.max_records",
+	RHIZOME_MANIFEST_DEFAULT_MAX_RECORDS, MAX_RHIZOME_MANIFESTS, RHIZOME_MANIFEST_MAX_RECORDS_LIMIT);
+  int count = manifest_slot_count ? RHIZOME_MANIFEST_SLAB_RECORDS : MAX_RHIZOME_MANIFESTS;
+  if (manifest_slot_count + count > manifest_slot_limit)
+    count = manifest_slot_limit - manifest_slot_count;
+  if (count <= 0)
+    return -1;
+  rhizome_manifest *slab = malloc(count * sizeof(rhizome_manifest));
+  if (slab == NULL)
+    return WHYF_perror("malloc(%d * %d)", count, (int)sizeof(rhizome_manifest));
+  struct manifest_slot *slots = realloc(manifest_slots, (manifest_slot_count + count) * sizeof *manifest_slots);
+  if (slots == NULL) {
+    free(slab);
+    return WHYF_perror("realloc(%d)", (int)((manifest_slot_count + count) * sizeof *manifest_slots));
+  }
+  manifest_slots = slots;
+  int i;
+  for (i = 0; i != count; ++i) {
+    struct manifest_slot *slot = &manifest_slots[manifest_slot_count + i];
+    slot->m = &slab[i];
+    slot->free = 1;
+    slot->alloc_where = __NOWHERE__;
+    slot->free_where = __NOWHERE__;
   }
+  manifest_first_free = manifest_slot_count;
+  manifest_slot_count += count;
+  ++manifest_stats.slabs;
+  return 0;
+}
 
+rhizome_manifest *_rhizome_new_manifest(struct __sourceloc where)
+{
   /* No free manifests */
-  if (manifest_first_free>=MAX_RHIZOME_MANIFESTS)
+  if (manifest_first_free >= manifest_slot_count && manifest_pool_grow() == -1)
     {
       int i;
-      logMessage(LOG_LEVEL_ERROR, where, "%s(): no free manifest records, this probably indicates a memory leak", __FUNCTION__);
+      ++manifest_stats.failures;
+      logMessage(LOG_LEVEL_ERROR, where, "%s(): no free manifest records (%d in use, limit %d), this probably indicates a memory leak",
+	  __FUNCTION__, manifest_stats.in_use, manifest_slot_limit);
       WHYF("   Slot# | Last allocated by");
-      for(i=0;i<MAX_RHIZOME_MANIFESTS;i++) {
+      for(i=0;i<manifest_slot_count && i<RHIZOME_MANIFEST_TRACE_RECORDS;i++) {
 	WHYF("   %-5d | %s:%d in %s()",
 		i,
-		manifest_alloc_where[i].file,
-		manifest_alloc_where[i].line,
-		manifest_alloc_where[i].function
+		manifest_slots[i].alloc_where.file,
+		manifest_slots[i].alloc_where.line,
+		manifest_slots[i].alloc_where.function
 	    );
       }     
+      if (manifest_slot_count > RHIZOME_MANIFEST_TRACE_RECORDS)
+	WHYF("   ... and %d more", manifest_slot_count - RHIZOME_MANIFEST_TRACE_RECORDS);
       return NULL;
     }
 
-  rhizome_manifest *m=&manifests[manifest_first_free];
+  struct manifest_slot *slot = &manifest_slots[manifest_first_free];
+  rhizome_manifest *m = slot->m;
   bzero(m,sizeof(rhizome_manifest));
   m->manifest_record_number=manifest_first_free;
 
   /* Indicate where manifest was allocated, and that it is no longer
      free. */
-  manifest_alloc_where[manifest_first_free]=where;
-  manifest_free[manifest_first_free]=0;
-  manifest_free_where[manifest_first_free]=__NOWHERE__;
+  slot->alloc_where=where;
+  slot->free=0;
+  slot->free_where=__NOWHERE__;
+  if (++manifest_stats.in_use > manifest_stats.high_water)
+    manifest_stats.high_water = manifest_stats.in_use;
 
   /* Work out where next free manifest record lives */
-  for (; manifest_first_free < MAX_RHIZOME_MANIFESTS && !manifest_free[manifest_first_free]; ++manifest_first_free)
+  for (; manifest_first_free < manifest_slot_count && !manifest_slots[manifest_first_free].free; ++manifest_first_free)
     ;
 
   if (debug & DEBUG_MANIFESTS) _log_manifest_trace(where, __FUNCTION__);
@@ -498,21 +687,22 @@ void _rhizome_manifest_free(struct __sourceloc where, rhizome_manifest *m)
   int i;
   int mid=m->manifest_record_number;
 
-  if (m!=&manifests[mid]) {
+  if (mid < 0 || mid >= manifest_slot_count || m != manifest_slots[mid].m) {
     logMessage(LOG_LEVEL_ERROR, where,
 	"%s(): asked to free manifest %p, which claims to be manifest slot #%d (%p), but isn't",
-	__FUNCTION__, m, mid, &manifests[mid]
+	__FUNCTION__, m, mid, (mid >= 0 && mid < manifest_slot_count) ? manifest_slots[mid].m : NULL
       );
     exit(-1);
   }
 
-  if (manifest_free[mid]) {
+  struct manifest_slot *slot = &manifest_slots[mid];
+  if (slot->free) {
     logMessage(LOG_LEVEL_ERROR, where,
 	"%s(): asked to free manifest slot #%d (%p), which was already freed at %s:%d:%s()",
 	__FUNCTION__, mid, m,
-	manifest_free_where[mid].file,
-	manifest_free_where[mid].line,
-	manifest_free_where[mid].function
+	slot->free_where.file,
+	slot->free_where.line,
+	slot->free_where.function
       );
     exit(-1);
   }
@@ -530,8 +720,13 @@ void _rhizome_manifest_free(struct __sourceloc where, rhizome_manifest *m)
   if (m->dataFileName) free(m->dataFileName);
   m->dataFileName=NULL;
 
-  manifest_free[mid]=1;
-  manifest_free_where[mid]=where;
+  if (m->manifestdata) free(m->manifestdata);
+  m->manifestdata=NULL;
+  m->manifestdata_size=0;
+
+  slot->free=1;
+  slot->free_where=where;
+  --manifest_stats.in_use;
   if (mid<manifest_first_free) manifest_first_free=mid;
 
   if (debug & DEBUG_MANIFESTS) _log_manifest_trace(where, __FUNCTION__);
@@ -544,13 +739,19 @@ void _rhizome_manifest_free(struct __sourceloc where, rhizome_manifest *m)
    Signatures etc will be added later. */
 int rhizome_manifest_pack_variables(rhizome_manifest *m)
 {
-  int i,ofs=0;
+  int i,ofs=0,bytes=1;
 
   for(i=0;i<m->var_count;i++)
     {
-      if ((ofs+strlen(m->vars[i])+1+strlen(m->values[i])+1+1)>MAX_MANIFEST_BYTES)
+      bytes+=strlen(m->vars[i])+1+strlen(m->values[i])+1;
+      if (bytes>MAX_MANIFEST_BYTES)
 	return WHY("Manifest variables too long in total to fit in MAX_MANIFEST_BYTES");
-      snprintf((char *)&m->manifestdata[ofs],MAX_MANIFEST_BYTES-ofs,"%s=%s\n",
+    }
+  if (rhizome_manifest_reserve(m, bytes) == -1)
+    return -1;
+  for(i=0;i<m->var_count;i++)
+    {
+      snprintf((char *)&m->manifestdata[ofs],m->manifestdata_size-ofs,"%s=%s\n",
 	       m->vars[i],m->values[i]);
       ofs+=strlen((char *)&m->manifestdata[ofs]);
     }
@@ -579,6 +780,10 @@ int rhizome_manifest_selfsign(rhizome_manifest *m)
     free(sig); 
     return WHY("Manifest plus signatures is too long.");
   }
+  if (rhizome_manifest_reserve(m, m->manifest_bytes+sig->signatureLength) == -1) {
+    free(sig);
+    return -1;
+  }
 
   bcopy(&sig->signature[0],&m->manifestdata[m->manifest_bytes],sig->signatureLength);
 
@@ -95,7 +95,7 @@ int rhizome_bk_xor(const unsigned char *authorSid, // binary
 int rhizome_extract_privatekey(rhizome_manifest *m, const unsigned char *authorSid)
 {
   IN();
-  char *bk = rhizome_manifest_get(m, "BK", NULL, 0);
+  char *bk = rhizome_manifest_get_field(m, RHIZOME_FIELD_BK);
   if (!bk) { RETURN(WHY("missing BK field")); }
   unsigned char bkBytes[RHIZOME_BUNDLE_KEY_BYTES];
   if (fromhexstr(bkBytes, bk, RHIZOME_BUNDLE_KEY_BYTES) == -1)
@@ -120,7 +120,7 @@ int rhizome_extract_privatekey(rhizome_manifest *m, const unsigned char *authorS
 int rhizome_is_self_signed(rhizome_manifest *m)
 {
   IN();
-  char *bk = rhizome_manifest_get(m, "BK", NULL, 0);
+  char *bk = rhizome_manifest_get_field(m, RHIZOME_FIELD_BK);
   if (!bk) {
     if (debug & DEBUG_RHIZOME) DEBUGF("missing BK field");
     RETURN(1);
@@ -231,66 +231,216 @@ rhizome_signature *rhizome_sign_hash(rhizome_manifest *m, const unsigned char *a
   RETURN(out);
 }
 
-typedef struct manifest_signature_block_cache {
+/* Verifying a signature is by far the most expensive part of accepting a manifest, and the same
+   manifests are verified again and again as they are re-advertised and re-imported.  Results are
+   kept in a direct-mapped cache of "rhizome.verify.cache_size" entries, indexed by the leading
+   bytes of the manifest hash and the signature, which are already uniformly distributed.  If
+   "rhizome.verify.persist" is set, good signatures are also recorded in the VERIFICATIONS table,
+   so that they need not be verified again after a restart.  In the server they are gathered and
+   written RHIZOME_SIGNATURE_PERSIST_BATCH at a time in one transaction, which also trims the
+   table, rather than a write per verification on the main loop.
+ */
+struct signature_cache_entry {
   unsigned char manifest_hash[crypto_hash_sha512_BYTES];
-  unsigned char signature_bytes[256];
-  int signature_length;
-  int signature_valid;
-} manifest_signature_block_cache;
+  unsigned char signature_bytes[RHIZOME_SIGNATURE_BLOCK_BYTES];
+  char in_use;
+  char signature_valid;
+};
+
+static struct signature_cache_entry *sig_cache = NULL;
+static int sig_cache_size = 0;
+static int sig_cache_persist = 0;
+static unsigned char sig_cache_pending[RHIZOME_SIGNATURE_PERSIST_BATCH][crypto_hash_sha512_BYTES + RHIZOME_SIGNATURE_BLOCK_BYTES];
+static int sig_cache_pending_count = 0;
+static struct sched_ent sig_cache_flush_alarm = STRUCT_SCHED_ENT_UNUSED;
+static struct profile_total sig_cache_flush_stats;
+static struct rhizome_signature_cache_stats sig_cache_stats;
+
+void rhizome_signature_cache_get_stats(struct rhizome_signature_cache_stats *stats)
+{
+  *stats = sig_cache_stats;
+  stats->size = sig_cache_size;
+}
 
-#define SIG_CACHE_SIZE 1024
-manifest_signature_block_cache sig_cache[SIG_CACHE_SIZE];
+static int sig_cache_init()
+{
+  if (sig_cache)
+    return 0;
+  sig_cache_size = (int) confValueGetInt64Range("rhizome.verify.cache_size",
+      RHIZOME_SIGNATURE_CACHE_DEFAULT_SIZE, 1, RHIZOME_SIGNATURE_CACHE_MAX_SIZE);
+  sig_cache_persist = confValueGetBoolean("rhizome.verify.persist", 1);
+  if ((sig_cache = calloc(sig_cache_size, sizeof *sig_cache)) == NULL) {
+    WHYF_perror("calloc(%d, %d)", sig_cache_size, (int)sizeof *sig_cache);
+    sig_cache_size = 0;
+    return -1;
+  }
+  return 0;
+}
 
-int rhizome_manifest_lookup_signature_validity(unsigned char *hash,unsigned char *sig,int sig_len)
+/* The VERIFICATIONS row for a signature block has the signatory's public key as its sid, and the
+   manifest hash followed by the signature proper as its signature.
+ */
+static void sig_cache_row_signature(unsigned char *row, const unsigned char *hash, const unsigned char *sig)
 {
-  IN();
-  unsigned int slot=0;
+  bcopy(hash, &row[0], crypto_hash_sha512_BYTES);
+  bcopy(sig, &row[crypto_hash_sha512_BYTES], crypto_sign_edwards25519sha512batch_BYTES);
+}
+
+static int sig_cache_db_lookup(const unsigned char *hash, const unsigned char *sig)
+{
+  if (!sig_cache_persist || !rhizome_db)
+    return 0;
+  unsigned char row[crypto_hash_sha512_BYTES + crypto_sign_edwards25519sha512batch_BYTES];
+  sig_cache_row_signature(row, hash, sig);
+  strbuf sql = strbuf_alloca(100);
+  strbuf_puts(sql, "SELECT 1 FROM VERIFICATIONS WHERE signature = ? AND sid = ?;");
+  sqlite3_stmt *statement = sqlite_prepare_loglevel(LOG_LEVEL_WARN, NULL, sql);
+  if (!statement)
+    return 0;
+  int found = 0;
+  if (   sqlite_code_ok(sqlite3_bind_blob(statement, 1, row, sizeof row, SQLITE_TRANSIENT))
+      && sqlite_code_ok(sqlite3_bind_blob(statement, 2, &sig[crypto_sign_edwards25519sha512batch_BYTES],
+	  crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES, SQLITE_TRANSIENT)))
+    found = _sqlite_step_retry(__HERE__, LOG_LEVEL_WARN, NULL, statement) == SQLITE_ROW;
+  sqlite3_finalize(statement);
+  return found;
+}
+
+/* Write the gathered signatures, and drop all but the most recent of the rows stored here (which
+   have no DID), so the table never holds more than RHIZOME_SIGNATURE_PERSIST_FACTOR times the
+   cache size of them.  If the database is busy they are simply dropped; they will be verified
+   again if they are seen again after a restart.
+ */
+static void sig_cache_db_flush()
+{
+  int count = sig_cache_pending_count;
+  sig_cache_pending_count = 0;
+  unschedule(&sig_cache_flush_alarm);
+  if (count == 0 || !rhizome_db)
+    return;
+  if (sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "BEGIN TRANSACTION;") == -1)
+    return;
+  strbuf sql = strbuf_alloca(100);
+  strbuf_sprintf(sql, "INSERT INTO VERIFICATIONS(sid, starttime, signature) VALUES(?, %lld, ?);", (long long) gettime_ms());
+  sqlite3_stmt *statement = sqlite_prepare_loglevel(LOG_LEVEL_WARN, NULL, sql);
+  if (!statement)
+    goto rollback;
   int i;
+  for (i = 0; i < count; ++i) {
+    const unsigned char *row = sig_cache_pending[i];
+    const unsigned char *sid = &row[crypto_hash_sha512_BYTES + crypto_sign_edwards25519sha512batch_BYTES];
+    sqlite3_reset(statement);
+    if (!(   sqlite_code_ok(sqlite3_bind_blob(statement, 1, sid, crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES, SQLITE_TRANSIENT))
+	  && sqlite_code_ok(sqlite3_bind_blob(statement, 2, row, crypto_hash_sha512_BYTES + crypto_sign_edwards25519sha512batch_BYTES, SQLITE_TRANSIENT))
+	  && _sqlite_step_retry(__HERE__, LOG_LEVEL_WARN, NULL, statement) != -1)) {
+      sqlite3_finalize(statement);
+      goto rollback;
+    }
+  }
+  sqlite3_finalize(statement);
+  if (sqlite_exec_void_loglevel(LOG_LEVEL_WARN,
+	"DELETE FROM VERIFICATIONS WHERE did IS NULL AND rowid <= (SELECT max(rowid) FROM VERIFICATIONS) - %d;",
+	sig_cache_size * RHIZOME_SIGNATURE_PERSIST_FACTOR) == -1
+    || sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "COMMIT;") == -1)
+    goto rollback;
+  if (debug & DEBUG_RHIZOME)
+    DEBUGF("Recorded %d verified signatures", count);
+  return;
+rollback:
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ROLLBACK;");
+}
+
+static void sig_cache_flush_alarm_fn(struct sched_ent *alarm)
+{
+  sig_cache_db_flush();
+}
+
+static void sig_cache_db_store(const unsigned char *hash, const unsigned char *sig)
+{
+  if (!sig_cache_persist || !rhizome_db)
+    return;
+  unsigned char *row = sig_cache_pending[sig_cache_pending_count++];
+  sig_cache_row_signature(row, hash, sig);
+  bcopy(&sig[crypto_sign_edwards25519sha512batch_BYTES], &row[crypto_hash_sha512_BYTES + crypto_sign_edwards25519sha512batch_BYTES],
+      crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
+  /* Outside the server there is no main loop to flush them later */
+  if (!serverMode || sig_cache_pending_count == RHIZOME_SIGNATURE_PERSIST_BATCH) {
+    sig_cache_db_flush();
+    return;
+  }
+  if (sig_cache_pending_count == 1) {
+    sig_cache_flush_alarm.function = sig_cache_flush_alarm_fn;
+    sig_cache_flush_stats.name = "sig_cache_flush_alarm";
+    sig_cache_flush_alarm.stats = &sig_cache_flush_stats;
+    sig_cache_flush_alarm.alarm = gettime_ms() + RHIZOME_SIGNATURE_PERSIST_DELAY_MS;
+    sig_cache_flush_alarm.deadline = sig_cache_flush_alarm.alarm + RHIZOME_SIGNATURE_PERSIST_DELAY_MS;
+    schedule(&sig_cache_flush_alarm);
+  }
+}
 
-  for(i=0;i<crypto_hash_sha512_BYTES;i++) {
-    slot=(slot<<1)+(slot&0x80000000?1:0);
-    slot+=hash[i];
+static int rhizome_verify_signature_block(const unsigned char *hash, const unsigned char *sig)
+{
+  unsigned char sigBuf[256];
+  unsigned char verifyBuf[256];
+  unsigned char publicKey[256];
+
+  /* Reconstitute signature by putting manifest hash between the two
+     32-byte halves */
+  bcopy(&sig[0],&sigBuf[0],32);
+  bcopy(hash,&sigBuf[32],crypto_hash_sha512_BYTES);
+  bcopy(&sig[32],&sigBuf[96],32);
+
+  /* Get public key of signatory */
+  bcopy(&sig[64],&publicKey[0],crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
+
+  unsigned long long mlen=0;
+  ++sig_cache_stats.verified;
+  if (crypto_sign_edwards25519sha512batch_open(verifyBuf,&mlen,&sigBuf[0],128,publicKey)) {
+    ++sig_cache_stats.failures;
+    return -1;
   }
-  for(i=0;i<sig_len;i++) {
-    slot=(slot<<1)+(slot&0x80000000?1:0);
-    slot+=sig[i];
+  return 0;
+}
+
+int rhizome_manifest_lookup_signature_validity(unsigned char *hash,unsigned char *sig,int sig_len)
+{
+  IN();
+  if (sig_len != RHIZOME_SIGNATURE_BLOCK_BYTES)
+    RETURN(WHYF("Unsupported signature block length %d", sig_len));
+  ++sig_cache_stats.lookups;
+  if (sig_cache_init() == -1)
+    RETURN(rhizome_verify_signature_block(hash, sig));
+
+  unsigned int slot;
+  bcopy(hash, &slot, sizeof slot);
+  unsigned int sigbits;
+  bcopy(sig, &sigbits, sizeof sigbits);
+  slot = (slot ^ sigbits) % sig_cache_size;
+
+  struct signature_cache_entry *e = &sig_cache[slot];
+  if (e->in_use
+   && memcmp(e->manifest_hash, hash, crypto_hash_sha512_BYTES) == 0
+   && memcmp(e->signature_bytes, sig, RHIZOME_SIGNATURE_BLOCK_BYTES) == 0) {
+    ++sig_cache_stats.hits;
+    RETURN(e->signature_valid);
   }
-  slot%=SIG_CACHE_SIZE;
-
-  int replace=0;
-  if (sig_cache[slot].signature_length!=sig_len) replace=1;
-  for(i=0;i<crypto_hash_sha512_BYTES;i++)
-    if (hash[i]!=sig_cache[i].manifest_hash[i]) { replace=1; break; }
-  for(i=0;i<sig_len;i++)
-    if (sig[i]!=sig_cache[i].signature_bytes[i]) { replace=1; break; }
-
-  if (replace) {
-    for(i=0;i<crypto_hash_sha512_BYTES;i++)
-      sig_cache[i].manifest_hash[i]=hash[i];
-    for(i=0;i<sig_len;i++)
-      sig_cache[i].signature_bytes[i]=sig[i];
-    sig_cache[i].signature_length=sig_len;
-
-    unsigned char sigBuf[256];
-    unsigned char verifyBuf[256];
-    unsigned char publicKey[256];
-
-    /* Reconstitute signature by putting manifest hash between the two
-       32-byte halves */
-    bcopy(&sig[0],&sigBuf[0],32);
-    bcopy(hash,&sigBuf[32],crypto_hash_sha512_BYTES);
-    bcopy(&sig[32],&sigBuf[96],32);
-
-    /* Get public key of signatory */
-    bcopy(&sig[64],&publicKey[0],crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
-
-    unsigned long long mlen=0;
-    sig_cache[i].signature_valid=
-      crypto_sign_edwards25519sha512batch_open(verifyBuf,&mlen,&sigBuf[0],128,
-					       publicKey)
-      ? -1 : 0;
+
+  if (e->in_use)
+    ++sig_cache_stats.evictions;
+  bcopy(hash, e->manifest_hash, crypto_hash_sha512_BYTES);
+  bcopy(sig, e->signature_bytes, RHIZOME_SIGNATURE_BLOCK_BYTES);
+  e->in_use = 1;
+  if (sig_cache_db_lookup(hash, sig)) {
+    ++sig_cache_stats.db_hits;
+    if (debug & DEBUG_RHIZOME)
+      DEBUGF("Signature by %s already verified", alloca_tohex(&sig[crypto_sign_edwards25519sha512batch_BYTES], 8));
+    e->signature_valid = 0;
+  } else {
+    e->signature_valid = rhizome_verify_signature_block(hash, sig);
+    if (e->signature_valid == 0)
+      sig_cache_db_store(hash, sig);
   }
-  RETURN(sig_cache[i].signature_valid);
+  RETURN(e->signature_valid);
 }
 
 int rhizome_manifest_extract_signature(rhizome_manifest *m,int *ofs)
@@ -309,6 +459,12 @@ int rhizome_manifest_extract_signature(rhizome_manifest *m,int *ofs)
     m->errors++;
     RETURN(WHY("Zero byte signature blocks are not allowed, assuming signature section corrupt."));
   }
+  /* The buffer holds only the manifest, so a truncated block must not be read past its end */
+  if ((*ofs)+len>m->manifest_all_bytes) {
+    (*ofs)=m->manifest_all_bytes;
+    m->errors++;
+    RETURN(WHY("Signature block runs past the end of the manifest, assuming signature section corrupt."));
+  }
 
   /* Each signature type is required to have a different length to detect it.
      At present only crypto_sign_edwards25519sha512batch() signatures are
@@ -320,7 +476,7 @@ int rhizome_manifest_extract_signature(rhizome_manifest *m,int *ofs)
       case 0x61: /* crypto_sign_edwards25519sha512batch() */
 	/* Reconstitute signature block */
 	r=rhizome_manifest_lookup_signature_validity
-	  (m->manifesthash,&m->manifestdata[(*ofs)+1],96);
+	  (m->manifesthash,&m->manifestdata[(*ofs)+1],RHIZOME_SIGNATURE_BLOCK_BYTES);
 #ifdef DEPRECATED
 	unsigned char sigBuf[256];
 	unsigned char verifyBuf[256];
@@ -108,18 +108,166 @@ sqlite3 *rhizome_db=NULL;
 int rhizome_manifest_priority(sqlite_retry_state *retry, const char *id)
 {
   long long result = 0;
-  if (sqlite_exec_int64_retry(retry, &result,
+  if (sqlite_exec_int64_key_retry(retry, &result, id,
 	"select max(grouplist.priorty) from grouplist,manifests,groupmemberships"
-	" where manifests.id='%s'"
+	" where manifests.id=?"
 	"   and grouplist.id=groupmemberships.groupid"
-	"   and groupmemberships.manifestid=manifests.id;",
-	id
+	"   and groupmemberships.manifestid=manifests.id;"
       ) == -1
   )
     return -1;
   return (int) result;
 }
 
+/* SQL function that converts a hex text key into the raw-byte BLOB it represents.  Any other
+   value, including a key that is already a BLOB, is returned unchanged.
+ */
+static void rhizome_sql_unhex(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+  if (sqlite3_value_type(argv[0]) == SQLITE_TEXT) {
+    const char *hex = (const char *) sqlite3_value_text(argv[0]);
+    size_t len = sqlite3_value_bytes(argv[0]);
+    unsigned char key[RHIZOME_KEY_MAX_BYTES];
+    if (len % 2 == 0 && len / 2 <= sizeof key && fromhex(key, hex, len / 2) == len / 2) {
+      sqlite3_result_blob(context, key, len / 2, SQLITE_TRANSIENT);
+      return;
+    }
+  }
+  sqlite3_result_value(context, argv[0]);
+}
+
+/* Databases with user_version 0 keyed their tables by upper case hex text.  Convert every key
+   to the raw-byte BLOB it represents, which halves the size of the keys and their indexes, and
+   lets lookups compare bytes instead of strings.
+ */
+static int rhizome_migrate_keys()
+{
+  long long version = 0;
+  if (sqlite_exec_int64(&version, "PRAGMA user_version;") == -1)
+    return -1;
+  if (version >= 1)
+    return 0;
+  if (sqlite3_create_function(rhizome_db, "rhizome_unhex", 1, SQLITE_UTF8, NULL, rhizome_sql_unhex, NULL, NULL) != SQLITE_OK)
+    return WHYF("sqlite3_create_function() failed: %s", sqlite3_errmsg(rhizome_db));
+  time_ms_t start = gettime_ms();
+  int changes = sqlite3_total_changes(rhizome_db);
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;") == -1)
+    return -1;
+  if (	sqlite_exec_void_retry(&retry, "UPDATE OR REPLACE MANIFESTS SET id = rhizome_unhex(id), filehash = rhizome_unhex(filehash);") == -1
+    ||	sqlite_exec_void_retry(&retry, "UPDATE OR REPLACE FILES SET id = rhizome_unhex(id);") == -1
+    ||	sqlite_exec_void_retry(&retry, "UPDATE OR REPLACE GROUPLIST SET id = rhizome_unhex(id);") == -1
+    ||	sqlite_exec_void_retry(&retry, "UPDATE GROUPMEMBERSHIPS SET manifestid = rhizome_unhex(manifestid), groupid = rhizome_unhex(groupid);") == -1
+    ||	sqlite_exec_void_retry(&retry, "UPDATE VERIFICATIONS SET sid = rhizome_unhex(sid);") == -1
+    ||	sqlite_exec_void_retry(&retry, "PRAGMA user_version = 1;") == -1
+    ||	sqlite_exec_void_retry(&retry, "COMMIT;") == -1
+  ) {
+    sqlite_exec_void_retry(&retry, "ROLLBACK;");
+    return -1;
+  }
+  changes = sqlite3_total_changes(rhizome_db) - changes;
+  if (changes)
+    INFOF("Migrated %d Rhizome database rows to BLOB keys in %lldms", changes, (long long)(gettime_ms() - start));
+  return 0;
+}
+
+/* Keep the spatial index entry of a bundle in step with its BAR.  Only bundles about an area no
+   wider than RHIZOME_GEO_INDEX_SPAN_DEGREES are indexed, which is what lets nearby bundles be found
+   with a bounded range scan of an ordinary index.
+ */
+static int rhizome_index_geobox(sqlite_retry_state *retry, const char *manifestid, const unsigned char *bar)
+{
+  unsigned short box[4];
+  rhizome_bar_geobox(bar, box);
+  if (box[2] - box[0] > RHIZOME_GEO_INDEX_SPAN_DEGREES * RHIZOME_GEO_LAT_UNITS
+   || box[3] - box[1] > RHIZOME_GEO_INDEX_SPAN_DEGREES * RHIZOME_GEO_LONG_UNITS)
+    return sqlite_exec_void_key_retry(retry, manifestid, "DELETE FROM GEOBOXES WHERE id = ?;");
+  return sqlite_exec_void_key_retry(retry, manifestid,
+      "INSERT OR REPLACE INTO GEOBOXES(id,minlat,minlong,maxlat,maxlong) VALUES(?,%d,%d,%d,%d);",
+      box[0], box[1], box[2], box[3]);
+}
+
+/* Fill in the spatial index from the BARs of the bundles already in the store, when the index has
+   just been created.
+ */
+static int rhizome_index_geoboxes()
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;") == -1)
+    return -1;
+  sqlite3_stmt *statement = sqlite_prepare(&retry, "SELECT id, bar FROM MANIFESTS;");
+  if (!statement) {
+    sqlite_exec_void_retry(&retry, "ROLLBACK;");
+    return -1;
+  }
+  int count = 0;
+  while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    char manifestid[RHIZOME_MANIFEST_ID_STRLEN + 1];
+    if (!rhizome_column_key(statement, 0, manifestid, sizeof manifestid)
+      || sqlite3_column_bytes(statement, 1) != RHIZOME_BAR_BYTES)
+      continue;
+    if (rhizome_index_geobox(&retry, manifestid, sqlite3_column_blob(statement, 1)) == -1) {
+      sqlite3_finalize(statement);
+      sqlite_exec_void_retry(&retry, "ROLLBACK;");
+      return -1;
+    }
+    count++;
+  }
+  sqlite3_finalize(statement);
+  if (sqlite_exec_void_retry(&retry, "COMMIT;") == -1) {
+    sqlite_exec_void_retry(&retry, "ROLLBACK;");
+    return -1;
+  }
+  if (count)
+    INFOF("Indexed the geoboxes of %d Rhizome bundles", count);
+  return 0;
+}
+
+/* Return the Rhizome Direct cursor size bin of a payload size.  Bin 0 holds payloads of up to
+   RHIZOME_SIZE_BIN_BYTES, and each following bin holds payloads up to twice the size of the one
+   before, which are exactly the ranges that a cursor walks.
+ */
+int rhizome_size_bin(long long size)
+{
+  int bin = 0;
+  long long high = RHIZOME_SIZE_BIN_BYTES;
+  while (size > high && high < RHIZOME_SIZE_BIN_LIMIT) {
+    high *= 2;
+    bin++;
+  }
+  return bin;
+}
+
+/* Fill in the size bins of manifest records that lack one, either because the column has just
+   been added or because the records were written by something other than servald.
+ */
+static int rhizome_index_sizebins()
+{
+  long long missing = 0;
+  if (sqlite_exec_int64(&missing, "SELECT COUNT(*) FROM MANIFESTS WHERE sizebin IS NULL;") == -1)
+    return -1;
+  if (missing == 0)
+    return 0;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;") == -1)
+    return -1;
+  int bin;
+  long long high = RHIZOME_SIZE_BIN_BYTES;
+  for (bin = 0; high < RHIZOME_SIZE_BIN_LIMIT; ++bin, high *= 2) {
+    if (sqlite_exec_void_retry(&retry, "UPDATE MANIFESTS SET sizebin = %d WHERE sizebin IS NULL AND filesize <= %lld;", bin, high) == -1) {
+      sqlite_exec_void_retry(&retry, "ROLLBACK;");
+      return -1;
+    }
+  }
+  if (sqlite_exec_void_retry(&retry, "UPDATE MANIFESTS SET sizebin = %d WHERE sizebin IS NULL;", bin) == -1
+    || sqlite_exec_void_retry(&retry, "COMMIT;") == -1) {
+    sqlite_exec_void_retry(&retry, "ROLLBACK;");
+    return -1;
+  }
+  INFOF("Indexed the size bins of %lld Rhizome bundles", missing);
+  return 0;
+}
+
 int rhizome_opendb()
 {
   if (rhizome_db) return 0;
@@ -148,24 +296,56 @@ int rhizome_opendb()
   }
   /* Create tables as required */
   sqlite_exec_void_loglevel(loglevel, "PRAGMA auto_vacuum=2;");
-  if (	sqlite_exec_void("CREATE TABLE IF NOT EXISTS GROUPLIST(id text not null primary key, closed integer,ciphered integer,priority integer);") == -1
-    ||	sqlite_exec_void("CREATE TABLE IF NOT EXISTS MANIFESTS(id text not null primary key, manifest blob, version integer,inserttime integer, bar blob, filesize integer, filehash text);") == -1
-    ||	sqlite_exec_void("CREATE TABLE IF NOT EXISTS FILES(id text not null primary key, data blob, length integer, highestpriority integer, datavalid integer, inserttime integer);") == -1
+  long long have_geoboxes = 0;
+  long long have_manifests = 0;
+  long long have_sizebins = 0;
+  if (	sqlite_exec_int64(&have_geoboxes, "SELECT COUNT(*) FROM SQLITE_MASTER WHERE type = 'table' AND name = 'GEOBOXES';") == -1
+    ||	sqlite_exec_int64(&have_manifests, "SELECT COUNT(*) FROM SQLITE_MASTER WHERE type = 'table' AND name = 'MANIFESTS';") == -1
+    ||	sqlite_exec_int64(&have_sizebins, "SELECT COUNT(*) FROM SQLITE_MASTER WHERE type = 'table' AND name = 'MANIFESTS' AND sql LIKE '%%sizebin%%';") == -1
+  )
+    RETURN(WHY("Failed to read schema"));
+  if (	sqlite_exec_void("CREATE TABLE IF NOT EXISTS GROUPLIST(id blob not null primary key, closed integer,ciphered integer,priority integer);") == -1
+    ||	sqlite_exec_void("CREATE TABLE IF NOT EXISTS MANIFESTS(id blob not null primary key, manifest blob, version integer,inserttime integer, bar blob, filesize integer, filehash blob, sizebin integer);") == -1
+    ||	(have_manifests && !have_sizebins && sqlite_exec_void("ALTER TABLE MANIFESTS ADD COLUMN sizebin integer;") == -1)
+    ||	sqlite_exec_void("CREATE TABLE IF NOT EXISTS FILES(id blob not null primary key, data blob, length integer, highestpriority integer, datavalid integer, inserttime integer);") == -1
     ||	sqlite_exec_void("DROP TABLE IF EXISTS FILEMANIFESTS;") == -1
-    ||	sqlite_exec_void("CREATE TABLE IF NOT EXISTS GROUPMEMBERSHIPS(manifestid text not null, groupid text not null);") == -1
-    ||	sqlite_exec_void("CREATE TABLE IF NOT EXISTS VERIFICATIONS(sid text not null, did text, name text, starttime integer, endtime integer, signature blob);") == -1
+    ||	sqlite_exec_void("CREATE TABLE IF NOT EXISTS GROUPMEMBERSHIPS(manifestid blob not null, groupid blob not null);") == -1
+    ||	sqlite_exec_void("CREATE TABLE IF NOT EXISTS VERIFICATIONS(sid blob not null, did text, name text, starttime integer, endtime integer, signature blob);") == -1
+    ||	sqlite_exec_void("CREATE TABLE IF NOT EXISTS GEOBOXES(id blob not null primary key, minlat integer, minlong integer, maxlat integer, maxlong integer);") == -1
   ) {
     RETURN(WHY("Failed to create schema"));
   }
+  if (rhizome_migrate_keys() == -1)
+    RETURN(WHY("Failed to migrate schema"));
+  if (!have_geoboxes && rhizome_index_geoboxes() == -1)
+    RETURN(WHY("Failed to index geoboxes"));
+  if (rhizome_index_sizebins() == -1)
+    RETURN(WHY("Failed to index size bins"));
 
   /* Create indexes if they don't already exist */
   sqlite_exec_void_loglevel(LOG_LEVEL_WARN,"CREATE INDEX IF NOT EXISTS bundlesizeindex ON manifests (filesize);");
   sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_HASH ON MANIFESTS(filehash);");
-
-  /* Clean out half-finished entries from the database */
+  /* Covering index for Rhizome Direct cursor fills, which walk BARs in order within a size bin.  The
+     bin comes first, so that a fill seeks straight to its bin whether that holds many or no bundles. */
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DROP INDEX IF EXISTS IDX_MANIFESTS_BAR;");
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_SIZEBIN ON MANIFESTS(sizebin, bar, id, filesize);");
+  /* Signature verification results that outlive the in-memory cache */
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_VERIFICATIONS_SIGNATURE ON VERIFICATIONS(signature);");
+  /* Spatial index for finding bundles about nearby places */
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_GEOBOXES_LAT ON GEOBOXES(minlat, maxlat);");
+
+  /* Clean out half-finished entries from the database.  Payload rows that were never completed
+     (datavalid=0) were left by a write that crashed or was killed, and would otherwise refuse every
+     later streamed write of the same payload.  A write still going on in another process notices
+     that its row has gone and fails (see rhizome_flush_write()). */
+  if (sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DELETE FROM FILES WHERE datavalid=0;") == 0 && sqlite3_changes(rhizome_db)) {
+    INFOF("Removed %d incomplete payloads", sqlite3_changes(rhizome_db));
+    rhizome_database_usage_invalidate();
+  }
   sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DELETE FROM MANIFESTS WHERE filehash IS NULL;");
   sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DELETE FROM FILES WHERE NOT EXISTS( SELECT  1 FROM MANIFESTS WHERE MANIFESTS.filehash = FILES.id);");
-  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DELETE FROM MANIFESTS WHERE filehash != '' AND NOT EXISTS( SELECT  1 FROM FILES WHERE MANIFESTS.filehash = FILES.id);");
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DELETE FROM MANIFESTS WHERE length(filehash) != 0 AND NOT EXISTS( SELECT  1 FROM FILES WHERE MANIFESTS.filehash = FILES.id);");
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DELETE FROM GEOBOXES WHERE NOT EXISTS( SELECT  1 FROM MANIFESTS WHERE MANIFESTS.id = GEOBOXES.id);");
   RETURN(0);
 }
 
@@ -204,16 +384,18 @@ int rhizome_opendb()
    timeout, giving a greater chance of success at the expense of potentially greater latency.
  */
 
-/* In the servald server process, by default we retry every 10 ms for up to 50 ms, so as to not
-   introduce too much latency into server responsiveness.  In other processes (eg, Batphone MeshMS
-   thread), by default we allow busy retries to go for over a second, waiting 100 ms between each
-   retry.
+/* In the servald server process, by default we do not retry at all, because sleeping would stall
+   every other alarm and file descriptor in the main loop.  A query that finds the database busy
+   fails at once; work that must not be lost is handed to rhizome_db_request(), which retries it
+   from a scheduled alarm.  A payload arriving on a socket is held in memory while the database is
+   busy (see rhizome_write_buffer()).  In other processes (eg, Batphone MeshMS thread), by default
+   we allow busy retries to go for over a second, waiting 100 ms between each retry.
  */
 sqlite_retry_state sqlite_retry_state_init(int serverLimit, int serverSleep, int otherLimit, int otherSleep)
 {
   return (sqlite_retry_state){
-      .limit = serverMode ? (serverLimit < 0 ? 50 : serverLimit) : (otherLimit < 0 ? 1500 : otherLimit),
-      .sleep = serverMode ? (serverSleep < 0 ? 10 : serverSleep) : (otherSleep < 0 ? 100 : otherSleep),
+      .limit = serverMode ? (serverLimit < 0 ? 0 : serverLimit) : (otherLimit < 0 ? 1500 : otherLimit),
+      .sleep = serverMode ? (serverSleep < 0 ? 0 : serverSleep) : (otherSleep < 0 ? 100 : otherSleep),
       .elapsed = 0,
       .start = -1,
       .busytries = 0
@@ -237,6 +419,7 @@ int _sqlite_retry(struct __sourceloc where, sqlite_retry_state *retry, const cha
       action
     );
   if (retry->elapsed >= retry->limit) {
+    rhizome_db_busy = 1;
     // reset ready for next query
     retry->busytries = 0;
     if (!serverMode)
@@ -266,6 +449,142 @@ void _sqlite_retry_done(struct __sourceloc where, sqlite_retry_state *retry, con
     retry->start = -1;
 }
 
+/* Deferred database requests.
+
+   Some work cannot simply be dropped when the database is busy, such as storing a bundle that has
+   just been fetched.  The caller wraps it in a function that returns -1 on failure, and passes it
+   to rhizome_db_request().  If the function fails because the database was busy (rhizome_db_busy
+   was set during the call), the request is queued and the function called again from a scheduled
+   alarm, backing off from RHIZOME_DB_RETRY_MIN_MS to RHIZOME_DB_RETRY_MAX_MS between tries, until
+   the "rhizome.db.retry_limit_ms" config option (default RHIZOME_DB_RETRY_LIMIT_MS) has elapsed.
+   The function must therefore be safe to call again after a busy failure.  The completion function
+   is called exactly once with the final result, and must release the context.  Returns
+   RHIZOME_DB_BUSY if the request was queued, otherwise the result passed to the completion.
+
+   Outside the server there is no main loop to return to, and sqlite_retry() sleeps as it always
+   has, so requests are never queued.
+ */
+
+int rhizome_db_busy = 0;
+
+struct rhizome_db_request {
+  struct sched_ent alarm;
+  const char *description;
+  int (*function)(void *context);
+  void (*completion)(void *context, int result);
+  void *context;
+  time_ms_t start;
+  int delay;
+  unsigned int tries;
+};
+
+static struct rhizome_db_request db_requests[RHIZOME_DB_REQUEST_MAX];
+static struct profile_total db_request_stats;
+
+static int rhizome_db_try(struct rhizome_db_request *r)
+{
+  rhizome_db_busy = 0;
+  ++r->tries;
+  int ret = r->function(r->context);
+  if (ret == -1 && rhizome_db_busy)
+    return RHIZOME_DB_BUSY;
+  return ret;
+}
+
+static void rhizome_db_request_alarm(struct sched_ent *alarm)
+{
+  struct rhizome_db_request *r = (struct rhizome_db_request *) alarm;
+  int ret = rhizome_db_try(r);
+  time_ms_t now = gettime_ms();
+  if (ret == RHIZOME_DB_BUSY) {
+    if (now - r->start < confValueGetInt64Range("rhizome.db.retry_limit_ms", RHIZOME_DB_RETRY_LIMIT_MS, 0, 3600000)) {
+      if (r->delay < RHIZOME_DB_RETRY_MAX_MS)
+	r->delay *= 2;
+      if (r->delay > RHIZOME_DB_RETRY_MAX_MS)
+	r->delay = RHIZOME_DB_RETRY_MAX_MS;
+      alarm->alarm = now + r->delay;
+      alarm->deadline = alarm->alarm + r->delay;
+      schedule(alarm);
+      return;
+    }
+    WARNF("Database still busy after %u tries over %lldms, giving up: %s", r->tries, now - r->start, r->description);
+    ret = -1;
+  } else if (debug & DEBUG_RHIZOME)
+    DEBUGF("Deferred %s finished after %u tries over %lldms, result=%d", r->description, r->tries, now - r->start, ret);
+  void (*completion)(void *, int) = r->completion;
+  void *context = r->context;
+  r->function = NULL;
+  if (completion)
+    completion(context, ret);
+}
+
+/* Return true if a deferred request is waiting to call the given function with a context that the
+   given predicate accepts.
+ */
+int rhizome_db_request_pending(int (*function)(void *context), int (*match)(void *context, const void *arg), const void *arg)
+{
+  int i;
+  for (i = 0; i < RHIZOME_DB_REQUEST_MAX; ++i)
+    if (db_requests[i].function == function && match(db_requests[i].context, arg))
+      return 1;
+  return 0;
+}
+
+/* Drop a deferred request without calling its completion, eg, because its context is being freed.
+   Returns 1 if a request was dropped.
+ */
+int rhizome_db_request_cancel(int (*function)(void *context), void *context)
+{
+  int i;
+  for (i = 0; i < RHIZOME_DB_REQUEST_MAX; ++i)
+    if (db_requests[i].function == function && db_requests[i].context == context) {
+      unschedule(&db_requests[i].alarm);
+      db_requests[i].function = NULL;
+      if (debug & DEBUG_RHIZOME)
+	DEBUGF("Cancelled deferred %s", db_requests[i].description);
+      return 1;
+    }
+  return 0;
+}
+
+int rhizome_db_request(const char *description, int (*function)(void *context),
+		       void (*completion)(void *context, int result), void *context)
+{
+  struct rhizome_db_request r;
+  bzero(&r, sizeof r);
+  r.description = description;
+  r.function = function;
+  r.context = context;
+  int ret = rhizome_db_try(&r);
+  if (ret == RHIZOME_DB_BUSY && serverMode) {
+    int i;
+    for (i = 0; i < RHIZOME_DB_REQUEST_MAX && db_requests[i].function; ++i)
+      ;
+    if (i < RHIZOME_DB_REQUEST_MAX) {
+      struct rhizome_db_request *q = &db_requests[i];
+      *q = r;
+      q->completion = completion;
+      q->start = gettime_ms();
+      q->delay = RHIZOME_DB_RETRY_MIN_MS;
+      q->alarm.function = rhizome_db_request_alarm;
+      db_request_stats.name = "rhizome_db_request_alarm";
+      q->alarm.stats = &db_request_stats;
+      q->alarm.alarm = q->start + q->delay;
+      q->alarm.deadline = q->alarm.alarm + q->delay;
+      schedule(&q->alarm);
+      if (debug & DEBUG_RHIZOME)
+	DEBUGF("Database busy, deferred %s", description);
+      return RHIZOME_DB_BUSY;
+    }
+    WARNF("Too many deferred database requests, giving up: %s", description);
+  }
+  if (ret == RHIZOME_DB_BUSY)
+    ret = -1;
+  if (completion)
+    completion(context, ret);
+  return ret;
+}
+
 /*
    Convenience wrapper for preparing an SQL command.
    Returns -1 if an error occurs (logged as an error), otherwise zero with the prepared
@@ -297,6 +616,7 @@ sqlite3_stmt *_sqlite_prepare_loglevel(struct __sourceloc where, int log_level,
 	if (retry && _sqlite_retry(where, retry, strbuf_str(stmt))) {
 	  break; // back to sqlite3_prepare_v2()
 	}
+	rhizome_db_busy = 1;
 	// fall through...
       default:
 	logMessage(log_level, where, "query invalid, %s: %s", sqlite3_errmsg(rhizome_db), strbuf_str(stmt));
@@ -325,6 +645,7 @@ int _sqlite_step_retry(struct __sourceloc where, int log_level, sqlite_retry_sta
 	  sqlite3_reset(statement);
 	  break; // back to sqlite3_step()
 	}
+	rhizome_db_busy = 1;
 	// fall through...
       default:
 	logMessage(log_level, where, "query failed, %s: %s", sqlite3_errmsg(rhizome_db), sqlite3_sql(statement));
@@ -403,11 +724,8 @@ int _sqlite_exec_void_retry(struct __sourceloc where, sqlite_retry_state *retry,
   return ret;
 }
 
-static int _sqlite_vexec_int64(struct __sourceloc where, sqlite_retry_state *retry, long long *result, const char *sqlformat, va_list ap)
+static int _sqlite_exec_int64_prepared(struct __sourceloc where, sqlite_retry_state *retry, long long *result, sqlite3_stmt *statement)
 {
-  strbuf stmt = strbuf_alloca(8192);
-  strbuf_vsprintf(stmt, sqlformat, ap);
-  sqlite3_stmt *statement = _sqlite_prepare_loglevel(where, LOG_LEVEL_ERROR, retry, stmt);
   if (!statement)
     return -1;
   int ret = 0;
@@ -428,6 +746,13 @@ static int _sqlite_vexec_int64(struct __sourceloc where, sqlite_retry_state *ret
   return sqlite_code_ok(stepcode) && ret != -1 ? rowcount : -1;
 }
 
+static int _sqlite_vexec_int64(struct __sourceloc where, sqlite_retry_state *retry, long long *result, const char *sqlformat, va_list ap)
+{
+  strbuf stmt = strbuf_alloca(8192);
+  strbuf_vsprintf(stmt, sqlformat, ap);
+  return _sqlite_exec_int64_prepared(where, retry, result, _sqlite_prepare_loglevel(where, LOG_LEVEL_ERROR, retry, stmt));
+}
+
 /*
    Convenience wrapper for executing an SQL command that returns a single int64 value.
    Logs an error and returns -1 if an error occurs.
@@ -495,17 +820,155 @@ int _sqlite_exec_strbuf(struct __sourceloc where, strbuf sb, const char *sqlform
   return sqlite_code_ok(stepcode) && ret != -1 ? rowcount : -1;
 }
 
+/* Bind a manifest ID, file hash or group ID, given in hex, to a statement parameter as the raw
+   bytes it is keyed by.  An empty string binds an empty BLOB, which is how a manifest with no
+   payload records its file hash.  Logs an error and returns -1 if the key is not valid hex.
+ */
+int rhizome_bind_key(sqlite3_stmt *statement, int index, const char *hexkey)
+{
+  unsigned char key[RHIZOME_KEY_MAX_BYTES];
+  size_t len = strlen(hexkey);
+  if (len % 2 || len / 2 > sizeof key || fromhex(key, hexkey, len / 2) != len / 2)
+    return WHYF("invalid key %s", alloca_toprint(-1, hexkey, len));
+  if (!sqlite_code_ok(sqlite3_bind_blob(statement, index, key, len / 2, SQLITE_TRANSIENT)))
+    return WHYF("query failed, %s: %s", sqlite3_errmsg(rhizome_db), sqlite3_sql(statement));
+  return 0;
+}
+
+/* Read a BLOB key column into upper case hex.  Returns NULL (without logging) if the column does
+   not hold a BLOB that fits in the buffer.
+ */
+char *rhizome_column_key(sqlite3_stmt *statement, int column, char *hexkey, size_t hexkeysize)
+{
+  if (sqlite3_column_type(statement, column) != SQLITE_BLOB)
+    return NULL;
+  const unsigned char *key = sqlite3_column_blob(statement, column);
+  size_t len = sqlite3_column_bytes(statement, column);
+  if (len * 2 + 1 > hexkeysize)
+    return NULL;
+  return tohex(hexkey, key, len);
+}
+
+/* Prepare a statement whose SQL contains a single '?' parameter, and bind the given hex key to it.
+ */
+static sqlite3_stmt *_sqlite_vprepare_key(struct __sourceloc where, sqlite_retry_state *retry, const char *hexkey, const char *sqlformat, va_list ap)
+{
+  strbuf stmt = strbuf_alloca(8192);
+  strbuf_vsprintf(stmt, sqlformat, ap);
+  sqlite3_stmt *statement = _sqlite_prepare_loglevel(where, LOG_LEVEL_ERROR, retry, stmt);
+  if (statement && rhizome_bind_key(statement, 1, hexkey) == -1) {
+    sqlite3_finalize(statement);
+    return NULL;
+  }
+  return statement;
+}
+
+/* Same as sqlite_exec_void(), but binds the given hex key as a BLOB to the '?' in the statement.
+ */
+int _sqlite_exec_void_key(struct __sourceloc where, const char *hexkey, const char *sqlformat, ...)
+{
+  va_list ap;
+  va_start(ap, sqlformat);
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = _sqlite_vprepare_key(where, &retry, hexkey, sqlformat, ap);
+  va_end(ap);
+  return _sqlite_exec_void_prepared(where, LOG_LEVEL_ERROR, &retry, statement);
+}
+
+int _sqlite_exec_void_key_retry(struct __sourceloc where, sqlite_retry_state *retry, const char *hexkey, const char *sqlformat, ...)
+{
+  va_list ap;
+  va_start(ap, sqlformat);
+  sqlite3_stmt *statement = _sqlite_vprepare_key(where, retry, hexkey, sqlformat, ap);
+  va_end(ap);
+  return _sqlite_exec_void_prepared(where, LOG_LEVEL_ERROR, retry, statement);
+}
+
+/* Same as sqlite_exec_int64(), but binds the given hex key as a BLOB to the '?' in the statement.
+ */
+int _sqlite_exec_int64_key(struct __sourceloc where, long long *result, const char *hexkey, const char *sqlformat, ...)
+{
+  va_list ap;
+  va_start(ap, sqlformat);
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = _sqlite_vprepare_key(where, &retry, hexkey, sqlformat, ap);
+  va_end(ap);
+  return _sqlite_exec_int64_prepared(where, &retry, result, statement);
+}
+
+int _sqlite_exec_int64_key_retry(struct __sourceloc where, sqlite_retry_state *retry, long long *result, const char *hexkey, const char *sqlformat, ...)
+{
+  va_list ap;
+  va_start(ap, sqlformat);
+  sqlite3_stmt *statement = _sqlite_vprepare_key(where, retry, hexkey, sqlformat, ap);
+  va_end(ap);
+  return _sqlite_exec_int64_prepared(where, retry, result, statement);
+}
+
+/* Storage accounting.
+
+   Measuring the database takes three PRAGMA queries, so the number of bytes in use is kept in
+   memory instead.  Storing or dropping a payload adjusts it by the payload length, which is close
+   enough to the pages actually used, and it is measured again (reconciled) once it is older than
+   RHIZOME_USAGE_RECONCILE_MS, or after a bulk delete has made it unknown.
+ */
+static long long db_used_bytes = 0;
+static time_ms_t db_used_reconciled = -1;
+
 long long rhizome_database_used_bytes()
 {
+  time_ms_t now = gettime_ms();
+  if (db_used_reconciled != -1 && now - db_used_reconciled < RHIZOME_USAGE_RECONCILE_MS)
+    return db_used_bytes;
   long long db_page_size;
   long long db_page_count;
   long long db_free_page_count;
-  if (	sqlite_exec_int64(&db_page_size, "PRAGMA page_size;") == -1LL
-    ||  sqlite_exec_int64(&db_page_count, "PRAGMA page_count;") == -1LL
-    ||	sqlite_exec_int64(&db_free_page_count, "PRAGMA free_count;") == -1LL
+  if (	sqlite_exec_int64(&db_page_size, "PRAGMA page_size;") != 1
+    ||  sqlite_exec_int64(&db_page_count, "PRAGMA page_count;") != 1
+    ||	sqlite_exec_int64(&db_free_page_count, "PRAGMA freelist_count;") != 1
   )
     return WHY("Cannot measure database used bytes");
-  return db_page_size * (db_page_count - db_free_page_count);
+  long long used = db_page_size * (db_page_count - db_free_page_count);
+  if (debug & DEBUG_RHIZOME)
+    DEBUGF("Database uses %lld bytes (estimated %lld)", used, db_used_reconciled == -1 ? -1 : db_used_bytes);
+  db_used_bytes = used;
+  db_used_reconciled = now;
+  return db_used_bytes;
+}
+
+void rhizome_database_usage_adjust(long long bytes)
+{
+  db_used_bytes += bytes;
+  if (db_used_bytes < 0)
+    db_used_reconciled = -1;
+}
+
+void rhizome_database_usage_invalidate()
+{
+  db_used_reconciled = -1;
+}
+
+/* Return free pages to the file system a few at a time, so that the database shrinks after large
+   deletions without ever running a full VACUUM, which would lock the database and stall the
+   server for as long as it takes to copy the whole file.  This only has an effect if the database
+   was created with auto_vacuum=INCREMENTAL, which rhizome_opendb() asks for.  The deadline is
+   generous, so the alarm normally only fires when there is nothing else to do.
+ */
+void rhizome_vacuum(struct sched_ent *alarm)
+{
+  int interval = RHIZOME_VACUUM_INTERVAL_MS;
+  long long free_pages;
+  if (rhizome_db && sqlite_exec_int64(&free_pages, "PRAGMA freelist_count;") == 1 && free_pages > 0) {
+    int pages = confValueGetInt64Range("rhizome.db.vacuum_pages", RHIZOME_VACUUM_PAGES, 1, 65536);
+    if (debug & DEBUG_RHIZOME)
+      DEBUGF("Reclaiming up to %d of %lld free pages", pages, free_pages);
+    if (sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA incremental_vacuum(%d);", pages) == 0
+      && free_pages > pages)
+      interval = RHIZOME_VACUUM_BUSY_INTERVAL_MS;
+  }
+  alarm->alarm = gettime_ms() + interval;
+  alarm->deadline = alarm->alarm + RHIZOME_VACUUM_INTERVAL_MS;
+  schedule(alarm);
 }
 
 int rhizome_make_space(int group_priority, long long bytes)
@@ -524,19 +987,17 @@ int rhizome_make_space(int group_priority, long long bytes)
 
   /* Okay, not enough space, so free up some. */
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  sqlite3_stmt *statement = sqlite_prepare(&retry, "select id,length from files where highestpriority < %d order by descending length", group_priority);
+  sqlite3_stmt *statement = sqlite_prepare(&retry, "select id,length from files where highestpriority < %d order by length desc", group_priority);
   if (!statement)
     return -1;
   while (bytes > (rhizome_space - 65536 - rhizome_database_used_bytes())
       && sqlite_step_retry(&retry, statement) == SQLITE_ROW
   ) {
     /* Make sure we can drop this blob, and if so drop it, and recalculate number of bytes required */
-    const unsigned char *id;
+    char id[RHIZOME_FILEHASH_STRLEN + 1];
 
     /* Get values */
-    if (sqlite3_column_type(statement, 0)==SQLITE_TEXT)
-      id = sqlite3_column_text(statement, 0);
-    else {
+    if (!rhizome_column_key(statement, 0, id, sizeof id)) {
       WHY("Incorrect type in id column of files table");
       break;
     }
@@ -549,7 +1010,7 @@ int rhizome_make_space(int group_priority, long long bytes)
     /* Try to drop this file from storage, discarding any references that do not trump the priority
        of this request.  The query done earlier should ensure this, but it doesn't hurt to be
        paranoid, and it also protects against inconsistency in the database. */
-    rhizome_drop_stored_file((char *)id, group_priority + 1);
+    rhizome_drop_stored_file(id, group_priority + 1);
   }
   sqlite3_finalize(statement);
 
@@ -570,17 +1031,21 @@ int rhizome_drop_stored_file(const char *id,int maximum_priority)
   if (!rhizome_str_is_file_hash(id))
     return WHYF("invalid file hash id=%s", alloca_toprint(-1, id, strlen(id)));
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  sqlite3_stmt *statement = sqlite_prepare(&retry, "select id from manifests where filehash='%s'", id);
+  sqlite3_stmt *statement = sqlite_prepare(&retry, "select id from manifests where filehash=?");
+  if (statement && rhizome_bind_key(statement, 1, id) == -1) {
+    sqlite3_finalize(statement);
+    statement = NULL;
+  }
   if (!statement)
     return WHYF("Could not drop stored file id=%s", id);
   int can_drop = 1;
   while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
     /* Find manifests for this file */
-    if (sqlite3_column_type(statement, 0) != SQLITE_TEXT) {
+    char manifestId[RHIZOME_MANIFEST_ID_STRLEN + 1];
+    if (!rhizome_column_key(statement, 0, manifestId, sizeof manifestId)) {
       WHYF("Incorrect type in id column of manifests table");
       break;
     }
-    const char *manifestId = (char *) sqlite3_column_text(statement, 0);
     /* Check that manifest is not part of a higher priority group.
 	If so, we cannot drop the manifest or the file.
 	However, we will keep iterating, as we can still drop any other manifests pointing to this file
@@ -594,14 +1059,19 @@ int rhizome_drop_stored_file(const char *id,int maximum_priority)
     } else {
       if (debug & DEBUG_RHIZOME)
 	DEBUGF("removing stale manifests, groupmemberships");
-      sqlite_exec_void_retry(&retry, "delete from manifests where id='%s';", manifestId);
+      sqlite_exec_void_key_retry(&retry, manifestId, "delete from manifests where id=?;");
+      sqlite_exec_void_key_retry(&retry, manifestId, "delete from geoboxes where id=?;");
       sqlite_exec_void_retry(&retry, "delete from keypairs where public='%s';", manifestId);
-      sqlite_exec_void_retry(&retry, "delete from groupmemberships where manifestid='%s';", manifestId);
+      sqlite_exec_void_key_retry(&retry, manifestId, "delete from groupmemberships where manifestid=?;");
     }
   }
   sqlite3_finalize(statement);
-  if (can_drop)
-    sqlite_exec_void_retry(&retry, "delete from files where id='%s';",id);
+  if (can_drop) {
+    long long length = 0;
+    if (sqlite_exec_int64_key_retry(&retry, &length, id, "select length from files where id=?;") == 1
+      && sqlite_exec_void_key_retry(&retry, id, "delete from files where id=?;") == 0)
+      rhizome_database_usage_adjust(-length);
+  }
   return 0;
 }
 
@@ -674,15 +1144,16 @@ int rhizome_store_bundle(rhizome_manifest *m)
     return -1;
 
   sqlite3_stmt *stmt;
-  if ((stmt = sqlite_prepare(&retry, "INSERT OR REPLACE INTO MANIFESTS(id,manifest,version,inserttime,bar,filesize,filehash) VALUES(?,?,?,?,?,?,?);")) == NULL)
+  if ((stmt = sqlite_prepare(&retry, "INSERT OR REPLACE INTO MANIFESTS(id,manifest,version,inserttime,bar,filesize,filehash,sizebin) VALUES(?,?,?,?,?,?,?,?);")) == NULL)
+    goto rollback;
+  if (rhizome_bind_key(stmt, 1, manifestid) == -1 || rhizome_bind_key(stmt, 7, filehash) == -1)
     goto rollback;
-  if (!(   sqlite_code_ok(sqlite3_bind_text(stmt, 1, manifestid, -1, SQLITE_TRANSIENT))
-        && sqlite_code_ok(sqlite3_bind_blob(stmt, 2, m->manifestdata, m->manifest_bytes, SQLITE_TRANSIENT))
+  if (!(   sqlite_code_ok(sqlite3_bind_blob(stmt, 2, m->manifestdata, m->manifest_bytes, SQLITE_TRANSIENT))
 	&& sqlite_code_ok(sqlite3_bind_int64(stmt, 3, m->version))
 	&& sqlite_code_ok(sqlite3_bind_int64(stmt, 4, (long long) gettime_ms()))
 	&& sqlite_code_ok(sqlite3_bind_blob(stmt, 5, bar, RHIZOME_BAR_BYTES, SQLITE_TRANSIENT))
 	&& sqlite_code_ok(sqlite3_bind_int64(stmt, 6, m->fileLength))
-	&& sqlite_code_ok(sqlite3_bind_text(stmt, 7, filehash, -1, SQLITE_TRANSIENT))
+	&& sqlite_code_ok(sqlite3_bind_int(stmt, 8, rhizome_size_bin(m->fileLength)))
   )) {
     WHYF("query failed, %s: %s", sqlite3_errmsg(rhizome_db), sqlite3_sql(stmt));
     goto rollback;
@@ -691,6 +1162,8 @@ int rhizome_store_bundle(rhizome_manifest *m)
     goto rollback;
   sqlite3_finalize(stmt);
   stmt = NULL;
+  if (rhizome_index_geobox(&retry, manifestid, bar) == -1)
+    goto rollback;
 
   // we might need to leave the old file around for a bit
   // clean out unreferenced files first
@@ -704,6 +1177,8 @@ int rhizome_store_bundle(rhizome_manifest *m)
     goto rollback;
   sqlite3_finalize(stmt);
   stmt = NULL;
+  if (sqlite3_changes(rhizome_db))
+    rhizome_database_usage_invalidate();
 
   if (rhizome_manifest_get(m,"isagroup",NULL,0)!=NULL) {
     int closed=rhizome_manifest_get_ll(m,"closedgroup");
@@ -712,8 +1187,9 @@ int rhizome_store_bundle(rhizome_manifest *m)
     if (ciphered<1) ciphered=0;
     if ((stmt = sqlite_prepare(&retry, "INSERT OR REPLACE INTO GROUPLIST(id,closed,ciphered,priority) VALUES (?,?,?,?);")) == NULL)
       goto rollback;
-    if (!(   sqlite_code_ok(sqlite3_bind_text(stmt, 1, manifestid, -1, SQLITE_TRANSIENT))
-          && sqlite_code_ok(sqlite3_bind_int(stmt, 2, closed))
+    if (rhizome_bind_key(stmt, 1, manifestid) == -1)
+      goto rollback;
+    if (!(   sqlite_code_ok(sqlite3_bind_int(stmt, 2, closed))
           && sqlite_code_ok(sqlite3_bind_int(stmt, 3, ciphered))
           && sqlite_code_ok(sqlite3_bind_int(stmt, 4, RHIZOME_PRIORITY_DEFAULT))
     )) {
@@ -731,12 +1207,8 @@ int rhizome_store_bundle(rhizome_manifest *m)
       goto rollback;
     int i;
     for (i=0;i<m->group_count;i++){
-      if (!(   sqlite_code_ok(sqlite3_bind_text(stmt, 1, manifestid, -1, SQLITE_TRANSIENT))
-	    && sqlite_code_ok(sqlite3_bind_text(stmt, 2, m->groups[i], -1, SQLITE_TRANSIENT))
-      )) {
-	WHYF("query failed, %s: %s", sqlite3_errmsg(rhizome_db), sqlite3_sql(stmt));
+      if (rhizome_bind_key(stmt, 1, manifestid) == -1 || rhizome_bind_key(stmt, 2, m->groups[i]) == -1)
 	goto rollback;
-      }
       if (sqlite_step_retry(&retry, stmt) == -1)
 	goto rollback;
       sqlite3_reset(stmt);
@@ -785,8 +1257,9 @@ int rhizome_list_manifests(const char *service, const char *sender_sid, const ch
   cli_puts("name"); cli_delim("\n"); // should be last, because name may contain ':'
   while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
     ++rows;
+    char q_manifestid[RHIZOME_MANIFEST_ID_STRLEN + 1];
     if (!(   sqlite3_column_count(statement) == 4
-	  && sqlite3_column_type(statement, 0) == SQLITE_TEXT
+	  && rhizome_column_key(statement, 0, q_manifestid, sizeof q_manifestid)
 	  && sqlite3_column_type(statement, 1) == SQLITE_BLOB
 	  && sqlite3_column_type(statement, 2) == SQLITE_INTEGER
 	  && sqlite3_column_type(statement, 3) == SQLITE_INTEGER
@@ -799,7 +1272,6 @@ int rhizome_list_manifests(const char *service, const char *sender_sid, const ch
       ret = WHY("Out of manifests");
       break;
     }
-    const char *q_manifestid = (const char *) sqlite3_column_text(statement, 0);
     const char *manifestblob = (char *) sqlite3_column_blob(statement, 1);
     size_t manifestblobsize = sqlite3_column_bytes(statement, 1); // must call after sqlite3_column_blob()
     long long q_version = sqlite3_column_int64(statement, 2);
@@ -807,15 +1279,15 @@ int rhizome_list_manifests(const char *service, const char *sender_sid, const ch
     if (rhizome_read_manifest_file(m, manifestblob, manifestblobsize) == -1) {
       WARNF("MANIFESTS row id=%s has invalid manifest blob -- skipped", q_manifestid);
     } else {
-      long long blob_version = rhizome_manifest_get_ll(m, "version");
+      long long blob_version = rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_VERSION);
       if (blob_version != q_version)
 	WARNF("MANIFESTS row id=%s version=%lld does not match manifest blob.version=%lld", q_manifestid, q_version, blob_version);
       int match = 1;
-      const char *blob_service = rhizome_manifest_get(m, "service", NULL, 0);
+      const char *blob_service = rhizome_manifest_get_field(m, RHIZOME_FIELD_SERVICE);
       if (service[0] && !(blob_service && strcasecmp(service, blob_service) == 0))
 	match = 0;
-      const char *blob_sender = rhizome_manifest_get(m, "sender", NULL, 0);
-      const char *blob_recipient = rhizome_manifest_get(m, "recipient", NULL, 0);
+      const char *blob_sender = rhizome_manifest_get_field(m, RHIZOME_FIELD_SENDER);
+      const char *blob_recipient = rhizome_manifest_get_field(m, RHIZOME_FIELD_RECIPIENT);
       if (match && sender_sid[0]) {
 	if (!(blob_sender && strcasecmp(sender_sid, blob_sender) == 0))
 	  match = 0;
@@ -825,10 +1297,10 @@ int rhizome_list_manifests(const char *service, const char *sender_sid, const ch
 	  match = 0;
       }
       if (match) {
-	const char *blob_name = rhizome_manifest_get(m, "name", NULL, 0);
-	long long blob_date = rhizome_manifest_get_ll(m, "date");
-	const char *blob_filehash = rhizome_manifest_get(m, "filehash", NULL, 0);
-	long long blob_filesize = rhizome_manifest_get_ll(m, "filesize");
+	const char *blob_name = rhizome_manifest_get_field(m, RHIZOME_FIELD_NAME);
+	long long blob_date = rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_DATE);
+	const char *blob_filehash = rhizome_manifest_get_field(m, RHIZOME_FIELD_FILEHASH);
+	long long blob_filesize = rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_FILESIZE);
 	int self_signed = rhizome_is_self_signed(m) ? 0 : 1;
 	if (debug & DEBUG_RHIZOME) DEBUGF("manifest payload size = %lld", blob_filesize);
 	cli_puts(blob_service ? blob_service : ""); cli_delim(":");
@@ -850,6 +1322,48 @@ int rhizome_list_manifests(const char *service, const char *sender_sid, const ch
   RETURN(ret);
 }
 
+/* Insert the FILES row for a payload about to be written, at its full length and invisible
+   (datavalid=0) until the payload is complete.  An existing row for the payload is never replaced,
+   as it either holds the payload already or belongs to another write still in progress, so returns
+   1 without inserting if there is one.  Returns 0 with the new row's rowid on success, -1 on error.
+ */
+static int rhizome_insert_file_row(sqlite_retry_state *retry, const char *id, long long length, int priority, int64_t *rowid)
+{
+  sqlite3_stmt *statement = sqlite_prepare(retry, "INSERT INTO FILES(id,data,length,highestpriority,datavalid,inserttime) VALUES(?,?,?,?,0,?);");
+  if (!statement)
+    return -1;
+  if (rhizome_bind_key(statement, 1, id) == -1) {
+    sqlite3_finalize(statement);
+    return -1;
+  }
+  /* Bind appropriate sized zero-filled blob to data field */
+  if (!(   sqlite_code_ok(sqlite3_bind_zeroblob(statement, 2, length))
+	&& sqlite_code_ok(sqlite3_bind_int64(statement, 3, length))
+	&& sqlite_code_ok(sqlite3_bind_int(statement, 4, priority))
+	&& sqlite_code_ok(sqlite3_bind_int64(statement, 5, (long long) gettime_ms()))
+  )) {
+    WHYF("query failed, %s: %s", sqlite3_errmsg(rhizome_db), sqlite3_sql(statement));
+    sqlite3_finalize(statement);
+    return -1;
+  }
+  int stepcode = _sqlite_step_retry(__HERE__, LOG_LEVEL_SILENT, retry, statement);
+  if (stepcode == -1 && sqlite3_errcode(rhizome_db) == SQLITE_CONSTRAINT) {
+    sqlite3_finalize(statement);
+    return 1;
+  }
+  if (stepcode == -1) {
+    WHYF("query failed, %s: %s", sqlite3_errmsg(rhizome_db), sqlite3_sql(statement));
+    sqlite3_finalize(statement);
+    return -1;
+  }
+  sqlite3_finalize(statement);
+  *rowid = sqlite3_last_insert_rowid(rhizome_db);
+  if (*rowid < 1)
+    return WHYF("Failed to get row ID of newly inserted row for fileid=%s", id);
+  rhizome_database_usage_adjust(length);
+  return 0;
+}
+
 /* The following function just stores the file (or silently returns if it already exists).
    The relationships of manifests to this file are the responsibility of the caller. */
 int rhizome_store_file(rhizome_manifest *m,const unsigned char *key)
@@ -870,19 +1384,19 @@ int rhizome_store_file(rhizome_manifest *m,const unsigned char *key)
      has received a manifest and checked that it exists in the database, it may 
      (sensibly) elect not supply the file. Rhizome Direct does this. */
   long long count = 0;
-  if (sqlite_exec_int64(&count, "SELECT COUNT(*) FROM FILES WHERE id='%s' AND datavalid<>0;", hash) < 1) {
+  if (sqlite_exec_int64_key(&count, hash, "SELECT COUNT(*) FROM FILES WHERE id=? AND datavalid<>0;") < 1) {
     WHY("Failed to count stored files");
     goto error;
   }
   if (count >= 1) {
     /* File is already stored, so just update the highestPriority field if required. */
     long long storedPriority = -1;
-    if (sqlite_exec_int64(&storedPriority, "SELECT highestPriority FROM FILES WHERE id='%s' AND datavalid!=0", hash) == -1) {
+    if (sqlite_exec_int64_key(&storedPriority, hash, "SELECT highestPriority FROM FILES WHERE id=? AND datavalid!=0") == -1) {
       WHY("Failed to select highest priority");
       goto error;
     }
     if (storedPriority<priority) {
-      if (sqlite_exec_void("UPDATE FILES SET highestPriority=%d WHERE id='%s';", priority, hash) == -1) {
+      if (sqlite_exec_void_key(hash, "UPDATE FILES SET highestPriority=%d WHERE id=?;", priority) == -1) {
 	WHY("SQLite failed to update highestPriority field for stored file.");
 	goto error;
       }
@@ -922,11 +1436,15 @@ int rhizome_store_file(rhizome_manifest *m,const unsigned char *key)
     goto error;
   }
 
-  /* Okay, so there are no records that match, but we should delete any half-baked record (with datavalid=0) so that the insert below doesn't fail.
-   Don't worry about the return result, since it might not delete any records. */
-  sqlite_exec_void("DELETE FROM FILES WHERE datavalid=0;");
+  /* Okay, so there are no records that match, but there may be a half-baked record (with
+     datavalid=0) of this payload left by a failed write, which would stop the insert below.  Only
+     this payload's row is deleted; streamed writes of other payloads may be in progress. */
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_void_key_retry(&retry, hash, "DELETE FROM FILES WHERE id=? AND datavalid=0;") == 0
+    && sqlite3_changes(rhizome_db))
+    rhizome_database_usage_invalidate();
 
-  /* INSERT INTO FILES(id as text, data blob, length integer, highestpriority integer).
+  /* INSERT INTO FILES(id as blob, data blob, length integer, highestpriority integer).
    BUT, we have to do this incrementally so that we can handle blobs larger than available memory.
   This is possible using:
      int sqlite3_bind_zeroblob(sqlite3_stmt*, int, int n);
@@ -934,33 +1452,22 @@ int rhizome_store_file(rhizome_manifest *m,const unsigned char *key)
   opening a handle to the blob using:
      int sqlite3_blob_write(sqlite3_blob *, const void *z, int n, int iOffset);
   */
-
-  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  sqlite3_stmt *statement = sqlite_prepare(&retry, "INSERT OR REPLACE INTO FILES(id,data,length,highestpriority,datavalid,inserttime) VALUES('%s',?,%lld,%d,0,%lld);",
-	  hash, (long long)m->fileLength, priority, (long long)gettime_ms()
-	);
-  if (!statement)
-    goto insert_row_fail;
-  /* Bind appropriate sized zero-filled blob to data field */
-  if (sqlite3_bind_zeroblob(statement, 1, m->fileLength) != SQLITE_OK) {
-    WHYF("sqlite3_bind_zeroblob() failed: %s: %s", sqlite3_errmsg(rhizome_db), sqlite3_sql(statement));
-    sqlite3_finalize(statement);
-    goto insert_row_fail;
-  }
-  /* Do actual insert, and abort if it fails */
-  if (_sqlite_exec_void_prepared(__HERE__, LOG_LEVEL_ERROR, &retry, statement) == -1) {
-insert_row_fail:
+  int64_t rowid;
+  switch (rhizome_insert_file_row(&retry, hash, m->fileLength, priority, &rowid)) {
+  case 0:
+    break;
+  case 1:
+    /* Stored by someone else since we looked */
+    if (sqlite_exec_int64_key(&count, hash, "SELECT COUNT(*) FROM FILES WHERE id=? AND datavalid<>0;") == 1 && count) {
+      close(fd);
+      return 0;
+    }
+    WHYF("Payload fileid=%s is already being stored", hash);
+    // fall through...
+  default:
     WHYF("Failed to insert row for fileid=%s", hash);
     goto error;
   }
-
-  /* Get rowid for inserted row, so that we can modify the blob */
-  int64_t rowid = sqlite3_last_insert_rowid(rhizome_db);
-  if (rowid<1) {
-    WHYF("query failed, %s: %s", sqlite3_errmsg(rhizome_db), sqlite3_sql(statement));
-    WHYF("Failed to get row ID of newly inserted row for fileid=%s", hash);
-    goto error;
-  }
   // We write the blob inside a transaction so that we can't get SQLITE_BUSY from
   // sqlite3_blob_close(), which cannot be retried.  Using an explicit transaction, defers BUSY
   // detection to the COMMIT, which can be retried.
@@ -1035,10 +1542,14 @@ insert_row_fail:
     goto rollback;
 
   /* Mark file as up-to-date */
-  if (sqlite_exec_void_retry(&retry, "UPDATE FILES SET datavalid=1 WHERE id='%s';", hash) != 0) {
+  if (sqlite_exec_void_key_retry(&retry, hash, "UPDATE FILES SET datavalid=1 WHERE rowid=%lld AND id=?;", (long long) rowid) != 0) {
     WHY("Failed to set datavalid");
     goto error;
   }
+  if (sqlite3_changes(rhizome_db) != 1) {
+    WHYF("Row for fileid=%s was deleted while being stored", hash);
+    goto error;
+  }
 
   close(fd);
   return 0;
@@ -1049,6 +1560,7 @@ rollback_blob:
     sqlite3_blob_close(blob);
 rollback:
   sqlite_exec_void_retry(&retry, "ROLLBACK;");
+  rhizome_database_usage_invalidate();
 error:
   if (fd != -1)
     close(fd);
@@ -1056,6 +1568,181 @@ error:
 }
 
 
+/* Store a payload that arrives a piece at a time, eg, from a socket or an archive, without it
+   ever being written anywhere but the FILES table.  The length and hash must be known in
+   advance (from the manifest), so that the row can be created at its full size and the hash
+   checked as the bytes go by.  Pieces are gathered in a buffer and written into the blob one
+   buffer at a time, each write being its own short transaction, so that nothing is held open
+   between calls and other stores may proceed while the payload trickles in.  The row is
+   invisible (datavalid=0) until rhizome_finish_write() has checked the hash.  If the database is
+   busy, the bytes stay in the buffer, which grows up to RHIZOME_WRITE_BUFFER_MAX, and go in with
+   the next write.
+ */
+int rhizome_open_write(struct rhizome_write *write, const char *expected_hash, long long file_length, int priority)
+{
+  bzero(write, sizeof *write);
+  strncpy(write->id, expected_hash, RHIZOME_FILEHASH_STRLEN);
+  write->id[RHIZOME_FILEHASH_STRLEN] = '\0';
+  str_toupper_inplace(write->id);
+  write->file_length = file_length;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  switch (rhizome_insert_file_row(&retry, write->id, file_length, priority, &write->rowid)) {
+  case 0:
+    break;
+  case 1:
+    return WHYF("Payload fileid=%s is already stored or being stored", write->id);
+  default:
+    return WHYF("Failed to insert row for fileid=%s", write->id);
+  }
+  write->buffer = malloc(RHIZOME_WRITE_BUFFER_SIZE);
+  if (!write->buffer) {
+    rhizome_fail_write(write);
+    return WHY_perror("malloc");
+  }
+  write->buffer_size = RHIZOME_WRITE_BUFFER_SIZE;
+  SHA512_Init(&write->sha512_context);
+  return 0;
+}
+
+/* Write the buffered bytes into the payload's row.  The row is looked up by rowid and id together
+   in the same transaction as the write, so that if it has been deleted, the write fails instead of
+   landing in whatever row has since taken its rowid.
+ */
+static int rhizome_flush_write(struct rhizome_write *write)
+{
+  if (write->data_size == 0)
+    return 0;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;") == -1)
+    return -1;
+  long long count = 0;
+  if (sqlite_exec_int64_key_retry(&retry, &count, write->id, "SELECT COUNT(*) FROM FILES WHERE rowid=%lld AND id=? AND datavalid=0;", (long long) write->rowid) == -1)
+    goto rollback;
+  if (count != 1) {
+    WHYF("Row for fileid=%s was deleted while being stored", write->id);
+    goto rollback;
+  }
+  sqlite3_blob *blob;
+  int ret;
+  do ret = sqlite3_blob_open(rhizome_db, "main", "FILES", "data", write->rowid, 1 /* read/write */, &blob);
+  while (sqlite_code_busy(ret) && sqlite_retry(&retry, "sqlite3_blob_open"));
+  if (ret != SQLITE_OK) {
+    WHYF("sqlite3_blob_open() failed, %s", sqlite3_errmsg(rhizome_db));
+    goto rollback;
+  }
+  sqlite_retry_done(&retry, "sqlite3_blob_open");
+  do ret = sqlite3_blob_write(blob, write->buffer, write->data_size, write->file_offset - write->data_size);
+  while (sqlite_code_busy(ret) && sqlite_retry(&retry, "sqlite3_blob_write"));
+  if (ret != SQLITE_OK) {
+    WHYF("sqlite3_blob_write() failed, %s", sqlite3_errmsg(rhizome_db));
+    sqlite3_blob_close(blob);
+    goto rollback;
+  }
+  sqlite_retry_done(&retry, "sqlite3_blob_write");
+  if (!sqlite_code_ok(sqlite3_blob_close(blob))) {
+    WHYF("sqlite3_blob_close() failed, %s", sqlite3_errmsg(rhizome_db));
+    goto rollback;
+  }
+  if (sqlite_exec_void_retry(&retry, "COMMIT;") == -1)
+    goto rollback;
+  write->data_size = 0;
+  return 0;
+rollback:
+  sqlite_exec_void_retry(&retry, "ROLLBACK;");
+  return -1;
+}
+
+int rhizome_write_buffer(struct rhizome_write *write, const unsigned char *data, int len)
+{
+  if (write->file_offset + len > write->file_length)
+    return WHYF("Too many bytes for fileid=%s, expected %lld", write->id, write->file_length);
+  SHA512_Update(&write->sha512_context, data, len);
+  while (len > 0) {
+    int n = write->buffer_size - write->data_size;
+    if (n > len)
+      n = len;
+    bcopy(data, &write->buffer[write->data_size], n);
+    write->data_size += n;
+    write->file_offset += n;
+    data += n;
+    len -= n;
+    if (write->data_size == write->buffer_size) {
+      rhizome_db_busy = 0;
+      if (rhizome_flush_write(write) == 0)
+	continue;
+      if (!rhizome_db_busy || write->buffer_size >= RHIZOME_WRITE_BUFFER_MAX)
+	return -1;
+      /* Hold on to the bytes until the database will take them */
+      unsigned char *p = realloc(write->buffer, write->buffer_size * 2);
+      if (!p)
+	return WHY_perror("realloc");
+      write->buffer = p;
+      write->buffer_size *= 2;
+      if (debug & DEBUG_RHIZOME)
+	DEBUGF("Database busy, holding %d bytes of fileid=%s", write->data_size, write->id);
+    }
+  }
+  return 0;
+}
+
+/* Returns 0 if the whole payload has been stored and matches its hash, and the write is over.
+   If the database was busy, returns -1 with rhizome_db_busy set and leaves the write open, so that
+   it may be finished by calling again later, or abandoned with rhizome_fail_write().  Otherwise
+   removes the row and returns -1, and the write is over.
+ */
+int rhizome_finish_write(struct rhizome_write *write)
+{
+  if (!write->hash_checked) {
+    if (write->file_offset != write->file_length) {
+      WHYF("Only received %lld of %lld bytes for fileid=%s", write->file_offset, write->file_length, write->id);
+      goto fail;
+    }
+    char hash_out[SHA512_DIGEST_STRING_LENGTH];
+    SHA512_End(&write->sha512_context, hash_out);
+    if (strcasecmp(hash_out, write->id) != 0) {
+      WHYF("Received payload hash %s does not match expected hash %s", hash_out, write->id);
+      goto fail;
+    }
+    write->hash_checked = 1;
+  }
+  rhizome_db_busy = 0;
+  if (rhizome_flush_write(write) == -1)
+    goto busy_or_fail;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_void_key_retry(&retry, write->id, "UPDATE FILES SET datavalid=1 WHERE rowid=%lld AND id=?;", (long long) write->rowid) == -1) {
+    WHY("Failed to set datavalid");
+    goto busy_or_fail;
+  }
+  if (sqlite3_changes(rhizome_db) != 1) {
+    WHYF("Row for fileid=%s was deleted while being stored", write->id);
+    goto fail;
+  }
+  free(write->buffer);
+  write->buffer = NULL;
+  return 0;
+busy_or_fail:
+  if (rhizome_db_busy)
+    return -1;
+fail:
+  rhizome_fail_write(write);
+  return -1;
+}
+
+/* Abandon a payload part way, eg, because the connection delivering it dropped.
+ */
+void rhizome_fail_write(struct rhizome_write *write)
+{
+  if (write->buffer) {
+    free(write->buffer);
+    write->buffer = NULL;
+  }
+  if (write->rowid
+    && sqlite_exec_void_key(write->id, "DELETE FROM FILES WHERE rowid=%lld AND id=? AND datavalid=0;", (long long) write->rowid) == 0
+    && sqlite3_changes(rhizome_db))
+    rhizome_database_usage_adjust(-write->file_length);
+  write->rowid = 0;
+}
+
 void rhizome_bytes_to_hex_upper(unsigned const char *in, char *out, int byteCount)
 {
   (void) tohex(out, in, byteCount);
@@ -1066,14 +1753,13 @@ int rhizome_update_file_priority(const char *fileid)
   /* work out the highest priority of any referrer */
   long long highestPriority = -1;
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  if (sqlite_exec_int64_retry(&retry, &highestPriority,
+  if (sqlite_exec_int64_key_retry(&retry, &highestPriority, fileid,
 	"SELECT max(grouplist.priority) FROM MANIFESTS,GROUPMEMBERSHIPS,GROUPLIST"
-	" where manifests.filehash='%s'"
+	" where manifests.filehash=?"
 	"   AND groupmemberships.manifestid=manifests.id"
-	"   AND groupmemberships.groupid=grouplist.id;",
-	fileid) == -1)
+	"   AND groupmemberships.groupid=grouplist.id;") == -1)
     return -1;
-  if (highestPriority >= 0 && sqlite_exec_void_retry(&retry, "UPDATE files set highestPriority=%lld WHERE id='%s';", highestPriority, fileid) != 0)
+  if (highestPriority >= 0 && sqlite_exec_void_key_retry(&retry, fileid, "UPDATE files set highestPriority=%lld WHERE id=?;", highestPriority) != 0)
     WHYF("cannot update priority for fileid=%s", fileid);
   return 0;
 }
@@ -1085,18 +1771,18 @@ int rhizome_update_file_priority(const char *fileid)
  */
 int rhizome_find_duplicate(const rhizome_manifest *m, rhizome_manifest **found, int checkVersionP)
 {
-  const char *service = rhizome_manifest_get(m, "service", NULL, 0);
+  const char *service = rhizome_manifest_get_field(m, RHIZOME_FIELD_SERVICE);
   const char *name = NULL;
   const char *sender = NULL;
   const char *recipient = NULL;
   if (service == NULL) {
     return WHY("Manifest has no service");
   } else if (strcasecmp(service, RHIZOME_SERVICE_FILE) == 0) {
-    name = rhizome_manifest_get(m, "name", NULL, 0);
+    name = rhizome_manifest_get_field(m, RHIZOME_FIELD_NAME);
     if (!name) return WHY("Manifest has no name");
   } else if (strcasecmp(service, RHIZOME_SERVICE_MESHMS) == 0) {
-    sender = rhizome_manifest_get(m, "sender", NULL, 0);
-    recipient = rhizome_manifest_get(m, "recipient", NULL, 0);
+    sender = rhizome_manifest_get_field(m, RHIZOME_FIELD_SENDER);
+    recipient = rhizome_manifest_get_field(m, RHIZOME_FIELD_RECIPIENT);
     if (!sender) return WHY("Manifest has no sender");
     if (!recipient) return WHY("Manifest has no recipient");
   } else {
@@ -1129,7 +1815,10 @@ int rhizome_find_duplicate(const rhizome_manifest *m, rhizome_manifest **found,
     str_toupper_inplace(filehash);
     if (debug & DEBUG_RHIZOME)
       DEBUGF("filehash=\"%s\"", filehash);
-    sqlite3_bind_text(statement, field++, filehash, -1, SQLITE_STATIC);
+    if (rhizome_bind_key(statement, field++, filehash) == -1) {
+      sqlite3_finalize(statement);
+      return -1;
+    }
   }
   if (checkVersionP)
     sqlite3_bind_int64(statement, field++, m->version);
@@ -1138,22 +1827,23 @@ int rhizome_find_duplicate(const rhizome_manifest *m, rhizome_manifest **found,
     ++rows;
     if (debug & DEBUG_RHIZOME) DEBUGF("Row %d", rows);
     if (!(   sqlite3_column_count(statement) == 3
-	  && sqlite3_column_type(statement, 0) == SQLITE_TEXT
+	  && sqlite3_column_type(statement, 0) == SQLITE_BLOB
 	  && sqlite3_column_type(statement, 1) == SQLITE_BLOB
 	  && sqlite3_column_type(statement, 2) == SQLITE_INTEGER
     )) {
       ret = WHY("Incorrect statement columns");
       break;
     }
-    const char *q_manifestid = (const char *) sqlite3_column_text(statement, 0);
-    size_t manifestidsize = sqlite3_column_bytes(statement, 0); // must call after sqlite3_column_text()
-    unsigned char manifest_id[RHIZOME_MANIFEST_ID_BYTES];
-    if (  manifestidsize != crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES * 2
-      ||  fromhexstr(manifest_id, q_manifestid, RHIZOME_MANIFEST_ID_BYTES) == -1
-    ) {
-      ret = WHYF("Malformed manifest.id from query: %s", q_manifestid);
+    const unsigned char *q_manifest_id = sqlite3_column_blob(statement, 0);
+    size_t manifestidsize = sqlite3_column_bytes(statement, 0); // must call after sqlite3_column_blob()
+    if (manifestidsize != RHIZOME_MANIFEST_ID_BYTES) {
+      ret = WHYF("Malformed manifest.id from query: %s", alloca_tohex(q_manifest_id, manifestidsize));
       break;
     }
+    unsigned char manifest_id[RHIZOME_MANIFEST_ID_BYTES];
+    memcpy(manifest_id, q_manifest_id, RHIZOME_MANIFEST_ID_BYTES);
+    char q_manifestid[RHIZOME_MANIFEST_ID_STRLEN + 1];
+    tohex(q_manifestid, manifest_id, RHIZOME_MANIFEST_ID_BYTES);
     const char *manifestblob = (char *) sqlite3_column_blob(statement, 1);
     size_t manifestblobsize = sqlite3_column_bytes(statement, 1); // must call after sqlite3_column_blob()
     long long q_version = sqlite3_column_int64(statement, 2);
@@ -1167,11 +1857,11 @@ int rhizome_find_duplicate(const rhizome_manifest *m, rhizome_manifest **found,
     } else if (rhizome_manifest_verify(blob_m)) {
       WARNF("MANIFESTS row id=%s fails verification -- skipped", q_manifestid);
     } else {
-      const char *blob_service = rhizome_manifest_get(blob_m, "service", NULL, 0);
-      const char *blob_id = rhizome_manifest_get(blob_m, "id", NULL, 0);
-      long long blob_version = rhizome_manifest_get_ll(blob_m, "version");
-      const char *blob_filehash = rhizome_manifest_get(blob_m, "filehash", NULL, 0);
-      long long blob_filesize = rhizome_manifest_get_ll(blob_m, "filesize");
+      const char *blob_service = rhizome_manifest_get_field(blob_m, RHIZOME_FIELD_SERVICE);
+      const char *blob_id = rhizome_manifest_get_field(blob_m, RHIZOME_FIELD_ID);
+      long long blob_version = rhizome_manifest_get_field_ll(blob_m, RHIZOME_FIELD_VERSION);
+      const char *blob_filehash = rhizome_manifest_get_field(blob_m, RHIZOME_FIELD_FILEHASH);
+      long long blob_filesize = rhizome_manifest_get_field_ll(blob_m, RHIZOME_FIELD_FILESIZE);
       if (debug & DEBUG_RHIZOME)
 	DEBUGF("Consider manifest.service=%s manifest.id=%s manifest.version=%lld", blob_service, q_manifestid, blob_version);
       /* Perform consistency checks, because we're paranoid. */
@@ -1214,15 +1904,15 @@ int rhizome_find_duplicate(const rhizome_manifest *m, rhizome_manifest **found,
       if (!inconsistent) {
 	strbuf b = strbuf_alloca(1024);
 	if (strcasecmp(service, RHIZOME_SERVICE_FILE) == 0) {
-	  const char *blob_name = rhizome_manifest_get(blob_m, "name", NULL, 0);
+	  const char *blob_name = rhizome_manifest_get_field(blob_m, RHIZOME_FIELD_NAME);
 	  if (blob_name && !strcmp(blob_name, name)) {
 	    if (debug & DEBUG_RHIZOME)
 	      strbuf_sprintf(b, " name=\"%s\"", blob_name);
 	    ret = 1;
 	  }
 	} else if (strcasecmp(service, RHIZOME_SERVICE_FILE) == 0) {
-	  const char *blob_sender = rhizome_manifest_get(blob_m, "sender", NULL, 0);
-	  const char *blob_recipient = rhizome_manifest_get(blob_m, "recipient", NULL, 0);
+	  const char *blob_sender = rhizome_manifest_get_field(blob_m, RHIZOME_FIELD_SENDER);
+	  const char *blob_recipient = rhizome_manifest_get_field(blob_m, RHIZOME_FIELD_RECIPIENT);
 	  if (blob_sender && !strcasecmp(blob_sender, sender) && blob_recipient && !strcasecmp(blob_recipient, recipient)) {
 	    if (debug & DEBUG_RHIZOME)
 	      strbuf_sprintf(b, " sender=%s recipient=%s", blob_sender, blob_recipient);
@@ -1266,14 +1956,13 @@ int rhizome_retrieve_manifest(const char *manifestid, rhizome_manifest **mp)
   sqlite3_stmt *statement = sqlite_prepare(&retry, "SELECT id, manifest, version, inserttime FROM manifests WHERE id = ?");
   if (!statement)
     return -1;
-  char manifestIdUpper[RHIZOME_MANIFEST_ID_STRLEN + 1];
-  tohex(manifestIdUpper, manifest_id, RHIZOME_MANIFEST_ID_BYTES);
-  sqlite3_bind_text(statement, 1, manifestIdUpper, -1, SQLITE_STATIC);
+  sqlite3_bind_blob(statement, 1, manifest_id, RHIZOME_MANIFEST_ID_BYTES, SQLITE_STATIC);
   int ret = 0;
   rhizome_manifest *m = NULL;
   while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    char q_manifestid[RHIZOME_MANIFEST_ID_STRLEN + 1];
     if (!(   sqlite3_column_count(statement) == 4
-	  && sqlite3_column_type(statement, 0) == SQLITE_TEXT
+	  && rhizome_column_key(statement, 0, q_manifestid, sizeof q_manifestid)
 	  && sqlite3_column_type(statement, 1) == SQLITE_BLOB
 	  && sqlite3_column_type(statement, 2) == SQLITE_INTEGER
 	  && sqlite3_column_type(statement, 3) == SQLITE_INTEGER
@@ -1281,7 +1970,6 @@ int rhizome_retrieve_manifest(const char *manifestid, rhizome_manifest **mp)
       ret = WHY("Incorrect statement column");
       break;
     }
-    const char *q_manifestid = (const char *) sqlite3_column_text(statement, 0);
     const char *manifestblob = (char *) sqlite3_column_blob(statement, 1);
     size_t manifestblobsize = sqlite3_column_bytes(statement, 1); // must call after sqlite3_column_blob()
     if (mp) {
@@ -1295,15 +1983,15 @@ int rhizome_retrieve_manifest(const char *manifestid, rhizome_manifest **mp)
       } else {
 	ret = 1;
 	memcpy(m->cryptoSignPublic, manifest_id, RHIZOME_MANIFEST_ID_BYTES);
-	const char *blob_service = rhizome_manifest_get(m, "service", NULL, 0);
+	const char *blob_service = rhizome_manifest_get_field(m, RHIZOME_FIELD_SERVICE);
 	if (blob_service == NULL)
 	  ret = WHY("Manifest is missing 'service' field");
-	long long filesizeq = rhizome_manifest_get_ll(m, "filesize");
+	long long filesizeq = rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_FILESIZE);
 	if (filesizeq == -1)
 	  ret = WHY("Manifest is missing 'filesize' field");
 	else
 	  m->fileLength = filesizeq;
-	const char *blob_filehash = rhizome_manifest_get(m, "filehash", NULL, 0);
+	const char *blob_filehash = rhizome_manifest_get_field(m, RHIZOME_FIELD_FILEHASH);
 	if (m->fileLength != 0) {
 	  if (blob_filehash == NULL)
 	    ret = WHY("Manifest is missing 'filehash' field");
@@ -1317,7 +2005,7 @@ int rhizome_retrieve_manifest(const char *manifestid, rhizome_manifest **mp)
 	  m->fileHexHash[0] = '\0';
 	  m->fileHashedP = 0;
 	}
-	long long blob_version = rhizome_manifest_get_ll(m, "version");
+	long long blob_version = rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_VERSION);
 	if (blob_version == -1)
 	  ret = WHY("Manifest is missing 'version' field");
 	else
@@ -1367,16 +2055,16 @@ int rhizome_retrieve_file(const char *fileid, const char *filepath, const unsign
   if (!statement)
     return -1;
   int ret = 0;
+  if (rhizome_bind_key(statement, 1, fileid) == -1) {
+    sqlite3_finalize(statement);
+    return -1;
+  }
   char fileIdUpper[RHIZOME_FILEHASH_STRLEN + 1];
-  strncpy(fileIdUpper, fileid, sizeof fileIdUpper);
-  fileIdUpper[RHIZOME_FILEHASH_STRLEN] = '\0';
-  str_toupper_inplace(fileIdUpper);
-  sqlite3_bind_text(statement, 1, fileIdUpper, -1, SQLITE_STATIC);
   int stepcode = sqlite_step_retry(&retry, statement);
   if (stepcode != SQLITE_ROW) {
     ret = 0; // no files found
   } else if (!(   sqlite3_column_count(statement) == 3
-		  && sqlite3_column_type(statement, 0) == SQLITE_TEXT
+		  && rhizome_column_key(statement, 0, fileIdUpper, sizeof fileIdUpper)
 		  && sqlite3_column_type(statement, 1) == SQLITE_INTEGER
 		  && sqlite3_column_type(statement, 2) == SQLITE_INTEGER
   )) { 
@@ -1392,7 +2080,7 @@ int rhizome_retrieve_file(const char *fileid, const char *filepath, const unsign
       ret = WHY("Could not open blob for reading");
     } else {
       cli_puts("filehash"); cli_delim(":");
-      cli_puts((const char *)sqlite3_column_text(statement, 0)); cli_delim("\n");
+      cli_puts(fileIdUpper); cli_delim("\n");
       cli_puts("filesize"); cli_delim(":");
       cli_printf("%lld", length); cli_delim("\n");
       ret = 1;
@@ -1484,7 +2172,7 @@ int rhizome_import_from_files(const char *manifestpath,const char *filepath)
 	status = 0;
       }
       if (status != -1) {
-	const char *service = rhizome_manifest_get(m, "service", NULL, 0);
+	const char *service = rhizome_manifest_get_field(m, RHIZOME_FIELD_SERVICE);
 	if (service) {
 	  cli_puts("service");
 	  cli_delim(":");
@@ -1507,7 +2195,7 @@ int rhizome_import_from_files(const char *manifestpath,const char *filepath)
 	  cli_puts(m->fileHexHash);
 	  cli_delim("\n");
 	}
-	const char *name = rhizome_manifest_get(m, "name", NULL, 0);
+	const char *name = rhizome_manifest_get_field(m, RHIZOME_FIELD_NAME);
 	if (name) {
 	  cli_puts("name");
 	  cli_delim(":");
@@ -114,6 +114,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 rhizome_direct_sync_request *rd_sync_handles[RHIZOME_DIRECT_MAX_SYNC_HANDLES];
 int rd_sync_handle_count=0;
+/* Syncs that have concluded having failed to send some of their cursor fills */
+int rd_sync_failures=0;
 
 /* Create (but don't start) a rhizome direct sync request. 
    This creates the record to say that we want to undertake this synchronisation,
@@ -152,6 +154,8 @@ rhizome_direct_sync_request
   r->pushP=mode&1;
   r->pullP=mode&2;
   r->interval=interval;
+  r->max_fills_in_flight=(int) confValueGetInt64Range("rhizome.direct.max_enquiries", 4, 1, 64);
+  r->reconcile=confValueGetBoolean("rhizome.direct.reconcile", 0);
   r->cursor=rhizome_direct_bundle_iterator(buffer_size);
   assert(r->cursor);
   
@@ -169,9 +173,38 @@ int rhizome_direct_start_sync_request(rhizome_direct_sync_request *r)
 
   r->syncs_started++;
 
+  if (r->reconcile) {
+    r->range_count=0;
+    if (rhizome_direct_reconcile_start(r))
+      return -1;
+  }
+
   return rhizome_direct_continue_sync_request(r);  
 }
 
+/* Return true if the cursor has explored all of the BAR address space and bundle data size bins.
+ */
+static int rhizome_direct_cursor_exhausted(rhizome_direct_sync_request *r)
+{
+  if (r->cursor->size_high>=r->cursor->limit_size_high)
+    {
+      DEBUG("Out of bins");
+      if (memcmp(r->cursor->bid_low,r->cursor->limit_bid_high,
+		 RHIZOME_MANIFEST_ID_BYTES)>=0)
+	{
+	  DEBUG("out of BIDs");
+	  return 1;
+	} else
+	DEBUGF("bid_low<limit_bid_high");
+    }
+  return 0;
+}
+
+/* Dispatch cursor fills until the transport has as many outstanding as it may, and conclude the
+   sync once the cursor is exhausted and every response and transfer has finished.  The transport
+   calls this again whenever a response has been processed or its transfers have progressed, so
+   it may be called any number of times per fill.  The sync request may be freed by this call.
+ */
 int rhizome_direct_continue_sync_request(rhizome_direct_sync_request *r)
 {
   assert(r);
@@ -186,38 +219,56 @@ int rhizome_direct_continue_sync_request(rhizome_direct_sync_request *r)
      In short, if the cursor's current position is the limit position, 
      then we can stop. 
   */
-
-  if (r->cursor->size_high>=r->cursor->limit_size_high)
+  if (r->reconcile)
     {
-      DEBUG("Out of bins");
-      if (memcmp(r->cursor->bid_low,r->cursor->limit_bid_high,
-		 RHIZOME_MANIFEST_ID_BYTES)>=0)
+      /* Reconciliation is over once no range remains to be compared */
+      int count=0;
+      while (!r->fills_failed && r->fills_in_flight<r->max_fills_in_flight && r->range_count>0)
+	{
+	  count=rhizome_direct_reconcile_fill(r);
+	  DEBUGF("Sending %d ranges",count);
+	  r->fills_in_flight++;
+	  r->fills_sent++;
+	  r->dispatch_function(r);
+	}
+      if (r->fills_in_flight==0 && (r->fills_failed || r->range_count==0))
 	{
-	  DEBUG("out of BIDs");
-	  /* Sync has finished.
-	     The transport may have initiated one or more transfers, so
-	     we cannot declare the sync complete until we know the transport
-	     has finished transferring. */
 	  if (!r->bundle_transfers_in_progress)
-	    {
-	      /* seems that all is done */
-	      DEBUG("All done");
-	      return rhizome_direct_conclude_sync_request(r);
-	    } else 
-	    DEBUG("Stuck on in-progress transfers");
-	} else
-	DEBUGF("bid_low<limit_bid_high");
+	    return rhizome_direct_conclude_sync_request(r);
+	  DEBUG("Stuck on in-progress transfers");
+	}
+      return count;
     }
 
-  int count=rhizome_direct_bundle_iterator_fill(r->cursor,-1);
+  int count=0;
+  while (!r->fills_failed && r->fills_in_flight<r->max_fills_in_flight && !rhizome_direct_cursor_exhausted(r))
+    {
+      count=rhizome_direct_bundle_iterator_fill(r->cursor,-1);
+
+      DEBUGF("Got %d BARs",count);
+      if (debug & DEBUG_RHIZOME)
+	dump("BARs",r->cursor->buffer,
+	     r->cursor->buffer_used+r->cursor->buffer_offset_bytes);
 
-  DEBUGF("Got %d BARs",count);
-  dump("BARs",r->cursor->buffer,
-       r->cursor->buffer_used+r->cursor->buffer_offset_bytes);
-  
-  r->dispatch_function(r);
+      r->fills_in_flight++;
+      r->fills_sent++;
+      r->dispatch_function(r);
+    }
 
-  r->fills_sent++;
+  if (r->fills_in_flight==0 && (r->fills_failed || rhizome_direct_cursor_exhausted(r)))
+    {
+      /* Sync has finished.
+	 The transport may have initiated one or more transfers, so
+	 we cannot declare the sync complete until we know the transport
+	 has finished transferring. */
+      if (!r->bundle_transfers_in_progress)
+	{
+	  /* seems that all is done */
+	  DEBUG("All done");
+	  return rhizome_direct_conclude_sync_request(r);
+	} else 
+	DEBUG("Stuck on in-progress transfers");
+    }
 
   return count;
 }
@@ -226,6 +277,13 @@ int rhizome_direct_conclude_sync_request(rhizome_direct_sync_request *r)
 {
   assert(r);
   r->syncs_completed++;
+  if (r->fills_failed) {
+    WHYF("Rhizome Direct sync failed, %d enquiries could not be sent", r->fills_failed);
+    rd_sync_failures++;
+  }
+  INFOF("Rhizome Direct sync finished: %d enquiries, %lld bytes sent, %lld bytes received, %d bundles pushed, %d pulls requested",
+	r->fills_sent,r->enquiry_bytes_sent,r->enquiry_bytes_received,
+	r->bundles_pushed,r->pulls_requested);
 
   /* reschedule if interval driven?
      if one-shot, should we remove from the list of active sync requests?
@@ -239,6 +297,8 @@ int rhizome_direct_conclude_sync_request(rhizome_direct_sync_request *r)
 	{
 	  DEBUG("Found it");
 	  rhizome_direct_bundle_iterator_free(&r->cursor);
+	  if (r->ranges)
+	    free(r->ranges);
 	  free(r);
 	  
 	  if (i!=rd_sync_handle_count-1)
@@ -312,15 +372,18 @@ rhizome_direct_bundle_cursor *rhizome_direct_get_fill_response
   DEBUGF("themcount=%d, uscount=%d",them_count,us_count);
   while(them<them_count||us<us_count)
     {
-      DEBUGF("them=%d, us=%d",them,us);
+      if (debug & DEBUG_RHIZOME)
+	DEBUGF("them=%d, us=%d",them,us);
       unsigned char *them_bar=&buffer[10+them*RHIZOME_BAR_BYTES];
       unsigned char *us_bar=&usbuffer[10+us*RHIZOME_BAR_BYTES];
       int relation=0;
       if (them<them_count&&us<us_count) {
 	relation=memcmp(them_bar,us_bar,RHIZOME_BAR_COMPARE_BYTES);
-	DEBUGF("relation = %d",relation);
-	dump("them BAR",them_bar,RHIZOME_BAR_BYTES);
-	dump("us BAR",us_bar,RHIZOME_BAR_BYTES);
+	if (debug & DEBUG_RHIZOME) {
+	  DEBUGF("relation = %d",relation);
+	  dump("them BAR",them_bar,RHIZOME_BAR_BYTES);
+	  dump("us BAR",us_bar,RHIZOME_BAR_BYTES);
+	}
       }
       else if (us==us_count) relation=-1; /* they have a bundle we don't have */
       else if (them==them_count) relation=+1; /* we have a bundle they don't have */
@@ -381,7 +444,7 @@ rhizome_direct_bundle_cursor *rhizome_direct_get_fill_response
 		 rhizome_bar_bidprefix_ll(&usbuffer[10+us*RHIZOME_BAR_BYTES]),
 		 rhizome_bar_version(&usbuffer[10+us*RHIZOME_BAR_BYTES]),
 		 rhizome_bar_version(&buffer[10+them*RHIZOME_BAR_BYTES]));
-	} else {
+	} else if (debug & DEBUG_RHIZOME) {
 	  DEBUGF("We both have the same version of %016llx*",
 		 rhizome_bar_bidprefix_ll(&buffer[10+them*RHIZOME_BAR_BYTES]));
 	}
@@ -424,7 +487,7 @@ rhizome_manifest *rhizome_direct_get_manifest(unsigned char *bid_prefix,int pref
   bcopy(bid_prefix,high,prefix_length);
 
   char query[1024];
-  snprintf(query,1024,"SELECT MANIFEST,ROWID FROM MANIFESTS WHERE ID>='%s' AND ID<='%s'",
+  snprintf(query,1024,"SELECT MANIFEST,ROWID FROM MANIFESTS WHERE ID>=x'%s' AND ID<=x'%s'",
 	   alloca_tohex(low,RHIZOME_MANIFEST_ID_BYTES),
 	   alloca_tohex(high,RHIZOME_MANIFEST_ID_BYTES));
   
@@ -494,12 +557,12 @@ int app_rhizome_direct_sync(int argc, const char *const *argv, struct command_li
   /* Get iterator capable of 64KB buffering.
      In future we should parse the sync URL and base the buffer size on the
      transport and allowable traffic volumes. */
-  rhizome_direct_transport_state_http 
-    *state=calloc(sizeof(rhizome_direct_transport_state_http),1);
   const char *sync_url=NULL;
   int peer_count=confValueGetInt64("rhizome.direct.peer.count",0);
   int peer_number=0;
   char peer_var[128];
+  int ret=0;
+  rd_sync_failures=0;
 
   if (argv[3]) {
     peer_count=1;
@@ -510,59 +573,85 @@ int app_rhizome_direct_sync(int argc, const char *const *argv, struct command_li
     DEBUG("No rhizome direct peers were configured or supplied.");
   }
 
-  /* XXX This code runs each sync in series, when we can probably do them in
-     parallel.  But we can't really do them in parallel until we make the
-     synchronisation process fully asynchronous, which probably won't happen
-     for a while yet.
-     Also, we don't currently parse the URI protocol field fully. */
- next_peer:
-  if (!sync_url) {
-    snprintf(peer_var,128,"rhizome.direct.peer.%d",peer_number);
-    sync_url=confValueGet(peer_var, NULL);
-  }
-   
-  if (strlen(sync_url)>1020)
-    {
-      DEBUG("rhizome direct URI too long");
-      return -1;
+  /* The synchronisation process is fully asynchronous, so all peers are synced
+     in parallel.  We don't currently parse the URI protocol field fully. */
+  for (peer_number=0; peer_number<peer_count; peer_number++, sync_url=NULL) {
+    if (!sync_url) {
+      snprintf(peer_var,128,"rhizome.direct.peer.%d",peer_number);
+      sync_url=confValueGet(peer_var, NULL);
     }
+    if (!sync_url) {
+      DEBUGF("%s is not configured", peer_var);
+      continue;
+    }
+     
+    if (strlen(sync_url)>1020)
+      {
+	WHY("rhizome direct URI too long");
+	ret=-1;
+	break;
+      }
 
-  char protocol[1024];
-  state->port=RHIZOME_HTTP_PORT;
-  int ok=0;
-  if (sscanf(sync_url,"%[^:]://%[^:]:%d",protocol,state->host,&state->port)>=2)
-    ok=1;
-  if (!ok) sprintf(protocol,"http");
-  if ((!ok)&&(sscanf(sync_url,"%[^:]:%d",state->host,&state->port)>=1))
-    ok=2;
-  if (!ok)
-    {
-      DEBUG("could not parse rhizome direct URI");     
-      return -1;
-    } 
-  DEBUGF("Rhizome direct peer is %s://%s:%d (parse route %d)",
-	 protocol,state->host,state->port,ok);
+    rhizome_direct_transport_state_http 
+      *state=calloc(sizeof(rhizome_direct_transport_state_http),1);
+    assert(state!=NULL);
+    char protocol[1024];
+    state->port=RHIZOME_HTTP_PORT;
+    int ok=0;
+    if (sscanf(sync_url,"%[^:]://%[^:]:%d",protocol,state->host,&state->port)>=2)
+      ok=1;
+    if (!ok) sprintf(protocol,"http");
+    if ((!ok)&&(sscanf(sync_url,"%[^:]:%d",state->host,&state->port)>=1))
+      ok=2;
+    if (!ok)
+      {
+	WHY("could not parse rhizome direct URI");     
+	free(state);
+	ret=-1;
+	break;
+      } 
+    DEBUGF("Rhizome direct peer is %s://%s:%d (parse route %d)",
+	   protocol,state->host,state->port,ok);
+
+    if (strcasecmp(protocol,"http")) {
+      WHY("Unsupport Rhizome Direct synchronisation protocol."
+	    "  Only HTTP is supported at present.");
+      free(state);
+      ret=-1;
+      break;
+    }
 
-  if (strcasecmp(protocol,"http")) {
-    DEBUG("Unsupport Rhizome Direct synchronisation protocol."
-	  "  Only HTTP is supported at present.");
-    return -1;
+    struct hostent *hostent = gethostbyname(state->host);
+    if (!hostent) {
+      DEBUGF("could not resolve hostname %s", state->host);
+      free(state);
+      continue;
+    }
+    state->addr.sin_family = AF_INET;
+    state->addr.sin_port = htons(state->port);
+    state->addr.sin_addr = *((struct in_addr *)hostent->h_addr);
+    state->max_pushes=(int) confValueGetInt64Range("rhizome.direct.max_pushes", 4, 1, 64);
+    state->push_batch=(int) confValueGetInt64Range("rhizome.direct.push_batch", 64, 1, 1024);
+    
+    rhizome_direct_sync_request 
+      *s = rhizome_direct_new_sync_request(rhizome_direct_http_dispatch,
+					   65536,0,mode,state);
+    if (!s) {
+      free(state);
+      continue;
+    }
+    state->sync = s;
+    
+    rhizome_direct_start_sync_request(s);
   }
   
-  rhizome_direct_sync_request 
-    *s = rhizome_direct_new_sync_request(rhizome_direct_http_dispatch,
-					 65536,0,mode,state);
-  
-  rhizome_direct_start_sync_request(s);
-  
-  if (rd_sync_handle_count>0)
-    while(fd_poll()&&(rd_sync_handle_count>0)) continue;   
-  
-  sync_url=NULL;
-  peer_number++;
-  if (peer_number<peer_count) goto next_peer;
+  /* Even if a peer could not be started, wait for those that were, as nothing else will */
+  while (rd_sync_handle_count>0)
+    fd_poll();
+  if (rd_sync_failures)
+    ret=-1;
 
-  return 0;
+  return ret;
 }
  
 rhizome_direct_bundle_cursor *rhizome_direct_bundle_iterator(int buffer_size)
@@ -574,7 +663,7 @@ rhizome_direct_bundle_cursor *rhizome_direct_bundle_iterator(int buffer_size)
   r->buffer_size=buffer_size;
 
   r->size_low=0;
-  r->size_high=1024;
+  r->size_high=RHIZOME_SIZE_BIN_BYTES;
 
   /* Make cursor initially unlimited in range */
   rhizome_direct_bundle_iterator_unlimit(r);
@@ -586,7 +675,7 @@ void rhizome_direct_bundle_iterator_unlimit(rhizome_direct_bundle_cursor *r)
 {
   assert(r!=NULL);
 
-  r->limit_size_high=1LL<<48LL;
+  r->limit_size_high=RHIZOME_SIZE_BIN_LIMIT;
   memset(r->limit_bid_high,0xff,RHIZOME_MANIFEST_ID_BYTES);
   return;
 }
@@ -646,7 +735,7 @@ int rhizome_direct_bundle_iterator_unpickle_range(rhizome_direct_bundle_cursor *
   /* Get start of range */
   r->size_high=1LL<<pickled[0];
   r->size_low=(r->size_high/2)+1;
-  if (r->size_high<=1024) r->size_low=0;
+  if (r->size_high<=RHIZOME_SIZE_BIN_BYTES) r->size_low=0;
   for(v=0;v<4;v++) r->bid_low[v]=pickled[1+v];
   for(;v<RHIZOME_MANIFEST_ID_BYTES;v++) r->bid_low[v]=0x00;
 
@@ -714,7 +803,7 @@ int rhizome_direct_bundle_iterator_fill(rhizome_direct_bundle_cursor *c,int max_
 	/* no more matches in this size bin, so move up a size bin */
 	c->size_low=c->size_high+1;
 	c->size_high*=2;
-	if (c->size_high<=1024) c->size_low=0;
+	if (c->size_high<=RHIZOME_SIZE_BIN_BYTES) c->size_low=0;
 	DEBUGF("size=%lld..%lld",c->size_low,c->size_high);
 	/* Record that we covered to the end of that size bin */
 	memset(c->bid_high,0xff,RHIZOME_MANIFEST_ID_BYTES);
@@ -758,11 +847,12 @@ void rhizome_direct_bundle_iterator_free(rhizome_direct_bundle_cursor **c)
    This is used by the cursor wrapper function that passes over all of the
    BARs in prioritised order.
 
-   XXX Once the rhizome database gets big, we will need to make sure
-   that we have suitable indexes.  It is tempting to just pack BARs
-   by row_id, but the far end needs them in an orderly manner so that
-   it is possible to make provably complete comparison of the contents
-   of the respective rhizome databases.
+   The size range is always one cursor size bin, and the BAR begins with the BID
+   prefix, so the BID range is also expressed as a range of BARs.  That lets the
+   query seek the (SIZEBIN, BAR, ID, FILESIZE) covering index to the start of the
+   range within the bin and walk it in BAR order, so each fill costs a seek plus
+   the rows it returns, however sparse or dense the bin, without sorting or
+   touching the table.
 */
 int rhizome_direct_get_bars(const unsigned char bid_low[RHIZOME_MANIFEST_ID_BYTES],
 			    unsigned char bid_high[RHIZOME_MANIFEST_ID_BYTES],
@@ -772,84 +862,62 @@ int rhizome_direct_get_bars(const unsigned char bid_low[RHIZOME_MANIFEST_ID_BYTE
 			    int bars_requested)
 {
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  char query[1024];
-
-  snprintf(query,1024,
-	   "SELECT BAR,ROWID,ID,FILESIZE FROM MANIFESTS"
+  unsigned char bar_low[RHIZOME_BAR_BYTES];
+  unsigned char bar_high[RHIZOME_BAR_BYTES];
+  memset(bar_low,0x00,RHIZOME_BAR_BYTES);
+  memset(bar_high,0xff,RHIZOME_BAR_BYTES);
+  bcopy(bid_low,&bar_low[RHIZOME_BAR_PREFIX_OFFSET],RHIZOME_BAR_PREFIX_BYTES);
+  bcopy(bid_max,&bar_high[RHIZOME_BAR_PREFIX_OFFSET],RHIZOME_BAR_PREFIX_BYTES);
+
+  sqlite3_stmt *statement=sqlite_prepare(&retry,
+	   "SELECT BAR,ID,FILESIZE FROM MANIFESTS"
 	   " WHERE"
-	   " FILESIZE BETWEEN %lld AND %lld"
-	   " AND ID>='%s' AND ID<='%s'"
-	   // The following formulation doesn't remove the weird returning of
-	   // bundles with out of range filesize values
-	   //	   " WHERE ID>='%s' AND ID<='%s' AND FILESIZE > %lld AND FILESIZE < %lld"
+	   " SIZEBIN = %d"
+	   " AND BAR BETWEEN x'%s' AND x'%s'"
+	   " AND FILESIZE BETWEEN %lld AND %lld"
+	   " AND ID BETWEEN x'%s' AND x'%s'"
 	   " ORDER BY BAR LIMIT %d;",
+	   rhizome_size_bin(size_high),
+	   alloca_tohex(bar_low,RHIZOME_BAR_BYTES),
+	   alloca_tohex(bar_high,RHIZOME_BAR_BYTES),
 	   size_low, size_high,
 	   alloca_tohex(bid_low,RHIZOME_MANIFEST_ID_BYTES),
 	   alloca_tohex(bid_max,RHIZOME_MANIFEST_ID_BYTES),
 	   bars_requested);
-
-  sqlite3_stmt *statement=sqlite_prepare(&retry, query);
-  sqlite3_blob *blob=NULL;  
+  if (!statement)
+    return 0;
 
   int bars_written=0;
   
   while(bars_written<bars_requested
 	&&  sqlite_step_retry(&retry, statement) == SQLITE_ROW)
     {
-      int column_type=sqlite3_column_type(statement, 0);
-      switch(column_type) {
-      case SQLITE_BLOB:
-	if (blob)
-	  sqlite3_blob_close(blob);
-	blob = NULL;
-	int ret;
-	int64_t filesize = sqlite3_column_int64(statement, 3);
-	if (filesize<size_low||filesize>size_high) {
-	  DEBUGF("WEIRDNESS ALERT: filesize=%lld, but query was: %s",
-		 filesize,query);
-	  break;
-	} 
-	int64_t rowid = sqlite3_column_int64(statement, 1);
-	do ret = sqlite3_blob_open(rhizome_db, "main", "manifests", "bar",
-				   rowid, 0 /* read only */, &blob);
-	while (sqlite_code_busy(ret) && sqlite_retry(&retry, "sqlite3_blob_open"));
-	if (!sqlite_code_ok(ret)) {
-	  WHYF("sqlite3_blob_open() failed, %s", sqlite3_errmsg(rhizome_db));
-	  continue;
-	}
-	sqlite_retry_done(&retry, "sqlite3_blob_open");
-	
-	int blob_bytes=sqlite3_blob_bytes(blob);
-	if (blob_bytes!=RHIZOME_BAR_BYTES) {
-	  if (debug&DEBUG_RHIZOME)
-	    DEBUG("Found a BAR that is the wrong size - ignoring");
-	  sqlite3_blob_close(blob);
-	  blob=NULL;
-	  continue;
-	}	
-	sqlite3_blob_read(blob,&bars_out[bars_written*RHIZOME_BAR_BYTES],
-			  RHIZOME_BAR_BYTES,0);
-	sqlite3_blob_close(blob);
-	blob=NULL;
-
-	/* Remember the BID so that we cant write it into bid_high so that the
-	   caller knows how far we got. */
-	fromhex(bid_high,
-		(const char *)sqlite3_column_text(statement, 2),
-		RHIZOME_MANIFEST_ID_BYTES);
-
-	bars_written++;
-	break;
-      default:
-	/* non-BLOB field.  This is an error, but we will persevere with subsequent
-	   rows, because they might be fine. */
-	break;
-      }
+      /* non-BLOB or wrongly sized BARs are an error, but we will persevere with
+	 subsequent rows, because they might be fine. */
+      if (sqlite3_column_type(statement, 0)!=SQLITE_BLOB)
+	continue;
+      int64_t filesize = sqlite3_column_int64(statement, 2);
+      if (filesize<size_low||filesize>size_high) {
+	DEBUGF("WEIRDNESS ALERT: filesize=%lld, but query was for %lld..%lld",
+	       filesize,size_low,size_high);
+	continue;
+      } 
+      if (sqlite3_column_bytes(statement, 0)!=RHIZOME_BAR_BYTES) {
+	if (debug&DEBUG_RHIZOME)
+	  DEBUG("Found a BAR that is the wrong size - ignoring");
+	continue;
+      }	
+      bcopy(sqlite3_column_blob(statement, 0),
+	    &bars_out[bars_written*RHIZOME_BAR_BYTES],RHIZOME_BAR_BYTES);
+
+      /* Remember the BID so that we cant write it into bid_high so that the
+	 caller knows how far we got. */
+      if (sqlite3_column_bytes(statement, 1)==RHIZOME_MANIFEST_ID_BYTES)
+	bcopy(sqlite3_column_blob(statement, 1),bid_high,RHIZOME_MANIFEST_ID_BYTES);
+
+      bars_written++;
     }
-  if (statement)
-    sqlite3_finalize(statement);
-  statement = NULL;
+  sqlite3_finalize(statement);
   
   return bars_written;
 }
-  
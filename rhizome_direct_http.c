@@ -41,48 +41,224 @@ int rhizome_direct_clear_temporary_files(rhizome_http_request *r)
   return 0;
 }
 
+static int rhizome_direct_import(void *context);
+static int rhizome_direct_archive_resume(void *context);
+static int rhizome_direct_form_complete(rhizome_http_request *r);
+
+/* Release whatever a multipart form request still holds, eg, because the connection dropped
+   part way through an upload.
+ */
+void rhizome_direct_free_request_state(rhizome_http_request *r)
+{
+  if (r->import_deferred) {
+    rhizome_db_request_cancel(rhizome_direct_import, r);
+    rhizome_db_request_cancel(rhizome_direct_archive_resume, r);
+    r->import_deferred = 0;
+  }
+  if (r->field_file) {
+    fclose(r->field_file);
+    r->field_file = NULL;
+    rhizome_direct_clear_temporary_files(r);
+  }
+  if (r->manifest_part) {
+    free(r->manifest_part);
+    r->manifest_part = NULL;
+  }
+  if (r->field_sink == RD_FIELD_PAYLOAD || r->import_payload == RD_IMPORT_PAYLOAD_WRITTEN) {
+    rhizome_fail_write(&r->import_write);
+    r->field_sink = RD_FIELD_DISCARD;
+    r->import_payload = RD_IMPORT_PAYLOAD_FAILED;
+  }
+  if (r->import_manifest) {
+    rhizome_manifest_free(r->import_manifest);
+    r->import_manifest = NULL;
+  }
+  if (r->archive) {
+    rhizome_archive_reader_end(r->archive, NULL, NULL);
+    r->archive = NULL;
+  }
+}
+
+/* Send a binary response body.
+ */
+static int rhizome_direct_send_octets(rhizome_http_request *r, const unsigned char *body, int bytes)
+{
+  r->buffer=malloc(bytes+1024);
+  if (!r->buffer)
+    return WHYF_perror("malloc(%d)", bytes+1024);
+  r->buffer_size=bytes+1024;
+  r->buffer_offset=0;
+
+  /* Write HTTP response header */
+  struct http_response hr;
+  hr.result_code=200;
+  hr.content_type="binary/octet-stream";
+  hr.content_length=bytes;
+  hr.body=NULL;
+  r->request_type=0;
+  rhizome_server_set_response(r,&hr);
+  assert(r->buffer_offset<1024);
+
+  /* Now append body and send it back. */
+  bcopy(body,&r->buffer[r->buffer_length],bytes);
+  r->buffer_length+=bytes;
+  r->buffer_offset=0;
+  return 0;
+}
+
+/* Save an uploaded manifest part, which is received into memory, to the temporary file that
+   rhizome_bundle_import_files() reads it from.
+ */
+static int rhizome_direct_write_manifest_part(rhizome_http_request *r)
+{
+  if (!r->manifest_part || r->manifest_part_length > MAX_MANIFEST_BYTES)
+    return -1;
+  char filename[1024];
+  snprintf(filename,1024,"rhizomedirect.%d.manifest",r->alarm.poll.fd);
+  FILE *f=fopen(filename,"w");
+  if (!f)
+    return WHYF_perror("fopen(%s, \"w\")", alloca_str_toprint(filename));
+  int ret = 0;
+  if (r->manifest_part_length && fwrite(r->manifest_part, r->manifest_part_length, 1, f) < 1)
+    ret = WHYF_perror("fwrite(%s)", alloca_str_toprint(filename));
+  if (fclose(f) == EOF)
+    ret = WHYF_perror("fclose(%s)", alloca_str_toprint(filename));
+  return ret;
+}
+
+/* Return 1 if we already hold the same or a newer version of the uploaded bundle.
+ */
+static int rhizome_direct_import_is_stale(rhizome_manifest *m)
+{
+  char id[RHIZOME_MANIFEST_ID_STRLEN + 1];
+  if (!rhizome_manifest_get(m, "id", id, sizeof id))
+    return 0;
+  str_toupper_inplace(id);
+  long long storedversion = -1;
+  if (sqlite_exec_int64_key(&storedversion, id, "SELECT version FROM MANIFESTS WHERE id=?;") != 1)
+    return 0;
+  return rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_VERSION) <= storedversion;
+}
+
+/* Finish a /rhizome/import whose manifest arrived before its payload, so the payload has been
+   stored (or found to be already held) as it arrived.  Returns as rhizome_bundle_import().
+ */
+static int rhizome_direct_import_streamed(rhizome_http_request *r)
+{
+  rhizome_manifest *m = r->import_manifest;
+  if (r->import_payload == RD_IMPORT_PAYLOAD_WRITTEN) {
+    if (rhizome_finish_write(&r->import_write) == -1) {
+      if (rhizome_db_busy)
+	return -1;
+      r->import_payload = RD_IMPORT_PAYLOAD_FAILED;
+    } else
+      r->import_payload = RD_IMPORT_PAYLOAD_STORED;
+  }
+  if (r->import_payload == RD_IMPORT_PAYLOAD_FAILED)
+    return -1;
+  if (rhizome_direct_import_is_stale(m))
+    return 2;
+  if (rhizome_manifest_check_file(m))
+    return WHY("File does not belong to manifest");
+  int ret = rhizome_manifest_check_duplicate(m, NULL);
+  if (ret == 0) {
+    ret = rhizome_add_manifest(m, 1); // ttl = 1
+    if (ret == -1)
+      WHY("rhizome_add_manifest() failed");
+  }
+  return ret;
+}
+
+/* Import the bundle of a completed /rhizome/import form, from wherever its parts went.  May be
+   called again if the database was busy.  Returns as rhizome_bundle_import().
+ */
+static int rhizome_direct_import(void *context)
+{
+  rhizome_http_request *r = context;
+  if (r->import_manifest && r->import_payload != RD_IMPORT_PAYLOAD_FILE)
+    return rhizome_direct_import_streamed(r);
+  /* The payload arrived first (or the manifest was not valid), or had to be spooled to a file */
+  if (rhizome_direct_write_manifest_part(r) == -1)
+    return -1;
+  DEBUGF("Call bundle import for rhizomedata.%d.{data,file}", r->alarm.poll.fd);
+  strbuf manifest_path = strbuf_alloca(50);
+  strbuf payload_path = strbuf_alloca(50);
+  strbuf_sprintf(manifest_path, "rhizomedirect.%d.manifest", r->alarm.poll.fd);
+  strbuf_sprintf(payload_path, "rhizomedirect.%d.data", r->alarm.poll.fd);
+  return rhizome_bundle_import_files(strbuf_str(manifest_path), strbuf_str(payload_path), 1); // ttl = 1
+}
+
+/* Report the outcome of an import to the uploader, and resume the connection if it was parked
+   while the import waited for the database.
+ */
+static void rhizome_direct_import_done(void *context, int ret)
+{
+  rhizome_http_request *r = context;
+  DEBUGF("Import returned %d",ret);
+  rhizome_direct_clear_temporary_files(r);
+  /* report back to caller.
+    200 = ok, which is probably appropriate for when we already had the bundle.
+    201 = content created, which is probably appropriate for when we successfully
+    import a bundle (or if we already have it).
+    403 = forbidden, which might be appropriate if we refuse to accept it, e.g.,
+    the import fails due to malformed data etc.
+    (should probably also indicate if we have a newer version if possible)
+  */
+  switch (ret) {
+  case 0:
+    rhizome_server_simple_http_response(r, 201, "Bundle succesfully imported.");
+    break;
+  case 2:
+    rhizome_server_simple_http_response(r, 200, "Bundle already imported.");
+    break;
+  default:
+    rhizome_server_simple_http_response(r, 500, "Server error: Rhizome import command failed.");
+    break;
+  }
+  if (r->import_deferred) {
+    r->import_deferred = 0;
+    r->alarm.poll.events = POLLOUT;
+    watch(&r->alarm);
+    r->alarm.alarm = gettime_ms() + RHIZOME_IDLE_TIMEOUT;
+    r->alarm.deadline = r->alarm.alarm + RHIZOME_IDLE_TIMEOUT;
+    schedule(&r->alarm);
+  }
+}
+
 int rhizome_direct_form_received(rhizome_http_request *r)
 {
+  /* The final boundary and the end of the body both end the form, so a form whose import is
+     already waiting for the database must not queue it again.  An archive still waiting is
+     finished once the database has let it catch up. */
+  if (r->import_deferred) {
+    r->import_form_ended = 1;
+    return 0;
+  }
+
   const char *submitBareFileURI=confValueGet("rhizome.api.addfile.uri", NULL);
 
+  {
+    time_ms_t elapsed = gettime_ms() - r->initiate_time;
+    long long bytes = r->source_index;
+    INFOF("Received %lld byte POST %s in %lldms (%lld KB/s)", bytes, r->path, (long long) elapsed,
+	elapsed > 0 ? bytes * 1000 / 1024 / elapsed : 0);
+  }
+
   /* Process completed form based on the set of fields seen */
   if (!strcmp(r->path,"/rhizome/import")) {
-    switch(r->fields_seen) {
-    case RD_MIME_STATE_MANIFESTHEADERS | RD_MIME_STATE_DATAHEADERS: {
-	/* Got a bundle to import */
-	DEBUGF("Call bundle import for rhizomedata.%d.{data,file}",
-	       r->alarm.poll.fd);
-	strbuf manifest_path = strbuf_alloca(50);
-	strbuf payload_path = strbuf_alloca(50);
-	strbuf_sprintf(manifest_path, "rhizomedirect.%d.manifest", r->alarm.poll.fd);
-	strbuf_sprintf(payload_path, "rhizomedirect.%d.data", r->alarm.poll.fd);
-	int ret = rhizome_bundle_import_files(strbuf_str(manifest_path), strbuf_str(payload_path), 1); // ttl = 1
-	
-	DEBUGF("Import returned %d",ret);
-	
-	rhizome_direct_clear_temporary_files(r);
-	/* report back to caller.
-	  200 = ok, which is probably appropriate for when we already had the bundle.
-	  201 = content created, which is probably appropriate for when we successfully
-	  import a bundle (or if we already have it).
-	  403 = forbidden, which might be appropriate if we refuse to accept it, e.g.,
-	  the import fails due to malformed data etc.
-	  (should probably also indicate if we have a newer version if possible)
-	*/
-	switch (ret) {
-	case 0:
-	  return rhizome_server_simple_http_response(r, 201, "Bundle succesfully imported.");
-	case 2:
-	  return rhizome_server_simple_http_response(r, 200, "Bundle already imported.");
-	}
-	return rhizome_server_simple_http_response(r, 500, "Server error: Rhizome import command failed.");
+    if (r->import_manifest || r->fields_seen == (RD_MIME_STATE_MANIFESTHEADERS | RD_MIME_STATE_DATAHEADERS)) {
+      /* Got a bundle to import.  If the database is busy, park the connection until the import
+	 has been done or given up. */
+      if (rhizome_db_request("/rhizome/import", rhizome_direct_import, rhizome_direct_import_done, r) == RHIZOME_DB_BUSY) {
+	r->import_deferred = 1;
+	unwatch(&r->alarm);
+	unschedule(&r->alarm);
       }
-      break;     
-    default:
-      /* Clean up after ourselves */
-      rhizome_direct_clear_temporary_files(r);	     
+      return 0;
     }
-  } else if (!strcmp(r->path,"/rhizome/enquiry")) {
+    /* Clean up after ourselves */
+    rhizome_direct_clear_temporary_files(r);
+  } else if (!strcmp(r->path,"/rhizome/enquiry") || !strcmp(r->path,"/rhizome/reconcile")) {
     int fd=-1;
     char file[1024];
     switch(r->fields_seen) {
@@ -113,6 +289,19 @@ int rhizome_direct_form_received(rhizome_http_request *r)
 	rhizome_direct_clear_temporary_files(r);	     
 	return rhizome_server_simple_http_response(r,500,"Couldn't mmap() a file");
       }
+      if (!strcmp(r->path,"/rhizome/reconcile")) {
+	/* Compare the ranges summarised by the far end with our own */
+	int bytes;
+	unsigned char *response=rhizome_direct_get_reconcile_response(addr,stat.st_size,&bytes);
+	munmap(addr,stat.st_size);
+	close(fd);
+	rhizome_direct_clear_temporary_files(r);
+	if (!response)
+	  return rhizome_server_simple_http_response(r,500,"Could not get response to reconciliation");
+	rhizome_direct_send_octets(r,response,bytes);
+	free(response);
+	return 0;
+      }
       /* Ask for a fill response.  Regardless of the size of the set of BARs passed
 	 to us, we will allow up to 64KB of response. */
       rhizome_direct_bundle_cursor 
@@ -126,26 +315,7 @@ int rhizome_direct_form_received(rhizome_http_request *r)
 	     We should be able to do this using the async framework fairly easily.
 	  */
 	  
-	  int bytes=c->buffer_offset_bytes+c->buffer_used;
-	  r->buffer=malloc(bytes+1024);
-	  r->buffer_size=bytes+1024;
-	  r->buffer_offset=0;
-	  assert(r->buffer);
-
-	  /* Write HTTP response header */
-	  struct http_response hr;
-	  hr.result_code=200;
-	  hr.content_type="binary/octet-stream";
-	  hr.content_length=bytes;
-	  hr.body=NULL;
-	  r->request_type=0;
-	  rhizome_server_set_response(r,&hr);
-	  assert(r->buffer_offset<1024);
-
-	  /* Now append body and send it back. */
-	  bcopy(c->buffer,&r->buffer[r->buffer_length],bytes);
-	  r->buffer_length+=bytes;
-	  r->buffer_offset=0;
+	  rhizome_direct_send_octets(r,c->buffer,c->buffer_offset_bytes+c->buffer_used);
 
 	  /* Clean up cursor after sending response */
 	  rhizome_direct_bundle_iterator_free(&c);
@@ -166,9 +336,32 @@ int rhizome_direct_form_received(rhizome_http_request *r)
       /* Clean up after ourselves */
       rhizome_direct_clear_temporary_files(r);	     
 
-      return rhizome_server_simple_http_response(r, 404, "/rhizome/enquiry requires 'data' field");
+      return rhizome_server_simple_http_response(r, 404, "Rhizome Direct enquiry requires 'data' field");
     }
   }  
+  else if (!strcmp(r->path,"/rhizome/importarchive")) {
+    switch(r->fields_seen) {
+    case RD_MIME_STATE_DATAHEADERS: {
+	/* The bundle archive has been imported as it arrived; report the fate of each bundle */
+	unsigned char *statuses=NULL;
+	int count=0;
+	if (r->archive) {
+	  rhizome_archive_reader_end(r->archive, &statuses, &count);
+	  r->archive=NULL;
+	}
+	rhizome_direct_clear_temporary_files(r);
+	/* A truncated or corrupt archive still yields the status of the bundles before the
+	   damage, which have been imported; the client treats the rest as not delivered. */
+	rhizome_direct_send_octets(r,statuses,count*RHIZOME_ARCHIVE_STATUS_RECORD_BYTES);
+	if (statuses)
+	  free(statuses);
+	return 0;
+      }
+    default:
+      rhizome_direct_clear_temporary_files(r);
+      return rhizome_server_simple_http_response(r, 400, "Rhizome archive import requires 'data' field");
+    }
+  }
   /* Allow servald to be configured to accept files without manifests via HTTP
      from localhost, so that rhizome bundles can be created programatically.
      There are probably still some security loop-holes here, which is part of
@@ -230,19 +423,19 @@ int rhizome_direct_form_received(rhizome_http_request *r)
 	 - use the current time for "date"
 	 - if service is file, then use the payload file's basename for "name"
       */
-      const char *service = rhizome_manifest_get(m, "service", NULL, 0);
+      const char *service = rhizome_manifest_get_field(m, RHIZOME_FIELD_SERVICE);
       if (service == NULL) {
 	rhizome_manifest_set(m, "service", (service = RHIZOME_SERVICE_FILE));
 	if (debug & DEBUG_RHIZOME) DEBUGF("missing 'service', set default service=%s", service);
       } else {
 	if (debug & DEBUG_RHIZOME) DEBUGF("manifest contains service=%s", service);
       }
-      if (rhizome_manifest_get(m, "date", NULL, 0) == NULL) {
+      if (rhizome_manifest_get_field(m, RHIZOME_FIELD_DATE) == NULL) {
 	rhizome_manifest_set_ll(m, "date", (long long) gettime_ms());
-	if (debug & DEBUG_RHIZOME) DEBUGF("missing 'date', set default date=%s", rhizome_manifest_get(m, "date", NULL, 0));
+	if (debug & DEBUG_RHIZOME) DEBUGF("missing 'date', set default date=%s", rhizome_manifest_get_field(m, RHIZOME_FIELD_DATE));
       }
 
-      const char *name = rhizome_manifest_get(m, "name", NULL, 0);
+      const char *name = rhizome_manifest_get_field(m, RHIZOME_FIELD_NAME);
       if (name == NULL) {
 	name=r->data_file_name;
 	rhizome_manifest_set(m, "name", r->data_file_name);
@@ -252,7 +445,7 @@ int rhizome_direct_form_received(rhizome_http_request *r)
       }
 
       const char *senderhex
-	= rhizome_manifest_get(m, "sender", NULL, 0);
+	= rhizome_manifest_get_field(m, RHIZOME_FIELD_SENDER);
       if (!senderhex) senderhex=confValueGet("rhizome.api.addfile.author",NULL);
       unsigned char authorSid[SID_SIZE];
       if (senderhex) fromhexstr(authorSid,senderhex,SID_SIZE);
@@ -261,7 +454,7 @@ int rhizome_direct_form_received(rhizome_http_request *r)
 
       /* Bind an ID to the manifest, and also bind the file.  Then finalise the 
 	 manifest. But if the manifest already contains an ID, don't override it. */
-      if (rhizome_manifest_get(m, "id", NULL, 0) == NULL) {
+      if (rhizome_manifest_get_field(m, RHIZOME_FIELD_ID) == NULL) {
 	if (rhizome_manifest_bind_id(m, senderhex ? authorSid : NULL)) {
 	  rhizome_manifest_free(m);
 	  m = NULL;
@@ -337,6 +530,221 @@ int rhizome_direct_form_received(rhizome_http_request *r)
 }
 
 
+/* A /rhizome/import manifest part has arrived.  If it is valid, keep it so that the payload
+   part (if it follows) can be stored straight into the database as it arrives.
+ */
+static void rhizome_direct_import_manifest_received(rhizome_http_request *r)
+{
+  if (r->import_manifest)
+    return;
+  rhizome_manifest *m = rhizome_new_manifest();
+  if (!m)
+    WHY("Out of manifests");
+  else if (rhizome_read_manifest_file(m, (const char *)r->manifest_part, r->manifest_part_length) == -1)
+    WHY("Could not read uploaded manifest");
+  else if (rhizome_manifest_verify(m))
+    WHY("Verification of uploaded manifest failed");
+  else {
+    /* Make sure we store signatures */
+    m->manifest_bytes=m->manifest_all_bytes;
+    r->import_manifest=m;
+    m=NULL;
+  }
+  if (m)
+    rhizome_manifest_free(m);
+}
+
+/* Decide where the payload part of a /rhizome/import goes, given its manifest.
+ */
+static void rhizome_direct_import_payload_start(rhizome_http_request *r)
+{
+  rhizome_manifest *m = r->import_manifest;
+  r->field_sink = RD_FIELD_DISCARD;
+  long long filesize = rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_FILESIZE);
+  const char *filehash = rhizome_manifest_get_field(m, RHIZOME_FIELD_FILEHASH);
+  m->fileLength = filesize < 0 ? 0 : filesize;
+  if (m->fileLength == 0 || rhizome_direct_import_is_stale(m)) {
+    r->import_payload = RD_IMPORT_PAYLOAD_HELD;
+    return;
+  }
+  if (!filehash || strlen(filehash) != RHIZOME_FILEHASH_STRLEN) {
+    WHY("Uploaded manifest has invalid filehash");
+    r->import_payload = RD_IMPORT_PAYLOAD_FAILED;
+    return;
+  }
+  memcpy(m->fileHexHash, filehash, RHIZOME_FILEHASH_STRLEN + 1);
+  str_toupper_inplace(m->fileHexHash);
+  m->fileHashedP = 1;
+  long long gotfile = 0;
+  if (sqlite_exec_int64_key(&gotfile, m->fileHexHash, "SELECT COUNT(*) FROM FILES WHERE id=? AND datavalid<>0;") == -1) {
+    r->import_payload = RD_IMPORT_PAYLOAD_FAILED;
+    return;
+  }
+  if (gotfile) {
+    if (debug & DEBUG_RHIZOME)
+      DEBUGF("Already hold payload %s, discarding upload", m->fileHexHash);
+    r->import_payload = RD_IMPORT_PAYLOAD_HELD;
+    return;
+  }
+  rhizome_db_busy = 0;
+  if (rhizome_open_write(&r->import_write, m->fileHexHash, m->fileLength, RHIZOME_PRIORITY_DEFAULT) == -1) {
+    /* If the database is locked, spool the payload to a file and import it once the lock goes */
+    r->import_payload = rhizome_db_busy ? RD_IMPORT_PAYLOAD_FILE : RD_IMPORT_PAYLOAD_FAILED;
+    return;
+  }
+  r->field_sink = RD_FIELD_PAYLOAD;
+}
+
+/* Headers of a form part have been read; set up to receive its body.  Bundle payloads and
+   archives go straight into the database as they arrive, manifests are kept in memory, and
+   anything else is written to a temporary file for rhizome_direct_form_received() to use.
+ */
+static int rhizome_direct_field_start(rhizome_http_request *r)
+{
+  int import = !strcmp(r->path, "/rhizome/import");
+  if (r->source_flags == RD_MIME_STATE_MANIFESTHEADERS && import) {
+    if (!r->manifest_part && !(r->manifest_part = malloc(MAX_MANIFEST_BYTES)))
+      return WHY_perror("malloc");
+    r->manifest_part_length = 0;
+    r->field_sink = RD_FIELD_MANIFEST;
+    return 0;
+  }
+  if (r->source_flags == RD_MIME_STATE_DATAHEADERS && import && r->import_manifest) {
+    rhizome_direct_import_payload_start(r);
+    if (r->import_payload != RD_IMPORT_PAYLOAD_FILE)
+      return 0;
+  }
+  if (r->source_flags == RD_MIME_STATE_DATAHEADERS && !strcmp(r->path, "/rhizome/importarchive")) {
+    if (r->archive)
+      return WHY("Multiple archives in one request");
+    char name[64];
+    snprintf(name, sizeof name, "upload.%d", r->alarm.poll.fd);
+    if (!(r->archive = rhizome_archive_reader_new(name)))
+      return -1;
+    r->field_sink = RD_FIELD_ARCHIVE;
+    return 0;
+  }
+  /* Prepare to write to file for field.
+     We may have multiple rhizome direct transactions running at the same
+     time on different TCP connections.  So serialise using file descriptor.
+     We could use the boundary string or some other random thing, but using
+     the file descriptor places a reasonable upper limit on the clutter that
+     is possible, while still preventing collisions -- provided that we don't
+     close the file descriptor until we have completed processing the 
+     request. */
+  char filename[1024];
+  char *field="unknown";
+  switch(r->source_flags) {
+  case RD_MIME_STATE_DATAHEADERS: field="data"; break;
+  case RD_MIME_STATE_MANIFESTHEADERS: field="manifest"; break;
+  }
+  snprintf(filename,1024,"rhizomedirect.%d.%s",r->alarm.poll.fd,field);
+  filename[1023]=0;
+  r->field_file=fopen(filename,"w");
+  if (!r->field_file)
+    return WHYF_perror("fopen(%s, \"w\")", alloca_str_toprint(filename));
+  if (import && r->source_flags == RD_MIME_STATE_DATAHEADERS)
+    r->import_payload = RD_IMPORT_PAYLOAD_FILE;
+  r->field_sink = RD_FIELD_FILE;
+  return 0;
+}
+
+/* Let an archive that was waiting for the database catch up with the bytes that arrived since.
+   May be called again while the database is still busy.
+ */
+static int rhizome_direct_archive_resume(void *context)
+{
+  rhizome_http_request *r = context;
+  if (rhizome_archive_reader_resume(r->archive) != RHIZOME_DB_BUSY)
+    return 0;
+  rhizome_db_busy = 1;
+  return -1;
+}
+
+/* Resume reading the form once the archive has caught up, or abandon the rest of the archive if
+   the database stayed busy.  If the form ended while the connection was parked, finish it now.
+ */
+static void rhizome_direct_archive_resumed(void *context, int ret)
+{
+  rhizome_http_request *r = context;
+  if (ret == -1 && rhizome_archive_reader_busy(r->archive))
+    rhizome_archive_reader_abort(r->archive);
+  if (!r->import_deferred)
+    return;
+  r->import_deferred = 0;
+  if (r->import_form_ended) {
+    r->import_form_ended = 0;
+    if (r->request_type < 0)
+      rhizome_direct_form_complete(r);
+  }
+  /* Finishing the form may have parked the connection again */
+  if (!r->import_deferred) {
+    r->alarm.poll.events = POLLOUT;
+    watch(&r->alarm);
+    r->alarm.alarm = gettime_ms() + RHIZOME_IDLE_TIMEOUT;
+    r->alarm.deadline = r->alarm.alarm + RHIZOME_IDLE_TIMEOUT;
+    schedule(&r->alarm);
+  }
+}
+
+static void rhizome_direct_field_write(rhizome_http_request *r, const unsigned char *bytes, int count)
+{
+  switch (r->field_sink) {
+  case RD_FIELD_FILE:
+    if (fwrite(bytes,count,1,r->field_file)<1 && count)
+      DEBUGF("Short write for multi-part form file -- %d bytes may be missing", count);
+    break;
+  case RD_FIELD_MANIFEST:
+    if (r->manifest_part_length + count > MAX_MANIFEST_BYTES) {
+      WHY("Uploaded manifest is too long");
+      r->manifest_part_length = MAX_MANIFEST_BYTES + 1;
+      r->field_sink = RD_FIELD_DISCARD;
+      break;
+    }
+    bcopy(bytes, &r->manifest_part[r->manifest_part_length], count);
+    r->manifest_part_length += count;
+    break;
+  case RD_FIELD_PAYLOAD:
+    if (rhizome_write_buffer(&r->import_write, bytes, count) == -1) {
+      rhizome_fail_write(&r->import_write);
+      r->import_payload = RD_IMPORT_PAYLOAD_FAILED;
+      r->field_sink = RD_FIELD_DISCARD;
+    }
+    break;
+  case RD_FIELD_ARCHIVE:
+    /* Once the archive proves invalid, the rest of it is ignored.  If a bundle must wait for the
+       database, the reader keeps what arrives meanwhile, and the connection is parked until it
+       has caught up or given up. */
+    if (rhizome_archive_reader_feed(r->archive, bytes, count) == RHIZOME_DB_BUSY && !r->import_deferred
+	&& rhizome_db_request("/rhizome/importarchive", rhizome_direct_archive_resume, rhizome_direct_archive_resumed, r) == RHIZOME_DB_BUSY) {
+      r->import_deferred = 1;
+      unwatch(&r->alarm);
+      unschedule(&r->alarm);
+    }
+    break;
+  }
+}
+
+static void rhizome_direct_field_end(rhizome_http_request *r)
+{
+  switch (r->field_sink) {
+  case RD_FIELD_FILE:
+    fclose(r->field_file);
+    r->field_file=NULL;
+    break;
+  case RD_FIELD_MANIFEST:
+    rhizome_direct_import_manifest_received(r);
+    break;
+  case RD_FIELD_PAYLOAD:
+    if (rhizome_finish_write(&r->import_write) == 0)
+      r->import_payload = RD_IMPORT_PAYLOAD_STORED;
+    else
+      r->import_payload = rhizome_db_busy ? RD_IMPORT_PAYLOAD_WRITTEN : RD_IMPORT_PAYLOAD_FAILED;
+    break;
+  }
+  r->field_sink = RD_FIELD_DISCARD;
+}
+
 int rhizome_direct_process_mime_line(rhizome_http_request *r,char *buffer,int count)
 {
   /* Check for boundary line at start of buffer.
@@ -394,26 +802,9 @@ int rhizome_direct_process_mime_line(rhizome_http_request *r,char *buffer,int co
 	  return -1;
 	}
       
-      /* Prepare to write to file for field.
-	 We may have multiple rhizome direct transactions running at the same
-	 time on different TCP connections.  So serialise using file descriptor.
-	 We could use the boundary string or some other random thing, but using
-	 the file descriptor places a reasonable upper limit on the clutter that
-	 is possible, while still preventing collisions -- provided that we don't
-	 close the file descriptor until we have completed processing the 
-	 request. */
       r->field_file=NULL;
-      char filename[1024];
-      char *field="unknown";
-      switch(r->source_flags) {
-      case RD_MIME_STATE_DATAHEADERS: field="data"; break;
-      case RD_MIME_STATE_MANIFESTHEADERS: field="manifest"; break;
-      }
-      snprintf(filename,1024,"rhizomedirect.%d.%s",r->alarm.poll.fd,field);
-      filename[1023]=0;
-      r->field_file=fopen(filename,"w");
-      if (!r->field_file) {
-	WHYF_perror("fopen(%s, \"w\")", alloca_str_toprint(filename));
+      r->field_crlf_pending=0;
+      if (rhizome_direct_field_start(r)==-1) {
 	rhizome_direct_clear_temporary_files(r);
 	rhizome_server_simple_http_response
 	  (r, 500, "<html><h1>Sorry, couldn't complete your request, reasonable as it was.  Perhaps try again later.</h1></html>\r\n");
@@ -450,21 +841,20 @@ int rhizome_direct_process_mime_line(rhizome_http_request *r,char *buffer,int co
   case RD_MIME_STATE_BODY:
     if (boundaryLine) {
       r->source_flags=RD_MIME_STATE_PARTHEADERS;
-
-      /* We will have written an extra CRLF to the end of the file,
-	 so prune that off. */
-      fflush(r->field_file);
-      int fd=fileno(r->field_file);
-      off_t correct_size=ftell(r->field_file)-2;
-      ftruncate(fd,correct_size);
-      fclose(r->field_file);
-      r->field_file=NULL;
+      /* The held back CRLF belonged to the boundary line, so is dropped */
+      r->field_crlf_pending=0;
+      rhizome_direct_field_end(r);
     }
     else {
-      int written=fwrite(r->request,count,1,r->field_file);
-      if (written<1) 
-	DEBUGF("Short write for multi-part form file -- %d bytes may be missing",
-	       count);
+      if (r->field_crlf_pending) {
+	rhizome_direct_field_write(r,(unsigned char *)"\r\n",2);
+	r->field_crlf_pending=0;
+      }
+      if (count>=2&&buffer[count-2]=='\r'&&buffer[count-1]=='\n') {
+	count-=2;
+	r->field_crlf_pending=1;
+      }
+      rhizome_direct_field_write(r,(unsigned char *)buffer,count);
     }
     break;
   }
@@ -474,22 +864,34 @@ int rhizome_direct_process_mime_line(rhizome_http_request *r,char *buffer,int co
        Pass it to function that deals with what has been received,
        and will also send response or close the http request if required. */
 
-    /* XXX Rewind last two bytes from file if open, and close file */
-
     return rhizome_direct_form_received(r);
   }
   return 0;
 }
 
+/* The whole body has arrived, so process the form, including any last line that was not ended.
+ */
+static int rhizome_direct_form_complete(rhizome_http_request *r)
+{
+  /* Flush out any remaining data */
+  if (r->request_length) {
+    DEBUGF("Flushing last %d bytes",r->request_length);
+    r->request[r->request_length]=0;
+    rhizome_direct_process_mime_line(r,r->request,r->request_length);
+  }
+  return rhizome_direct_form_received(r);
+}
+
 int rhizome_direct_process_post_multipart_bytes(rhizome_http_request *r,const char *bytes,int count)
 {
-  {
+  if (debug & DEBUG_RHIZOME_RX) {
     char logname[128];
     snprintf(logname,128,"post-%08x.log",r->uuid);
     FILE *f=fopen(logname,"a"); 
     if (f) fwrite(bytes,count,1,f);
     if (f) fclose(f);
   }
+  r->source_index+=count;
 
   /* This function looks for multi-part form separators and descriptor lines,
      and streams any "manifest" or "data" blocks to respectively named files.
@@ -558,13 +960,10 @@ int rhizome_direct_process_post_multipart_bytes(rhizome_http_request *r,const ch
 
     /* If the form is still being processed, then flush things through */
     if (r->request_type<0) {
-      /* Flush out any remaining data */
-      if (r->request_length) {
-	DEBUGF("Flushing last %d bytes",r->request_length);
-	r->request[r->request_length]=0;
-	rhizome_direct_process_mime_line(r,r->request,r->request_length);
-      }      
-      return rhizome_direct_form_received(r);
+      if (r->import_deferred)
+	r->import_form_ended = 1;
+      else
+	return rhizome_direct_form_complete(r);
     } else {
       /* Form has already been processed, so do nothing */
     }
@@ -631,6 +1030,8 @@ int rhizome_direct_parse_http_request(rhizome_http_request *r)
   } else if (strcmp(verb, "POST") == 0
       && (   strcmp(path, "/rhizome/import") == 0 
 	  || strcmp(path, "/rhizome/enquiry") == 0
+	  || strcmp(path, "/rhizome/reconcile") == 0
+	  || strcmp(path, "/rhizome/importarchive") == 0
 	  || (submitBareFileURI && strcmp(path, submitBareFileURI) == 0)
 	 )
   ) {
@@ -701,65 +1102,537 @@ int rhizome_direct_parse_http_request(rhizome_http_request *r)
   return 0;
 }
 
-static int receive_http_response(int sock, char *buffer, size_t buffer_len, struct http_response_parts *parts)
+/* Rhizome Direct HTTP client.
+
+   Each HTTP request/response with the far end is an exchange, driven entirely from fd_poll(), so
+   a sync never blocks the event loop.  The sync request may keep several cursor fills ("enquiries")
+   in flight at once, and the bundles that the far end's replies tell us to push or pull are
+   queued on the transport state and transferred concurrently, up to configured limits.
+ */
+
+#define RD_HTTP_CONNECTING 0
+#define RD_HTTP_SENDING 1
+#define RD_HTTP_RECEIVING 2
+
+/* A piece of an HTTP request, either bytes in memory (owned by the exchange sending them) or a
+   payload streamed from the FILES row with the given rowid.  The payload's blob is only held open
+   while a chunk is read from it, as an open blob is an open read transaction, which would keep
+   every other process from writing to the database for as long as the upload took.
+ */
+typedef struct rhizome_direct_http_segment {
+  unsigned char *bytes;
+  long long rowid;
+  long long len;
+} rhizome_direct_http_segment;
+
+typedef struct rhizome_direct_http_exchange {
+  struct sched_ent alarm;
+  rhizome_direct_sync_request *sync;
+  int state;
+
+  /* The request is sent as a sequence of segments */
+  rhizome_direct_http_segment *segments;
+  int segment_count;
+  int segment;
+  long long segment_ofs;
+  long long request_ofs;
+
+  /* The response is accumulated here until the server closes the connection or the whole body
+     (as given by Content-Length) has arrived */
+  char *response;
+  int response_size;
+  int response_len;
+
+  /* Called once the exchange ends, with parts==NULL if it failed */
+  void (*completed)(struct rhizome_direct_http_exchange *x, struct http_response_parts *parts);
+  int failed;
+  /* Number of bundles carried by a push, and for a batch, their queue entries in archive order */
+  int bundles;
+  unsigned char (*pushed)[1+RHIZOME_BAR_PREFIX_BYTES];
+} rhizome_direct_http_exchange;
+
+static struct profile_total rd_http_stats;
+
+static void rhizome_direct_http_kick(rhizome_direct_transport_state_http *state);
+static int rhizome_direct_http_queue_transfer(rhizome_direct_transport_state_http *state, int type, const unsigned char *bid_prefix);
+
+static void rhizome_direct_http_segments_free(rhizome_direct_http_segment *segments, int count)
 {
-  int len = 0;
-  int count;
-  do {
-      if ((count = read(sock, &buffer[len], buffer_len - len)) == -1)
-	return WHYF_perror("read(%d, %p, %d)", sock, &buffer[len], buffer_len - len);
-      len += count;
-  } while (len < buffer_len && count != 0 && !http_header_complete(buffer, len, len));
-  if (debug & DEBUG_RHIZOME_RX)
-    DEBUGF("Received HTTP response %s", alloca_toprint(-1, buffer, len));
-  if (unpack_http_response(buffer, parts) == -1)
-    return -1;
-  if (parts->code != 200 && parts->code != 201) {
-    INFOF("Failed HTTP request: server returned %003u %s", parts->code, parts->reason);
-    return -1;
+  int i;
+  for (i = 0; i < count; ++i) {
+    if (segments[i].bytes)
+      free(segments[i].bytes);
   }
-  if (parts->content_length == -1) {
+  free(segments);
+}
+
+static void rhizome_direct_http_exchange_free(rhizome_direct_http_exchange *x)
+{
+  unwatch(&x->alarm);
+  unschedule(&x->alarm);
+  if (x->alarm.poll.fd != -1)
+    close(x->alarm.poll.fd);
+  if (x->segments)
+    rhizome_direct_http_segments_free(x->segments, x->segment_count);
+  if (x->response)
+    free(x->response);
+  if (x->pushed)
+    free(x->pushed);
+  free(x);
+}
+
+static void rhizome_direct_http_exchange_end(rhizome_direct_http_exchange *x, int ok)
+{
+  struct http_response_parts parts;
+  struct http_response_parts *pp = NULL;
+  if (ok && x->response_len) {
+    x->response[x->response_len] = '\0';
     if (debug & DEBUG_RHIZOME_RX)
-      DEBUGF("Invalid HTTP reply: missing Content-Length header");
-    return -1;
+      DEBUGF("Received HTTP response %s", alloca_toprint(160, x->response, x->response_len));
+    if (unpack_http_response(x->response, &parts) != -1) {
+      if (parts.code != 200 && parts.code != 201)
+	INFOF("Failed HTTP request: server returned %003u %s", parts.code, parts.reason);
+      else if (parts.content_length == -1) {
+	if (debug & DEBUG_RHIZOME_RX)
+	  DEBUGF("Invalid HTTP reply: missing Content-Length header");
+      } else if (parts.content_start + parts.content_length > x->response + x->response_len)
+	INFOF("Truncated HTTP reply: expected %lld content bytes", parts.content_length);
+      else
+	pp = &parts;
+    }
+  }
+  x->completed(x, pp);
+  rhizome_direct_http_exchange_free(x);
+}
+
+/* Return 1 if the whole response (headers and Content-Length bytes of body) has arrived.
+ */
+static int rhizome_direct_http_response_complete(rhizome_direct_http_exchange *x)
+{
+  if (!http_header_complete(x->response, x->response_len, x->response_len))
+    return 0;
+  const char *cl = strcasestr(x->response, "\nContent-Length:");
+  const char *body = strstr(x->response, "\r\n\r\n");
+  if (!cl || !body)
+    return 0;
+  long long content_length = atoll(cl + strlen("\nContent-Length:"));
+  return x->response + x->response_len >= body + 4 + content_length;
+}
+
+static int rhizome_direct_http_send(rhizome_direct_http_exchange *x)
+{
+  int fd = x->alarm.poll.fd;
+  while (x->segment < x->segment_count) {
+    rhizome_direct_http_segment *seg = &x->segments[x->segment];
+    if (x->segment_ofs >= seg->len) {
+      x->segment++;
+      x->segment_ofs = 0;
+      continue;
+    }
+    unsigned char chunk[4096];
+    const unsigned char *p;
+    int len;
+    if (seg->rowid) {
+      len = sizeof chunk;
+      if (seg->len - x->segment_ofs < len)
+	len = seg->len - x->segment_ofs;
+      sqlite3_blob *blob;
+      int ret = sqlite3_blob_open(rhizome_db, "main", "files", "data", seg->rowid, 0 /* read only */, &blob);
+      if (ret != SQLITE_OK)
+	return WHYF("sqlite error #%d occurred opening the blob: %s", ret, sqlite3_errmsg(rhizome_db));
+      if (sqlite3_blob_bytes(blob) < seg->len) {
+	sqlite3_blob_close(blob);
+	return WHYF("Payload row #%lld has changed while being sent", seg->rowid);
+      }
+      ret = sqlite3_blob_read(blob, chunk, len, x->segment_ofs);
+      sqlite3_blob_close(blob);
+      if (ret != SQLITE_OK)
+	return WHYF("sqlite error #%d occurred reading from the blob: %s", ret, sqlite3_errmsg(rhizome_db));
+      p = chunk;
+    } else {
+      p = &seg->bytes[x->segment_ofs];
+      len = seg->len - x->segment_ofs;
+    }
+    int count = write_nonblock(fd, p, len);
+    if (count == -1)
+      return -1;
+    if (count == 0)
+      return 0;
+    x->segment_ofs += count;
+    x->request_ofs += count;
   }
-  DEBUGF("content_length=%d", parts->content_length);
+  /* Whole request sent, now wait for the response */
+  x->state = RD_HTTP_RECEIVING;
+  x->alarm.poll.events = POLLIN;
+  watch(&x->alarm);
   return 0;
 }
 
-void rhizome_direct_http_dispatch(rhizome_direct_sync_request *r)
+static int rhizome_direct_http_receive(rhizome_direct_http_exchange *x)
+{
+  for (;;) {
+    if (x->response_size - x->response_len < 4096) {
+      int size = x->response_size ? x->response_size * 2 : 8192;
+      char *response = realloc(x->response, size + 1);
+      if (response == NULL)
+	return WHYF_perror("realloc(%d)", size + 1);
+      x->response = response;
+      x->response_size = size;
+    }
+    ssize_t count = read(x->alarm.poll.fd, &x->response[x->response_len], x->response_size - x->response_len);
+    if (count == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	return 0;
+      return WHY_perror("read");
+    }
+    if (count == 0)
+      return 1;
+    x->response_len += count;
+    x->response[x->response_len] = '\0';
+    if (rhizome_direct_http_response_complete(x))
+      return 1;
+  }
+}
+
+static void rhizome_direct_http_poll(struct sched_ent *alarm)
+{
+  rhizome_direct_http_exchange *x = (rhizome_direct_http_exchange *)alarm;
+  if (x->failed || alarm->poll.revents == 0) {
+    if (!x->failed && (debug & DEBUG_RHIZOME))
+      DEBUG("Rhizome Direct HTTP exchange timed out");
+    rhizome_direct_http_exchange_end(x, 0);
+    return;
+  }
+  if (x->state == RD_HTTP_CONNECTING) {
+    int err = 0;
+    socklen_t len = sizeof err;
+    if (getsockopt(alarm->poll.fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+      WHYF("connect: %s", strerror(err ? err : errno));
+      rhizome_direct_http_exchange_end(x, 0);
+      return;
+    }
+    x->state = RD_HTTP_SENDING;
+  }
+  int ret = 0;
+  if (x->state == RD_HTTP_SENDING && (alarm->poll.revents & POLLOUT))
+    ret = rhizome_direct_http_send(x);
+  else if (x->state == RD_HTTP_RECEIVING && (alarm->poll.revents & (POLLIN | POLLHUP)))
+    ret = rhizome_direct_http_receive(x);
+  else if (alarm->poll.revents & (POLLHUP | POLLERR))
+    ret = -1;
+  if (ret) {
+    rhizome_direct_http_exchange_end(x, ret == 1);
+    return;
+  }
+  unschedule(&x->alarm);
+  x->alarm.alarm = gettime_ms() + RHIZOME_IDLE_TIMEOUT;
+  x->alarm.deadline = x->alarm.alarm + RHIZOME_IDLE_TIMEOUT;
+  schedule(&x->alarm);
+}
+
+/* Start a new exchange with the sync request's peer.  Takes ownership of the segments and
+   everything in them.  Even if the connection cannot be started, the completion function is
+   called later from the event loop, never from within this function.
+ */
+static rhizome_direct_http_exchange *rhizome_direct_http_exchange_start(
+    rhizome_direct_sync_request *r,
+    rhizome_direct_http_segment *segments, int segment_count,
+    void (*completed)(rhizome_direct_http_exchange *, struct http_response_parts *))
 {
-  DEBUGF("Dispatch size_high=%lld",r->cursor->size_high);
   rhizome_direct_transport_state_http *state = r->transport_specific_state;
+  rhizome_direct_http_exchange *x = calloc(1, sizeof *x);
+  if (x == NULL) {
+    WHYF_perror("calloc(1, %u)", (unsigned) sizeof *x);
+    rhizome_direct_http_segments_free(segments, segment_count);
+    return NULL;
+  }
+  x->sync = r;
+  x->segments = segments;
+  x->segment_count = segment_count;
+  x->completed = completed;
+  x->state = RD_HTTP_CONNECTING;
+  x->alarm.function = rhizome_direct_http_poll;
+  rd_http_stats.name = "rhizome_direct_http_poll";
+  x->alarm.stats = &rd_http_stats;
+  x->alarm.poll.fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (x->alarm.poll.fd == -1) {
+    WHY_perror("socket");
+    x->failed = 1;
+  } else if (set_nonblock(x->alarm.poll.fd) == -1) {
+    x->failed = 1;
+  } else if (connect(x->alarm.poll.fd, (struct sockaddr *)&state->addr, sizeof state->addr) == -1 && errno != EINPROGRESS) {
+    WHY_perror("connect");
+    x->failed = 1;
+  }
+  time_ms_t now = gettime_ms();
+  if (x->failed) {
+    x->alarm.alarm = now;
+    x->alarm.deadline = now;
+  } else {
+    x->alarm.poll.events = POLLOUT;
+    watch(&x->alarm);
+    x->alarm.alarm = now + RHIZOME_IDLE_TIMEOUT;
+    x->alarm.deadline = x->alarm.alarm + RHIZOME_IDLE_TIMEOUT;
+  }
+  schedule(&x->alarm);
+  return x;
+}
 
-  int sock=socket(AF_INET, SOCK_STREAM, 0);
-  if (sock==-1) {
-    WHY_perror("socket");    
-    goto end;
-  } 
-
-  struct hostent *hostent;
-  hostent = gethostbyname(state->host);
-  if (!hostent) {
-    DEBUGF("could not resolve hostname");
-    goto end;
+static void rhizome_direct_http_push_completed(rhizome_direct_http_exchange *x, struct http_response_parts *parts)
+{
+  rhizome_direct_sync_request *r = x->sync;
+  rhizome_direct_transport_state_http *state = r->transport_specific_state;
+  if (parts) {
+    INFOF("Received HTTP response %03u %s", parts->code, parts->reason);
+    r->bundles_pushed++;
   }
+  state->pushes_in_flight--;
+  rhizome_direct_http_kick(state);
+  /* The sync request may be concluded and freed by this */
+  rhizome_direct_continue_sync_request(r);
+}
 
-  struct sockaddr_in addr;  
-  addr.sin_family = AF_INET;     
-  addr.sin_port = htons(state->port);   
-  addr.sin_addr = *((struct in_addr *)hostent->h_addr);
-  bzero(&(addr.sin_zero),8);     
+/* Find the FILES row holding a manifest's payload, if it has one, and check that it is all there.
+   Returns the payload size with its rowid (or 0 if it has no payload), or -1 if the payload cannot
+   be read.
+ */
+static long long rhizome_direct_http_open_payload(rhizome_manifest *m, long long *rowidp)
+{
+  /* Get filehash and size from manifest if present */
+  const char *id = rhizome_manifest_get_field(m, RHIZOME_FIELD_ID);
+  DEBUGF("bundle id = '%s'",id);
+  const char *hash = rhizome_manifest_get_field(m, RHIZOME_FIELD_FILEHASH);
+  DEBUGF("bundle file hash = '%s'",hash);
+  long long filesize = rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_FILESIZE);
+  DEBUGF("file size = %lld",filesize);
+
+  *rowidp = 0;
+  if (filesize > 0) {
+    long long rowid = -1;
+    long long length = -1;
+    sqlite_exec_int64_key(&rowid, hash, "select rowid from files where id=? and datavalid<>0;");
+    DEBUGF("Reading from rowid #%lld filehash='%s'",rowid,hash?hash:"(null)");
+    if (rowid < 0)
+      return WHYF("Could not find payload for filehash='%s'", hash ? hash : "(null)");
+    if (sqlite_exec_int64(&length, "select length from files where rowid=%lld;", rowid) != 1 || length < filesize)
+      return WHYF("Payload blob for filehash='%s' is shorter than filesize=%lld", hash, filesize);
+    *rowidp = rowid;
+  }
+  return filesize < 0 ? 0 : filesize;
+}
 
-  if (connect(sock,(struct sockaddr *)&addr,sizeof(struct sockaddr)) == -1) {
-    WHY_perror("connect");
-    close(sock);
-    goto end;
+/* Compose the POST request to submit the bundle identified by the given BAR prefix, and start
+   sending it.  The payload is streamed straight from its blob.
+ */
+static int rhizome_direct_http_push(rhizome_direct_sync_request *r, unsigned char *bid_prefix)
+{
+  /* Start by getting the manifest, which is the main thing we need, and also
+     gives us the information we need for sending any associated file. */
+  rhizome_manifest *m = rhizome_direct_get_manifest(bid_prefix, RHIZOME_BAR_PREFIX_BYTES);
+  if (!m)
+    return WHY("This should never happen.  The manifest exists, but when I went looking for it, it doesn't appear to be there.");
+
+  long long rowid = 0;
+  long long filesize = rhizome_direct_http_open_payload(m, &rowid);
+  if (filesize == -1) {
+    rhizome_manifest_free(m);
+    return -1;
   }
- 
+
   char boundary[20];
-  char buffer[8192];
+  strbuf bb = strbuf_local(boundary, sizeof boundary);
+  strbuf_sprintf(bb, "%08lx%08lx", random(), random());
+  assert(!strbuf_overrun(bb));
 
+  /* We now have everything we need to compose the POST request and send it.
+   */
+  char *template="POST /rhizome/import HTTP/1.0\r\n"
+    "Content-Length: %d\r\n"
+    "Content-Type: multipart/form-data; boundary=%s\r\n"
+    "\r\n";
+  char *template2="--%s\r\n"
+    "Content-Disposition: form-data; name=\"manifest\"; filename=\"m\"\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "\r\n";
+  char *template3=
+    "\r\n--%s\r\n"
+    "Content-Disposition: form-data; name=\"data\"; filename=\"d\"\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "\r\n";
+  /* Work out what the content length should be */
+  DEBUGF("manifest_all_bytes=%d, manifest_bytes=%d",
+	 m->manifest_all_bytes,m->manifest_bytes);
+  int content_length
+    =strlen(template2)-2 /* minus 2 for the "%s" that gets replaced */
+    +strlen(boundary)
+    +m->manifest_all_bytes
+    +strlen(template3)-2 /* minus 2 for the "%s" that gets replaced */
+    +strlen(boundary)
+    +filesize
+    +strlen("\r\n--")+strlen(boundary)+strlen("--\r\n");
+
+  /* XXX For some reason the above is four bytes out, so fix that */
+  content_length+=4;
+
+  rhizome_direct_http_segment *segments = calloc(3, sizeof *segments);
+  int size = 1024 + m->manifest_all_bytes;
+  unsigned char *buffer = malloc(size);
+  char *suffix = malloc(64);
+  if (segments == NULL || buffer == NULL || suffix == NULL) {
+    WHY_perror("malloc");
+    if (segments) free(segments);
+    if (buffer) free(buffer);
+    if (suffix) free(suffix);
+    rhizome_manifest_free(m);
+    return -1;
+  }
+  int len=snprintf((char *)buffer,size,template,content_length,boundary);
+  len+=snprintf((char *)&buffer[len],size-len,template2,boundary);
+  memcpy(&buffer[len],m->manifestdata,m->manifest_all_bytes);
+  len+=m->manifest_all_bytes;
+  len+=snprintf((char *)&buffer[len],size-len,template3,boundary);
+  rhizome_manifest_free(m);
+
+  snprintf(suffix, 64, "\r\n--%s--\r\n", boundary);
+  segments[0].bytes = buffer;
+  segments[0].len = len;
+  segments[1].rowid = rowid;
+  segments[1].len = filesize;
+  segments[2].bytes = (unsigned char *)suffix;
+  segments[2].len = strlen(suffix);
+
+  rhizome_direct_transport_state_http *state = r->transport_specific_state;
+  rhizome_direct_http_exchange *x = rhizome_direct_http_exchange_start(r, segments, 3, rhizome_direct_http_push_completed);
+  if (!x)
+    return -1;
+  x->bundles = 1;
+  state->pushes_in_flight++;
+  return 0;
+}
+
+static void rhizome_direct_http_push_batch_completed(rhizome_direct_http_exchange *x, struct http_response_parts *parts)
+{
+  rhizome_direct_sync_request *r = x->sync;
+  rhizome_direct_transport_state_http *state = r->transport_specific_state;
+  int i, reached = 0;
+  if (parts) {
+    /* One status record per bundle that the far end got to */
+    const unsigned char *status = (const unsigned char *)parts->content_start;
+    int count = parts->content_length / RHIZOME_ARCHIVE_STATUS_RECORD_BYTES;
+    if (count > x->bundles)
+      count = x->bundles;
+    int rejected = 0;
+    for (i = 0; i < count; ++i, status += RHIZOME_ARCHIVE_STATUS_RECORD_BYTES) {
+      if (status[0] == RHIZOME_ARCHIVE_STATUS_REJECTED) {
+	++rejected;
+	INFOF("Far end rejected bundle %s*", alloca_tohex(&status[1], RHIZOME_BAR_PREFIX_BYTES));
+      } else
+	r->bundles_pushed++;
+    }
+    INFOF("Pushed %d bundles in one request: %d accepted, %d rejected, %d not reached",
+	x->bundles, count - rejected, rejected, x->bundles - count);
+    reached = count;
+  }
+  /* The far end reads the archive in order, so the bundles it did not report on never reached it,
+     eg, because the POST was cut short.  Each is given one more go in a later request. */
+  for (i = reached; i < x->bundles; ++i) {
+    if (x->pushed[i][0] == 1)
+      rhizome_direct_http_queue_transfer(state, 3, &x->pushed[i][1]);
+    else
+      INFOF("Giving up pushing bundle %s*", alloca_tohex(&x->pushed[i][1], RHIZOME_BAR_PREFIX_BYTES));
+  }
+  state->pushes_in_flight--;
+  rhizome_direct_http_kick(state);
+  /* The sync request may be concluded and freed by this */
+  rhizome_direct_continue_sync_request(r);
+}
+
+/* Submit up to state->push_batch of the queued pushes, starting with the one at index first,
+   as a bundle archive in a single POST to /rhizome/importarchive.  Every payload is streamed
+   straight from its blob.  The pushes taken are removed from the queue; those that the far end does
+   not get to are queued again once (see rhizome_direct_http_push_batch_completed()).
+ */
+static int rhizome_direct_http_push_batch(rhizome_direct_transport_state_http *state, int first)
+{
+  rhizome_direct_sync_request *r = state->sync;
+  int max_segments = 2 * state->push_batch + 2;
+  rhizome_direct_http_segment *segments = calloc(max_segments, sizeof *segments);
+  unsigned char (*pushed)[1+RHIZOME_BAR_PREFIX_BYTES] = malloc(state->push_batch * sizeof *pushed);
+  if (segments == NULL || pushed == NULL) {
+    WHYF_perror("calloc(%d, %u)", max_segments, (unsigned) sizeof *segments);
+    if (segments) free(segments);
+    if (pushed) free(pushed);
+    if (first != state->pending_count - 1)
+      memmove(state->pending[first], state->pending[first + 1], (state->pending_count - 1 - first) * sizeof state->pending[0]);
+    state->pending_count--;
+    return -1;
+  }
+  struct rhizome_archive_index index = { NULL, 0, 0 };
+  int nsegments = 1; /* the first is the request header, composed last */
+  off_t offset = RHIZOME_ARCHIVE_MAGIC_BYTES;
+  long long payload_bytes = 0;
+  int i = first;
+  while (   i < state->pending_count
+	 && index.count < state->push_batch
+	 && payload_bytes < RHIZOME_DIRECT_PUSH_BATCH_BYTES
+  ) {
+    if (state->pending[i][0] != 1 && state->pending[i][0] != 3) {
+      ++i;
+      continue;
+    }
+    unsigned char entry_type = state->pending[i][0];
+    unsigned char bid_prefix[RHIZOME_BAR_PREFIX_BYTES];
+    bcopy(&state->pending[i][1], bid_prefix, RHIZOME_BAR_PREFIX_BYTES);
+    if (i != state->pending_count - 1)
+      memmove(state->pending[i], state->pending[i + 1], (state->pending_count - 1 - i) * sizeof state->pending[0]);
+    state->pending_count--;
+
+    rhizome_manifest *m = rhizome_direct_get_manifest(bid_prefix, RHIZOME_BAR_PREFIX_BYTES);
+    if (!m) {
+      WHYF("Could not find manifest for bundle %s* to push", alloca_tohex(bid_prefix, RHIZOME_BAR_PREFIX_BYTES));
+      continue;
+    }
+    long long rowid = 0;
+    long long filesize = rhizome_direct_http_open_payload(m, &rowid);
+    const char *id = rhizome_manifest_get_field(m, RHIZOME_FIELD_ID);
+    unsigned char bid[RHIZOME_MANIFEST_ID_BYTES];
+    if (filesize == -1 || !id || fromhexstr(bid, id, RHIZOME_MANIFEST_ID_BYTES) == -1) {
+      rhizome_manifest_free(m);
+      continue;
+    }
+    long long version = rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_VERSION);
+    int len = RHIZOME_ARCHIVE_ENTRY_HEADER_BYTES + m->manifest_all_bytes;
+    unsigned char *entry = malloc(len);
+    if (!entry || rhizome_archive_index_append(&index, bid, version, offset) == -1) {
+      WHY_perror("malloc");
+      if (entry)
+	free(entry);
+      rhizome_manifest_free(m);
+      break;
+    }
+    pushed[index.count - 1][0] = entry_type;
+    bcopy(bid_prefix, &pushed[index.count - 1][1], RHIZOME_BAR_PREFIX_BYTES);
+    rhizome_archive_entry_header(entry, bid, version, m->manifestdata, m->manifest_all_bytes, filesize);
+    bcopy(m->manifestdata, &entry[RHIZOME_ARCHIVE_ENTRY_HEADER_BYTES], m->manifest_all_bytes);
+    rhizome_manifest_free(m);
+    segments[nsegments].bytes = entry;
+    segments[nsegments].len = len;
+    nsegments++;
+    if (rowid) {
+      segments[nsegments].rowid = rowid;
+      segments[nsegments].len = filesize;
+      nsegments++;
+    }
+    offset += len + filesize;
+    payload_bytes += filesize;
+  }
+  if (index.count == 0) {
+    rhizome_direct_http_segments_free(segments, nsegments);
+    free(pushed);
+    return -1;
+  }
+
+  char boundary[20];
   strbuf bb = strbuf_local(boundary, sizeof boundary);
   strbuf_sprintf(bb, "%08lx%08lx", random(), random());
   assert(!strbuf_overrun(bb));
@@ -767,7 +1640,7 @@ void rhizome_direct_http_dispatch(rhizome_direct_sync_request *r)
   strbuf content_postamble = strbuf_alloca(40);
   strbuf_sprintf(content_preamble,
       "--%s\r\n"
-      "Content-Disposition: form-data; name=\"data\"; filename=\"IHAVEs\"\r\n"
+      "Content-Disposition: form-data; name=\"data\"; filename=\"bundles\"\r\n"
       "Content-Type: application/octet-stream\r\n"
       "\r\n",
       boundary
@@ -775,290 +1648,260 @@ void rhizome_direct_http_dispatch(rhizome_direct_sync_request *r)
   strbuf_sprintf(content_postamble, "\r\n--%s--\r\n", boundary);
   assert(!strbuf_overrun(content_preamble));
   assert(!strbuf_overrun(content_postamble));
-  int content_length = strbuf_len(content_preamble)
-		     + r->cursor->buffer_offset_bytes
-		     + r->cursor->buffer_used
-		     + strbuf_len(content_postamble);
-  strbuf request = strbuf_local(buffer, sizeof buffer);
+
+  /* The archive's index and trailer, then the end of the form */
+  int index_len = rhizome_archive_index_bytes(&index);
+  int tail_len = index_len + strbuf_len(content_postamble);
+  unsigned char *tail = malloc(tail_len);
+  int head_size = 512;
+  unsigned char *head = malloc(head_size);
+  if (!tail || !head) {
+    WHY_perror("malloc");
+    if (tail) free(tail);
+    if (head) free(head);
+    free(index.records);
+    free(pushed);
+    rhizome_direct_http_segments_free(segments, nsegments);
+    return -1;
+  }
+  rhizome_archive_put_index(&index, tail, offset);
+  bcopy(strbuf_str(content_postamble), &tail[index_len], strbuf_len(content_postamble));
+  segments[nsegments].bytes = tail;
+  segments[nsegments].len = tail_len;
+  nsegments++;
+
+  long long content_length = strbuf_len(content_preamble) + offset + tail_len;
+  strbuf request = strbuf_local((char *)head, head_size);
   strbuf_sprintf(request,
-      "POST /rhizome/enquiry HTTP/1.0\r\n"
-      "Content-Length: %d\r\n"
+      "POST /rhizome/importarchive HTTP/1.0\r\n"
+      "Content-Length: %lld\r\n"
       "Content-Type: multipart/form-data; boundary=%s\r\n"
       "\r\n%s",
       content_length, boundary, strbuf_str(content_preamble)
     );
   assert(!strbuf_overrun(request));
-
-  /* TODO: Refactor this code so that it uses our asynchronous framework.
-   */
   int len = strbuf_len(request);
-  int sent=0;
-  while(sent<len) {
-    DEBUGF("write(%d, %s, %d)", sock, alloca_toprint(-1, &buffer[sent], len-sent), len-sent);
-    int count=write(sock,&buffer[sent],len-sent);
-    if (count == -1) {
-      if (errno==EPIPE) goto rx;
-      WHYF_perror("write(%d)", len - sent);
-      close(sock);
-      goto end;
-    }
-    sent+=count;
+  assert(len + RHIZOME_ARCHIVE_MAGIC_BYTES <= head_size);
+  bcopy(RHIZOME_ARCHIVE_MAGIC, &head[len], RHIZOME_ARCHIVE_MAGIC_BYTES);
+  segments[0].bytes = head;
+  segments[0].len = len + RHIZOME_ARCHIVE_MAGIC_BYTES;
+
+  if (debug & DEBUG_RHIZOME)
+    DEBUGF("Pushing %d bundles (%lld payload bytes) in one request", index.count, payload_bytes);
+  int bundles = index.count;
+  free(index.records);
+  rhizome_direct_http_exchange *x = rhizome_direct_http_exchange_start(r, segments, nsegments, rhizome_direct_http_push_batch_completed);
+  if (!x) {
+    free(pushed);
+    return -1;
   }
+  x->bundles = bundles;
+  x->pushed = pushed;
+  state->pushes_in_flight++;
+  return 0;
+}
 
-  len=r->cursor->buffer_offset_bytes+r->cursor->buffer_used;
-  sent=0;
-  while(sent<len) {
-    int count=write(sock,&r->cursor->buffer[sent],len-sent);
-    if (count == -1) {
-      if (errno == EPIPE)
-	goto rx;
-      WHYF_perror("write(%d)", count);
-      close(sock);
-      goto end;
-    }
-    sent+=count;
-  }
+static void rhizome_direct_http_transfer_alarm(struct sched_ent *alarm)
+{
+  rhizome_direct_transport_state_http *state = (rhizome_direct_transport_state_http *)alarm;
+  rhizome_direct_http_kick(state);
+  /* The sync request may be concluded and freed by this */
+  rhizome_direct_continue_sync_request(state->sync);
+}
 
-  strbuf_reset(request);
-  strbuf_puts(request, strbuf_str(content_postamble));
-  len = strbuf_len(request);
-  sent=0;
-  while(sent<len) {
-    DEBUGF("write(%d, %s, %d)", sock, alloca_toprint(-1, &buffer[sent], len-sent), len-sent);
-    int count=write(sock,&buffer[sent],len-sent);
-    if (count == -1) {
-      if (errno==EPIPE) goto rx;
-      WHYF_perror("write(%d)", len - sent);
-      close(sock);
-      goto end;
+/* Start as many of the queued pushes and pulls as the limits allow.  Pulls are handed to the
+   Rhizome fetch queue, which only has room for a few transfers at a time, and each manifest
+   fetched may then need a slot of its own to fetch its payload, so pulls are only started while
+   at least half of the fetch queue is free.  While anything remains outstanding, an alarm
+   re-checks periodically, as the fetch queue gives no completion callback.  The caller must then
+   call rhizome_direct_continue_sync_request(), which concludes the sync once all transfers are done.
+ */
+static void rhizome_direct_http_kick(rhizome_direct_transport_state_http *state)
+{
+  rhizome_direct_sync_request *r = state->sync;
+  int i = 0;
+  while (i < state->pending_count) {
+    unsigned char *item = state->pending[i];
+    int type = item[0];
+    int started = 0;
+    if (type == 1 || type == 3) {
+      if (state->pushes_in_flight >= state->max_pushes) {
+	++i;
+	continue;
+      }
+      if (state->push_batch > 1) {
+	/* Takes this and following pushes off the queue itself */
+	rhizome_direct_http_push_batch(state, i);
+	continue;
+      }
+      rhizome_direct_http_push(r, &item[1]);
+      started = 1;
+    } else {
+      if (rhizome_fetch_queue_space() * 2 < rhizome_fetch_queue_size()) {
+	++i;
+	continue;
+      }
+      /* Fetching the manifest, and then using it to see if we want to 
+	 fetch the file for import is all handled asynchronously. */
+      if (rhizome_fetch_request_manifest_by_prefix(&state->addr, &item[1], RHIZOME_BAR_PREFIX_BYTES,
+	    1 /* import, getting file if needed */) == 0)
+	r->pulls_requested++;
+      started = 1;
+    }
+    if (started) {
+      if (i != state->pending_count - 1)
+	memmove(item, state->pending[i + 1], (state->pending_count - 1 - i) * sizeof state->pending[0]);
+      state->pending_count--;
     }
-    sent+=count;
   }
-
-  struct http_response_parts parts;
- rx:
-  /* request sent, now get response back. */
-  if (receive_http_response(sock, buffer, sizeof buffer, &parts) == -1) {
-    close(sock);
-    goto end;
+  state->pulls_in_flight = rhizome_file_fetch_queue_count > 0;
+  unschedule(&state->alarm);
+  if (state->pending_count || state->pulls_in_flight) {
+    state->alarm.function = rhizome_direct_http_transfer_alarm;
+    state->alarm.alarm = gettime_ms() + 100;
+    state->alarm.deadline = state->alarm.alarm + 1000;
+    schedule(&state->alarm);
   }
+  r->bundle_transfers_in_progress = state->pending_count + state->pushes_in_flight + state->pulls_in_flight;
+}
 
-  /* For some reason the response data gets overwritten during a push,
-     so we need to copy it, and use the copy instead. */
-  unsigned char *actionlist=alloca(parts.content_length);
-  bcopy(parts.content_start, actionlist, parts.content_length);
-  dump("response", actionlist, parts.content_length);
+static int rhizome_direct_http_queue_transfer(rhizome_direct_transport_state_http *state, int type, const unsigned char *bid_prefix)
+{
+  if (state->pending_count >= state->pending_size) {
+    int size = state->pending_size ? state->pending_size * 2 : 64;
+    void *pending = realloc(state->pending, size * sizeof state->pending[0]);
+    if (pending == NULL)
+      return WHYF_perror("realloc(%d)", (int)(size * sizeof state->pending[0]));
+    state->pending = pending;
+    state->pending_size = size;
+  }
+  state->pending[state->pending_count][0] = type;
+  bcopy(bid_prefix, &state->pending[state->pending_count][1], RHIZOME_BAR_PREFIX_BYTES);
+  state->pending_count++;
+  return 0;
+}
 
+/* Queue the pushes and pulls in a list of (1+RHIZOME_BAR_PREFIX_BYTES)-byte action records.
+ */
+static void rhizome_direct_http_queue_actions(rhizome_direct_transport_state_http *state,
+					      const unsigned char *actionlist, int length)
+{
+  rhizome_direct_sync_request *r = state->sync;
   /* We now have the list of (1+RHIZOME_BAR_PREFIX_BYTES)-byte records that indicate
      the list of BAR prefixes that differ between the two nodes.  We can now action
      those which are relevant, i.e., based on whether we are pushing, pulling or 
      synchronising (both).
-
-     I am currently undecided as to whether it is cleaner to have some general
-     rhizome direct function for doing that, or whether it just adds unnecessary
-     complication, and the responses should just be handled in here.
-
-     For now, I am just going to implement it in here, and we can generalise later.
   */
   int i;
-  for(i=10;i<content_length;i+=(1+RHIZOME_BAR_PREFIX_BYTES))
+  for(i=0;i+1+RHIZOME_BAR_PREFIX_BYTES<=length;i+=(1+RHIZOME_BAR_PREFIX_BYTES))
     {
       int type=actionlist[i];
       unsigned long long 
 	bid_prefix_ll=rhizome_bar_bidprefix_ll((unsigned char *)&actionlist[i+1]);
       DEBUGF("%s %016llx* @ 0x%x",type==1?"push":"pull",bid_prefix_ll,i);
-      if (type==2&&r->pullP) {
-	/* Need to fetch manifest.  Once we have the manifest, then we can
-	   use our normal bundle fetch routines from rhizome_fetch.c	 
-
-	   Generate a request like: GET /rhizome/manifestbybar/<hex of bar>
-	   and add it to our list of HTTP fetch requests, then watch
-	   until the request is finished.  That will give us the manifest.
-	   Then as noted above, we can use that to pull the file down using
-	   existing routines.
-	*/
-	if (!rhizome_fetch_request_manifest_by_prefix
-	    (&addr,&actionlist[i+1],RHIZOME_BAR_PREFIX_BYTES,
-	     1 /* import, getting file if needed */))
-	  {
-	    /* Fetching the manifest, and then using it to see if we want to 
-	       fetch the file for import is all handled asynchronously, so just
-	       wait for it to finish. */
-	    while(rhizome_file_fetch_queue_count) fd_poll();
-	  }
-	
-      } else if (type==1&&r->pushP) {
-	/* Form up the POST request to submit the appropriate bundle. */
-
-	/* Start by getting the manifest, which is the main thing we need, and also
-	   gives us the information we need for sending any associated file. */
-	rhizome_manifest 
-	  *m=rhizome_direct_get_manifest(&actionlist[i+1],
-					 RHIZOME_BAR_PREFIX_BYTES);
-	if (!m) {
-	  WHY("This should never happen.  The manifest exists, but when I went looking for it, it doesn't appear to be there.");
-	  goto next_item;
-	}
-
-	/* Get filehash and size from manifest if present */
-	const char *id = rhizome_manifest_get(m, "id", NULL, 0);
-	DEBUGF("bundle id = '%s'",id);
-	const char *hash = rhizome_manifest_get(m, "filehash", NULL, 0);
-	DEBUGF("bundle file hash = '%s'",hash);
-	long long filesize = rhizome_manifest_get_ll(m, "filesize");
-	DEBUGF("file size = %lld",filesize);
-
-	/* We now have everything we need to compose the POST request and send it.
-	 */
-	char *template="POST /rhizome/import HTTP/1.0\r\n"
-	  "Content-Length: %d\r\n"
-	  "Content-Type: multipart/form-data; boundary=%s\r\n"
-	  "\r\n";
-	char *template2="--%s\r\n"
-	  "Content-Disposition: form-data; name=\"manifest\"; filename=\"m\"\r\n"
-	  "Content-Type: application/octet-stream\r\n"
-	  "\r\n";
-	char *template3=
-	  "\r\n--%s\r\n"
-	  "Content-Disposition: form-data; name=\"data\"; filename=\"d\"\r\n"
-	  "Content-Type: application/octet-stream\r\n"
-	  "\r\n";
-	/* Work out what the content length should be */
-	DEBUGF("manifest_all_bytes=%d, manifest_bytes=%d",
-	       m->manifest_all_bytes,m->manifest_bytes);
-	int content_length
-	  =strlen(template2)-2 /* minus 2 for the "%s" that gets replaced */
-	  +strlen(boundary)
-	  +m->manifest_all_bytes
-	  +strlen(template3)-2 /* minus 2 for the "%s" that gets replaced */
-	  +strlen(boundary)
-	  +filesize
-	  +strlen("\r\n--")+strlen(boundary)+strlen("--\r\n");
-
-	/* XXX For some reason the above is four bytes out, so fix that */
-	content_length+=4;
-
-	int len=snprintf(buffer,8192,template,content_length,boundary);
-	len+=snprintf(&buffer[len],8192-len,template2,boundary);
-	memcpy(&buffer[len],m->manifestdata,m->manifest_all_bytes);
-	len+=m->manifest_all_bytes;
-	len+=snprintf(&buffer[len],8192-len,template3,boundary);
-
-	addr.sin_family = AF_INET;     
-	addr.sin_port = htons(state->port);   
-	addr.sin_addr = *((struct in_addr *)hostent->h_addr);
-	bzero(&(addr.sin_zero),8);     
-	
-	sock=socket(AF_INET, SOCK_STREAM, 0);
-	if (sock==-1) {
-	  DEBUGF("could not open socket");    
-	  goto closeit;
-	} 
-	if (connect(sock,(struct sockaddr *)&addr,sizeof(struct sockaddr)) == -1)
-	  {
-	    DEBUGF("Could not connect to remote");
-	    goto closeit;
-	  }
-
-	int sent=0;
-	/* Send buffer now */
-	while(sent<len) {
-	  int r=write(sock,&buffer[sent],len-sent);
-	  if (r>0) sent+=r;
-	  if (r<0) goto closeit;
-	}
-
-	/* send file contents now */
-	long long rowid = -1;
-	sqlite3_blob *blob=NULL;
-	sqlite_exec_int64(&rowid, "select rowid from files where id='%s';", hash);
-	DEBUGF("Reading from rowid #%lld filehash='%s'",rowid,hash?hash:"(null)");
-	if (rowid >= 0 && sqlite3_blob_open(rhizome_db, "main", "files", "data", 
-					    rowid, 0, &blob) != SQLITE_OK)
-	  goto closeit;
-	int i;
-	for(i=0;i<filesize;)
-	  {
-	    int count=4096;
-	    if (filesize-i<count) count=filesize-i;
-	    unsigned char buffer[4096];
-	    DEBUGF("reading %d bytes @ %d from blob",count,i);
-	    int sr=sqlite3_blob_read(blob,buffer,count,i);
-	    if (sr==SQLITE_OK||sr==SQLITE_DONE) {
-	      count=write(sock,buffer,count);
-	      if (count<0) {
-		WHY_perror("write");
-		sqlite3_blob_close(blob);
-		goto closeit;
-	      } else { 
-		i+=count;
-		DEBUGF("Wrote %d bytes of file",count);
-	      }
-	    } else {
-	      WHYF("sqlite error #%d occurred reading from the blob: %s",sr, sqlite3_errmsg(rhizome_db));
-	      sqlite3_blob_close(blob);
-	      goto closeit;
-	    }
-	  }
-
-	/* Send final mime boundary */
-	len=snprintf(buffer,8192,"\r\n--%s--\r\n",boundary);
-	sent=0;
-	while(sent<len) {
-	  int r=write(sock,&buffer[sent],len-sent);
-	  if (r>0) sent+=r;
-	  if (r<0) goto closeit;
-	}	
-
-	/* get response back. */
-	if (receive_http_response(sock, buffer, sizeof buffer, &parts) == -1)
-	  goto closeit;
-	INFOF("Received HTTP response %03u %s", parts.code, parts.reason);
-
-      closeit:
-	close(sock);
-
-	if (m) rhizome_manifest_free(m);
-      }
-    next_item:
-      DEBUGF("Next item.");
-      continue;
+      if ((type==2&&r->pullP) || (type==1&&r->pushP))
+	rhizome_direct_http_queue_transfer(state, type, &actionlist[i+1]);
     }
+}
 
-  /* now update cursor according to what range was covered in the response.
-     We set our current position to just past the high limit of the returned
-     cursor.
-
-     XXX - This introduces potential problems with the returned cursor range.
-     If the far end returns an earlier cursor position than we are in, we could
-     end up in an infinite loop.  We could also end up in a very long finite loop
-     if the cursor doesn't advance far.  A simple solution is to not adjust the
-     cursor position, and simply re-attempt the sync until no actions result.
-     That will do for now.     
- */
-#ifdef FANCY_CURSOR_POSITION_HANDLING
-  rhizome_direct_bundle_cursor *c=rhizome_direct_bundle_iterator(10);
-  assert(c!=NULL);
-  if (rhizome_direct_bundle_iterator_unpickle_range(c,(unsigned char *)&p[0],10))
-    {
-      DEBUGF("Couldn't unpickle range. This should never happen.  Assuming near and far cursor ranges match.");
+static void rhizome_direct_http_enquiry_completed(rhizome_direct_http_exchange *x, struct http_response_parts *parts)
+{
+  rhizome_direct_sync_request *r = x->sync;
+  rhizome_direct_transport_state_http *state = r->transport_specific_state;
+  r->enquiry_bytes_sent += x->request_ofs;
+  r->enquiry_bytes_received += x->response_len;
+  if (parts) {
+    unsigned char *content = (unsigned char *)parts->content_start;
+    if (debug & DEBUG_RHIZOME)
+      dump("response", content, parts->content_length);
+    if (r->reconcile) {
+      unsigned char *actions;
+      int actions_length;
+      if (rhizome_direct_reconcile_response(r, content, parts->content_length, &actions, &actions_length) == 0)
+	rhizome_direct_http_queue_actions(state, actions, actions_length);
+      if (actions)
+	free(actions);
+    } else if (parts->content_length >= 10) {
+      /* Skip the pickled cursor range at the start */
+      rhizome_direct_http_queue_actions(state, content + 10, parts->content_length - 10);
     }
-  else {
-    DEBUGF("unpickled size_high=%lld, limit_size_high=%lld",
-	   c->size_high,c->limit_size_high);
-    DEBUGF("c->buffer_size=%d",c->buffer_size);
-    r->cursor->size_low=c->limit_size_high;
-    bcopy(c->limit_bid_high,r->cursor->bid_low,4);
-    /* Set tail of BID to all high, as we assume the far end has returned all
-       BIDs with the specified prefix. */
-    memset(&r->cursor->bid_low[4],0xff,RHIZOME_MANIFEST_ID_BYTES);
+    r->fill_responses_processed++;
   }
-  rhizome_direct_bundle_iterator_free(&c);
-#endif
 
-  end:
-  /* Warning: tail recursion when done this way. 
-     Should be triggered by an asynchronous event.
-     But this will do for now. */
+  /* The cursor position is not adjusted according to what range was covered in the
+     response.  If the far end returned an earlier cursor position than we are in, we
+     could end up in an infinite loop.  A simple solution is to not adjust the cursor
+     position, and simply re-attempt the sync until no actions result.
+  */
+  r->fills_in_flight--;
+  rhizome_direct_http_kick(state);
+  /* Send the next fill, or conclude; the sync request may be freed by this */
   rhizome_direct_continue_sync_request(r);
 }
+
+/* Send the current cursor fill to the far end as a /rhizome/enquiry.  The fill is copied, so the
+   cursor may be refilled for the next enquiry straight away.
+ */
+void rhizome_direct_http_dispatch(rhizome_direct_sync_request *r)
+{
+  DEBUGF("Dispatch size_high=%lld",r->cursor->size_high);
+
+  char boundary[20];
+  strbuf bb = strbuf_local(boundary, sizeof boundary);
+  strbuf_sprintf(bb, "%08lx%08lx", random(), random());
+  assert(!strbuf_overrun(bb));
+  strbuf content_preamble = strbuf_alloca(200);
+  strbuf content_postamble = strbuf_alloca(40);
+  strbuf_sprintf(content_preamble,
+      "--%s\r\n"
+      "Content-Disposition: form-data; name=\"data\"; filename=\"IHAVEs\"\r\n"
+      "Content-Type: application/octet-stream\r\n"
+      "\r\n",
+      boundary
+    );
+  strbuf_sprintf(content_postamble, "\r\n--%s--\r\n", boundary);
+  assert(!strbuf_overrun(content_preamble));
+  assert(!strbuf_overrun(content_postamble));
+  int fill_len = r->cursor->buffer_offset_bytes + r->cursor->buffer_used;
+  int content_length = strbuf_len(content_preamble)
+		     + fill_len
+		     + strbuf_len(content_postamble);
+  int size = 512 + fill_len;
+  unsigned char *buffer = malloc(size);
+  char *suffix = strdup(strbuf_str(content_postamble));
+  rhizome_direct_http_segment *segments = calloc(2, sizeof *segments);
+  if (buffer == NULL || suffix == NULL || segments == NULL) {
+    WHYF_perror("malloc(%d)", size);
+    WHY("Could not send cursor fill, the sync will fail");
+    if (buffer) free(buffer);
+    if (suffix) free(suffix);
+    if (segments) free(segments);
+    r->fills_in_flight--;
+    r->fills_failed++;
+    return;
+  }
+  strbuf request = strbuf_local((char *)buffer, size);
+  strbuf_sprintf(request,
+      "POST %s HTTP/1.0\r\n"
+      "Content-Length: %d\r\n"
+      "Content-Type: multipart/form-data; boundary=%s\r\n"
+      "\r\n%s",
+      r->reconcile ? "/rhizome/reconcile" : "/rhizome/enquiry",
+      content_length, boundary, strbuf_str(content_preamble)
+    );
+  assert(!strbuf_overrun(request));
+  int len = strbuf_len(request);
+  bcopy(r->cursor->buffer, &buffer[len], fill_len);
+  len += fill_len;
+
+  segments[0].bytes = buffer;
+  segments[0].len = len;
+  segments[1].bytes = (unsigned char *)suffix;
+  segments[1].len = strlen(suffix);
+
+  if (!rhizome_direct_http_exchange_start(r, segments, 2, rhizome_direct_http_enquiry_completed)) {
+    WHY("Could not send cursor fill, the sync will fail");
+    r->fills_in_flight--;
+    r->fills_failed++;
+  }
+}
@@ -0,0 +1,465 @@
+/*
+Serval Mesh Software
+Copyright (C) 2012 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Rhizome Direct set reconciliation.
+
+  The cursor based sync sends the far end every BAR we hold, one cursor fill at a time,
+  so the traffic grows with the size of the stores even when they differ by only a
+  single bundle.  Set reconciliation instead compares ranges of the BID space by
+  digest, in the manner of a Merkle tree whose nodes are BID hex prefixes:
+
+  1. We start with the single range covering every BID (no prefix digits), and send the
+  far end its summary: the number of bundles we hold in it, and the XOR of the hashes
+  of their BARs.
+
+  2. The far end summarises the same range of its own store.  If the summaries match,
+  the range needs no further attention and nothing is returned for it.  If they differ
+  and the far end holds only a few bundles in the range (or the range cannot be split
+  any further), it returns its BARs for the range (a "leaf").  Otherwise it returns the
+  summaries of the sixteen sub-ranges obtained by appending one more hex digit to the
+  prefix (a "split").
+
+  3. For a leaf, we compare the far end's BARs with our own for the range, and so know
+  exactly which bundles to push and which to pull.  For a split, we summarise our own
+  sixteen sub-ranges and send the far end those that differ, which brings us back to
+  step 2 one level down.
+
+  Only the ranges on the path to a differing bundle are ever explored, so both the round
+  trips and the bytes exchanged scale with the size of the difference (times the log of
+  the store size), rather than with the size of the stores.
+
+  Enquiry records (what we send) are each RHIZOME_DIRECT_RANGE_RECORD_BYTES long:
+
+     byte - number of prefix nibbles
+     RHIZOME_BAR_PREFIX_BYTES bytes - the BID prefix, zero padded
+     4 bytes - count of bundles in range (big-endian)
+     RHIZOME_DIRECT_RANGE_DIGEST_BYTES bytes - range digest
+
+  Response records begin with a type byte and the range they describe, followed by:
+
+     0x01 (leaf): 2 bytes count, then that many BARs
+     0x02 (split): 16 times (4 bytes count, RHIZOME_DIRECT_RANGE_DIGEST_BYTES digest)
+
+  The client turns leaf comparisons into the same (1+RHIZOME_BAR_PREFIX_BYTES)-byte
+  push (0x01) and pull (0x02) action records that cursor enquiry responses contain, so
+  the transport can action them in the same way.
+*/
+
+#include "serval.h"
+#include "rhizome.h"
+#include "str.h"
+#include <assert.h>
+
+#define RD_RECONCILE_LEAF 0x01
+#define RD_RECONCILE_SPLIT 0x02
+
+#define RD_RANGE_BYTES (1+RHIZOME_BAR_PREFIX_BYTES)
+#define RD_SPLIT_CHILD_BYTES (4+RHIZOME_DIRECT_RANGE_DIGEST_BYTES)
+
+struct rhizome_direct_range_scan {
+  unsigned int count;
+  unsigned char digest[RHIZOME_DIRECT_RANGE_DIGEST_BYTES];
+  unsigned int child_count[16];
+  unsigned char child_digest[16][RHIZOME_DIRECT_RANGE_DIGEST_BYTES];
+
+  /* Up to max_bars BARs in the range are collected, or all of them if max_bars is -1 */
+  int max_bars;
+  unsigned char *bars;
+  int bars_kept;
+  int bars_size;
+};
+
+static void write_uint32(unsigned char *o, unsigned int v)
+{
+  o[0]=v>>24; o[1]=v>>16; o[2]=v>>8; o[3]=v;
+}
+
+static unsigned int read_uint32(const unsigned char *o)
+{
+  return ((unsigned int)o[0]<<24)|(o[1]<<16)|(o[2]<<8)|o[3];
+}
+
+static int range_nibble(const unsigned char *prefix, int n)
+{
+  return (n&1) ? prefix[n>>1]&0xf : prefix[n>>1]>>4;
+}
+
+static void range_set_nibble(unsigned char *prefix, int n, int v)
+{
+  if (n&1)
+    prefix[n>>1]=(prefix[n>>1]&0xf0)|v;
+  else
+    prefix[n>>1]=(prefix[n>>1]&0x0f)|(v<<4);
+}
+
+static int bar_cmp(const void *a, const void *b)
+{
+  return memcmp(a,b,RHIZOME_BAR_BYTES);
+}
+
+static void rhizome_direct_range_scan_free(struct rhizome_direct_range_scan *s)
+{
+  if (s->bars)
+    free(s->bars);
+  s->bars=NULL;
+}
+
+/* Summarise our store over the BIDs beginning with the given prefix: count and digest
+   of the whole range and of each of its sixteen sub-ranges, and optionally the BARs
+   themselves, sorted.
+ */
+static int rhizome_direct_scan_range(const unsigned char *prefix, int nibbles,
+				     struct rhizome_direct_range_scan *s)
+{
+  assert(nibbles>=0 && nibbles<=RHIZOME_DIRECT_RANGE_MAX_NIBBLES);
+  int max_bars=s->max_bars;
+  bzero(s,sizeof *s);
+  s->max_bars=max_bars;
+
+  char low[RHIZOME_MANIFEST_ID_STRLEN+1];
+  char high[RHIZOME_MANIFEST_ID_STRLEN+1];
+  int i;
+  for (i=0;i<RHIZOME_MANIFEST_ID_STRLEN;i++) {
+    if (i<nibbles)
+      low[i]=high[i]=hexdigit[range_nibble(prefix,i)];
+    else {
+      low[i]='0';
+      high[i]='F';
+    }
+  }
+  low[i]=high[i]='\0';
+
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare(&retry,
+      "SELECT BAR,ID FROM MANIFESTS WHERE ID BETWEEN x'%s' AND x'%s';", low, high);
+  if (!statement)
+    return -1;
+  while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    const unsigned char *bar=sqlite3_column_blob(statement, 0);
+    const unsigned char *id=sqlite3_column_blob(statement, 1);
+    if (!bar || sqlite3_column_bytes(statement, 0)!=RHIZOME_BAR_BYTES
+	|| !id || sqlite3_column_bytes(statement, 1)!=RHIZOME_MANIFEST_ID_BYTES)
+      continue;
+    unsigned char hash[crypto_hash_sha512_BYTES];
+    crypto_hash_sha512(hash,bar,RHIZOME_BAR_COMPARE_BYTES);
+    int child=range_nibble(id,nibbles);
+    for (i=0;i<RHIZOME_DIRECT_RANGE_DIGEST_BYTES;i++) {
+      s->digest[i]^=hash[i];
+      s->child_digest[child][i]^=hash[i];
+    }
+    s->count++;
+    s->child_count[child]++;
+    if (s->max_bars==-1 || s->bars_kept<s->max_bars) {
+      if (s->bars_kept>=s->bars_size) {
+	int size=s->bars_size?s->bars_size*2:64;
+	unsigned char *bars=realloc(s->bars,size*RHIZOME_BAR_BYTES);
+	if (!bars) {
+	  sqlite3_finalize(statement);
+	  rhizome_direct_range_scan_free(s);
+	  return WHYF_perror("realloc(%d)",size*RHIZOME_BAR_BYTES);
+	}
+	s->bars=bars;
+	s->bars_size=size;
+      }
+      bcopy(bar,&s->bars[s->bars_kept*RHIZOME_BAR_BYTES],RHIZOME_BAR_BYTES);
+      s->bars_kept++;
+    }
+  }
+  sqlite3_finalize(statement);
+  if (s->bars_kept)
+    qsort(s->bars,s->bars_kept,RHIZOME_BAR_BYTES,bar_cmp);
+  return 0;
+}
+
+static int rhizome_direct_queue_range(rhizome_direct_sync_request *r,
+				      const unsigned char *prefix, int nibbles,
+				      unsigned int count, const unsigned char *digest)
+{
+  if (r->range_count>=r->range_size) {
+    int size=r->range_size?r->range_size*2:64;
+    void *ranges=realloc(r->ranges,size*sizeof r->ranges[0]);
+    if (!ranges)
+      return WHYF_perror("realloc(%d)",(int)(size*sizeof r->ranges[0]));
+    r->ranges=ranges;
+    r->range_size=size;
+  }
+  unsigned char *record=r->ranges[r->range_count++];
+  record[0]=nibbles;
+  bzero(&record[1],RHIZOME_BAR_PREFIX_BYTES);
+  bcopy(prefix,&record[1],(nibbles+1)/2);
+  write_uint32(&record[RD_RANGE_BYTES],count);
+  bcopy(digest,&record[RD_RANGE_BYTES+4],RHIZOME_DIRECT_RANGE_DIGEST_BYTES);
+  return 0;
+}
+
+/* Begin a reconciliation by queuing the range that covers every BID.
+ */
+int rhizome_direct_reconcile_start(rhizome_direct_sync_request *r)
+{
+  unsigned char prefix[RHIZOME_BAR_PREFIX_BYTES];
+  bzero(prefix,sizeof prefix);
+  struct rhizome_direct_range_scan s;
+  s.max_bars=0;
+  if (rhizome_direct_scan_range(prefix,0,&s))
+    return -1;
+  if (debug & DEBUG_RHIZOME)
+    DEBUGF("Reconciling %u bundles",s.count);
+  return rhizome_direct_queue_range(r,prefix,0,s.count,s.digest);
+}
+
+/* Move as many queued ranges as will fit into one enquiry into the cursor buffer, from
+   where the transport dispatch function sends it.  Returns the number of ranges.
+ */
+int rhizome_direct_reconcile_fill(rhizome_direct_sync_request *r)
+{
+  int n=r->range_count;
+  if (n>RHIZOME_DIRECT_RECONCILE_MAX_RANGES)
+    n=RHIZOME_DIRECT_RECONCILE_MAX_RANGES;
+  if (n>r->cursor->buffer_size/RHIZOME_DIRECT_RANGE_RECORD_BYTES)
+    n=r->cursor->buffer_size/RHIZOME_DIRECT_RANGE_RECORD_BYTES;
+  r->range_count-=n;
+  bcopy(r->ranges[r->range_count],r->cursor->buffer,n*RHIZOME_DIRECT_RANGE_RECORD_BYTES);
+  r->cursor->buffer_offset_bytes=0;
+  r->cursor->buffer_used=n*RHIZOME_DIRECT_RANGE_RECORD_BYTES;
+  return n;
+}
+
+static int append_bytes(unsigned char **buffer, int *length, int *size,
+			const unsigned char *bytes, int count)
+{
+  if (*length+count>*size) {
+    int new_size=*size?*size:1024;
+    while (*length+count>new_size)
+      new_size*=2;
+    unsigned char *b=realloc(*buffer,new_size);
+    if (!b)
+      return WHYF_perror("realloc(%d)",new_size);
+    *buffer=b;
+    *size=new_size;
+  }
+  bcopy(bytes,&(*buffer)[*length],count);
+  *length+=count;
+  return 0;
+}
+
+/* Answer a reconciliation enquiry from the far end.  Returns a malloc()ed response, or
+   NULL on error.
+ */
+unsigned char *rhizome_direct_get_reconcile_response(const unsigned char *request, int length,
+						     int *response_length)
+{
+  if (length%RHIZOME_DIRECT_RANGE_RECORD_BYTES) {
+    WHYF("Malformed reconciliation enquiry (%d bytes)",length);
+    return NULL;
+  }
+  unsigned char *response=NULL;
+  int response_size=0;
+  *response_length=0;
+  /* Make sure an empty response is not mistaken for an error */
+  if (append_bytes(&response,response_length,&response_size,(unsigned char *)"",0))
+    return NULL;
+
+  const unsigned char *record;
+  for (record=request;record<request+length;record+=RHIZOME_DIRECT_RANGE_RECORD_BYTES) {
+    int nibbles=record[0];
+    const unsigned char *prefix=&record[1];
+    if (nibbles>RHIZOME_DIRECT_RANGE_MAX_NIBBLES) {
+      WHYF("Malformed reconciliation range (%d nibbles)",nibbles);
+      free(response);
+      return NULL;
+    }
+    struct rhizome_direct_range_scan s;
+    s.max_bars=RHIZOME_DIRECT_RECONCILE_LEAF_BARS;
+    if (rhizome_direct_scan_range(prefix,nibbles,&s)) {
+      free(response);
+      return NULL;
+    }
+    if (s.count==read_uint32(&record[RD_RANGE_BYTES])
+	&& !memcmp(s.digest,&record[RD_RANGE_BYTES+4],RHIZOME_DIRECT_RANGE_DIGEST_BYTES)) {
+      rhizome_direct_range_scan_free(&s);
+      continue;
+    }
+    unsigned char head[1+RD_RANGE_BYTES+2];
+    bcopy(record,&head[1],RD_RANGE_BYTES);
+    int ret;
+    if (s.count<=RHIZOME_DIRECT_RECONCILE_LEAF_BARS || nibbles==RHIZOME_DIRECT_RANGE_MAX_NIBBLES) {
+      if (s.bars_kept<s.count) {
+	/* Can't be split any further, so send every BAR */
+	s.max_bars=-1;
+	rhizome_direct_range_scan_free(&s);
+	if (rhizome_direct_scan_range(prefix,nibbles,&s)) {
+	  free(response);
+	  return NULL;
+	}
+      }
+      if (s.bars_kept>0xffff)
+	s.bars_kept=0xffff;
+      head[0]=RD_RECONCILE_LEAF;
+      head[1+RD_RANGE_BYTES]=s.bars_kept>>8;
+      head[1+RD_RANGE_BYTES+1]=s.bars_kept;
+      ret=append_bytes(&response,response_length,&response_size,head,sizeof head);
+      if (!ret)
+	ret=append_bytes(&response,response_length,&response_size,s.bars,s.bars_kept*RHIZOME_BAR_BYTES);
+    } else {
+      unsigned char children[16*RD_SPLIT_CHILD_BYTES];
+      int i;
+      for (i=0;i<16;i++) {
+	write_uint32(&children[i*RD_SPLIT_CHILD_BYTES],s.child_count[i]);
+	bcopy(s.child_digest[i],&children[i*RD_SPLIT_CHILD_BYTES+4],RHIZOME_DIRECT_RANGE_DIGEST_BYTES);
+      }
+      head[0]=RD_RECONCILE_SPLIT;
+      ret=append_bytes(&response,response_length,&response_size,head,1+RD_RANGE_BYTES);
+      if (!ret)
+	ret=append_bytes(&response,response_length,&response_size,children,sizeof children);
+    }
+    rhizome_direct_range_scan_free(&s);
+    if (ret) {
+      free(response);
+      return NULL;
+    }
+  }
+  return response;
+}
+
+static int append_action(unsigned char **actions, int *length, int *size,
+			 int type, const unsigned char *bar)
+{
+  unsigned char action[1+RHIZOME_BAR_PREFIX_BYTES];
+  action[0]=type;
+  bcopy(&bar[RHIZOME_BAR_PREFIX_OFFSET],&action[1],RHIZOME_BAR_PREFIX_BYTES);
+  return append_bytes(actions,length,size,action,sizeof action);
+}
+
+/* Compare the far end's BARs for a range with our own, and append the pushes and pulls
+   needed to make the two the same.  Both lists are sorted, so a merge will do.
+ */
+static int rhizome_direct_reconcile_leaf(const unsigned char *prefix, int nibbles,
+					 const unsigned char *them_bars, int them_count,
+					 unsigned char **actions, int *length, int *size)
+{
+  struct rhizome_direct_range_scan s;
+  s.max_bars=-1;
+  if (rhizome_direct_scan_range(prefix,nibbles,&s))
+    return -1;
+  unsigned char *sorted=NULL;
+  if (them_count) {
+    sorted=malloc(them_count*RHIZOME_BAR_BYTES);
+    if (!sorted) {
+      rhizome_direct_range_scan_free(&s);
+      return WHYF_perror("malloc(%d)",them_count*RHIZOME_BAR_BYTES);
+    }
+    bcopy(them_bars,sorted,them_count*RHIZOME_BAR_BYTES);
+    qsort(sorted,them_count,RHIZOME_BAR_BYTES,bar_cmp);
+  }
+  int them=0,us=0,ret=0;
+  while (!ret && (them<them_count || us<s.bars_kept)) {
+    unsigned char *them_bar=&sorted[them*RHIZOME_BAR_BYTES];
+    unsigned char *us_bar=&s.bars[us*RHIZOME_BAR_BYTES];
+    int relation;
+    if (them==them_count) relation=+1;
+    else if (us==s.bars_kept) relation=-1;
+    else relation=memcmp(them_bar,us_bar,RHIZOME_BAR_PREFIX_BYTES);
+    if (relation<0) {
+      /* They have a bundle we don't have any version of */
+      ret=append_action(actions,length,size,0x02,them_bar);
+      them++;
+    } else if (relation>0) {
+      /* We have a bundle they don't have any version of */
+      ret=append_action(actions,length,size,0x01,us_bar);
+      us++;
+    } else {
+      long long them_version=rhizome_bar_version(them_bar);
+      long long us_version=rhizome_bar_version(us_bar);
+      if (them_version>us_version)
+	ret=append_action(actions,length,size,0x02,them_bar);
+      else if (them_version<us_version)
+	ret=append_action(actions,length,size,0x01,us_bar);
+      them++;
+      us++;
+    }
+  }
+  if (sorted)
+    free(sorted);
+  rhizome_direct_range_scan_free(&s);
+  return ret;
+}
+
+/* Process the far end's response to a reconciliation enquiry.  Differing sub-ranges of
+   split ranges are queued on the sync request for the next enquiry, and the pushes and
+   pulls found by comparing leaf ranges are returned as a malloc()ed list of action records.
+ */
+int rhizome_direct_reconcile_response(rhizome_direct_sync_request *r,
+				      const unsigned char *response, int length,
+				      unsigned char **actions, int *actions_length)
+{
+  int actions_size=0;
+  *actions=NULL;
+  *actions_length=0;
+  int ofs=0;
+  while (ofs<length) {
+    if (ofs+1+RD_RANGE_BYTES>length)
+      return WHY("Truncated reconciliation response");
+    int type=response[ofs];
+    int nibbles=response[ofs+1];
+    const unsigned char *prefix=&response[ofs+2];
+    if (nibbles>RHIZOME_DIRECT_RANGE_MAX_NIBBLES)
+      return WHYF("Malformed reconciliation range (%d nibbles)",nibbles);
+    ofs+=1+RD_RANGE_BYTES;
+    if (type==RD_RECONCILE_LEAF) {
+      if (ofs+2>length)
+	return WHY("Truncated reconciliation response");
+      int count=(response[ofs]<<8)|response[ofs+1];
+      ofs+=2;
+      if (ofs+count*RHIZOME_BAR_BYTES>length)
+	return WHY("Truncated reconciliation response");
+      if (debug & DEBUG_RHIZOME)
+	DEBUGF("Range %s* is a leaf of %d BARs",alloca_tohex(prefix,(nibbles+1)/2),count);
+      if (rhizome_direct_reconcile_leaf(prefix,nibbles,&response[ofs],count,
+					actions,actions_length,&actions_size))
+	return -1;
+      ofs+=count*RHIZOME_BAR_BYTES;
+    } else if (type==RD_RECONCILE_SPLIT && nibbles<RHIZOME_DIRECT_RANGE_MAX_NIBBLES) {
+      if (ofs+16*RD_SPLIT_CHILD_BYTES>length)
+	return WHY("Truncated reconciliation response");
+      struct rhizome_direct_range_scan s;
+      s.max_bars=0;
+      if (rhizome_direct_scan_range(prefix,nibbles,&s))
+	return -1;
+      int i,queued=0;
+      for (i=0;i<16;i++) {
+	const unsigned char *child=&response[ofs+i*RD_SPLIT_CHILD_BYTES];
+	if (read_uint32(child)==s.child_count[i]
+	    && !memcmp(&child[4],s.child_digest[i],RHIZOME_DIRECT_RANGE_DIGEST_BYTES))
+	  continue;
+	unsigned char child_prefix[RHIZOME_BAR_PREFIX_BYTES];
+	bcopy(prefix,child_prefix,RHIZOME_BAR_PREFIX_BYTES);
+	range_set_nibble(child_prefix,nibbles,i);
+	if (rhizome_direct_queue_range(r,child_prefix,nibbles+1,s.child_count[i],s.child_digest[i]))
+	  return -1;
+	queued++;
+      }
+      if (debug & DEBUG_RHIZOME)
+	DEBUGF("Range %s* split, %d of 16 sub-ranges differ",alloca_tohex(prefix,(nibbles+1)/2),queued);
+      ofs+=16*RD_SPLIT_CHILD_BYTES;
+    } else
+      return WHYF("Unknown reconciliation response record type 0x%02x",type);
+  }
+  return 0;
+}
@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <time.h>
 #include <arpa/inet.h>
 #include <assert.h>
+#include <ctype.h>
 #include "serval.h"
 #include "rhizome.h"
 #include "str.h"
@@ -113,7 +114,7 @@ int rhizome_manifest_version_cache_store(rhizome_manifest *m)
   int slot;
   int i;
 
-  char *id=rhizome_manifest_get(m,"id",NULL,0);
+  char *id=rhizome_manifest_get_field(m, RHIZOME_FIELD_ID);
   if (!id) return 1; // dodgy manifest, so don't suggest that we want to RX it.
 
   /* Work out bin number in cache */
@@ -127,7 +128,7 @@ int rhizome_manifest_version_cache_store(rhizome_manifest *m)
   slot=random()%RHIZOME_VERSION_CACHE_ASSOCIATIVITY;
   rhizome_manifest_version_cache_slot *entry
     =&rhizome_manifest_version_cache[bin][slot];
-  unsigned long long manifest_version = rhizome_manifest_get_ll(m,"version");
+  unsigned long long manifest_version = rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_VERSION);
 
   entry->version=manifest_version;
   for(i=0;i<24;i++)
@@ -150,11 +151,11 @@ int rhizome_manifest_version_cache_lookup(rhizome_manifest *m)
     // dodgy manifest, we don't want to receive it
     return WHY("Ignoring bad manifest (no ID field)");
   str_toupper_inplace(id);
-  m->version = rhizome_manifest_get_ll(m, "version");
+  m->version = rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_VERSION);
   
   // skip the cache for now
   long long dbVersion = -1;
-  if (sqlite_exec_int64(&dbVersion, "SELECT version FROM MANIFESTS WHERE id='%s';", id) == -1)
+  if (sqlite_exec_int64_key(&dbVersion, id, "SELECT version FROM MANIFESTS WHERE id=?;") == -1)
     return WHY("Select failure");
   if (dbVersion >= m->version) {
     if (0) WHYF("We already have %s (%lld vs %lld)", id, dbVersion, m->version);
@@ -183,12 +184,12 @@ int rhizome_manifest_version_cache_lookup(rhizome_manifest *m)
 	}
       if (i==24) {
 	/* Entries match -- so check version */
-	long long rev = rhizome_manifest_get_ll(m,"version");
+	long long rev = rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_VERSION);
 	if (1) DEBUGF("cached version %lld vs manifest version %lld", entry->version,rev);
 	if (rev > entry->version) {
 	  /* If we only have an old version, try refreshing the cache
 	     by querying the database */
-	  if (sqlite_exec_int64(&entry->version, "select version from manifests where id='%s'", id) != 1)
+	  if (sqlite_exec_int64_key(&entry->version, id, "select version from manifests where id=?") != 1)
 	    return WHY("failed to select stored manifest version");
 	  DEBUGF("Refreshed stored version from database: entry->version=%lld", entry->version);
 	}
@@ -235,9 +236,9 @@ int rhizome_manifest_version_cache_lookup(rhizome_manifest *m)
      and require regular database queries, and that memory allowing, we should use
      a fairly large cache here.
  */
-  long long manifest_version = rhizome_manifest_get_ll(m, "version");
+  long long manifest_version = rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_VERSION);
   long long count;
-  switch (sqlite_exec_int64(&count, "select count(*) from manifests where id='%s' and version>=%lld", id, manifest_version)) {
+  switch (sqlite_exec_int64_key(&count, id, "select count(*) from manifests where id=? and version>=%lld", manifest_version)) {
     case -1:
       return WHY("database error reading stored manifest version");
     case 1:
@@ -245,7 +246,7 @@ int rhizome_manifest_version_cache_lookup(rhizome_manifest *m)
 	/* Okay, we have a stored version which is newer, so update the cache
 	  using a random replacement strategy. */
 	long long stored_version;
-	if (sqlite_exec_int64(&stored_version, "select version from manifests where id='%s'", id) < 1)
+	if (sqlite_exec_int64_key(&stored_version, id, "select version from manifests where id=?") < 1)
 	  return WHY("database error reading stored manifest version"); // database is broken, we can't confirm that it is here
 	DEBUGF("stored version=%lld, manifest_version=%lld (not fetching; remembering in cache)",
 	    stored_version,manifest_version);
@@ -339,17 +340,139 @@ int rhizome_queue_ignore_manifest(rhizome_manifest *m,
 
 }
 
+/* Subscriptions limit which bundles this node fetches.  If none are configured, every bundle is
+   fetched.  Otherwise a bundle is only fetched if its service, its sender or its group is
+   subscribed to.  Each set is a small open-addressed hash table, so checking a bundle costs the
+   same however many subscriptions there are.
+ */
+#define SUBSCRIPTION_SLOTS 128
+
+typedef struct subscription_set {
+  int count;
+  char *keys[SUBSCRIPTION_SLOTS];
+} subscription_set;
+
+static subscription_set subscribed_services;
+static subscription_set subscribed_senders;
+static subscription_set subscribed_groups;
+static int subscriptions_count = 0;
+static long long unsubscribed_bundles = 0;
+static long long unsubscribed_bytes = 0;
+
+static unsigned subscription_hash(const char *key)
+{
+  unsigned h = 2166136261u;
+  for (; *key; ++key)
+    h = (h ^ (unsigned char) toupper(*key)) * 16777619u;
+  return h;
+}
+
+static char **subscription_slot(subscription_set *set, const char *key)
+{
+  unsigned i = subscription_hash(key) % SUBSCRIPTION_SLOTS;
+  while (set->keys[i] && strcasecmp(set->keys[i], key))
+    i = (i + 1) % SUBSCRIPTION_SLOTS;
+  return &set->keys[i];
+}
+
+static int subscribed(subscription_set *set, const char *key)
+{
+  return key && set->count && *subscription_slot(set, key);
+}
+
+/* Load a comma-separated list of subscriptions from the given config option.  If is_id is set,
+   every entry must be a hex SID or group ID.
+ */
+static void subscriptions_load(subscription_set *set, const char *var, int is_id)
+{
+  int i;
+  for (i = 0; i != SUBSCRIPTION_SLOTS; ++i)
+    if (set->keys[i]) {
+      free(set->keys[i]);
+      set->keys[i] = NULL;
+    }
+  set->count = 0;
+  const char *list = confValueGet(var, "");
+  while (*list) {
+    size_t len = strcspn(list, ",");
+    char key[len + 1];
+    strncpy(key, list, len);
+    key[len] = '\0';
+    list += len;
+    if (*list == ',')
+      ++list;
+    char *k = key + strspn(key, " \t");
+    for (i = strlen(k); i && isspace(k[i - 1]); --i)
+      k[i - 1] = '\0';
+    if (!*k)
+      continue;
+    if (is_id && !rhizome_str_is_manifest_id(k)) {
+      WARNF("Ignoring invalid %s entry %s", var, alloca_str_toprint(k));
+      continue;
+    }
+    if (set->count >= SUBSCRIPTION_SLOTS / 2) {
+      WARNF("Too many %s entries, ignoring %s and after", var, alloca_str_toprint(k));
+      break;
+    }
+    char **slot = subscription_slot(set, k);
+    if (!*slot && (*slot = strdup(k)))
+      ++set->count;
+  }
+}
+
+int rhizome_subscriptions_configure()
+{
+  subscriptions_load(&subscribed_services, "rhizome.subscribe.services", 0);
+  subscriptions_load(&subscribed_senders, "rhizome.subscribe.senders", 1);
+  subscriptions_load(&subscribed_groups, "rhizome.subscribe.groups", 1);
+  subscriptions_count = subscribed_services.count + subscribed_senders.count + subscribed_groups.count;
+  return 0;
+}
+
+/* Return 1 if this node wants the bundle described by the given (unverified) manifest.  A manifest
+   belongs to at most one group, named by its "group" field.
+ */
+int rhizome_manifest_subscribed(rhizome_manifest *m)
+{
+  if (!subscriptions_count)
+    return 1;
+  if (   subscribed(&subscribed_services, rhizome_manifest_get_field(m, RHIZOME_FIELD_SERVICE))
+      || subscribed(&subscribed_senders, rhizome_manifest_get_field(m, RHIZOME_FIELD_SENDER))
+      || subscribed(&subscribed_groups, rhizome_manifest_get(m, "group", NULL, 0)))
+    return 1;
+  ++unsubscribed_bundles;
+  unsubscribed_bytes += m->fileLength;
+  if (debug & DEBUG_RHIZOME_RX) {
+    const char *service = rhizome_manifest_get_field(m, RHIZOME_FIELD_SERVICE);
+    DEBUGF("Not subscribed to bundle bid=%s service=%s, avoided %lld bundles, %lld bytes so far",
+	rhizome_manifest_get_field(m, RHIZOME_FIELD_ID),
+	service ? alloca_str_toprint(service) : "NULL",
+	unsubscribed_bundles, unsubscribed_bytes);
+  }
+  return 0;
+}
+
 typedef struct rhizome_candidates {
   rhizome_manifest *manifest;
   struct sockaddr_in peer;
   long long size;
   /* XXX Need group memberships/priority level here */
   int priority;
+  /* how far away the place the bundle is about is, see rhizome_bar_geo_rank() */
+  int georank;
 } rhizome_candidates;
 
 rhizome_candidates candidates[MAX_CANDIDATES];
 int candidate_count=0;
 
+/* Candidates are fetched in order of priority, then nearest first, then smallest first */
+static int rhizome_candidate_before(const rhizome_candidates *c1, const rhizome_candidates *c2)
+{
+  if (c1->priority!=c2->priority) return c1->priority<c2->priority;
+  if (c1->georank!=c2->georank) return c1->georank<c2->georank;
+  return c1->size<c2->size;
+}
+
 /* sort indicated candidate from starting position down
    (or up) */
 int rhizome_position_candidate(int position)
@@ -357,9 +480,7 @@ int rhizome_position_candidate(int position)
   while(position<candidate_count&&position>=0) {
     rhizome_candidates *c1=&candidates[position];
     rhizome_candidates *c2=&candidates[position+1];
-    if (c1->priority>c2->priority
-	||(c1->priority==c2->priority
-	   &&c1->size>c2->size))
+    if (rhizome_candidate_before(c2,c1))
       {
 	rhizome_candidates c=*c1;
 	*c1=*c2;
@@ -370,9 +491,7 @@ int rhizome_position_candidate(int position)
       /* doesn't need moving down, but does it need moving up? */
       if (!position) return 0;
       rhizome_candidates *c0=&candidates[position-1];
-      if (c1->priority<c0->priority
-	  ||(c1->priority==c0->priority
-	     &&c1->size<c0->size))
+      if (rhizome_candidate_before(c1,c0))
 	{
 	  rhizome_candidates c=*c1;
 	  *c1=*c2;
@@ -385,6 +504,31 @@ int rhizome_position_candidate(int position)
   return 0;
 }
 
+static int import_received(void *context)
+{
+  rhizome_manifest *m = context;
+  return rhizome_bundle_import(m, m->ttl);
+}
+
+static int import_received_matches(void *context, const void *bid)
+{
+  return memcmp(((rhizome_manifest *) context)->cryptoSignPublic, bid, RHIZOME_MANIFEST_ID_BYTES) == 0;
+}
+
+static void import_received_done(void *context, int result)
+{
+  rhizome_manifest_free((rhizome_manifest *) context);
+}
+
+/* Import a bundle received from a peer, and free the manifest once done.  If the database is busy,
+   the import is retried later instead of blocking the server.
+ */
+static void rhizome_import_deferred(rhizome_manifest *m, int ttl)
+{
+  m->ttl = ttl;
+  rhizome_db_request("rhizome_bundle_import", import_received, import_received_done, m);
+}
+
 void rhizome_import_received_bundle(struct rhizome_manifest *m)
 {
   m->finalised = 1;
@@ -393,7 +537,7 @@ void rhizome_import_received_bundle(struct rhizome_manifest *m)
     DEBUGF("manifest len=%d has %d signatories", m->manifest_bytes, m->sig_count);
     dump("manifest", m->manifestdata, m->manifest_all_bytes);
   }
-  rhizome_bundle_import(m, m->ttl - 1 /* TTL */);
+  rhizome_import_deferred(m, m->ttl - 1 /* TTL */);
 }
 
 /* Verifies manifests as late as possible to avoid wasting time. */
@@ -401,7 +545,7 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, struct sockaddr_i
 {
   IN();
   /* must free manifest when done with it */
-  char *id = rhizome_manifest_get(m, "id", NULL, 0);
+  char *id = rhizome_manifest_get_field(m, RHIZOME_FIELD_ID);
   int priority=100; /* normal priority */
 
   if (debug & DEBUG_RHIZOME_RX)
@@ -414,9 +558,16 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, struct sockaddr_i
     RETURN(-1);
   }
 
+  if (!rhizome_manifest_subscribed(m)) {
+    /* Don't look at this bundle again for a while */
+    rhizome_queue_ignore_manifest(m, peerip, RHIZOME_UNSUBSCRIBED_IGNORE_MS);
+    rhizome_manifest_free(m);
+    RETURN(-1);
+  }
+
   if (debug & DEBUG_RHIZOME_RX) {
     long long stored_version;
-    if (sqlite_exec_int64(&stored_version, "select version from manifests where id='%s'",id) > 0)
+    if (sqlite_exec_int64_key(&stored_version, id, "select version from manifests where id=?") > 0)
       DEBUGF("   is new (have version %lld)", stored_version);
   }
 
@@ -432,6 +583,11 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, struct sockaddr_i
     RETURN(0);
   }
 
+  rhizome_candidates c;
+  c.size=m->fileLength;
+  c.priority=priority;
+  c.georank=rhizome_manifest_geo_rank(m);
+
   /* work out where to put it in the list */
   int i;
   for(i=0;i<candidate_count;i++)
@@ -440,12 +596,12 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, struct sockaddr_i
          (also replace older manifest versions with newer ones,
           which can upset the ordering.) */
       if (candidates[i].manifest==NULL) continue;
-      if (!strcasecmp(id,rhizome_manifest_get(candidates[i].manifest,"id",NULL,0)))
+      if (!strcasecmp(id,rhizome_manifest_get_field(candidates[i].manifest, RHIZOME_FIELD_ID)))
 	  {
 	    /* duplicate.
 	       XXX - Check versions! We should replace older with newer,
 	       and then update position in queue based on size */
-	  long long list_version = rhizome_manifest_get_ll(candidates[i].manifest, "version");
+	  long long list_version = rhizome_manifest_get_field_ll(candidates[i].manifest, RHIZOME_FIELD_VERSION);
 	  if (list_version >= m->version) {
 	    /* this version is older than the one in the list, so don't list this one */
 	    rhizome_manifest_free(m);
@@ -471,9 +627,7 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, struct sockaddr_i
       /* if we have a higher priority file than the one at this
 	 point in the list, stop, and we will shuffle the rest of
 	 the list down. */
-      if (candidates[i].priority>priority
-	  ||(candidates[i].priority==priority
-	     &&candidates[i].size>m->fileLength))
+      if (rhizome_candidate_before(&c,&candidates[i]))
 	break;
     }
   if (i>=MAX_CANDIDATES) {
@@ -503,19 +657,18 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, struct sockaddr_i
 	&candidates[i+1],
 	bytes);
   /* put new candidate in */
-  candidates[i].manifest=m;
-  candidates[i].size=m->fileLength;
-  candidates[i].priority=priority;
-  candidates[i].peer=*peerip;
+  c.manifest=m;
+  c.peer=*peerip;
+  candidates[i]=c;
 
   int j;
   if (1) {
     DEBUG("Rhizome priorities fetch list now:");
     for(j=0;j<candidate_count;j++)
-      DEBUGF("%02d:%s:size=%lld, priority=%d",
+      DEBUGF("%02d:%s:size=%lld, priority=%d, georank=%d",
 	   j,
-	   rhizome_manifest_get(candidates[j].manifest,"id",NULL,0),
-	   candidates[j].size,candidates[j].priority);
+	   rhizome_manifest_get_field(candidates[j].manifest, RHIZOME_FIELD_ID),
+	   candidates[j].size,candidates[j].priority,candidates[j].georank);
   }
 
   RETURN(0);
@@ -556,7 +709,7 @@ int rhizome_queue_manifest_import(rhizome_manifest *m, struct sockaddr_in *peeri
   *manifest_kept = 0;
 
   const char *bid = alloca_tohex_bid(m->cryptoSignPublic);
-  long long filesize = rhizome_manifest_get_ll(m, "filesize");
+  long long filesize = rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_FILESIZE);
 
   /* Do the quick rejection tests first, before the more expensive once,
      like querying the database for manifests. 
@@ -602,6 +755,11 @@ int rhizome_queue_manifest_import(rhizome_manifest *m, struct sockaddr_in *peeri
       }
     }
   }
+  if (rhizome_db_request_pending(import_received, import_received_matches, m->cryptoSignPublic)) {
+    if (debug & DEBUG_RHIZOME_RX)
+      DEBUGF("   import already waiting for the database");
+    return 3;
+  }
 
   if (!rhizome_manifest_get(m, "filehash", m->fileHexHash, sizeof m->fileHexHash))
     return WHY("Manifest missing filehash");
@@ -615,7 +773,7 @@ int rhizome_queue_manifest_import(rhizome_manifest *m, struct sockaddr_in *peeri
       DEBUGF("   Getting ready to fetch filehash=%s for bid=%s", m->fileHexHash, bid);
 
     long long gotfile = 0;
-    if (sqlite_exec_int64(&gotfile, "SELECT COUNT(*) FROM FILES WHERE ID='%s' and datavalid=1;", m->fileHexHash) != 1)
+    if (sqlite_exec_int64_key(&gotfile, m->fileHexHash, "SELECT COUNT(*) FROM FILES WHERE ID=? and datavalid=1;") != 1)
       return WHY("select failed");
     if (gotfile == 0) {
       /* We need to get the file, unless already queued */
@@ -671,7 +829,7 @@ int rhizome_queue_manifest_import(rhizome_manifest *m, struct sockaddr_in *peeri
 
 	/* XXX Don't forget to implement resume */
 	/* XXX We should stream file straight into the database */
-	const char *id = rhizome_manifest_get(q->manifest, "id", NULL, 0);
+	const char *id = rhizome_manifest_get_field(q->manifest, RHIZOME_FIELD_ID);
 	if (id == NULL) {
 	  close(sock);
 	  return WHY("Manifest missing ID");
@@ -718,7 +876,8 @@ int rhizome_queue_manifest_import(rhizome_manifest *m, struct sockaddr_in *peeri
     } else {
       if (debug & DEBUG_RHIZOME_RX) 
 	DEBUGF("We already have the file for this manifest; importing from manifest alone.");
-      rhizome_bundle_import(m, m->ttl-1);
+      *manifest_kept = 1;
+      rhizome_import_deferred(m, m->ttl-1);
     }
   }
 
@@ -746,6 +905,20 @@ int rhizome_fetch_close(rhizome_file_fetch_record *q){
   else
     WHY("rhizome_file_fetch_queue_count is already zero, is a fetch record being double freed?");
   
+  /* New fetches are queued at file_fetch_queue[rhizome_file_fetch_queue_count], so keep the live
+     records packed at the front by moving the last one into the slot just released */
+  rhizome_file_fetch_record *last = &file_fetch_queue[rhizome_file_fetch_queue_count];
+  if (q < last) {
+    unwatch(&last->alarm);
+    unschedule(&last->alarm);
+    *q = *last;
+    watch(&q->alarm);
+    schedule(&q->alarm);
+    last->file = NULL;
+    last->manifest = NULL;
+    last->alarm.poll.fd = -1;
+  }
+  
   if (debug & DEBUG_RHIZOME_RX) 
     DEBUGF("Released rhizome fetch slot (%d used)", rhizome_file_fetch_queue_count);
   return 0;
@@ -799,7 +972,6 @@ void rhizome_write_content(rhizome_file_fetch_record *q, char *buffer, int bytes
     q->file = NULL;
     if (q->manifest) {
       rhizome_import_received_bundle(q->manifest);
-      rhizome_manifest_free(q->manifest);
       q->manifest = NULL;
     } else {
       /* This was to fetch the manifest, so now fetch the file if needed */
@@ -994,12 +1166,24 @@ int unpack_http_response(char *response, struct http_response_parts *parts)
   return 0;
 }
 
+int rhizome_fetch_queue_size()
+{
+  return MAX_QUEUED_FILES;
+}
+
+int rhizome_fetch_queue_space()
+{
+  return MAX_QUEUED_FILES - rhizome_file_fetch_queue_count;
+}
+
 int rhizome_fetch_request_manifest_by_prefix(struct sockaddr_in *peerip,
 					     unsigned char *prefix,
 					     int prefix_length,
 					     int importP)
 {
   assert(peerip);
+  if (rhizome_file_fetch_queue_count >= MAX_QUEUED_FILES)
+    return WHY("All fetch queue slots full");
   /* Transfer via HTTP over IPv4 */
   int sock = socket(AF_INET, SOCK_STREAM, 0);
   if (sock == -1)
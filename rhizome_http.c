@@ -27,13 +27,162 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "serval.h"
 #include "str.h"
 #include "rhizome.h"
-#define RHIZOME_SERVER_MAX_LIVE_REQUESTS 32
 
 struct sched_ent server_alarm;
 struct profile_total server_stats;
 
 struct profile_total connection_stats;
 
+/* Admission control and fairness for the HTTP server.  The number of live requests is bounded
+   overall and per client address, so a single greedy client cannot take every connection while
+   mesh fetchers starve.  Each client address may also be given a share of the server's sending
+   bandwidth.  Each client earns credit at its share, and may save up RHIZOME_HTTP_PEER_BURST_MS of it;
+   once its credit is spent, its connections stop writing until enough has been earned again.
+ */
+#define RHIZOME_HTTP_PEER_BURST_MS 100
+
+struct rhizome_http_peer {
+  struct rhizome_http_peer *next;
+  struct in_addr addr;
+  int connections;
+  time_ms_t credit_updated;
+  long long credit;
+};
+
+static struct rhizome_http_peer *rhizome_http_peers = NULL;
+static int rhizome_http_live_requests = 0;
+static int rhizome_http_max_requests = RHIZOME_SERVER_MAX_LIVE_REQUESTS;
+static int rhizome_http_max_requests_per_peer = RHIZOME_SERVER_MAX_REQUESTS_PER_PEER;
+static long long rhizome_http_peer_bytes_per_second = 0;
+static time_ms_t rhizome_http_idle_timeout = RHIZOME_IDLE_TIMEOUT;
+static struct rhizome_http_server_stats rhizome_http_stats;
+
+void rhizome_http_server_get_stats(struct rhizome_http_server_stats *stats)
+{
+  *stats = rhizome_http_stats;
+  stats->live = rhizome_http_live_requests;
+}
+
+void rhizome_http_server_show_stats()
+{
+  struct rhizome_http_server_stats stats;
+  rhizome_http_server_get_stats(&stats);
+  if (stats.live || stats.accepted || stats.refused || stats.refused_per_peer || stats.throttled)
+    INFOF("Rhizome HTTP server: %d live requests, %lld accepted, %lld refused as full, %lld refused per client, %lld throttled",
+	stats.live, stats.accepted, stats.refused, stats.refused_per_peer, stats.throttled);
+}
+
+static long long rhizome_http_peer_burst()
+{
+  long long burst = rhizome_http_peer_bytes_per_second * RHIZOME_HTTP_PEER_BURST_MS / 1000;
+  return burst < 1 ? 1 : burst;
+}
+
+static void rhizome_http_server_configure()
+{
+  rhizome_http_max_requests = (int) confValueGetInt64Range("rhizome.http.max_connections",
+      RHIZOME_SERVER_MAX_LIVE_REQUESTS, 1, 65536);
+  rhizome_http_max_requests_per_peer = (int) confValueGetInt64Range("rhizome.http.max_connections_per_peer",
+      RHIZOME_SERVER_MAX_REQUESTS_PER_PEER, 1, 65536);
+  rhizome_http_peer_bytes_per_second = confValueGetInt64Range("rhizome.http.peer_bytes_per_second",
+      0, 0, 1LL << 40);
+  rhizome_http_idle_timeout = confValueGetInt64Range("rhizome.http.idle_timeout_ms",
+      RHIZOME_IDLE_TIMEOUT, 100, 3600000);
+}
+
+static struct rhizome_http_peer *rhizome_http_peer_find(struct in_addr addr, int create)
+{
+  struct rhizome_http_peer *p;
+  for (p = rhizome_http_peers; p; p = p->next)
+    if (p->addr.s_addr == addr.s_addr)
+      return p;
+  if (!create)
+    return NULL;
+  p = calloc(1, sizeof *p);
+  if (p == NULL) {
+    WHYF_perror("calloc(1, %u)", (unsigned) sizeof *p);
+    return NULL;
+  }
+  p->addr = addr;
+  p->credit_updated = gettime_ms();
+  p->credit = rhizome_http_peer_burst();
+  p->next = rhizome_http_peers;
+  rhizome_http_peers = p;
+  return p;
+}
+
+static void rhizome_http_peer_release(struct in_addr addr)
+{
+  struct rhizome_http_peer **pp;
+  for (pp = &rhizome_http_peers; *pp; pp = &(*pp)->next) {
+    struct rhizome_http_peer *p = *pp;
+    if (p->addr.s_addr == addr.s_addr) {
+      if (--p->connections <= 0) {
+	*pp = p->next;
+	free(p);
+      }
+      return;
+    }
+  }
+}
+
+/* Return the number of bytes the request's client may send now, or -1 if there is no limit.
+ */
+static long long rhizome_http_peer_allowance(rhizome_http_request *r, time_ms_t now)
+{
+  if (rhizome_http_peer_bytes_per_second <= 0)
+    return -1;
+  struct rhizome_http_peer *p = rhizome_http_peer_find(r->requestor.sin_addr, 0);
+  if (p == NULL)
+    return -1;
+  if (now > p->credit_updated) {
+    p->credit += (now - p->credit_updated) * rhizome_http_peer_bytes_per_second / 1000;
+    p->credit_updated = now;
+    long long burst = rhizome_http_peer_burst();
+    if (p->credit > burst)
+      p->credit = burst;
+  }
+  return p->credit < 0 ? 0 : p->credit;
+}
+
+static void rhizome_http_peer_charge(rhizome_http_request *r, int bytes)
+{
+  if (rhizome_http_peer_bytes_per_second <= 0)
+    return;
+  struct rhizome_http_peer *p = rhizome_http_peer_find(r->requestor.sin_addr, 0);
+  if (p)
+    p->credit -= bytes;
+}
+
+/* Stop writing to a client that has used up its bandwidth share, and wake up again once it has
+   earned half a burst.
+ */
+static void rhizome_http_throttle(rhizome_http_request *r, time_ms_t now)
+{
+  struct rhizome_http_peer *p = rhizome_http_peer_find(r->requestor.sin_addr, 0);
+  ++rhizome_http_stats.throttled;
+  r->throttled = 1;
+  unwatch(&r->alarm);
+  unschedule(&r->alarm);
+  time_ms_t delay = 1000;
+  if (p)
+    delay = (rhizome_http_peer_burst() / 2 - p->credit) * 1000 / rhizome_http_peer_bytes_per_second + 1;
+  r->alarm.alarm = now + delay;
+  r->alarm.deadline = r->alarm.alarm + 100;
+  schedule(&r->alarm);
+}
+
+/* Refuse a connection that would exceed one of the limits, with a best-effort 503 response.
+ */
+static void rhizome_server_refuse(int sock, const char *reason)
+{
+  static const char response[] = "HTTP/1.0 503 Service Unavailable\r\nContent-length: 0\r\n\r\n";
+  INFOF("RHIZOME HTTP SERVER, REFUSE %s", reason);
+  if (write(sock, response, sizeof response - 1) == -1 && (debug & DEBUG_RHIZOME_TX))
+    DEBUG_perror("write");
+  close(sock);
+}
+
 /*
   HTTP server and client code for rhizome transfers and rhizome direct.
   Selection of either use is made when starting the HTTP server and
@@ -74,7 +223,7 @@ int favicon_len=318;
 
 int rhizome_http_server_running()
 {
-  return rhizome_server_socket != -1;
+  return rhizome_server_socket != -1 || rhizome_worker_serving();
 }
 
 /* Start the Rhizome HTTP server by creating a socket, binding it to an available port, and
@@ -161,6 +310,7 @@ success:
   rhizome_http_parse_func_description=parse_func_desc;
 
   rhizome_http_server_port = port;
+  rhizome_http_server_configure();
   /* Add Rhizome HTTPd server to list of file descriptors to watch */
   server_alarm.function = rhizome_server_poll;
   server_stats.name="rhizome_server_poll";
@@ -175,6 +325,18 @@ success:
 void rhizome_client_poll(struct sched_ent *alarm)
 {
   rhizome_http_request *r = (rhizome_http_request *)alarm;
+  if (alarm->poll.revents == 0 && r->throttled){
+    /* Start of a new bandwidth window, so resume sending. */
+    r->throttled = 0;
+    r->alarm.poll.events = POLLOUT;
+    watch(&r->alarm);
+    r->alarm.alarm = gettime_ms() + rhizome_http_idle_timeout;
+    r->alarm.deadline = r->alarm.alarm + rhizome_http_idle_timeout;
+    unschedule(&r->alarm);
+    schedule(&r->alarm);
+    rhizome_server_http_send_bytes(r);
+    return;
+  }
   if (alarm->poll.revents == 0){
     if (debug & DEBUG_RHIZOME_TX)
       DEBUG("Closing connection due to timeout");
@@ -192,8 +354,8 @@ void rhizome_client_poll(struct sched_ent *alarm)
 	/* If we got some data, see if we have found the end of the HTTP request */
 	if (bytes > 0) {
 	  // reset inactivity timer
-	  r->alarm.alarm = gettime_ms() + RHIZOME_IDLE_TIMEOUT;
-	  r->alarm.deadline = r->alarm.alarm + RHIZOME_IDLE_TIMEOUT;
+	  r->alarm.alarm = gettime_ms() + rhizome_http_idle_timeout;
+	  r->alarm.deadline = r->alarm.alarm + rhizome_http_idle_timeout;
 	  unschedule(&r->alarm);
 	  schedule(&r->alarm);
 	  rhizome_direct_process_post_multipart_bytes(r,buffer,bytes);
@@ -218,8 +380,8 @@ void rhizome_client_poll(struct sched_ent *alarm)
       /* If we got some data, see if we have found the end of the HTTP request */
       if (bytes > 0) {
 	// reset inactivity timer
-	r->alarm.alarm = gettime_ms() + RHIZOME_IDLE_TIMEOUT;
-	r->alarm.deadline = r->alarm.alarm + RHIZOME_IDLE_TIMEOUT;
+	r->alarm.alarm = gettime_ms() + rhizome_http_idle_timeout;
+	r->alarm.deadline = r->alarm.alarm + rhizome_http_idle_timeout;
 	unschedule(&r->alarm);
 	schedule(&r->alarm);
 	r->request_length += bytes;
@@ -272,14 +434,37 @@ void rhizome_server_poll(struct sched_ent *alarm)
 	    addr_len, addr.sa_family, alloca_tohex((unsigned char *)addr.sa_data, sizeof addr.sa_data)
 	  );
       }
+      if (rhizome_http_live_requests >= rhizome_http_max_requests) {
+	++rhizome_http_stats.refused;
+	rhizome_server_refuse(sock, "too many connections");
+	continue;
+      }
+      struct rhizome_http_peer *peer = NULL;
+      if (peerip) {
+	peer = rhizome_http_peer_find(peerip->sin_addr, 0);
+	if (peer && peer->connections >= rhizome_http_max_requests_per_peer) {
+	  ++rhizome_http_stats.refused_per_peer;
+	  rhizome_server_refuse(sock, "too many connections from client");
+	  continue;
+	}
+      }
       rhizome_http_request *request = calloc(sizeof(rhizome_http_request), 1);
       if (request == NULL) {
 	WHYF_perror("calloc(%u, 1)", sizeof(rhizome_http_request));
 	WHY("Cannot respond to request, out of memory");
+	close(sock);
       } else {
+	/* Only start tracking a new client once it has a request, so a failure above can't leak it */
+	if (peerip && !peer)
+	  peer = rhizome_http_peer_find(peerip->sin_addr, 1);
 	request->uuid=rhizome_http_request_uuid_counter++;
+	request->initiate_time=gettime_ms();
 	if (peerip) request->requestor=*peerip; 
 	else bzero(&request->requestor,sizeof(request->requestor));
+	if (peer)
+	  ++peer->connections;
+	++rhizome_http_live_requests;
+	++rhizome_http_stats.accepted;
 	request->data_file_name[0]=0;
 	/* We are now trying to read the HTTP request */
 	request->request_type=RHIZOME_HTTP_REQUEST_RECEIVING;
@@ -288,8 +473,8 @@ void rhizome_server_poll(struct sched_ent *alarm)
 	request->alarm.stats=&connection_stats;
 	request->alarm.poll.fd=sock;
 	request->alarm.poll.events=POLLIN;
-	request->alarm.alarm = gettime_ms()+RHIZOME_IDLE_TIMEOUT;
-	request->alarm.deadline = request->alarm.alarm+RHIZOME_IDLE_TIMEOUT;
+	request->alarm.alarm = gettime_ms()+rhizome_http_idle_timeout;
+	request->alarm.deadline = request->alarm.alarm+rhizome_http_idle_timeout;
 	// watch for the incoming http request
 	watch(&request->alarm);
 	// set an inactivity timeout to close the connection
@@ -306,6 +491,10 @@ void rhizome_server_poll(struct sched_ent *alarm)
 
 int rhizome_server_free_http_request(rhizome_http_request *r)
 {
+  if (r->requestor.sin_family == AF_INET)
+    rhizome_http_peer_release(r->requestor.sin_addr);
+  --rhizome_http_live_requests;
+  rhizome_direct_free_request_state(r);
   unwatch(&r->alarm);
   unschedule(&r->alarm);
   close(r->alarm.poll.fd);
@@ -322,8 +511,12 @@ int rhizome_server_sql_query_http_response(rhizome_http_request *r,
 					   int bytes_per_row,int dehexP)
 {
   /* Run the provided SQL query progressively and return the values of the first
-     column it returns.  As the result list may be very long, we will add the
-     LIMIT <skip>,<count> clause to do it piece by piece.
+     column it returns.  As the result list may be very long, we fetch it piece by
+     piece, each time the buffer drains.  Rather than skip over the rows already sent
+     with LIMIT <skip>,<count>, which costs O(n^2) row visits for the whole list, each
+     piece re-seeks past the rowid of the last row sent, so the whole list is streamed
+     in linear time without holding a statement (and its read lock) open between pieces.
+     The query body must therefore not contain WHERE, ORDER BY or LIMIT clauses.
 
      Otherwise, the response is prefixed by a 256 byte header, including the public
      key of the sending node, and allowing space for information about encryption of
@@ -378,23 +571,27 @@ int rhizome_server_sql_query_http_response(rhizome_http_request *r,
   if (strbuf_overrun(b))
     WHYF("SQL query overrun: %s", strbuf_str(b));
   r->source_index=0;
+  r->source_last_rowid=-1;
+  r->source_table=table;
+  r->source_column=column;
   r->source_flags=dehexP;
 
   DEBUGF("buffer_length=%d",r->buffer_length);
 
-  /* Populate spare space in buffer with rows of data */
+  /* Populate spare space in buffer with rows of data, and fetch more each time it drains */
+  if (r->source_count > 0)
+    r->request_type |= RHIZOME_HTTP_REQUEST_SQL_ROWS;
   return rhizome_server_sql_query_fill_buffer(r, table, column);
 }
 
 int rhizome_server_sql_query_fill_buffer(rhizome_http_request *r, char *table, char *column)
 {
-  unsigned char blob_value[r->source_record_size*2+1];
-
   if (debug & DEBUG_RHIZOME_TX)
     DEBUGF("populating with sql rows at offset %d",r->buffer_length);
   if (r->source_index>=r->source_count)
     {
       /* All done */
+      r->request_type &= ~RHIZOME_HTTP_REQUEST_SQL_ROWS;
       return 0;
     }
 
@@ -405,56 +602,43 @@ int rhizome_server_sql_query_fill_buffer(rhizome_http_request *r, char *table, c
 	   r->buffer_size, r->buffer_length, r->source_record_size);
     return WHY("Not enough space to fit any records");
   }
+  if (record_count > r->source_count - r->source_index)
+    record_count = r->source_count - r->source_index;
 
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  sqlite3_stmt *statement = sqlite_prepare(&retry, "%s LIMIT %lld,%d", r->source, r->source_index, record_count);
+  sqlite3_stmt *statement = sqlite_prepare(&retry, "%s WHERE rowid > ? ORDER BY rowid LIMIT %d", r->source, record_count);
   if (!statement)
     return -1;
+  sqlite3_bind_int64(statement, 1, r->source_last_rowid);
   if (debug & DEBUG_RHIZOME_TX)
     DEBUG(sqlite3_sql(statement));
-  while(  r->buffer_length + r->source_record_size < r->buffer_size
+  int rows = 0;
+  while(  r->buffer_length + r->source_record_size <= r->buffer_size
       &&  sqlite_step_retry(&retry, statement) == SQLITE_ROW
   ) {
-    r->source_index++;
+    ++rows;
+    r->source_last_rowid = sqlite3_column_int64(statement, 1);
     if (sqlite3_column_count(statement)!=2) {
       sqlite3_finalize(statement);
       return WHY("sqlite3 returned multiple columns for a single column query");
     }
-    sqlite3_blob *blob;
     const unsigned char *value;
+    int value_bytes = sqlite3_column_bytes(statement, 0);
     int column_type=sqlite3_column_type(statement, 0);
     switch(column_type) {
     case SQLITE_TEXT:	value=sqlite3_column_text(statement, 0); break;
-    case SQLITE_BLOB:
-      if (debug & DEBUG_RHIZOME_TX)
-	DEBUGF("table='%s',col='%s',rowid=%lld", table, column, sqlite3_column_int64(statement,1));
-
-      int ret;
-      int64_t rowid = sqlite3_column_int64(statement, 1);
-      do ret = sqlite3_blob_open(rhizome_db, "main", table, column, rowid, 0 /* read only */, &blob);
-	while (sqlite_code_busy(ret) && sqlite_retry(&retry, "sqlite3_blob_open"));
-      if (!sqlite_code_ok(ret)) {
-	WHYF("sqlite3_blob_open() failed, %s", sqlite3_errmsg(rhizome_db));
-	continue;
-      }
-      sqlite_retry_done(&retry, "sqlite3_blob_open");
-      if (sqlite3_blob_read(blob,&blob_value[0],
-			/* copy number of bytes based on whether we need to
-			    de-hex the string or not */
-			    r->source_record_size*(1+(r->source_flags&1)),0)
-	  !=SQLITE_OK) {
-	WHYF("sqlite3_blob_read() failed, %s", sqlite3_errmsg(rhizome_db));
-	sqlite3_blob_close(blob);
-	continue;
-      }
-      value = blob_value;
-      sqlite3_blob_close(blob);
-      break;
+    case SQLITE_BLOB:	value=sqlite3_column_blob(statement, 0); break;
     default:
       /* improper column type, so don't include in report */
       WHYF("Bad column type %d", column_type);
       continue;
     }
+    /* copy number of bytes based on whether we need to de-hex the string or not */
+    if (value_bytes < r->source_record_size*(1+(r->source_flags&1))) {
+      WHYF("%s.%s at rowid=%lld is too short (%d bytes)", table, column, r->source_last_rowid, value_bytes);
+      continue;
+    }
+    r->source_index++;
     if (r->source_flags&1) {
       /* hex string to be converted */
       int i;
@@ -469,6 +653,11 @@ int rhizome_server_sql_query_fill_buffer(rhizome_http_request *r, char *table, c
     
   }
   sqlite3_finalize(statement);
+  if (r->buffer_length > r->buffer_offset)
+    r->request_type |= RHIZOME_HTTP_REQUEST_FROMBUFFER;
+  /* Rows deleted since the response header was sent leave us short; stop rather than spin. */
+  if (rows == 0 || r->source_index >= r->source_count)
+    r->request_type &= ~RHIZOME_HTTP_REQUEST_SQL_ROWS;
   return 0;
 }
 
@@ -525,11 +714,11 @@ int rhizome_server_parse_http_request(rhizome_http_request *r)
       r->request_type = RHIZOME_HTTP_REQUEST_FAVICON;
       rhizome_server_http_response_header(r, 200, "image/vnd.microsoft.icon", favicon_len);
     } else if (strcmp(path, "/rhizome/groups") == 0) {
-      /* Return the list of known groups */
-      rhizome_server_sql_query_http_response(r, "id", "groups", "from groups", 32, 1);
+      /* Return the list of known groups, ids in hex as the keys are stored as BLOBs */
+      rhizome_server_sql_query_http_response(r, "hex(id)", "groups", "from groups", 32, 0);
     } else if (strcmp(path, "/rhizome/files") == 0) {
-      /* Return the list of known files */
-      rhizome_server_sql_query_http_response(r, "id", "files", "from files", 32, 1);
+      /* Return the list of known files, ids in hex as the keys are stored as BLOBs */
+      rhizome_server_sql_query_http_response(r, "hex(id)", "files", "from files", 32, 0);
     } else if (strcmp(path, "/rhizome/bars") == 0) {
       /* Return the list of known BARs */
       rhizome_server_sql_query_http_response(r, "bar", "manifests", "from manifests", 32, 0);
@@ -539,9 +728,8 @@ int rhizome_server_parse_http_request(rhizome_http_request *r)
 	rhizome_server_simple_http_response(r, 400, "<html><h1>Invalid payload ID</h1></html>\r\n");
       } else {
 	// TODO: Check for Range: header and return 206 if returning partial content
-	str_toupper_inplace(id);
 	long long rowid = -1;
-	sqlite_exec_int64(&rowid, "select rowid from files where id='%s';", id);
+	sqlite_exec_int64_key(&rowid, id, "select rowid from files where id=?;");
 	if (rowid >= 0 && sqlite3_blob_open(rhizome_db, "main", "files", "data", rowid, 0, &r->blob) != SQLITE_OK)
 	  rowid = -1;
 	if (rowid == -1) {
@@ -576,7 +764,15 @@ int rhizome_server_parse_http_request(rhizome_http_request *r)
 	     bid_low,bid_high);
 
       long long rowid = -1;
-      sqlite_exec_int64(&rowid, "select rowid from manifests where id between '%s' and '%s';", bid_low,bid_high);
+      sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+      sqlite3_stmt *statement = sqlite_prepare(&retry, "select rowid from manifests where id between ? and ?;");
+      if (statement
+	  && rhizome_bind_key(statement, 1, bid_low) != -1
+	  && rhizome_bind_key(statement, 2, bid_high) != -1
+	  && sqlite_step_retry(&retry, statement) == SQLITE_ROW)
+	rowid = sqlite3_column_int64(statement, 0);
+      if (statement)
+	sqlite3_finalize(statement);
       if (rowid >= 0 && sqlite3_blob_open(rhizome_db, "main", "manifests", "manifest", rowid, 0, &r->blob) != SQLITE_OK)
 	rowid = -1;
       if (rowid == -1) {
@@ -686,6 +882,47 @@ int rhizome_server_http_response_header(rhizome_http_request *r, int result, con
   return rhizome_server_set_response(r, &hr);
 }
 
+/* Top up the connection's buffer from the payload blob.  The buffer is allocated once per
+   connection and reused for the whole transfer.  Unsent bytes (including any response headers) are
+   shuffled to the front and the remainder is filled from the blob, so every write() hands the
+   kernel as much as the buffer holds, and the headers share a segment with the first payload bytes.
+   To keep blob reads large, nothing is read until at least half the buffer has drained.
+ */
+static int rhizome_server_http_fill_from_blob(rhizome_http_request *r)
+{
+  if (r->buffer_size < RHIZOME_BLOB_BUFFER_SIZE) {
+    unsigned char *buffer = realloc(r->buffer, RHIZOME_BLOB_BUFFER_SIZE);
+    if (buffer == NULL)
+      return WHYF_perror("realloc(%d)", RHIZOME_BLOB_BUFFER_SIZE);
+    r->buffer = buffer;
+    r->buffer_size = RHIZOME_BLOB_BUFFER_SIZE;
+  }
+  int unsent = r->buffer_length - r->buffer_offset;
+  if (unsent > r->buffer_size / 2)
+    return 0;
+  if (r->buffer_offset) {
+    memmove(r->buffer, &r->buffer[r->buffer_offset], unsent);
+    r->buffer_offset = 0;
+    r->buffer_length = unsent;
+  }
+  int read_size = r->buffer_size - r->buffer_length;
+  if (r->blob_end - r->source_index < read_size)
+    read_size = r->blob_end - r->source_index;
+  if (read_size > 0) {
+    if (sqlite3_blob_read(r->blob, &r->buffer[r->buffer_length], read_size, r->source_index) != SQLITE_OK)
+      return WHYF("sqlite3_blob_read() failed, %s", sqlite3_errmsg(rhizome_db));
+    r->buffer_length += read_size;
+    r->source_index += read_size;
+    r->request_type |= RHIZOME_HTTP_REQUEST_FROMBUFFER;
+  }
+  if (r->source_index >= r->blob_end) {
+    sqlite3_blob_close(r->blob);
+    r->blob = NULL;
+    r->request_type &= ~RHIZOME_HTTP_REQUEST_BLOB;
+  }
+  return 0;
+}
+
 /*
   return codes:
   1: connection still open.
@@ -697,25 +934,45 @@ int rhizome_server_http_send_bytes(rhizome_http_request *r)
   // keep writing until the write would block or we run out of data
   while(r->request_type){
     
+    if (r->request_type&RHIZOME_HTTP_REQUEST_BLOB) {
+      if (rhizome_server_http_fill_from_blob(r) == -1) {
+	r->request_type=0;
+	break;
+      }
+    }
+
     /* Flush anything out of the buffer if present, before doing any further
        processing */
     if (r->request_type&RHIZOME_HTTP_REQUEST_FROMBUFFER)
       {
 	int bytes=r->buffer_length-r->buffer_offset;
+	time_ms_t now = gettime_ms();
+	long long allowance = rhizome_http_peer_allowance(r, now);
+	if (allowance == 0) {
+	  rhizome_http_throttle(r, now);
+	  return 1;
+	}
+	if (allowance > 0 && bytes > allowance)
+	  bytes = allowance;
 	bytes=write(r->alarm.poll.fd,&r->buffer[r->buffer_offset],bytes);
 	if (bytes<=0){
+	  if (bytes==-1 && errno!=EAGAIN && errno!=EWOULDBLOCK) {
+	    WHY_perror("write");
+	    r->request_type=0;
+	    break;
+	  }
 	  // stop writing when the tcp buffer is full
-	  // TODO errors?
 	  return 1;
 	}
 	
 	if (0)
 	  dump("bytes written",&r->buffer[r->buffer_offset],bytes);
 	r->buffer_offset+=bytes;
+	rhizome_http_peer_charge(r, bytes);
 	  
 	// reset inactivity timer
-	r->alarm.alarm = gettime_ms()+RHIZOME_IDLE_TIMEOUT;
-	r->alarm.deadline = r->alarm.alarm+RHIZOME_IDLE_TIMEOUT;
+	r->alarm.alarm = now+rhizome_http_idle_timeout;
+	r->alarm.deadline = r->alarm.alarm+rhizome_http_idle_timeout;
 	unschedule(&r->alarm);
 	schedule(&r->alarm);
 	
@@ -750,44 +1007,12 @@ int rhizome_server_http_send_bytes(rhizome_http_request *r)
 	    r->request_type=RHIZOME_HTTP_REQUEST_FROMBUFFER;
 	}
 	break;
-      case RHIZOME_HTTP_REQUEST_BLOB:
-	{
-	  /* Get more data from the file and put it in the buffer */
-	  int read_size = 65536;
-	  if (r->blob_end-r->source_index < read_size)
-	    read_size = r->blob_end-r->source_index;
-	    
+      case RHIZOME_HTTP_REQUEST_SQL_ROWS:
+	/* Buffer has drained, so fetch the next piece of the list */
+	r->buffer_offset=0; r->buffer_length=0;
+	if (rhizome_server_sql_query_fill_buffer(r, r->source_table, r->source_column) == -1)
 	  r->request_type=0;
-	  if (read_size>0){
-	    
-	    if (r->buffer_size < read_size) {
-	      if (r->buffer)
-		free(r->buffer);
-	      r->buffer=malloc(read_size);
-	      if (!r->buffer) {
-		WHY_perror("malloc");
-		r->request_type=0; break;
-	      }
-	      r->buffer_size=read_size;
-	    }
-	      
-	    if(sqlite3_blob_read(r->blob,&r->buffer[0],read_size,r->source_index)
-	       ==SQLITE_OK)
-	      {
-		r->buffer_length = read_size;
-		r->source_index+=read_size;
-		r->request_type|=RHIZOME_HTTP_REQUEST_FROMBUFFER;
-	      }
-	  }
-	    
-	  if (r->source_index >= r->blob_end){
-	    sqlite3_blob_close(r->blob);
-	    r->blob=0;
-	  }else
-	    r->request_type|=RHIZOME_HTTP_REQUEST_BLOB;
-	}
 	break;
-	  
       default:
 	WHY("sending data from this type of HTTP request not implemented");
 	r->request_type=0;
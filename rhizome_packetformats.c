@@ -24,6 +24,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "overlay_address.h"
 #include "overlay_packet.h"
 #include <stdlib.h>
+#include <math.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -100,10 +101,10 @@ int rhizome_manifest_to_bar(rhizome_manifest *m,unsigned char *bar)
   if (maxLong<-180) maxLong=-180; if (maxLong>180) maxLong=180;  
   unsigned short v;
   int o=RHIZOME_BAR_GEOBOX_OFFSET;
-  v=(minLat+90)*(65535/180); bar[o++]=(v>>8)&0xff; bar[o++]=(v>>0)&0xff;
-  v=(minLong+180)*(65535/360); bar[o++]=(v>>8)&0xff; bar[o++]=(v>>0)&0xff;
-  v=(maxLat+90)*(65535/180); bar[o++]=(v>>8)&0xff; bar[o++]=(v>>0)&0xff;
-  v=(maxLong+180)*(65535/360); bar[o++]=(v>>8)&0xff; bar[o++]=(v>>0)&0xff;
+  v=(minLat+90)*RHIZOME_GEO_LAT_UNITS; bar[o++]=(v>>8)&0xff; bar[o++]=(v>>0)&0xff;
+  v=(minLong+180)*RHIZOME_GEO_LONG_UNITS; bar[o++]=(v>>8)&0xff; bar[o++]=(v>>0)&0xff;
+  v=(maxLat+90)*RHIZOME_GEO_LAT_UNITS; bar[o++]=(v>>8)&0xff; bar[o++]=(v>>0)&0xff;
+  v=(maxLong+180)*RHIZOME_GEO_LONG_UNITS; bar[o++]=(v>>8)&0xff; bar[o++]=(v>>0)&0xff;
 
   /* TTL */
   if (m->ttl>0) bar[RHIZOME_BAR_TTL_OFFSET]=m->ttl-1; 
@@ -132,6 +133,110 @@ unsigned long long rhizome_bar_bidprefix_ll(unsigned char *bar)
   return bidprefix;
 }
 
+/* Unpack the quantised geobox of a BAR: min latitude, min longitude, max latitude, max longitude.
+ */
+void rhizome_bar_geobox(const unsigned char *bar, unsigned short box[4])
+{
+  int i;
+  for(i=0;i<4;i++)
+    box[i]=(bar[RHIZOME_BAR_GEOBOX_OFFSET+i*2]<<8)|bar[RHIZOME_BAR_GEOBOX_OFFSET+i*2+1];
+}
+
+static int geo_units(double degrees, double limit, int units)
+{
+  if (degrees<-limit) degrees=-limit;
+  if (degrees>limit) degrees=limit;
+  return (degrees+limit)*units;
+}
+
+/* Rank a bundle by how far its geobox is from this node: roughly log2 of the distance in km to
+   the nearest edge of the box, plus a quarter of the size of the box itself, so that a bundle
+   about the next street ranks ahead of one about the whole region.  Bundles with no geobox cover
+   the world, and so rank last.  Lower is nearer; everything ranks 0 if this node has no position.
+ */
+int rhizome_bar_geo_rank(const unsigned char *bar)
+{
+  double lat, lon;
+  if (!rhizome_geo_position(&lat, &lon, NULL))
+    return 0;
+  unsigned short box[4];
+  rhizome_bar_geobox(bar, box);
+  double minLat=box[0]/(double)RHIZOME_GEO_LAT_UNITS-90;
+  double minLong=box[1]/(double)RHIZOME_GEO_LONG_UNITS-180;
+  double maxLat=box[2]/(double)RHIZOME_GEO_LAT_UNITS-90;
+  double maxLong=box[3]/(double)RHIZOME_GEO_LONG_UNITS-180;
+  double coslat=cos(lat*M_PI/180);
+  double dlat=lat<minLat?minLat-lat:lat>maxLat?lat-maxLat:0;
+  double dlong=(lon<minLong?minLong-lon:lon>maxLong?lon-maxLong:0)*coslat;
+  double wlat=maxLat-minLat;
+  double wlong=(maxLong-minLong)*coslat;
+  double km=111.2*(sqrt(dlat*dlat+dlong*dlong)+sqrt(wlat*wlat+wlong*wlong)/4);
+  int rank=0;
+  while(km>=1&&rank<RHIZOME_GEO_RANK_MAX) {
+    km/=2;
+    rank++;
+  }
+  return rank;
+}
+
+int rhizome_manifest_geo_rank(rhizome_manifest *m)
+{
+  unsigned char bar[RHIZOME_BAR_BYTES];
+  if (rhizome_manifest_to_bar(m,bar))
+    return RHIZOME_GEO_RANK_MAX;
+  return rhizome_bar_geo_rank(bar);
+}
+
+/* Append the BARs of bundles about places near this node, taken a few at a time from the
+   spatial index in rotation, so that they reach our neighbours well before the round robin through
+   the whole store would get to them.  Returns the number of BARs appended.
+ */
+static int nearby_offset=0;
+static int rhizome_append_nearby_bars(sqlite_retry_state *retry, struct overlay_buffer *e)
+{
+  double lat, lon;
+  int radius_km;
+  if (!rhizome_geo_position(&lat, &lon, &radius_km))
+    return 0;
+  double dlat=radius_km/111.2;
+  double coslat=cos(lat*M_PI/180);
+  double dlong=dlat/(coslat<0.01?0.01:coslat);
+  int minLat=geo_units(lat-dlat,90,RHIZOME_GEO_LAT_UNITS);
+  int maxLat=geo_units(lat+dlat,90,RHIZOME_GEO_LAT_UNITS);
+  int minLong=geo_units(lon-dlong,180,RHIZOME_GEO_LONG_UNITS);
+  int maxLong=geo_units(lon+dlong,180,RHIZOME_GEO_LONG_UNITS);
+  /* Every indexed box starts at most RHIZOME_GEO_INDEX_SPAN_DEGREES before it ends, so only that
+     slice of the minlat index needs to be scanned */
+  sqlite3_stmt *statement = sqlite_prepare(retry,
+      "SELECT MANIFESTS.BAR FROM GEOBOXES, MANIFESTS"
+      " WHERE GEOBOXES.minlat BETWEEN %d AND %d AND GEOBOXES.maxlat >= %d"
+      " AND GEOBOXES.minlong <= %d AND GEOBOXES.maxlong >= %d"
+      " AND MANIFESTS.id = GEOBOXES.id LIMIT %d,%d",
+      minLat-RHIZOME_GEO_INDEX_SPAN_DEGREES*RHIZOME_GEO_LAT_UNITS, maxLat, minLat,
+      maxLong, minLong, nearby_offset, RHIZOME_GEO_ADVERT_BARS);
+  if (!statement)
+    return 0;
+  int rows=0, appended=0;
+  while (sqlite_step_retry(retry, statement) == SQLITE_ROW) {
+    rows++;
+    if (sqlite3_column_bytes(statement, 0) != RHIZOME_BAR_BYTES)
+      continue;
+    if (ob_makespace(e, RHIZOME_BAR_BYTES+2))
+      break;
+    ob_append_bytes(e, (unsigned char *)sqlite3_column_blob(statement, 0), RHIZOME_BAR_BYTES);
+    ob_checkpoint(e);
+    appended++;
+  }
+  sqlite3_finalize(statement);
+  if (rows<RHIZOME_GEO_ADVERT_BARS)
+    nearby_offset=0;
+  else
+    nearby_offset+=rows;
+  if (appended && (debug & DEBUG_RHIZOME_TX))
+    DEBUGF("Advertising %d nearby BARs", appended);
+  return appended;
+}
+
 int bundles_available=-1;
 int bundle_offset[2]={0,0};
 int overlay_rhizome_add_advertisements(int interface_number, struct overlay_buffer *e)
@@ -228,6 +333,8 @@ int overlay_rhizome_add_advertisements(int interface_number, struct overlay_buff
 
   for(pass=skipmanifests;pass<2;pass++) {
     ob_checkpoint(e);
+    if (pass==1)
+      bundles_advertised+=rhizome_append_nearby_bars(&retry, e);
     switch(pass) {
     case 0: /* Full manifests */
       statement = sqlite_prepare(&retry, "SELECT MANIFEST,ROWID FROM MANIFESTS LIMIT %d,%d", bundle_offset[pass], slots);
@@ -394,7 +501,7 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
 	/* trim manifest ID to a prefix for ease of debugging 
 	   (that is the only use of this */
 	manifest_id_prefix[8]=0; 
-	long long version = rhizome_manifest_get_ll(m, "version");
+	long long version = rhizome_manifest_get_field_ll(m, RHIZOME_FIELD_VERSION);
 	if (debug & DEBUG_RHIZOME_RX) DEBUGF("manifest id=%s* version=%lld", manifest_id_prefix, version);
 
 	/* Crude signature presence test */
@@ -413,8 +520,9 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
 	
 	if (rhizome_ignore_manifest_check(m, &httpaddr))
 	  {
-	    /* Ignoring manifest that has caused us problems recently */
-	    if (1) WARNF("Ignoring manifest with errors: %s*", manifest_id_prefix);
+	    /* Ignoring manifest that has caused us problems recently, or that we are not
+	       subscribed to */
+	    if (debug & DEBUG_RHIZOME_RX) DEBUGF("Ignoring manifest for now: %s*", manifest_id_prefix);
 	  }
 	else if (m->errors == 0)
 	  {
@@ -0,0 +1,397 @@
+/*
+Serval Distributed Numbering Architecture (DNA)
+Copyright (C) 2012 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Rhizome worker process.
+
+  If the "rhizome.worker" config option is set, the server forks a companion process before it
+  opens any sockets.  The worker runs the Rhizome HTTP server (and so Rhizome Direct), the fetch
+  queue, and all the database writes, hashing and signature checks that go with them, so that a big
+  import cannot hold up routing, MDP or VoMP in the overlay process.  The overlay process still
+  builds Rhizome advertisements itself, which only reads the database.
+
+  The two processes talk over a local datagram socket pair.  Each message starts with a type byte:
+
+    overlay -> worker   ADVERT   interface number, sender address, and the rest of a received
+			         Rhizome advertisement frame
+    worker -> overlay   PORT     port number that the worker's HTTP server is listening on
+    worker -> overlay   BUNDLE   manifest of a newly stored bundle, to pass on to monitor clients
+
+  The overlay process never blocks on the worker.  If the worker is too busy to drain its socket,
+  adverts are dropped, which costs nothing because every peer repeats them.  If the worker dies,
+  the overlay process takes Rhizome back and carries on as if the worker had never been started.
+ */
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include "serval.h"
+#include "rhizome.h"
+#include "strbuf.h"
+#include "strbuf_helpers.h"
+#include "overlay_buffer.h"
+#include "overlay_packet.h"
+
+#define RHIZOME_WORKER_ADVERT 1
+#define RHIZOME_WORKER_PORT 2
+#define RHIZOME_WORKER_BUNDLE 3
+
+/* Large enough for a whole manifest plus the type byte */
+#define RHIZOME_WORKER_MESSAGE_MAX (MAX_MANIFEST_BYTES + 64)
+
+int rhizome_worker_process = 0;
+
+static pid_t rhizome_worker_pid = -1;
+static pid_t rhizome_worker_parent = -1;
+static int rhizome_worker_sock = -1;
+static int rhizome_worker_http_port = 0;
+static long long rhizome_worker_adverts_dropped = 0;
+
+static struct sched_ent sched_messages = STRUCT_SCHED_ENT_UNUSED;
+static struct sched_ent sched_harvester = STRUCT_SCHED_ENT_UNUSED;
+static struct sched_ent sched_parent = STRUCT_SCHED_ENT_UNUSED;
+static struct sched_ent sched_suggestions = STRUCT_SCHED_ENT_UNUSED;
+static struct sched_ent sched_vacuum = STRUCT_SCHED_ENT_UNUSED;
+static struct profile_total messages_stats;
+static struct profile_total harvester_stats;
+static struct profile_total parent_stats;
+static struct profile_total suggestions_stats;
+static struct profile_total vacuum_stats;
+
+static void overlay_worker_messages(struct sched_ent *alarm);
+static void worker_overlay_messages(struct sched_ent *alarm);
+static void harvester(struct sched_ent *alarm);
+static void parent_check(struct sched_ent *alarm);
+static void rhizome_worker_main();
+
+/* Return true if Rhizome is being run by a worker process, as seen from the overlay process.
+ */
+int rhizome_worker_running()
+{
+  return rhizome_worker_pid > 0;
+}
+
+/* Return true if the worker has told us where its HTTP server is listening.
+ */
+int rhizome_worker_serving()
+{
+  return rhizome_worker_pid > 0 && rhizome_worker_http_port != 0;
+}
+
+int rhizome_worker_start()
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == -1)
+    return WHY_perror("socketpair");
+  switch (rhizome_worker_pid = fork()) {
+  case 0:
+    close(fds[0]);
+    rhizome_worker_sock = fds[1];
+    rhizome_worker_main();
+    exit(0);
+  case -1:
+    WHY_perror("fork");
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  default:
+    close(fds[1]);
+    rhizome_worker_sock = fds[0];
+    set_nonblock(rhizome_worker_sock);
+    INFOF("STARTED RHIZOME WORKER pid=%u", rhizome_worker_pid);
+    sched_messages.function = overlay_worker_messages;
+    messages_stats.name = "overlay_worker_messages";
+    sched_messages.stats = &messages_stats;
+    sched_messages.poll.fd = rhizome_worker_sock;
+    sched_messages.poll.events = POLLIN;
+    watch(&sched_messages);
+    sched_harvester.function = harvester;
+    harvester_stats.name = "rhizome_worker_harvester";
+    sched_harvester.stats = &harvester_stats;
+    sched_harvester.alarm = gettime_ms() + 1000;
+    sched_harvester.deadline = sched_harvester.alarm + 1000;
+    schedule(&sched_harvester);
+    return 0;
+  }
+}
+
+/* Hand a received Rhizome advertisement frame to the worker.  Returns 1 if the worker has taken
+   (or dropped) it, or 0 if there is no worker and the caller must process the frame itself.
+ */
+int rhizome_worker_forward_advert(int interface, struct overlay_frame *f)
+{
+  if (rhizome_worker_pid <= 0)
+    return 0;
+  unsigned char msg[RHIZOME_WORKER_MESSAGE_MAX];
+  int len = f->payload->sizeLimit - f->payload->position;
+  int header = 1 + sizeof interface + sizeof(struct sockaddr_in);
+  if (len < 0 || header + len > sizeof msg) {
+    WARNF("Rhizome advertisement of %d bytes is too big for the worker", len);
+    return 1;
+  }
+  msg[0] = RHIZOME_WORKER_ADVERT;
+  bcopy(&interface, &msg[1], sizeof interface);
+  if (f->recvaddr)
+    bcopy(f->recvaddr, &msg[1 + sizeof interface], sizeof(struct sockaddr_in));
+  else
+    bzero(&msg[1 + sizeof interface], sizeof(struct sockaddr_in));
+  bcopy(&f->payload->bytes[f->payload->position], &msg[header], len);
+  if (send(rhizome_worker_sock, msg, header + len, MSG_DONTWAIT) == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+      WHY_perror("send");
+    else if (debug & DEBUG_RHIZOME_RX)
+      DEBUGF("Rhizome worker busy, dropped advertisement (%lld so far)", rhizome_worker_adverts_dropped + 1);
+    ++rhizome_worker_adverts_dropped;
+  }
+  return 1;
+}
+
+/* Called in the worker when a bundle has been stored.  Monitor clients are connected to the
+   overlay process, so send the manifest there for it to announce.
+ */
+int rhizome_worker_announce_bundle(rhizome_manifest *m)
+{
+  unsigned char msg[1 + MAX_MANIFEST_BYTES];
+  msg[0] = RHIZOME_WORKER_BUNDLE;
+  bcopy(m->manifestdata, &msg[1], m->manifest_all_bytes);
+  if (send(rhizome_worker_sock, msg, 1 + m->manifest_all_bytes, 0) == -1)
+    return WHY_perror("send");
+  return 0;
+}
+
+static void rhizome_worker_close()
+{
+  if (sched_messages.poll.fd != -1) {
+    unwatch(&sched_messages);
+    sched_messages.poll.fd = -1;
+  }
+  if (rhizome_worker_sock != -1) {
+    close(rhizome_worker_sock);
+    rhizome_worker_sock = -1;
+  }
+}
+
+/* The worker has gone, so run Rhizome in this process from now on.
+ */
+static void rhizome_worker_takeover()
+{
+  rhizome_worker_close();
+  unschedule(&sched_harvester);
+  rhizome_worker_pid = -1;
+  rhizome_worker_http_port = 0;
+  rhizome_http_server_port = 0;
+  INFO("Rhizome worker gone, running Rhizome in the overlay process");
+  rhizome_http_server_start(rhizome_server_parse_http_request,
+			    "rhizome_server_parse_http_request",
+			    RHIZOME_HTTP_PORT,RHIZOME_HTTP_PORT_MAX);
+  sched_vacuum.function = rhizome_vacuum;
+  vacuum_stats.name = "rhizome_vacuum";
+  sched_vacuum.stats = &vacuum_stats;
+  sched_vacuum.alarm = gettime_ms() + RHIZOME_VACUUM_INTERVAL_MS;
+  sched_vacuum.deadline = sched_vacuum.alarm + RHIZOME_VACUUM_INTERVAL_MS;
+  schedule(&sched_vacuum);
+}
+
+static int rhizome_worker_harvest(int blocking)
+{
+  if (rhizome_worker_pid <= 0)
+    return 0;
+  int status;
+  pid_t pid = waitpid(rhizome_worker_pid, &status, blocking ? 0 : WNOHANG);
+  if (pid == rhizome_worker_pid) {
+    strbuf b = strbuf_alloca(80);
+    INFOF("RHIZOME WORKER process pid=%u %s", pid, strbuf_str(strbuf_append_exit_status(b, status)));
+    return 1;
+  } else if (pid == -1)
+    return WHYF_perror("waitpid(%d, %s)", rhizome_worker_pid, blocking ? "0" : "WNOHANG");
+  return 0;
+}
+
+int rhizome_worker_shutdown()
+{
+  if (rhizome_worker_pid <= 0)
+    return 0;
+  if (debug & DEBUG_RHIZOME)
+    DEBUGF("Sending SIGTERM to Rhizome worker pid=%d", rhizome_worker_pid);
+  rhizome_worker_close();
+  if (kill(rhizome_worker_pid, SIGTERM) == -1)
+    WHYF_perror("kill(%d, SIGTERM)", rhizome_worker_pid);
+  int ret = rhizome_worker_harvest(1);
+  rhizome_worker_pid = -1;
+  return ret;
+}
+
+static void harvester(struct sched_ent *alarm)
+{
+  if (rhizome_worker_harvest(0) == 1) {
+    rhizome_worker_takeover();
+    return;
+  }
+  alarm->alarm = gettime_ms() + 1000;
+  alarm->deadline = alarm->alarm + 1000;
+  schedule(alarm);
+}
+
+/* Overlay process: read messages from the worker.
+ */
+static void overlay_worker_messages(struct sched_ent *alarm)
+{
+  unsigned char msg[RHIZOME_WORKER_MESSAGE_MAX];
+  ssize_t len;
+  while ((len = recv(alarm->poll.fd, msg, sizeof msg, 0)) > 0) {
+    switch (msg[0]) {
+    case RHIZOME_WORKER_PORT:
+      if (len == 1 + sizeof rhizome_http_server_port) {
+	bcopy(&msg[1], &rhizome_http_server_port, sizeof rhizome_http_server_port);
+	rhizome_worker_http_port = rhizome_http_server_port;
+	INFOF("Rhizome worker HTTP server listening on port %d", rhizome_worker_http_port);
+      }
+      break;
+    case RHIZOME_WORKER_BUNDLE: {
+	rhizome_manifest *m = rhizome_new_manifest();
+	if (!m)
+	  break;
+	if (rhizome_read_manifest_file(m, (const char *) &msg[1], len - 1) != -1)
+	  monitor_announce_bundle(m);
+	rhizome_manifest_free(m);
+      }
+      break;
+    default:
+      WARNF("Unknown message type %d from Rhizome worker", msg[0]);
+      break;
+    }
+  }
+  if (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+    WHY_perror("recv");
+}
+
+/* Worker process: read advertisements forwarded by the overlay process.
+ */
+static void worker_overlay_messages(struct sched_ent *alarm)
+{
+  unsigned char msg[RHIZOME_WORKER_MESSAGE_MAX];
+  ssize_t len;
+  int header = 1 + sizeof(int) + sizeof(struct sockaddr_in);
+  while ((len = recv(alarm->poll.fd, msg, sizeof msg, MSG_DONTWAIT)) > 0) {
+    if (msg[0] != RHIZOME_WORKER_ADVERT || len < header) {
+      WARNF("Unexpected message type %d (%d bytes) from overlay", msg[0], (int) len);
+      continue;
+    }
+    int interface;
+    struct sockaddr_in recvaddr;
+    bcopy(&msg[1], &interface, sizeof interface);
+    bcopy(&msg[1 + sizeof interface], &recvaddr, sizeof recvaddr);
+    struct overlay_frame f;
+    bzero(&f, sizeof f);
+    f.type = OF_TYPE_RHIZOME_ADVERT;
+    f.recvaddr = (struct sockaddr *) &recvaddr;
+    if ((f.payload = ob_static(&msg[header], len - header)) == NULL)
+      continue;
+    ob_limitsize(f.payload, len - header);
+    overlay_rhizome_saw_advertisements(interface, &f, gettime_ms());
+    ob_free(f.payload);
+  }
+  if (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+    WHY_perror("recv");
+}
+
+/* Worker process: the overlay process has gone away without stopping us, so stop.
+ */
+static void parent_check(struct sched_ent *alarm)
+{
+  if (getppid() != rhizome_worker_parent) {
+    INFO("Overlay process has gone, Rhizome worker exiting");
+    exit(0);
+  }
+  alarm->alarm = gettime_ms() + 1000;
+  alarm->deadline = alarm->alarm + 1000;
+  schedule(alarm);
+}
+
+static void rhizome_worker_main()
+{
+  rhizome_worker_process = 1;
+  rhizome_worker_pid = -1;
+  rhizome_worker_parent = getppid();
+  /* Shutting down the server is the overlay process's job, and respawning it on a crash would
+     start a second server */
+  signal(SIGHUP, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGQUIT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  serverRespawnOnCrash = 0;
+  /* An SQLite connection must not be used on both sides of a fork(), so abandon the one inherited
+     from the overlay process without closing it, and open our own. */
+  rhizome_db = NULL;
+  if (rhizome_opendb() == -1)
+    exit(1);
+  INFOF("Rhizome worker running, pid=%u", getpid());
+
+  if (rhizome_http_server_start(rhizome_server_parse_http_request,
+				"rhizome_server_parse_http_request",
+				RHIZOME_HTTP_PORT,RHIZOME_HTTP_PORT_MAX) == 0) {
+    unsigned char msg[1 + sizeof rhizome_http_server_port];
+    msg[0] = RHIZOME_WORKER_PORT;
+    bcopy(&rhizome_http_server_port, &msg[1], sizeof rhizome_http_server_port);
+    if (send(rhizome_worker_sock, msg, sizeof msg, 0) == -1)
+      WHY_perror("send");
+  }
+
+  sched_messages.function = worker_overlay_messages;
+  messages_stats.name = "worker_overlay_messages";
+  sched_messages.stats = &messages_stats;
+  sched_messages.poll.fd = rhizome_worker_sock;
+  sched_messages.poll.events = POLLIN;
+  watch(&sched_messages);
+
+  sched_parent.function = parent_check;
+  parent_stats.name = "rhizome_worker_parent_check";
+  sched_parent.stats = &parent_stats;
+  sched_parent.alarm = gettime_ms() + 1000;
+  sched_parent.deadline = sched_parent.alarm + 1000;
+  schedule(&sched_parent);
+
+  sched_suggestions.function = rhizome_enqueue_suggestions;
+  suggestions_stats.name = "rhizome_enqueue_suggestions";
+  sched_suggestions.stats = &suggestions_stats;
+  sched_suggestions.alarm = gettime_ms() + rhizome_fetch_interval_ms;
+  sched_suggestions.deadline = sched_suggestions.alarm + rhizome_fetch_interval_ms * 3;
+  schedule(&sched_suggestions);
+
+  sched_vacuum.function = rhizome_vacuum;
+  vacuum_stats.name = "rhizome_vacuum";
+  sched_vacuum.stats = &vacuum_stats;
+  sched_vacuum.alarm = gettime_ms() + RHIZOME_VACUUM_INTERVAL_MS;
+  sched_vacuum.deadline = sched_vacuum.alarm + RHIZOME_VACUUM_INTERVAL_MS;
+  schedule(&sched_vacuum);
+
+  if (debug & DEBUG_TIMING) {
+    static struct sched_ent sched_stats = STRUCT_SCHED_ENT_UNUSED;
+    static struct profile_total stats_stats;
+    sched_stats.function = fd_periodicstats;
+    stats_stats.name = "fd_periodicstats";
+    sched_stats.stats = &stats_stats;
+    sched_stats.alarm = gettime_ms() + 3000;
+    sched_stats.deadline = sched_stats.alarm + 500;
+    schedule(&sched_stats);
+  }
+
+  while (1)
+    fd_poll();
+}
@@ -168,6 +168,7 @@ typedef long long time_ms_t;
 double simulatedBER;
 
 extern int serverMode;
+extern int serverRespawnOnCrash;
 extern int servalShutdown;
 
 extern char *gatewayspec;
@@ -385,6 +386,21 @@ typedef struct overlay_interface {
      But if it comes back up again, we should try to reuse this structure, even if the broadcast address has changed.
    */
   int state;  
+  
+  /* Token bucket that paces transmission to bits_per_second. tx_budget is the number of bits we
+     may send right now, multiplied by 1000 so slow links don't lose fractions of a bit each ms.
+     Sending a packet may take it below zero. */
+  long long tx_budget;
+  long long tx_budget_limit;
+  time_ms_t tx_budget_updated;
+  // are we holding traffic back? cleared by the next packet sent
+  int tx_holding;
+  
+  /* pacing statistics since they were last reported */
+  int tx_held;                  // times queued traffic was held back to stay under the rate
+  int tx_frames;                // frames sent from the queues
+  time_ms_t tx_queue_delay;     // total time those frames waited in the queues
+  time_ms_t tx_queue_delay_max;
 } overlay_interface;
 
 /* Maximum interface count is rather arbitrary.
@@ -419,10 +435,32 @@ typedef struct overlay_peer {
 extern overlay_peer overlay_peers[OVERLAY_MAX_PEERS];
 
 
+/* The frames in one queue that share a destination, so that a packet being assembled can take
+   or skip all of them after looking at the route once */
+struct overlay_tx_bucket {
+  struct overlay_tx_bucket *prev;
+  struct overlay_tx_bucket *next;
+  /* NULL for frames broadcast to everyone */
+  struct subscriber *destination;
+  struct overlay_frame *first;
+  struct overlay_frame *last;
+  int length;
+};
+
 typedef struct overlay_txqueue {
+  const char *name;
+  
+  /* every frame in the order it was queued, so expired frames are always at the front */
   struct overlay_frame *first;
   struct overlay_frame *last;
   int length; /* # frames in queue */
+  
+  /* the same frames grouped by destination. Buckets start in the order they were created, and a
+   bucket that has had frames sent goes to the back, so that each destination takes its turn */
+  struct overlay_tx_bucket *first_bucket;
+  struct overlay_tx_bucket *last_bucket;
+  struct overlay_tx_bucket *broadcast_bucket;
+  
   int maxLength; /* max # frames in queue before we consider ourselves congested */
   
   /* wait until first->enqueued_at+transmit_delay before trying to force the transmission of a packet */
@@ -435,6 +473,19 @@ typedef struct overlay_txqueue {
    Frames older than the latency target will get dropped. */
   int latencyTarget;
   
+  /* Bytes this queue may add to each packet per deficit round robin round, in proportion to its
+   weight. The voice queue is served first, but only up to its quantum until the others have had
+   their turn. */
+  int quantum;
+  int deficit;
+  
+  /* statistics since they were last shown */
+  int sent;
+  time_ms_t latency_total;
+  time_ms_t latency_max;
+  int dropped_expired;
+  int dropped_congested;
+  
   /* XXX Need to initialise these:
    Real-time queue for voice (<200ms ?)
    Real-time queue for video (<200ms ?) (lower priority than voice)
@@ -450,11 +501,22 @@ extern overlay_txqueue overlay_tx[OQ_MAX];
 
 ssize_t recvwithttl(int sock, unsigned char *buffer, size_t bufferlen, int *ttl, struct sockaddr *recvaddr, socklen_t *recvaddrlen);
 
+struct recv_datagram {
+  unsigned char *buffer;
+  size_t bufferlen;
+  ssize_t len;
+  int ttl;
+  struct sockaddr addr;
+  socklen_t addrlen;
+};
+int recvmmsgwithttl(int sock, struct recv_datagram *datagrams, int count);
+
 int is_xsubstring(const char *text, int len);
 int is_xstring(const char *text, int len);
 char *tohex(char *dstHex, const unsigned char *srcBinary, size_t bytes);
 size_t fromhex(unsigned char *dstBinary, const char *srcHex, size_t bytes);
 int fromhexstr(unsigned char *dstBinary, const char *srcHex, size_t bytes);
+extern char hexdigit[16];
 int hexvalue(char c);
 char *str_toupper_inplace(char *s);
 
@@ -568,6 +630,8 @@ int asteriskObtainGateway(char *requestor_sid,char *did,char *uri_out);
 int packetOkDNA(unsigned char *packet,int len,unsigned char *transaction_id,
 		int recvttl,struct sockaddr *recvaddr, size_t recvaddrlen,int parseP);
 int overlay_forward_payload(struct overlay_frame *f);
+int overlay_show_allocations();
+int overlay_reset_allocations();
 int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, size_t len,
 		    unsigned char *transaction_id,int recvttl,
 		    struct sockaddr *recvaddr, size_t recvaddrlen,int parseP);
@@ -596,6 +660,11 @@ int overlay_sendto(struct sockaddr_in *recipientaddr,unsigned char *bytes,int le
 int overlay_rhizome_add_advertisements(int interface_number,struct overlay_buffer *e);
 int overlay_add_local_identity(unsigned char *s);
 void overlay_update_queue_schedule(overlay_txqueue *queue, struct overlay_frame *frame);
+int overlay_interface_show_pacing();
+int overlay_queue_show_stats();
+int overlay_queue_bucket_append(overlay_txqueue *queue, struct overlay_frame *frame);
+void overlay_queue_bucket_remove(overlay_txqueue *queue, struct overlay_frame *frame);
+void overlay_queue_bucket_rotate(overlay_txqueue *queue, struct overlay_tx_bucket *bucket);
 void overlay_send_packet(struct sched_ent *alarm);
 
 extern int overlay_interface_count;
@@ -640,6 +709,7 @@ unsigned int overlay_route_hash_sid(const unsigned char *sid);
 
 int packetEncipher(unsigned char *packet,int maxlen,int *len,int cryptoflags);
 int overlayServerMode();
+void overlay_queue_init();
 int overlay_payload_enqueue(int q, struct overlay_frame *p);
 int overlay_route_record_link( time_ms_t now,unsigned char *to,
 			      unsigned char *via,int sender_interface,
@@ -839,6 +909,10 @@ int app_pa_phone(int argc, const char *const *argv, struct command_line_option *
 #endif
 int app_monitor_cli(int argc, const char *const *argv, struct command_line_option *o, void *context);
 int app_vomp_console(int argc, const char *const *argv, struct command_line_option *o, void *context);
+int app_test_udp(int argc, const char *const *argv, struct command_line_option *o, void *context);
+int app_test_forward(int argc, const char *const *argv, struct command_line_option *o, void *context);
+int app_test_stuff(int argc, const char *const *argv, struct command_line_option *o, void *context);
+int app_test_share(int argc, const char *const *argv, struct command_line_option *o, void *context);
 
 int monitor_get_fds(struct pollfd *fds,int *fdcount,int fdmax);
 
@@ -891,6 +965,12 @@ int server_probe(int *pid);
 
 int dna_helper_start();
 int dna_helper_shutdown();
+extern int rhizome_worker_process;
+int rhizome_worker_start();
+int rhizome_worker_shutdown();
+int rhizome_worker_running();
+int rhizome_worker_serving();
+int rhizome_worker_forward_advert(int interface, struct overlay_frame *f);
 int dna_helper_enqueue(overlay_mdp_frame *mdp, const char *did, const unsigned char *requestorSid);
 int dna_return_resolution(overlay_mdp_frame *mdp, unsigned char *fromSid,
 			  const char *did,const char *name,const char *uri);
@@ -912,6 +992,7 @@ void overlay_interface_discover(struct sched_ent *alarm);
 void overlay_dummy_poll(struct sched_ent *alarm);
 void overlay_route_tick(struct sched_ent *alarm);
 void rhizome_enqueue_suggestions(struct sched_ent *alarm);
+void rhizome_vacuum(struct sched_ent *alarm);
 void server_shutdown_check(struct sched_ent *alarm);
 void overlay_mdp_poll(struct sched_ent *alarm);
 void fd_periodicstats(struct sched_ent *alarm);
@@ -926,6 +1007,8 @@ void rhizome_server_poll(struct sched_ent *alarm);
 /* function timing routines */
 int fd_clearstats();
 int fd_showstats();
+int fd_clearlatency();
+int fd_showlatency();
 int fd_checkalarms();
 int fd_func_exit(struct call_stats *this_call);
 int fd_func_enter(struct call_stats *this_call);
@@ -242,6 +242,7 @@ void serverCleanUp()
     unlink(filename);
   }
   dna_helper_shutdown();
+  rhizome_worker_shutdown();
 }
 
 static void signame(char *buf, size_t len, int signal)
@@ -235,3 +235,41 @@ get_rhizome_server_port() {
    fi
    return 0
 }
+
+setup_sqlite3() {
+   case "$(sqlite3 -version)" in
+   3.*) ;;
+   '') fail "sqlite3(1) command is not present";;
+   *) fail "sqlite3(1) version is not adequate (expecting 3)";;
+   esac
+}
+
+# Add synthetic manifest records directly to the Rhizome database of the current instance, to
+# build a large store quickly.  The records carry random BLOB IDs, and BARs that begin with the
+# ID prefix as real ones do, but no manifest or payload.
+add_synthetic_manifests() {
+   local count="${1?}"
+   executeOk sqlite3 "$SERVALINSTANCE_PATH/rhizome.db" "
+      WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < $count)
+      INSERT INTO manifests(id, version, inserttime, bar, filesize, filehash, sizebin)
+         SELECT 'synthetic' || i, 1, 0, randomblob(32), 0, x'', 0 FROM n;
+      UPDATE manifests SET id = CAST(substr(bar, 1, 15) || randomblob(17) AS BLOB)
+         WHERE id LIKE 'synthetic%';"
+}
+
+# Copy the synthetic manifest records of another instance into the Rhizome database of the
+# current instance, so that both stores hold the same large set of bundles.
+copy_synthetic_manifests() {
+   local other="${1?}"
+   executeOk sqlite3 "$SERVALINSTANCE_PATH/rhizome.db" "
+      ATTACH '$servald_instances_dir/${other#+}/servald/rhizome.db' AS other;
+      INSERT INTO manifests(id, version, inserttime, bar, filesize, filehash, sizebin)
+         SELECT id, version, inserttime, bar, filesize, filehash, sizebin FROM other.manifests WHERE length(filehash)=0;"
+}
+
+# Assert the number of manifest records in the Rhizome database of the current instance.
+assert_manifest_count() {
+   local expected="${1?}"
+   local count=$(sqlite3 "$SERVALINSTANCE_PATH/rhizome.db" "SELECT COUNT(*) FROM manifests;")
+   assert --message="$expected manifests in $instance_name" [ "$count" -eq "$expected" ]
+}